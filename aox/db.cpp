@@ -8,9 +8,12 @@
 #include "granter.h"
 #include "postgres.h"
 #include "selector.h"
+#include "blobstore.h"
 #include "recipient.h"
 #include "transaction.h"
 #include "configuration.h"
+#include "estringlist.h"
+#include "dict.h"
 
 #include <stdio.h>
 
@@ -144,7 +147,9 @@ f3( "vacuum", "", "Perform routine maintenance.",
     "    Synopsis: aox vacuum\n\n"
     "    Permanently deletes messages that were marked for deletion\n"
     "    more than a certain number of days ago (cf. undelete-time)\n"
-    "    and removes any bodyparts that are no longer used.\n\n"
+    "    and removes any bodyparts that are no longer used, including\n"
+    "    any file in blob-directory which no bodypart has used for a\n"
+    "    day.\n\n"
     "    This is not a replacement for running VACUUM ANALYSE on the\n"
     "    database (either with vaccumdb or via autovacuum).\n\n"
     "    This command should be run (we suggest daily) via crontab.\n" );
@@ -154,7 +159,8 @@ f3( "vacuum", "", "Perform routine maintenance.",
 */
 
 Vacuum::Vacuum( EStringList * args )
-    : AoxCommand( args ), t( 0 ), r( 0 ), s( 0 )
+    : AoxCommand( args ), t( 0 ), r( 0 ), s( 0 ),
+      used( 0 ), hashes( 0 )
 {
 }
 
@@ -168,6 +174,7 @@ void Vacuum::execute()
         database( true );
         Mailbox::setup( this );
         t = new Transaction( this );
+        t->setPriority( Query::Background );
         uint days = Configuration::scalar( Configuration::UndeleteTime );
 
         Query * q;
@@ -331,6 +338,53 @@ void Vacuum::execute()
     if ( t->failed() )
         error( "Vacuuming failed" );
 
+    // files in blob-directory which no bodyparts row uses can go
+    // too. that includes those of the bodyparts we just deleted and
+    // those stored by injections which failed.
+    if ( BlobStore::enabled() && !hashes ) {
+        hashes = BlobStore::stale();
+        used = new List<Query>;
+        EStringList::Iterator h( hashes );
+        while ( h ) {
+            EStringList chunk;
+            while ( h && chunk.count() < 4096 ) {
+                chunk.append( *h );
+                ++h;
+            }
+            Query * q = new Query( "select hash from bodyparts "
+                                   "where blob and hash=any($1)", this );
+            q->setPriority( Query::Background );
+            q->bind( 1, chunk );
+            q->execute();
+            used->append( q );
+        }
+    }
+
+    if ( used ) {
+        List<Query>::Iterator q( used );
+        while ( q ) {
+            if ( !q->done() )
+                return;
+            ++q;
+        }
+        Dict<EString> inUse;
+        q = used->first();
+        while ( q ) {
+            while ( q->hasResults() ) {
+                EString h( q->nextRow()->getEString( "hash" ) );
+                inUse.insert( h, new EString( h ) );
+            }
+            ++q;
+        }
+        EStringList::Iterator h( hashes );
+        while ( h ) {
+            if ( !inUse.contains( *h ) )
+                BlobStore::remove( *h );
+            ++h;
+        }
+        used = 0;
+    }
+
     finish();
 }
 
@@ -4,6 +4,7 @@
 #define DB_H
 
 #include "aoxcommand.h"
+#include "list.h"
 
 
 class ShowSchema
@@ -41,6 +42,8 @@ private:
     class Transaction * t;
     class RetentionSelector * r;
     class Selector * s;
+    List<class Query> * used;
+    class EStringList * hashes;
 };
 
 
@@ -0,0 +1,150 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "recompress.h"
+
+#include "query.h"
+#include "transaction.h"
+#include "configuration.h"
+
+#include <stdio.h>
+
+
+class RecompressBodypartsData
+    : public Garbage
+{
+public:
+    RecompressBodypartsData()
+        : Garbage(), t( 0 ), find( 0 ),
+          sofar( 0 ), rows( 0 ), changed( 0 ), total( 0 ),
+          compress( false ), committing( false )
+        {}
+
+    Transaction * t;
+    Query * find;
+
+    uint sofar;
+    uint rows;
+    uint changed;
+    uint total;
+
+    bool compress;
+    bool committing;
+};
+
+
+static AoxFactory<RecompressBodyparts>
+f( "recompress", "bodyparts", "Compress or uncompress stored bodyparts.",
+   "    Synopsis: aox recompress bodyparts\n\n"
+   "    If compress-bodyparts is enabled, compresses those existing\n"
+   "    bodyparts which are stored uncompressed. If it's disabled,\n"
+   "    uncompresses those which are stored compressed.\n\n"
+   "    This command is meant to be used while the server is\n"
+   "    running. It does its work in small chunks, so it can be\n"
+   "    restarted at any time, and is tolerant of interruptions.\n" );
+
+
+/*! \class RecompressBodyparts recompress.h
+    This class handles the "aox recompress bodyparts" command.
+
+    It makes the storage of bodyparts.data agree with the current
+    compress-bodyparts setting, a few hundred rows per transaction.
+    The hash doesn't change, since it's always computed from the
+    uncompressed contents.
+*/
+
+RecompressBodyparts::RecompressBodyparts( EStringList * args )
+    : AoxCommand( args ), d( new RecompressBodypartsData )
+{
+}
+
+
+void RecompressBodyparts::execute()
+{
+    if ( !d->t ) {
+        if ( !d->find ) {
+            parseOptions();
+            end();
+            database( true );
+            d->compress =
+                Configuration::toggle( Configuration::CompressBodyparts );
+            if ( d->compress )
+                printf( "Compressing bodyparts.\n" );
+            else
+                printf( "Uncompressing bodyparts.\n" );
+        }
+
+        EString which( "compressed" );
+        if ( d->compress )
+            which = "compressed is not true";
+        d->t = new Transaction( this );
+        d->find = new Query( "select id, data from bodyparts "
+                             "where id>$1 and data is not null and " +
+                             which + " order by id limit 256 for update",
+                             this );
+        d->find->bind( 1, d->sofar );
+        d->t->enqueue( d->find );
+        d->t->execute();
+        d->rows = 0;
+        d->committing = false;
+    }
+
+    if ( !d->committing ) {
+        while ( d->find->hasResults() ) {
+            Row * r = d->find->nextRow();
+            d->sofar = r->getInt( "id" );
+            d->rows++;
+
+            EString data( r->getEString( "data" ) );
+            EString n;
+            if ( d->compress ) {
+                // as in the Injector: if it doesn't shrink much, it's
+                // better left alone.
+                n = data.compressed();
+                if ( n.length() >= data.length() - data.length() / 8 )
+                    n.truncate();
+            }
+            else {
+                n = data.uncompressed();
+                if ( n.isEmpty() && !data.isEmpty() )
+                    printf( "Cannot uncompress bodypart %d, skipping.\n",
+                            d->sofar );
+            }
+
+            if ( !n.isEmpty() ) {
+                Query * u = new Query( "update bodyparts "
+                                       "set data=$1, compressed=$2 "
+                                       "where id=$3", 0 );
+                u->bind( 1, n, Query::Binary );
+                u->bind( 2, d->compress );
+                u->bind( 3, d->sofar );
+                d->t->enqueue( u );
+                d->changed++;
+            }
+        }
+
+        if ( !d->find->done() )
+            return;
+
+        d->committing = true;
+        d->t->commit();
+    }
+
+    if ( !d->t->done() )
+        return;
+
+    if ( d->t->failed() )
+        error( "Transaction failed: " + d->t->error() );
+
+    d->t = 0;
+    d->total += d->rows;
+    if ( !d->rows ) {
+        printf( "Done. Examined %d bodyparts, changed %d.\n",
+                d->total, d->changed );
+        finish();
+        return;
+    }
+
+    printf( "Examined %d bodyparts so far, changed %d.\n",
+            d->total, d->changed );
+    execute();
+}
@@ -0,0 +1,21 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef RECOMPRESS_H
+#define RECOMPRESS_H
+
+#include "aoxcommand.h"
+
+
+class RecompressBodyparts
+    : public AoxCommand
+{
+public:
+    RecompressBodyparts( EStringList * );
+    void execute();
+
+private:
+    class RecompressBodypartsData * d;
+};
+
+
+#endif
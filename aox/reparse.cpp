@@ -7,6 +7,7 @@
 #include "message.h"
 #include "mailbox.h"
 #include "injector.h"
+#include "blobstore.h"
 #include "integerset.h"
 #include "transaction.h"
 
@@ -62,7 +63,8 @@ void Reparse::execute()
         d->q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
                           "mm.message as wrapper, "
                           "mb.nextmodseq, "
-                          "b.id as bodypart, b.text, b.data "
+                          "b.id as bodypart, b.text, b.data, b.compressed, "
+                          "b.blob, b.hash "
                           "from unparsed_messages u "
                           "join bodyparts b on (u.bodypart=b.id) "
                           "join part_numbers p on (p.bodypart=b.id) "
@@ -92,6 +94,10 @@ void Reparse::execute()
             text = r->getEString( "text" );
         else
             text = r->getEString( "data" );
+        if ( !r->isNull( "compressed" ) && r->getBoolean( "compressed" ) )
+            text = text.uncompressed();
+        if ( !r->isNull( "blob" ) && r->getBoolean( "blob" ) )
+            text = BlobStore::fetch( r->getEString( "hash" ) );
         Mailbox * mb = Mailbox::find( r->getInt( "mailbox" ) );
         Injectee * im = new Injectee;
         im->parse( text );
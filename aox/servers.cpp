@@ -312,6 +312,8 @@ static void checkFilePermissions()
 
     if ( Configuration::text( Configuration::MessageCopy ).lower() != "none" )
         addPath( Path::WritableDir, Configuration::MessageCopyDir );
+    if ( !Configuration::text( Configuration::BlobDir ).isEmpty() )
+        addPath( Path::WritableDir, Configuration::BlobDir );
     addPath( Path::JailDir, Configuration::JailDir );
     if ( Configuration::toggle( Configuration::UseTls ) ) {
         EString c = Configuration::text( Configuration::TlsCertFile );
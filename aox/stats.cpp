@@ -2,7 +2,14 @@
 
 #include "stats.h"
 
+#include "list.h"
 #include "query.h"
+#include "buffer.h"
+#include "endpoint.h"
+#include "resolver.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "estringlist.h"
 #include "configuration.h"
 
 #include <stdio.h>
@@ -178,3 +185,397 @@ void ShowCounts::execute()
 
     finish();
 }
+
+
+
+class StatisticsReader
+    : public Connection
+{
+public:
+    StatisticsReader( const Endpoint & e, EventHandler * owner )
+        : Connection(), failed( false ), o( owner ) {
+        connect( e );
+        EventLoop::global()->addConnection( this );
+        setTimeoutAfter( 10 );
+    }
+    void react( Event e ) {
+        switch ( e ) {
+        case Connect:
+        case Shutdown:
+            break;
+
+        case Read:
+            text.append( readBuffer()->string( readBuffer()->size() ) );
+            readBuffer()->remove( readBuffer()->size() );
+            break;
+
+        case Timeout:
+        case Error:
+            failed = true;
+            setState( Closing );
+            o->execute();
+            break;
+
+        case Close:
+            o->execute();
+            break;
+        }
+    }
+
+    EString text;
+    bool failed;
+    EventHandler * o;
+};
+
+
+/*! Returns a StatisticsReader which reads from \a port on the
+    statistics-address, and notifies \a owner when done. Returns 0
+    and sets \a error if that isn't possible.
+*/
+
+static StatisticsReader * readStatistics( uint port, EventHandler * owner,
+                                          EString & error )
+{
+    if ( !Configuration::toggle( Configuration::UseStatistics ) ) {
+        error = "use-statistics is disabled in archiveopteryx.conf";
+        return 0;
+    }
+
+    EString addr = Configuration::text( Configuration::StatisticsAddress );
+    EStringList::Iterator it( Resolver::resolve( addr ) );
+    if ( !it ) {
+        error = "Cannot resolve statistics-address: " + addr;
+        return 0;
+    }
+    return new StatisticsReader( Endpoint( *it, port ), owner );
+}
+
+
+class ShowMemoryData
+    : public Garbage
+{
+public:
+    ShowMemoryData(): reader( 0 ), port( 0 ) {}
+
+    StatisticsReader * reader;
+    uint port;
+};
+
+
+static AoxFactory<ShowMemory>
+f2( "show", "memory", "Show what is using memory in a running server.",
+    "    Synopsis: aox show memory [port]\n\n"
+    "    Fetches memory statistics from a running server via its\n"
+    "    statistics port (by default, the one in archiveopteryx.conf)\n"
+    "    and displays them. If memory-profile-interval is set in\n"
+    "    archiveopteryx.conf, this includes the number of live objects\n"
+    "    of each size, and estimates of how much memory is held by\n"
+    "    objects allocated by each site in the code and in each log\n"
+    "    context, as of the last garbage collection.\n"
+    "\n"
+    "    Sites are shown as offsets in the server executable. Use\n"
+    "    e.g. addr2line -Cfe /path/to/archiveopteryx to see what\n"
+    "    code they are.\n" );
+
+
+/*! \class ShowMemory stats.h
+    This class handles the "aox show memory" command.
+
+    It reads the GraphDumper output of the server, and presents the
+    memory-related parts (see Allocator::heapProfile()).
+*/
+
+ShowMemory::ShowMemory( EStringList * args )
+    : AoxCommand( args ), d( new ShowMemoryData )
+{
+}
+
+
+class MemoryStat
+    : public Garbage
+{
+public:
+    MemoryStat( const EString & n, uint v ): name( n ), value( v ) {}
+
+    EString name;
+    uint value;
+};
+
+
+/*! Prints \a heading followed by the entries in \a l, largest
+    first. If \a bytes is true, the values are printed as byte counts.
+*/
+
+static void printLargest( List<MemoryStat> * l, const char * heading,
+                          bool bytes )
+{
+    if ( l->isEmpty() )
+        return;
+    printf( "%s\n", heading );
+    while ( !l->isEmpty() ) {
+        List<MemoryStat>::Iterator i( l );
+        List<MemoryStat>::Iterator best( l );
+        while ( i ) {
+            if ( i->value > best->value )
+                best = i;
+            ++i;
+        }
+        EString v = fn( best->value );
+        if ( bytes )
+            v = EString::humanNumber( best->value );
+        printf( "  %-32s %s\n", best->name.cstr(), v.cstr() );
+        l->take( best );
+    }
+}
+
+
+void ShowMemory::execute()
+{
+    if ( !d->reader ) {
+        parseOptions();
+        d->port = Configuration::scalar( Configuration::StatisticsPort );
+        EString p = next();
+        if ( !p.isEmpty() ) {
+            bool ok = false;
+            d->port = p.number( &ok );
+            if ( !ok )
+                error( "Bad port number: " + p );
+        }
+        end();
+
+        EString e;
+        d->reader = readStatistics( d->port, this, e );
+        if ( !d->reader )
+            error( e );
+        return;
+    }
+
+    if ( d->reader->state() != Connection::Closing &&
+         d->reader->state() != Connection::Invalid )
+        return;
+    if ( d->reader->failed )
+        error( "Could not read statistics from port " + fn( d->port ) );
+
+    // each line is "name time:value time:value...", and we want
+    // the last value.
+    uint used = 0;
+    uint pause = 0;
+    uint interval = 0;
+    List<MemoryStat> objects;
+    List<MemoryStat> sites;
+    List<MemoryStat> contexts;
+    EStringList::Iterator l( EStringList::split( '\n',
+                                                d->reader->text ) );
+    while ( l ) {
+        EString line = l->simplified();
+        ++l;
+        int s = line.find( ' ' );
+        int c = line.length();
+        while ( c > s && line[c-1] != ':' )
+            c--;
+        if ( s < 1 || c <= s )
+            continue;
+        EString name = line.mid( 0, s );
+        uint v = line.mid( c ).number( 0 );
+        if ( name == "memory-used" )
+            used = v;
+        else if ( name == "gc-pause" )
+            pause = v;
+        else if ( name == "heap-sample-interval" )
+            interval = v;
+        else if ( name.startsWith( "heap-objects-" ) )
+            objects.append( new MemoryStat( name.mid( 13 ) + " bytes", v ) );
+        else if ( name.startsWith( "heap-site-" ) )
+            sites.append( new MemoryStat( "0x" + name.mid( 10 ), v ) );
+        else if ( name.startsWith( "heap-context-" ) )
+            contexts.append( new MemoryStat( name.mid( 13 ), v ) );
+    }
+
+    printf( "Memory used: %s\n", EString::humanNumber( used ).cstr() );
+    printf( "Longest recent GC pause: %d.%03dms\n",
+            pause / 1000, pause % 1000 );
+    if ( !interval ) {
+        printf( "Heap profiling is disabled "
+                "(see memory-profile-interval).\n" );
+        finish();
+        return;
+    }
+
+    printf( "Heap sampled every %s, as of the last garbage collection.\n",
+            EString::humanNumber( interval ).cstr() );
+    printLargest( &objects, "Live objects by size:", false );
+    printLargest( &sites, "Live bytes by allocation site:", true );
+    printLargest( &contexts, "Live bytes by log context:", true );
+    finish();
+}
+
+
+class ShowQueriesData
+    : public Garbage
+{
+public:
+    ShowQueriesData(): reader( 0 ), port( 0 ) {}
+
+    StatisticsReader * reader;
+    uint port;
+};
+
+
+static AoxFactory<ShowQueries>
+f3( "show", "queries", "Show how long database queries take.",
+    "    Synopsis: aox show queries [-v] [port]\n\n"
+    "    Fetches query statistics from a running server via its\n"
+    "    statistics port (by default, the one in archiveopteryx.conf)\n"
+    "    and displays them. Queries which differ only in constants\n"
+    "    are counted together. For each kind of query, aox shows how\n"
+    "    many have been run, their total, mean and longest time, and\n"
+    "    times within which half and 95% of them completed. The last\n"
+    "    two are rounded up to a power of two.\n"
+    "\n"
+    "    The -v flag also shows the plans the database reported for\n"
+    "    queries slower than db-slow-query-time.\n" );
+
+
+/*! \class ShowQueries stats.h
+    This class handles the "aox show queries" command.
+
+    It reads the GraphDumper output of the server, and presents the
+    QueryStatistics::report() parts.
+*/
+
+ShowQueries::ShowQueries( EStringList * args )
+    : AoxCommand( args ), d( new ShowQueriesData )
+{
+}
+
+
+class QueryStat
+    : public Garbage
+{
+public:
+    QueryStat()
+        : n( 0 ), count( 0 ), total( 0 ), max( 0 ), buckets( 0 ) {}
+
+    uint n;
+    uint count;
+    int64 total;
+    uint max;
+    EStringList * buckets;
+    EString text;
+    EStringList plan;
+
+    // returns the upper bound of the bucket which holds the p'th
+    // percentile
+    EString percentile( uint p ) {
+        uint want = ( count * p + 99 ) / 100;
+        uint seen = 0;
+        uint b = 0;
+        EStringList::Iterator i( buckets );
+        while ( i ) {
+            seen += i->number( 0 );
+            if ( seen >= want )
+                return fn( 1 << b );
+            b++;
+            ++i;
+        }
+        return "-";
+    }
+};
+
+
+void ShowQueries::execute()
+{
+    if ( !d->reader ) {
+        parseOptions();
+        d->port = Configuration::scalar( Configuration::StatisticsPort );
+        EString p = next();
+        if ( !p.isEmpty() ) {
+            bool ok = false;
+            d->port = p.number( &ok );
+            if ( !ok )
+                error( "Bad port number: " + p );
+        }
+        end();
+
+        EString e;
+        d->reader = readStatistics( d->port, this, e );
+        if ( !d->reader )
+            error( e );
+        return;
+    }
+
+    if ( d->reader->state() != Connection::Closing &&
+         d->reader->state() != Connection::Invalid )
+        return;
+    if ( d->reader->failed )
+        error( "Could not read statistics from port " + fn( d->port ) );
+
+    // see QueryStatistics::report() for the format
+    List<QueryStat> stats;
+    QueryStat * last = 0;
+    EStringList::Iterator l( EStringList::split( '\n',
+                                                d->reader->text ) );
+    while ( l ) {
+        EString line = *l;
+        ++l;
+        if ( line.endsWith( "\r" ) )
+            line.truncate( line.length() - 1 );
+        if ( line.startsWith( "query " ) ) {
+            QueryStat * s = new QueryStat;
+            s->n = line.section( " ", 2 ).number( 0 );
+            s->count = line.section( " ", 3 ).number( 0 );
+            s->total = line.section( " ", 4 ).number( 0 );
+            s->max = line.section( " ", 5 ).number( 0 );
+            s->buckets = EStringList::split( ',', line.section( " ", 6 ) );
+            uint i = 0;
+            uint spaces = 0;
+            while ( i < line.length() && spaces < 6 ) {
+                if ( line[i] == ' ' )
+                    spaces++;
+                i++;
+            }
+            s->text = line.mid( i );
+            stats.append( s );
+            last = s;
+        }
+        else if ( line.startsWith( "query-plan " ) && last &&
+                  line.section( " ", 2 ).number( 0 ) == last->n ) {
+            int i = line.find( ' ', 11 );
+            if ( i > 0 )
+                last->plan.append( line.mid( i + 1 ) );
+        }
+    }
+
+    if ( stats.isEmpty() ) {
+        printf( "No queries have been run.\n" );
+        finish();
+        return;
+    }
+
+    printf( "%8s %10s %8s %8s %8s %8s  %s\n",
+            "Count", "Total ms", "Mean", "Median", "95%", "Max", "Query" );
+    while ( !stats.isEmpty() ) {
+        List<QueryStat>::Iterator i( stats );
+        List<QueryStat>::Iterator best( stats );
+        while ( i ) {
+            if ( i->total > best->total )
+                best = i;
+            ++i;
+        }
+        QueryStat * s = best;
+        stats.take( best );
+        printf( "%8u %10s %8s %8s %8s %8u  %s\n",
+                s->count, fn( s->total ).cstr(),
+                fn( s->count ? s->total / s->count : 0 ).cstr(),
+                s->percentile( 50 ).cstr(), s->percentile( 95 ).cstr(),
+                s->max, s->text.cstr() );
+        if ( opt( 'v' ) && !s->plan.isEmpty() ) {
+            EStringList::Iterator p( s->plan );
+            while ( p ) {
+                printf( "%57s%s\n", "", p->cstr() );
+                ++p;
+            }
+        }
+    }
+    finish();
+}
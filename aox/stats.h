@@ -18,4 +18,28 @@ private:
 };
 
 
+class ShowMemory
+    : public AoxCommand
+{
+public:
+    ShowMemory( EStringList * );
+    void execute();
+
+private:
+    class ShowMemoryData * d;
+};
+
+
+class ShowQueries
+    : public AoxCommand
+{
+public:
+    ShowQueries( EStringList * );
+    void execute();
+
+private:
+    class ShowQueriesData * d;
+};
+
+
 #endif
@@ -4,7 +4,7 @@
 
 #include "md5.h"
 #include "utf.h"
-#include "dict.h"
+#include "hashtable.h"
 #include "query.h"
 #include "ustring.h"
 #include "address.h"
@@ -195,7 +195,7 @@ void UpdateDatabase::execute()
     if ( !d->update ) {
         Query * q = new Query( "copy md( messageid, thread_root ) "
                              "from stdin with binary", 0 );
-        Dict<ThreadRootCreator::ThreadNode>::Iterator
+        HashDict<ThreadRootCreator::ThreadNode>::Iterator
             i( d->threader->threadNodes() );
         while ( i ) {
             ThreadRootCreator::ThreadNode * n = i;
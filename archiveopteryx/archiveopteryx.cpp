@@ -9,9 +9,11 @@
 #include "graph.h"
 
 #include "tlsthread.h"
+#include "sharedcache.h"
 #include "flag.h"
 #include "event.h"
 #include "cache.h"
+#include "allocator.h"
 #include "mailbox.h"
 #include "listener.h"
 #include "database.h"
@@ -107,6 +109,16 @@ int main( int argc, char *argv[] )
     }
 
 
+    EString bd( Configuration::text( Configuration::BlobDir ) );
+    if ( !bd.isEmpty() ) {
+        struct stat st;
+        if ( ::stat( bd.cstr(), &st ) < 0 || !S_ISDIR( st.st_mode ) )
+            log( "Inaccessible blob-directory: " + bd, Log::Disaster );
+        else if ( security && !bd.startsWith( root ) )
+            log( "blob-directory must be under jail directory " + root,
+                 Log::Disaster );
+    }
+
     EString sA( Configuration::text( Configuration::SmartHostAddress ) );
     uint sP( Configuration::scalar( Configuration::SmartHostPort ) );
 
@@ -224,6 +236,14 @@ int main( int argc, char *argv[] )
         TlsThread::setup();
     }
 
+    // this has to be done before Server::run() forks the server
+    // processes, and is pointless unless there are several.
+    uint shared = Configuration::scalar( Configuration::SharedCacheSize );
+    if ( shared > 4095 )
+        shared = 4095;
+    if ( Configuration::scalar( Configuration::ServerProcesses ) > 1 )
+        SharedCache::setup( shared * 1024 * 1024 );
+
     s.setup( Server::LogStartup );
 
     Listener< GraphDumper >::create(
@@ -233,6 +253,8 @@ int main( int argc, char *argv[] )
 
     EventLoop::global()->setMemoryUsage(
         1024 * 1024 * Configuration::scalar( Configuration::MemoryLimit ) );
+    Allocator::setProfiling(
+        1024 * Configuration::scalar( Configuration::MemoryProfileInterval ) );
 
     Database::setup();
 
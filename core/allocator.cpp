@@ -4,6 +4,8 @@
 
 #include "cache.h"
 #include "estring.h"
+#include "estringlist.h"
+#include "scope.h"
 #include "log.h"
 
 // fprintf
@@ -148,6 +150,47 @@ static uint marked;
 static uint tos;
 static uint peak;
 static AllocationBlock ** stack;
+static uint freed;
+static uint allocatedBefore;
+static uint sweepClass;
+static bool sweepPending;
+static uint timeToMark;
+static uint timeToSweep;
+
+
+struct HeapSample
+{
+    void * p;
+    const void * site;
+    Log * log;
+    uint weight;
+};
+
+struct HeapSite
+{
+    const void * site;
+    Log * log;
+    uint bytes;
+    uint samples;
+};
+
+struct HeapContext
+{
+    char id[48];
+    uint bytes;
+};
+
+static const uint reportedSites = 40;
+static const uint reportedContexts = 20;
+
+static uint profileInterval;
+static int profileCountdown;
+static HeapSample * samples;
+static uint sampleCapacity;
+static uint sampleCount;
+static uint survivors[32];
+static HeapSite topSites[reportedSites];
+static HeapContext topContexts[reportedContexts];
 
 
 static void oneMegabyteAllocated()
@@ -163,12 +206,16 @@ static void oneMegabyteAllocated()
     value is UINT_MAX, which in practice means that the entire object
     may consist of pointers.
 
+    If setProfiling() has been called, \a site is recorded as the
+    place in the code that allocated the object. If \a site is null
+    (the default), the caller of alloc() is used.
+
     Note that \a s is a uint, not a size_t. In our universe, it isn't
     possible to allocate more than 4GB at a time. So it is.
 */
 
 
-void * Allocator::alloc( uint s, uint n )
+void * Allocator::alloc( uint s, uint n, const void * site )
 {
     if ( s > SizeLimit )
         die( Memory );
@@ -185,6 +232,15 @@ void * Allocator::alloc( uint s, uint n )
          ( ( ::total + ::allocated ) & 0xfff00000 ) )
         ::oneMegabyteAllocated();
     ::allocated += a->chunkSize();
+    if ( ::profileInterval ) {
+        ::profileCountdown -= a->chunkSize();
+        if ( ::profileCountdown <= 0 ) {
+            if ( !site )
+                site = __builtin_return_address( 0 );
+            sample( p, a->chunkSize(), site );
+            ::profileCountdown = ::profileInterval;
+        }
+    }
     return p;
 }
 
@@ -203,6 +259,8 @@ void Allocator::dealloc( void * p )
     Allocator * a = AllocatorMapTable::find( p );
     if ( a )
         a->deallocate( p );
+    if ( ::sampleCount )
+        unsample( p );
 }
 
 
@@ -263,6 +321,20 @@ Allocator * Allocator::allocator( uint size )
     reachable. It can be called whenever there are no pointers into
     the heap, ie. only during the main event loop.
 
+    Marking has to happen all at once, but sweeping need not: Anything
+    that was unreachable when free() marked will stay unreachable, so
+    the sweep can be done in slices between passes of the event loop
+    (see free( uint ) and sweep( uint )), and the program can allocate
+    new objects in the meantime. Objects allocated before an Allocator
+    has been swept are born marked, so the sweep leaves them alone.
+
+    Marking can't be sliced likewise, since the program stores
+    pointers into the heap without telling the Allocator (there is no
+    write barrier), so an object could become reachable only via one
+    that has already been scanned. The pause caused by free() is
+    therefore at least as long as marking takes, and grows with the
+    number of live objects.
+
     Each single instance of the Allocator class allocates memory blocks
     of a given size. There are static functions to the heavy loading,
     such as free() to free all unreachable memory, allocate() to
@@ -283,7 +355,7 @@ Allocator * Allocator::allocator( uint size )
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
       used( 0 ), marked( 0 ), buffer( 0 ),
-      next( 0 )
+      next( 0 ), unswept( false )
 {
     if ( s < ( BlockSize ) )
         capacity = ( BlockSize ) / ( s );
@@ -376,7 +448,10 @@ void * Allocator::allocate( uint size, uint pointers )
                     else
                         b->x.number = pointers;
                     b->x.magic = ::magic;
-                    marked[base/bits] &= ~( 1UL << j );
+                    if ( unswept )
+                        marked[base/bits] |= ( 1UL << j );
+                    else
+                        marked[base/bits] &= ~( 1UL << j );
                     used[base/bits] |= ( 1UL << j );
                     taken++;
                     base++;
@@ -535,20 +610,39 @@ void Allocator::mark()
 
 void Allocator::free()
 {
-    struct timeval start, afterMark, afterSweep;
-    start.tv_sec = 0;
-    start.tv_usec = 0;
-    afterMark.tv_sec = 0;
-    afterMark.tv_usec = 0;
-    afterSweep.tv_sec = 0;
-    afterSweep.tv_usec = 0;
+    free( UINT_MAX );
+}
+
+
+static uint microsecondsSince( const struct timeval & start )
+{
+    struct timeval now;
+    gettimeofday( &now, 0 );
+    return ( now.tv_sec - start.tv_sec ) * 1000000 +
+        ( now.tv_usec - start.tv_usec );
+}
+
+
+/*! Marks all memory that's still in use, then frees unused memory
+    for at most \a budget microseconds. If that isn't enough to sweep
+    everything, sweeping() returns true afterwards, and sweep() must
+    be called to free the rest.
+
+    If an earlier sweep is still unfinished, this function finishes it
+    before it starts marking.
+*/
+
+void Allocator::free( uint budget )
+{
+    if ( ::sweepPending )
+        sweep( UINT_MAX );
+
+    struct timeval start;
     gettimeofday( &start, 0 );
 
     Cache::clearAllCaches( false );
 
-    total = 0;
     peak = 0;
-    uint freed = 0;
     objects = 0;
     ::marked = 0;
 
@@ -566,59 +660,143 @@ void Allocator::free()
 
         i++;
     }
-    gettimeofday( &afterMark, 0 );
 
-    // and sweep
+    // everything that's marked now stays, so we know how much will
+    // be in use once the sweep is done, and can start counting anew.
+    total = ::marked;
+    ::allocatedBefore = ::allocated;
+    ::allocated = 0;
+    ::freed = 0;
+    ::timeToMark = microsecondsSince( start );
+    ::timeToSweep = 0;
+
+    // note which allocators need sweeping
     i = 0;
-    uint blocks = 0;
     while ( i < 32 ) {
         Allocator * a = allocators[i];
         while ( a ) {
-            uint taken = a->taken;
-            if ( a->taken )
-                a->sweep();
-            freed = freed + ( taken - a->taken ) * a->step;
-            total = total + a->taken * a->step;
+            a->unswept = a->taken > 0;
             a = a->next;
         }
-        Allocator * s = 0;
-        a = allocators[i];
-        while ( a ) {
-            Allocator * n = a->next;
-            if ( a->taken ) {
-                a->next = s;
-                s = a;
-                blocks++;
-            }
-            else {
-                delete a;
+        i++;
+    }
+    ::sweepClass = 0;
+    ::sweepPending = true;
+
+    if ( ::profileInterval )
+        profile();
+
+    uint used = ::timeToMark;
+    if ( used < budget )
+        sweep( budget - used );
+    else
+        sweep( 0 );
+}
+
+
+/*! Returns true if free() has marked memory, but not yet swept all of
+    it, and false otherwise.
+*/
+
+bool Allocator::sweeping()
+{
+    return ::sweepPending;
+}
+
+
+/*! Continues the sweep started by free(), and keeps sweeping for at
+    most \a budget microseconds. The budget is checked after each
+    Allocator, so at least one Allocator is swept even if \a budget is
+    0.
+
+    Like free(), this can only be called when there are no pointers
+    into the heap except from eternal objects.
+*/
+
+void Allocator::sweep( uint budget )
+{
+    if ( !::sweepPending )
+        return;
+
+    struct timeval start;
+    gettimeofday( &start, 0 );
+
+    uint elapsed = 0;
+    bool progress = false;
+    while ( ::sweepClass < 32 ) {
+        Allocator * a = allocators[::sweepClass];
+        while ( a && !a->unswept )
+            a = a->next;
+        if ( a ) {
+            if ( progress && elapsed >= budget ) {
+                ::timeToSweep += elapsed;
+                return;
             }
-            a = n;
+            uint taken = a->taken;
+            a->sweep();
+            ::freed += ( taken - a->taken ) * a->step;
+            progress = true;
         }
-        allocators[i] = s;
-        i++;
+        else {
+            release( ::sweepClass );
+            ::sweepClass++;
+        }
+        elapsed = microsecondsSince( start );
     }
-    gettimeofday( &afterSweep, 0 );
 
-    uint timeToMark = 0;
-    uint timeToSweep = 0;
-    if ( start.tv_sec ) {
-        timeToMark = ( afterMark.tv_sec - start.tv_sec ) * 1000000 +
-                     ( afterMark.tv_usec - start.tv_usec );
-        timeToSweep = ( afterSweep.tv_sec - afterMark.tv_sec ) * 1000000 +
-                      ( afterSweep.tv_usec - afterMark.tv_usec );
+    ::timeToSweep += elapsed;
+    ::sweepPending = false;
+    report();
+}
+
+
+/*! Deletes all the empty Allocators for size class \a i. */
+
+void Allocator::release( uint i )
+{
+    Allocator * s = 0;
+    Allocator * a = allocators[i];
+    while ( a ) {
+        Allocator * n = a->next;
+        if ( a->taken ) {
+            a->next = s;
+            s = a;
+        }
+        else {
+            delete a;
+        }
+        a = n;
     }
-    // dumpRandomObject();
+    allocators[i] = s;
+}
 
-    if ( !freed )
+
+/*! Logs statistics about the collection that just finished, if
+    setReporting() has asked for that.
+*/
+
+void Allocator::report()
+{
+    if ( !::freed || !verbose )
         return;
 
-    if ( verbose && ( ::allocated >= 4*1024*1024 ||
-                      timeToMark + timeToSweep >= 10000 ) )
+    uint blocks = 0;
+    uint i = 0;
+    while ( i < 32 ) {
+        Allocator * a = allocators[i];
+        while ( a ) {
+            blocks++;
+            a = a->next;
+        }
+        i++;
+    }
+
+    if ( ::allocatedBefore >= 4*1024*1024 ||
+         timeToMark + timeToSweep >= 10000 )
         log( "Allocator: allocated " +
-             EString::humanNumber( ::allocated ) +
+             EString::humanNumber( ::allocatedBefore ) +
              " then freed " +
-             EString::humanNumber( freed ) +
+             EString::humanNumber( ::freed ) +
              " bytes, leaving " +
              fn( objects ) +
              " objects of " +
@@ -632,7 +810,7 @@ void Allocator::free()
              fn( (timeToMark+500)/1000 ) + "ms. To sweep: " +
              fn( (timeToSweep+500)/1000 ) + "ms.",
              Log::Info );
-    if ( verbose && total > 8 * 1024 * 1024 ) {
+    if ( total > 8 * 1024 * 1024 ) {
         EString objects;
         i = 0;
         while ( i < 32 ) {
@@ -661,7 +839,7 @@ void Allocator::free()
         log( objects, Log::Debug );
     }
     const uint ObjectLimit = 8192;
-    if ( verbose && objects > ObjectLimit ) {
+    if ( objects > ObjectLimit ) {
         i = 0;
         while ( i < numRoots ) {
             if ( roots[i].root && roots[i].objects > ObjectLimit/2 ) {
@@ -679,7 +857,6 @@ void Allocator::free()
             i++;
         }
     }
-    ::allocated = 0;
 }
 
 
@@ -710,6 +887,337 @@ void Allocator::sweep()
         b++;
     }
     base = 0;
+    unswept = false;
+}
+
+
+/*! Instructs the Allocator to sample roughly one allocation per \a
+    interval bytes allocated, and to record where each sampled object
+    was allocated. After each mark phase, the samples that are still
+    alive are summed up by allocation site and Log context, and the
+    number of live objects in each size class is counted, so that
+    heapProfile() can tell what is using memory.
+
+    If \a interval is 0 (the initial value), nothing is sampled.
+*/
+
+void Allocator::setProfiling( uint interval )
+{
+    ::profileInterval = interval;
+    ::profileCountdown = interval;
+    if ( interval )
+        return;
+    ::free( ::samples );
+    ::samples = 0;
+    ::sampleCapacity = 0;
+    ::sampleCount = 0;
+}
+
+
+/*! Returns the sampling interval set by setProfiling(), or 0 if the
+    heap isn't being profiled.
+*/
+
+uint Allocator::profiling()
+{
+    return ::profileInterval;
+}
+
+
+static uint sampleSlot( const void * p, uint capacity )
+{
+    ulong h = (ulong)p >> 4;
+    h = h * 2654435761UL;
+    return (uint)( h ^ ( h >> 16 ) ) & ( capacity - 1 );
+}
+
+
+/*! Records that \a p, a chunk of \a size bytes, was allocated at \a
+    site while the current Scope's Log was in effect.
+
+    The sample table uses malloc() rather than the Allocator, so
+    sampling never causes further allocation, and the samples don't
+    keep anything alive.
+*/
+
+void Allocator::sample( void * p, uint size, const void * site )
+{
+    if ( ( ::sampleCount + 1 ) * 2 > ::sampleCapacity ) {
+        uint capacity = ::sampleCapacity ? ::sampleCapacity * 2 : 1024;
+        HeapSample * n
+            = (HeapSample*)::calloc( capacity, sizeof( HeapSample ) );
+        if ( !n )
+            return;
+        uint i = 0;
+        while ( i < ::sampleCapacity ) {
+            if ( ::samples[i].p ) {
+                uint j = sampleSlot( ::samples[i].p, capacity );
+                while ( n[j].p )
+                    j = ( j + 1 ) & ( capacity - 1 );
+                n[j] = ::samples[i];
+            }
+            i++;
+        }
+        ::free( ::samples );
+        ::samples = n;
+        ::sampleCapacity = capacity;
+    }
+
+    uint i = sampleSlot( p, ::sampleCapacity );
+    while ( ::samples[i].p && ::samples[i].p != p )
+        i = ( i + 1 ) & ( ::sampleCapacity - 1 );
+    if ( !::samples[i].p )
+        ::sampleCount++;
+    ::samples[i].p = p;
+    ::samples[i].site = site;
+    ::samples[i].log = 0;
+    Scope * cs = Scope::current();
+    if ( cs )
+        ::samples[i].log = cs->log();
+    // each sample stands for the interval's worth of allocations
+    ::samples[i].weight = size > ::profileInterval ? size : ::profileInterval;
+}
+
+
+/*! Forgets any sample recorded for \a p. */
+
+void Allocator::unsample( void * p )
+{
+    uint i = sampleSlot( p, ::sampleCapacity );
+    while ( ::samples[i].p && ::samples[i].p != p )
+        i = ( i + 1 ) & ( ::sampleCapacity - 1 );
+    if ( !::samples[i].p )
+        return;
+
+    // remove it, and move later entries in the same run back so that
+    // lookups still find them
+    ::samples[i].p = 0;
+    ::sampleCount--;
+    uint j = i;
+    while ( true ) {
+        j = ( j + 1 ) & ( ::sampleCapacity - 1 );
+        if ( !::samples[j].p )
+            return;
+        uint k = sampleSlot( ::samples[j].p, ::sampleCapacity );
+        if ( ( j > i && ( k <= i || k > j ) ) ||
+             ( j < i && ( k <= i && k > j ) ) ) {
+            ::samples[i] = ::samples[j];
+            ::samples[j].p = 0;
+            i = j;
+        }
+    }
+}
+
+
+/*! Returns true if \a p points to an object that was found to be
+    reachable by the last mark phase, and false otherwise.
+*/
+
+bool Allocator::isMarked( void * p )
+{
+    Allocator * a = AllocatorMapTable::find( p );
+    if ( !a || (ulong)a->buffer > (ulong)p )
+        return false;
+    ulong i = ((ulong)p - (ulong)a->buffer) / a->step;
+    if ( i >= a->capacity )
+        return false;
+    if ( !( a->used[i/bits] & a->marked[i/bits] & 1UL << (i%bits) ) )
+        return false;
+    return true;
+}
+
+
+/*! This private helper is called right after each mark phase when
+    profiling is enabled. It counts the survivors in each size class,
+    drops the samples whose objects are dead, and sums up the live ones
+    by allocation site and by Log.
+*/
+
+void Allocator::profile()
+{
+    uint i = 0;
+    while ( i < 32 ) {
+        uint n = 0;
+        Allocator * a = allocators[i];
+        while ( a ) {
+            uint b = 0;
+            while ( b * bits < a->capacity ) {
+                ulong w = a->used[b] & a->marked[b];
+                while ( w ) {
+                    w &= w - 1;
+                    n++;
+                }
+                b++;
+            }
+            a = a->next;
+        }
+        ::survivors[i] = n;
+        i++;
+    }
+
+    // sum up the live samples per site and per log, and keep only
+    // the live ones. there are usually few sites and logs, so a
+    // linear search is good enough.
+    uint maxSites = 1024;
+    HeapSite * sites = (HeapSite*)::calloc( maxSites, sizeof( HeapSite ) );
+    HeapSite * logs = (HeapSite*)::calloc( maxSites, sizeof( HeapSite ) );
+    HeapSample * live
+        = (HeapSample*)::calloc( ::sampleCapacity, sizeof( HeapSample ) );
+    if ( !sites || !logs || !live ) {
+        ::free( sites );
+        ::free( logs );
+        ::free( live );
+        return;
+    }
+    uint nsites = 0;
+    uint nlogs = 0;
+    ::sampleCount = 0;
+    i = 0;
+    while ( i < ::sampleCapacity ) {
+        HeapSample * s = &::samples[i];
+        i++;
+        if ( !s->p || !isMarked( s->p ) )
+            continue;
+
+        uint j = sampleSlot( s->p, ::sampleCapacity );
+        while ( live[j].p )
+            j = ( j + 1 ) & ( ::sampleCapacity - 1 );
+        // a dead log's slot may be reused by anything, so the sample
+        // must forget it now rather than check again next time.
+        Log * l = s->log;
+        if ( l && !isMarked( l ) )
+            l = 0;
+        live[j] = *s;
+        live[j].log = l;
+        ::sampleCount++;
+
+        j = 0;
+        while ( j < nsites && sites[j].site != s->site )
+            j++;
+        if ( j == nsites && nsites < maxSites )
+            sites[nsites++].site = s->site;
+        if ( j < nsites ) {
+            sites[j].bytes += s->weight;
+            sites[j].samples++;
+        }
+
+        j = 0;
+        while ( j < nlogs && logs[j].log != l )
+            j++;
+        if ( j == nlogs && nlogs < maxSites )
+            logs[nlogs++].log = l;
+        if ( j < nlogs ) {
+            logs[j].bytes += s->weight;
+            logs[j].samples++;
+        }
+    }
+    ::free( ::samples );
+    ::samples = live;
+
+    // pick the biggest of each
+    i = 0;
+    while ( i < reportedSites ) {
+        uint best = 0;
+        uint j = 0;
+        while ( j < nsites ) {
+            if ( sites[j].bytes > sites[best].bytes )
+                best = j;
+            j++;
+        }
+        if ( nsites && sites[best].bytes ) {
+            ::topSites[i] = sites[best];
+            sites[best].bytes = 0;
+        }
+        else {
+            ::topSites[i].bytes = 0;
+        }
+        i++;
+    }
+    i = 0;
+    while ( i < reportedContexts ) {
+        uint best = 0;
+        uint j = 0;
+        while ( j < nlogs ) {
+            if ( logs[j].bytes > logs[best].bytes )
+                best = j;
+            j++;
+        }
+        ::topContexts[i].bytes = 0;
+        if ( nlogs && logs[best].bytes ) {
+            EString id( "-" );
+            if ( logs[best].log )
+                id = logs[best].log->id();
+            uint l = id.length();
+            if ( l >= sizeof( ::topContexts[i].id ) )
+                l = sizeof( ::topContexts[i].id ) - 1;
+            memcpy( ::topContexts[i].id, id.data(), l );
+            ::topContexts[i].id[l] = 0;
+            ::topContexts[i].bytes = logs[best].bytes;
+            logs[best].bytes = 0;
+        }
+        i++;
+    }
+
+    ::free( sites );
+    ::free( logs );
+}
+
+
+#if defined(__ELF__)
+// provided by the linker; lets us report sites as offsets that
+// addr2line understands, even in position-independent executables
+extern char __executable_start;
+#endif
+
+
+/*! Returns a description of what was alive after the last mark phase,
+    as a list of "name value" strings, or an empty list if the heap
+    isn't being profiled (see setProfiling()).
+
+    heap-objects-<size> is the number of live objects of up to <size>
+    bytes. heap-site-<offset> is the (estimated) number of live bytes
+    allocated by the code at <offset> in the executable, and
+    heap-context-<id> is the same for objects allocated while the Log
+    with that id() was in effect. heap-sample-interval is the
+    interval given to setProfiling().
+*/
+
+EStringList * Allocator::heapProfile()
+{
+    EStringList * r = new EStringList;
+    if ( !::profileInterval )
+        return r;
+
+    r->append( "heap-sample-interval " + fn( ::profileInterval ) );
+
+    uint i = 0;
+    while ( i < 32 ) {
+        if ( ::survivors[i] && allocators[i] )
+            r->append( "heap-objects-" + fn( allocators[i]->step - bytes ) +
+                       " " + fn( ::survivors[i] ) );
+        i++;
+    }
+
+    ulong base = 0;
+#if defined(__ELF__)
+    base = (ulong)&__executable_start;
+#endif
+    i = 0;
+    while ( i < reportedSites && ::topSites[i].bytes ) {
+        EString n( "heap-site-" );
+        n.appendNumber( (int64)( (ulong)::topSites[i].site - base ), 16u );
+        r->append( n + " " + fn( ::topSites[i].bytes ) );
+        i++;
+    }
+
+    i = 0;
+    while ( i < reportedContexts && ::topContexts[i].bytes ) {
+        r->append( EString( "heap-context-" ) + ::topContexts[i].id +
+                   " " + fn( ::topContexts[i].bytes ) );
+        i++;
+    }
+
+    return r;
 }
 
 
@@ -21,6 +21,9 @@ public:
     static Allocator * allocator( uint size );
 
     static void free();
+    static void free( uint );
+    static bool sweeping();
+    static void sweep( uint );
     static void addEternal( const void *, const char * );
 
     static void removeEternal( void * );
@@ -31,9 +34,13 @@ public:
     static uint allocated();
     static uint inUse();
 
-    static void * alloc( uint, uint = UINT_MAX );
+    static void * alloc( uint, uint = UINT_MAX, const void * = 0 );
     static void dealloc( void * );
 
+    static void setProfiling( uint );
+    static uint profiling();
+    static class EStringList * heapProfile();
+
     uint chunkSize() const;
 
     static Allocator * owner( const void * );
@@ -54,6 +61,7 @@ private:
     ulong * marked;
     void * buffer;
     Allocator * next;
+    bool unswept;
 
     friend void pointers( void * );
     friend class AllocatorMapTable;
@@ -61,6 +69,12 @@ private:
 private:
     static void mark( void * );
     static void mark();
+    static void release( uint );
+    static void report();
+    static bool isMarked( void * );
+    static void sample( void *, uint, const void * );
+    static void unsample( void * );
+    static void profile();
     void sweep();
 };
 
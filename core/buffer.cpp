@@ -5,20 +5,36 @@
 #include "list.h"
 #include "estring.h"
 #include "allocator.h"
+#include "log.h"
 
 // open, O_CREAT|O_RDWR|O_EXCL
 #include <fcntl.h>
 // read, write, unlink, lseek, close
 #include <unistd.h>
+// readv, writev
+#include <sys/uio.h>
+// errno
+#include <errno.h>
 // strlen, memmove
 #include <string.h>
 
 #include <zlib.h>
 
+#if defined(__linux__)
+// sendfile
+#include <sys/sendfile.h>
+#endif
+
 
 static const uint bufsiz = 8192;
 static char buffer[bufsiz];
 
+// strings at least this long are appended by reference, not copied
+static const uint shareable = 2048;
+
+// the most vectors write() gives the kernel at once
+static const int maxvecs = 64;
+
 
 
 /*! \class Buffer buffer.h
@@ -34,6 +50,15 @@ static char buffer[bufsiz];
     calls remove() etc. However, its owner has the option of putting
     things into the buffer and later removing them. One class does use
     that: IMAPS.
+
+    Large strings are kept by reference rather than copied, so e.g. a
+    message body goes from the database to the socket without being
+    copied into the Buffer. write() sends as many of the queued
+    vectors as possible using a single writev().
+
+    appendFile() goes one step further and refers to a file, which
+    write() sends using sendfile() where that's available, so the
+    contents never enter this process.
 */
 
 /*! Creates an empty Buffer. */
@@ -167,28 +192,204 @@ void Buffer::append2( const char * s, uint l )
 
 /*! \overload
     Appends the EString \a s to a Buffer.
+
+    If \a s is large and the Buffer doesn't compress, the Buffer
+    refers to the data in \a s instead of copying it.
 */
 
 void Buffer::append( const EString &s )
 {
-    if ( s.length() > 0 )
+    if ( s.length() >= shareable && filter == None )
+        share( s );
+    else if ( s.length() > 0 )
         append( s.data(), s.length() );
 }
 
 
+/*! This private helper appends \a s to the Buffer by reference. */
+
+void Buffer::share( const EString & s )
+{
+    // the copy makes the data read-only, so neither s nor anything
+    // else will change or free it while we refer to it.
+    EString copy( s );
+
+    Vector * v = new Vector;
+    v->base = (char*)copy.data();
+    v->len = copy.length();
+    v->shared = true;
+    add( v );
+}
+
+
+/*! This private helper appends the shared or file-backed vector \a v
+    to the Buffer.
+*/
+
+void Buffer::add( Vector * v )
+{
+    Vector * last = vecs.last();
+    if ( last && firstfree ) {
+        // the rest of the last vector cannot be used any more
+        last->len = firstfree;
+    }
+    else if ( last ) {
+        // a spare vector kept by remove()
+        vecs.clear();
+    }
+
+    if ( vecs.isEmpty() )
+        firstused = 0;
+    vecs.append( v );
+    firstfree = v->len;
+    bytes += v->len;
+}
+
+
+// Returns \a length bytes from \a offset onwards in the file called
+// \a name. If the file is shorter or cannot be read, the rest is NULs,
+// and we log an error, since whoever receives them won't know.
+
+static EString readFile( const EString & name, uint offset, uint length )
+{
+    EString r;
+    r.reserve( length );
+    int fd = ::open( name.cstr(), O_RDONLY );
+    if ( fd >= 0 ) {
+        char b[8192];
+        while ( r.length() < length ) {
+            uint n = length - r.length();
+            if ( n > sizeof( b ) )
+                n = sizeof( b );
+            int l = ::pread( fd, b, n, offset + r.length() );
+            if ( l <= 0 )
+                break;
+            r.append( b, l );
+        }
+        ::close( fd );
+    }
+    if ( r.length() < length )
+        log( "Could read only " + fn( r.length() ) + " of " +
+             fn( length ) + " bytes at offset " + fn( offset ) +
+             " in " + name + ", sending NULs instead", Log::Error );
+    while ( r.length() < length )
+        r.append( '\0' );
+    return r;
+}
+
+
+/*! Appends \a length bytes from the file called \a name to the
+    Buffer, starting at \a offset. \a name must be usable as it is,
+    i.e. already adjusted using File::chrooted().
+
+    If the Buffer doesn't compress, the file is read only when
+    write() sends it, and its contents must not change until then.
+    If it turns out to be shorter than \a length, or can't be read,
+    write() logs an error and sends NULs instead of the missing bytes,
+    so that whatever protocol is spoken remains in sync.
+*/
+
+void Buffer::appendFile( const EString & name, uint offset, uint length )
+{
+    if ( !length )
+        return;
+
+    if ( filter != None ) {
+        append( readFile( name, offset, length ) );
+        return;
+    }
+
+    Vector * v = new Vector;
+    v->file = new EString( name );
+    v->offset = offset;
+    v->len = length;
+    v->shared = true;
+    add( v );
+}
+
+
+/*! This private helper replaces the file reference in \a v with the
+    file's contents, padded with NULs as described for appendFile().
+*/
+
+void Buffer::unfile( Vector * v )
+{
+    EString s( readFile( *v->file, v->offset, v->len ) );
+    v->base = (char*)s.data();
+    v->file = 0;
+}
+
+
+// Sends up to \a length bytes from \a offset within the file \a name
+// to \a fd, and returns the number of bytes sent, -1 if \a fd doesn't
+// accept anything just now or has failed (as for write()), or 0 if
+// the file cannot be sent this way.
+
+static int writeFile( int fd, const EString & name, uint offset, uint length )
+{
+    int f = ::open( name.cstr(), O_RDONLY );
+    if ( f < 0 )
+        return 0;
+#if defined(__linux__)
+    off_t o = offset;
+    int r = ::sendfile( fd, f, &o, length );
+    // if fd doesn't support sendfile(), unfile() and writev() will
+    // do. other errors concern fd, and writev() would fail likewise.
+    if ( r < 0 && ( errno == EINVAL || errno == ENOSYS ) )
+        r = 0;
+#else
+    char b[32768];
+    if ( length > sizeof( b ) )
+        length = sizeof( b );
+    int r = ::pread( f, b, length, offset );
+    if ( r > 0 )
+        r = ::write( fd, b, r );
+    else if ( r < 0 )
+        r = 0;
+#endif
+    ::close( f );
+    return r;
+}
+
+
 /*! Reads as much as possible from the file descriptor \a fd into the
     Buffer. It assumes that the file descriptor is nonblocking, and
     that enough memory is available.
+
+    When possible, the data is read straight into the free space at
+    the end of the Buffer.
 */
 
 void Buffer::read( int fd )
 {
     char buf[32768];
 
-    int n = ::read( fd, &buf, 32768 );
-    while ( n > 0 ) {
-        append( buf, n );
-        n = ::read( fd, &buf, 32768 );
+    while ( true ) {
+        struct iovec iov[2];
+        int n = 0;
+        uint room = 0;
+        Vector * v = vecs.last();
+        if ( filter == None && v && !v->shared && v->len > firstfree ) {
+            room = v->len - firstfree;
+            iov[n].iov_base = v->base + firstfree;
+            iov[n].iov_len = room;
+            n++;
+        }
+        iov[n].iov_base = buf;
+        iov[n].iov_len = sizeof( buf );
+        n++;
+
+        int r = ::readv( fd, iov, n );
+        if ( r <= 0 )
+            return;
+
+        uint direct = (uint)r;
+        if ( direct > room )
+            direct = room;
+        firstfree += direct;
+        bytes += direct;
+        if ( (uint)r > direct )
+            append( buf, r - direct );
     }
 }
 
@@ -199,22 +400,48 @@ void Buffer::read( int fd )
 
 void Buffer::write( int fd )
 {
+    struct iovec iov[maxvecs];
     int written = 1;
 
-    while ( written > 0 ) {
-        Vector * v = vecs.firstElement();
+    while ( written > 0 && bytes > 0 ) {
+        Vector * f = vecs.firstElement();
+        if ( f->file ) {
+            written = writeFile( fd, *f->file,
+                                 f->offset + firstused, f->len - firstused );
+            if ( written > 0 ) {
+                remove( written );
+            }
+            else if ( !written ) {
+                // the file is gone or too short, but we promised to
+                // send f->len bytes.
+                unfile( f );
+                written = 1;
+            }
+            continue;
+        }
 
-        int max = 0;
-        if ( v )
-            max = v->len;
-        if ( vecs.count() == 1 )
-            max = firstfree;
-        int n = max - firstused;
+        int n = 0;
+        bool first = true;
+        List< Vector >::Iterator it( vecs );
+        while ( it && n < maxvecs ) {
+            Vector * v = it;
+            if ( v->file )
+                break;
+            ++it;
+            uint start = first ? firstused : 0;
+            uint end = it ? v->len : firstfree;
+            if ( end > start ) {
+                iov[n].iov_base = v->base + start;
+                iov[n].iov_len = end - start;
+                n++;
+            }
+            first = false;
+        }
 
-        if ( n <= 0 || !v )
+        if ( !n )
             written = 0;
         else
-            written = ::write( fd, v->base+firstused, n );
+            written = ::writev( fd, iov, n );
         if ( written > 0 )
             remove( written );
     }
@@ -241,7 +468,7 @@ void Buffer::remove( uint n )
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
         vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        if ( v && !v->shared && v->len > 100 && v->len < 20000 )
             vecs.append( v );
         return;
     }
@@ -289,6 +516,8 @@ char Buffer::at( uint i ) const
         v = it;
     }
 
+    if ( v->file )
+        return readFile( *v->file, v->offset + i, 1 )[0];
     return *( v->base + i );
 }
 
@@ -322,14 +551,20 @@ EString Buffer::string( uint num ) const
     if ( copied > n )
         copied = n;
 
-    result.append( v->base + firstused, copied );
+    if ( v->file )
+        result.append( readFile( *v->file, v->offset + firstused, copied ) );
+    else
+        result.append( v->base + firstused, copied );
 
     while ( copied < n ) {
         v = ++it;
         uint l = v->len;
         if ( copied + l > n )
             l = n - copied;
-        result.append( v->base, l );
+        if ( v->file )
+            result.append( readFile( *v->file, v->offset, l ) );
+        else
+            result.append( v->base, l );
         copied += l;
     }
 
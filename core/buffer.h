@@ -22,6 +22,7 @@ public:
 
     void append( const EString & );
     void append( const char *, uint );
+    void appendFile( const EString &, uint, uint );
 
     void read( int );
     void write( int );
@@ -37,7 +38,7 @@ public:
 
         i += firstused;
         Vector *v = vecs.firstElement();
-        if ( v && v->len > i )
+        if ( v && v->base && v->len > i )
             return *( v->base + i );
 
         return at( i );
@@ -49,18 +50,29 @@ private:
 private:
     void append( const char *, uint, bool );
     void append2( const char *, uint );
+    void share( const EString & );
 
     struct Vector
         : public Garbage
     {
-        Vector() : base( 0 ), len( 0 ) {
+        Vector()
+            : base( 0 ), file( 0 ), len( 0 ), offset( 0 ), shared( false ) {
             setFirstNonPointer( &len );
         }
         char *base;
+        // if non-null, the data is in this file, starting at offset
+        EString * file;
         // no pointers after this line
         uint len;
+        uint offset;
+        // true if base points into an EString's data, or if file is
+        // used
+        bool shared;
     };
 
+    void add( Vector * );
+    void unfile( Vector * );
+
     List< Vector > vecs;
     Compression filter;
     struct z_stream_s * zs;
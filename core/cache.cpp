@@ -22,7 +22,8 @@ static List<Cache> * caches;
 
     Subclasses of Cache have to provide cache insertion and
     retrieval. This class provides only one bit of core functionality,
-    namely clearing the cache at GC time.
+    namely clearing the cache at GC time. (A subclass which can keep
+    its contents across GC can reimplement shrink() instead.)
 */
 
 
@@ -71,10 +72,14 @@ void Cache::clearAllCaches( bool harder)
         Cache * c = i;
         ++i;
         c->n++;
-        if ( harder || c->n > c->factor ) {
+        if ( harder ) {
             c->n = 0;
             c->clear(); // careful: no iterator pointing to c meanwhile
         }
+        else if ( c->n > c->factor ) {
+            c->n = 0;
+            c->shrink();
+        }
     }
 }
 
@@ -82,3 +87,14 @@ void Cache::clearAllCaches( bool harder)
 /*! \fn virtual void Cache::clear() = 0;
     Implemented by subclasses to discards the contents of the cache.
 */
+
+
+/*! Called instead of clear() when clearAllCaches() is called without
+    \a harder. The default implementation calls clear(); subclasses
+    may reimplement it to discard only some of their contents.
+*/
+
+void Cache::shrink()
+{
+    clear();
+}
@@ -16,6 +16,7 @@ public:
     static void clearAllCaches( bool );
 
     virtual void clear() = 0;
+    virtual void shrink();
 
 private:
     uint factor;
@@ -164,7 +164,24 @@ static struct {
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "gc-slice-time", Configuration::GcSliceTime, 5 },
+    { "memory-profile-interval", Configuration::MemoryProfileInterval, 0 },
+    { "tls-threads", Configuration::TlsThreads, 0 },
+    { "tls-session-cache", Configuration::TlsSessionCache, 4096 },
+    { "db-pipeline-depth", Configuration::DbPipelineDepth, 4 },
+    { "db-prepared-statements", Configuration::DbPreparedStatements, 100 },
+    { "db-replica-handles", Configuration::DbReplicaHandles, 2 },
+    { "db-interactive-handles", Configuration::DbInteractiveHandles, 1 },
+    { "db-delivery-handles", Configuration::DbDeliveryHandles, 1 },
+    { "db-background-handles", Configuration::DbBackgroundHandles, 0 },
+    { "db-priority-aging", Configuration::DbPriorityAging, 10 },
+    { "db-slow-query-time", Configuration::DbSlowQueryTime, 1000 },
+    { "injection-batch-window", Configuration::InjectionBatchWindow, 5 },
+    { "injection-batch-size", Configuration::InjectionBatchSize, 100 },
+    { "message-cache-size", Configuration::MessageCacheSize, 16 },
+    { "shared-cache-size", Configuration::SharedCacheSize, 16 },
+    { "blob-threshold", Configuration::BlobThreshold, 1024 }
 };
 
 
@@ -211,7 +228,9 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "db-replicas", Configuration::DbReplicas, "" },
+    { "blob-directory", Configuration::BlobDir, "" }
 };
 
 
@@ -243,7 +262,10 @@ static struct {
     { "use-statistics", Configuration::UseStatistics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "auto-flag-views", Configuration::AutoFlagViews, false }
+    { "auto-flag-views", Configuration::AutoFlagViews, false },
+    { "db-explain-analyze", Configuration::DbExplainAnalyze, false },
+    { "store-raw-messages", Configuration::StoreRawMessages, false },
+    { "compress-bodyparts", Configuration::CompressBodyparts, false }
 };
 
 
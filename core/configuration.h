@@ -57,6 +57,23 @@ public:
         StatisticsPort,
         LdapServerPort,
         MemoryLimit,
+        GcSliceTime,
+        MemoryProfileInterval,
+        TlsThreads,
+        TlsSessionCache,
+        DbPipelineDepth,
+        DbPreparedStatements,
+        DbReplicaHandles,
+        DbInteractiveHandles,
+        DbDeliveryHandles,
+        DbBackgroundHandles,
+        DbPriorityAging,
+        DbSlowQueryTime,
+        InjectionBatchWindow,
+        InjectionBatchSize,
+        MessageCacheSize,
+        SharedCacheSize,
+        BlobThreshold,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -102,6 +119,8 @@ public:
         AddressSeparator,
         StatisticsAddress,
         LdapServerAddress,
+        DbReplicas,
+        BlobDir,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -134,6 +153,9 @@ public:
         SoftBounce,
         CheckSenderAddresses,
         AutoFlagViews,
+        DbExplainAnalyze,
+        StoreRawMessages,
+        CompressBodyparts,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
@@ -41,13 +41,16 @@ public:
     UDict(): PatriciaTree<T>() {}
 
     T * find( const UString & s ) const {
-        return PatriciaTree<T>::find( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        uint b[64];
+        return PatriciaTree<T>::find( (const char *)s.codepoints( b, 64 ), s.length() * 8 * sizeof( uint ) );
     }
     void insert( const UString & s, T* r ) {
-        PatriciaTree<T>::insert( (const char *)s.data(), s.length() * 8 * sizeof( uint ), r );
+        uint b[64];
+        PatriciaTree<T>::insert( (const char *)s.codepoints( b, 64 ), s.length() * 8 * sizeof( uint ), r );
     }
     T* remove( const UString & s ) {
-        return PatriciaTree<T>::remove( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        uint b[64];
+        return PatriciaTree<T>::remove( (const char *)s.codepoints( b, 64 ), s.length() * 8 * sizeof( uint ) );
     }
     bool contains( const UString & s ) const {
         return find( s ) != 0;
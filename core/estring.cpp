@@ -6,8 +6,10 @@
 
 // stderr, fprintf
 #include <stdio.h>
-// strlen
+// strlen, memset
 #include <string.h>
+// compress2, inflate
+#include <zlib.h>
 
 
 /*! \class EStringData estring.h
@@ -1499,6 +1501,60 @@ bool EString::needsQP() const
 }
 
 
+/*! Returns a zlib-compressed copy of this string, which
+    uncompressed() can decode. An empty string stays empty.
+*/
+
+EString EString::compressed() const
+{
+    EString r;
+    if ( isEmpty() )
+        return r;
+    uLongf l = ::compressBound( length() );
+    r.reserve( l );
+    if ( ::compress2( (Bytef*)r.d->str, &l, (const Bytef*)d->str,
+                      length(), Z_DEFAULT_COMPRESSION ) != Z_OK )
+        return EString();
+    r.d->len = l;
+    return r;
+}
+
+
+/*! Returns the uncompressed version of this string, which must have
+    been made by compressed(), or an empty string if this string isn't
+    zlib-compressed data.
+*/
+
+EString EString::uncompressed() const
+{
+    EString r;
+    if ( isEmpty() )
+        return r;
+
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    if ( ::inflateInit( &zs ) != Z_OK )
+        return r;
+    zs.next_in = (Bytef*)d->str;
+    zs.avail_in = length();
+
+    r.reserve( length() * 4 );
+    int e = Z_OK;
+    while ( e == Z_OK ) {
+        if ( r.d->len == r.d->max )
+            r.reserve( r.d->max * 2 );
+        zs.next_out = (Bytef*)r.d->str + r.d->len;
+        zs.avail_out = r.d->max - r.d->len;
+        e = ::inflate( &zs, Z_NO_FLUSH );
+        r.d->len = zs.total_out;
+    }
+    ::inflateEnd( &zs );
+    if ( e != Z_STREAM_END )
+        return EString();
+    return r;
+}
+
+
 /*! Returns -1 if this string is lexicographically before \a other, 0
     if they are the same, and 1 if this string is lexicographically
     after \a other.
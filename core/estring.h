@@ -121,6 +121,9 @@ public:
     EString eQP( bool = false, bool = false ) const;
     bool needsQP() const;
 
+    EString compressed() const;
+    EString uncompressed() const;
+
     friend inline bool operator==( const EString &, const EString & );
     friend bool operator==( const EString &, const char * );
 
@@ -45,7 +45,8 @@ void die( Exception e )
 
 void *Garbage::operator new( size_t s )
 {
-    return Allocator::alloc( (uint)s );
+    return Allocator::alloc( (uint)s, UINT_MAX,
+                             __builtin_return_address( 0 ) );
 }
 
 
@@ -57,7 +58,8 @@ void Garbage::operator delete( void * )
 
 void *Garbage::operator new[]( size_t s )
 {
-    return Allocator::alloc( (uint)s );
+    return Allocator::alloc( (uint)s, UINT_MAX,
+                             __builtin_return_address( 0 ) );
 }
 
 
@@ -0,0 +1,169 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "dict.h"
+#include "map.h"
+#include "hashtable.h"
+#include "allocator.h"
+#include "estring.h"
+
+// fprintf
+#include <stdio.h>
+// atoi
+#include <stdlib.h>
+// gettimeofday
+#include <sys/time.h>
+
+
+// hashbench compares PatriciaTree-based Dict and Map with HashDict
+// and HashMap: it inserts n keys, looks each up, looks up n keys that
+// aren't there, iterates and removes half the keys, and prints the
+// time each step took in nanoseconds per key.
+
+
+static EString ** keys;
+static EString ** misses;
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday( &tv, 0 );
+    return tv.tv_sec * 1000000000.0 + tv.tv_usec * 1000.0;
+}
+
+
+static void report( const char * what, const char * step,
+                    double start, uint n, uint found )
+{
+    fprintf( stdout, "%-9s %-8s %8.1f ns/key (%u)\n",
+             what, step, ( now() - start ) / n, found );
+}
+
+
+template< class D >
+static void strings( const char * what, uint n )
+{
+    D * d = new D;
+    Allocator::addEternal( d, "benchmark dictionary" );
+
+    double t = now();
+    uint i = 0;
+    while ( i < n ) {
+        d->insert( *keys[i], keys[i] );
+        i++;
+    }
+    report( what, "insert", t, n, d->count() );
+
+    uint found = 0;
+    t = now();
+    i = 0;
+    while ( i < n ) {
+        if ( d->find( *keys[i] ) )
+            found++;
+        i++;
+    }
+    report( what, "hit", t, n, found );
+
+    found = 0;
+    t = now();
+    i = 0;
+    while ( i < n ) {
+        if ( d->find( *misses[i] ) )
+            found++;
+        i++;
+    }
+    report( what, "miss", t, n, found );
+
+    found = 0;
+    t = now();
+    typename D::Iterator it( d );
+    while ( it ) {
+        found++;
+        ++it;
+    }
+    report( what, "iterate", t, n, found );
+
+    found = 0;
+    t = now();
+    i = 0;
+    while ( i < n ) {
+        if ( d->remove( *keys[i] ) )
+            found++;
+        i += 2;
+    }
+    report( what, "remove", t, n / 2, found );
+
+    Allocator::removeEternal( d );
+}
+
+
+template< class M >
+static void numbers( const char * what, uint n )
+{
+    M * m = new M;
+    Allocator::addEternal( m, "benchmark map" );
+
+    double t = now();
+    uint i = 0;
+    while ( i < n ) {
+        m->insert( i * 7 + 1, keys[i] );
+        i++;
+    }
+    report( what, "insert", t, n, m->count() );
+
+    uint found = 0;
+    t = now();
+    i = 0;
+    while ( i < n ) {
+        if ( m->find( i * 7 + 1 ) )
+            found++;
+        i++;
+    }
+    report( what, "hit", t, n, found );
+
+    found = 0;
+    t = now();
+    i = 0;
+    while ( i < n ) {
+        if ( m->find( i * 7 + 2 ) )
+            found++;
+        i++;
+    }
+    report( what, "miss", t, n, found );
+
+    Allocator::removeEternal( m );
+}
+
+
+/*! \nodoc */
+
+int main( int argc, char ** argv )
+{
+    uint n = 100000;
+    if ( argc > 1 )
+        n = atoi( argv[1] );
+    if ( !n )
+        n = 1;
+
+    // message-id-like keys, which share long prefixes
+    keys = (EString**)Allocator::alloc( n * sizeof( EString * ) );
+    misses = (EString**)Allocator::alloc( n * sizeof( EString * ) );
+    Allocator::addEternal( keys, "benchmark keys" );
+    Allocator::addEternal( misses, "benchmark misses" );
+    uint i = 0;
+    while ( i < n ) {
+        EString k = "<" + fn( i * 2654435761u ) + ".archiveopteryx@";
+        EString hit = k + "example.org>";
+        EString miss = k + "example.com>";
+        keys[i] = new EString( hit );
+        misses[i] = new EString( miss );
+        i++;
+    }
+
+    fprintf( stdout, "%u keys\n", n );
+    strings< Dict<EString> >( "Dict", n );
+    strings< HashDict<EString> >( "HashDict", n );
+    numbers< Map<EString> >( "Map", n );
+    numbers< HashMap<EString> >( "HashMap", n );
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "hashtable.h"
+
+// memcpy
+#include <string.h>
+
+
+/*! Returns a 32-bit hash of the \a l bytes at \a k, suitable for
+    HashTable. The input is consumed eight bytes at a time.
+*/
+
+uint hashBytes( const char * k, uint l )
+{
+    typedef unsigned long long Word;
+    Word h = 0x9e3779b97f4a7c15ULL ^ l;
+    while ( l >= sizeof( Word ) ) {
+        Word w;
+        memcpy( &w, k, sizeof( w ) );
+        h = ( h ^ w ) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+        k += sizeof( w );
+        l -= sizeof( w );
+    }
+    if ( l ) {
+        Word w = 0;
+        memcpy( &w, k, l );
+        h = ( h ^ w ) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (uint)h;
+}
+
+
+/*! \class HashTable hashtable.h
+
+    Implements a hash table with open addressing, for the places where
+    a PatriciaTree's lookup speed matters.
+
+    Like PatriciaTree it stores pointers to objects of a single type,
+    keyed by a string of bytes (not bits), and has the subclasses
+    HashDict, HashUDict and HashMap with the same API as Dict, UDict
+    and Map.
+
+    The entries are kept in one array, in the order in which they were
+    inserted, and that's also the order in which Iterator returns them.
+    The table proper is an array of one-byte control codes and an
+    array of indexes into the entry array. Each control byte contains
+    seven bits of the hash, or marks an empty or deleted slot, and the
+    control bytes are examined eight at a time, so that most lookups
+    touch one word of control bytes and one entry. Keys that fit in a
+    pointer are stored in the entry itself.
+
+    There are three common public operations: insert(), find() and
+    remove(). There's also a clear(), which is fast but relies on GC
+    to tidy up slowly later.
+
+    An Iterator remains valid if the current item is removed, but not
+    if new items are inserted.
+*/
+
+
+/*! \fn HashTable::HashTable()
+
+    Creates an empty table.
+*/
+
+
+/*! \fn T * HashTable::find( const char * k, uint l ) const
+
+    Looks up the item with key \a k of length \a l bytes. Returns 0 if
+    there is no such item.
+*/
+
+
+/*! \fn void HashTable::insert( const char * k, uint l, T * t )
+
+    Inserts the item \a t using key \a k of length \a l bytes. If there
+    already was an item with that key, the old item is silently
+    forgotten. Inserting a null pointer removes the key.
+*/
+
+
+/*! \fn T * HashTable::remove( const char * k, uint l )
+
+    Removes the item with key \a k of length \a l bytes. Returns a
+    pointer to the removed item, or a null pointer if there was no
+    such item in the table.
+*/
+
+
+/*! \fn bool HashTable::isEmpty() const
+
+    Returns true if the table is empty, and false otherwise.
+*/
+
+
+/*! \fn uint HashTable::count() const
+
+    Returns the number of items in the table.
+*/
+
+
+/*! \fn void HashTable::clear()
+
+    Instantly forgets everything in the table.
+*/
+
+
+/*! \fn T * HashTable::first() const
+
+    Returns the first item inserted that's still in the table, or a
+    null pointer if the table is empty.
+*/
+
+
+/*! \class HashDict hashtable.h
+    A HashTable that takes EString keys, like Dict.
+*/
+
+
+/*! \class HashUDict hashtable.h
+    A HashTable that takes UString keys, like UDict.
+*/
+
+
+/*! \class HashMap hashtable.h
+    A HashTable that takes uint keys, like Map.
+*/
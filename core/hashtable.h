@@ -0,0 +1,391 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef HASHTABLE_H
+#define HASHTABLE_H
+
+#include "global.h"
+#include "allocator.h"
+#include "estring.h"
+#include "ustring.h"
+
+// memcmp, memcpy, memset
+#include <string.h>
+
+
+extern uint hashBytes( const char *, uint );
+
+
+template< class T >
+class HashTable
+    : public Garbage
+{
+public:
+    HashTable()
+        : entries( 0 ), control( 0 ), index( 0 ), pool( 0 ),
+          used( 0 ), live( 0 ), filled( 0 ), slots( 0 ), pooled( 0 ) {
+    }
+
+    struct Entry
+    {
+        union {
+            const char * key;
+            char bytes[sizeof( const char * )];
+        };
+        T * data;
+        uint length;
+        uint hash;
+
+        const char * k() const {
+            return length <= sizeof( bytes ) ? bytes : key;
+        }
+    };
+
+    T * find( const char * k, uint l ) const {
+        if ( !live )
+            return 0;
+        uint s = locate( k, l, hashBytes( k, l ) );
+        if ( s == UINT_MAX )
+            return 0;
+        return entries[index[s]].data;
+    }
+
+    void insert( const char * k, uint l, T * t ) {
+        if ( !t ) {
+            remove( k, l );
+            return;
+        }
+        uint h = hashBytes( k, l );
+        if ( live ) {
+            uint s = locate( k, l, h );
+            if ( s != UINT_MAX ) {
+                entries[index[s]].data = t;
+                return;
+            }
+        }
+        if ( used >= capacity() || ( filled + 1 ) * 8 > slots * 7 )
+            rehash( live + 1 );
+
+        Entry * e = entries + used;
+        e->length = l;
+        e->hash = h;
+        e->data = t;
+        if ( l <= sizeof( e->bytes ) ) {
+            memcpy( e->bytes, k, l );
+        }
+        else {
+            char * c = store( l );
+            memcpy( c, k, l );
+            e->key = c;
+        }
+        place( h, used );
+        used++;
+        live++;
+    }
+
+    T * remove( const char * k, uint l ) {
+        if ( !live )
+            return 0;
+        uint s = locate( k, l, hashBytes( k, l ) );
+        if ( s == UINT_MAX )
+            return 0;
+        uint i = index[s];
+        T * r = entries[i].data;
+        entries[i].data = 0;
+        entries[i].key = 0;
+        if ( i + 1 == used )
+            used--;
+        live--;
+        // a probe sequence ends at the first group with an empty
+        // slot, so if this group has one, no probe passes it and the
+        // slot can be empty rather than deleted.
+        if ( matchEmpty( group( s / 8 ) ) ) {
+            control[s] = Empty;
+            filled--;
+        }
+        else {
+            control[s] = Deleted;
+        }
+        return r;
+    }
+
+    bool isEmpty() const { return live == 0; }
+    uint count() const { return live; }
+
+    void clear() {
+        entries = 0;
+        control = 0;
+        index = 0;
+        pool = 0;
+        used = 0;
+        live = 0;
+        filled = 0;
+        slots = 0;
+        pooled = 0;
+    }
+
+    T * first() const {
+        uint i = 0;
+        while ( i < used && !entries[i].data )
+            i++;
+        if ( i < used )
+            return entries[i].data;
+        return 0;
+    }
+
+    class Iterator
+        : public Garbage
+    {
+    public:
+        Iterator(): t( 0 ), i( 0 ) {}
+        Iterator( const HashTable<T> * table ): t( table ), i( 0 ) {
+            skip();
+        }
+        Iterator( const HashTable<T> & table ): t( &table ), i( 0 ) {
+            skip();
+        }
+
+        operator bool() { return t && i < t->used; }
+        operator T *() { return *this ? t->entries[i].data : 0; }
+        T *operator ->() { ok(); return t->entries[i].data; }
+        Iterator &operator ++() { ok(); i++; skip(); return *this; }
+        T &operator *() { ok(); return *( t->entries[i].data ); }
+
+    private:
+        void skip() {
+            while ( t && i < t->used && !t->entries[i].data )
+                i++;
+        }
+        void ok() {
+            if ( !*this )
+                die( Invariant );
+        }
+
+        const HashTable<T> * t;
+        uint i;
+    };
+
+private:
+    friend class Iterator;
+
+    enum { Empty = 0x80, Deleted = 0xfe };
+
+    typedef unsigned long long Word;
+
+    static Word repeat( uint c ) { return 0x0101010101010101ULL * c; }
+
+    Word group( uint g ) const {
+        Word w;
+        memcpy( &w, control + g * 8, sizeof( w ) );
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64( w );
+#endif
+        return w;
+    }
+
+    // the high bit of each byte of the result is set if that byte of
+    // w is c. the sum can't carry from one byte into the next.
+    static Word match( Word w, uint c ) {
+        Word x = w ^ repeat( c );
+        return ~( ( ( x & repeat( 0x7f ) ) + repeat( 0x7f ) ) | x |
+                  repeat( 0x7f ) );
+    }
+
+    static Word matchEmpty( Word w ) {
+        return w & ~( w << 6 ) & repeat( 0x80 );
+    }
+
+    static Word matchFree( Word w ) {
+        return w & repeat( 0x80 );
+    }
+
+    static uint lowest( Word m ) {
+        return __builtin_ctzll( m ) / 8;
+    }
+
+    uint capacity() const { return slots / 8 * 7; }
+
+    // keys longer than a pointer are copied into 4k chunks, so
+    // inserting doesn't cost an allocation each time.
+    enum { PoolSize = 4096 };
+
+    char * store( uint l ) {
+        if ( l > PoolSize / 4 )
+            return (char*)Allocator::alloc( l, 0 );
+        if ( !pool || pooled + l > PoolSize ) {
+            pool = (char*)Allocator::alloc( PoolSize, 0 );
+            pooled = 0;
+        }
+        char * r = pool + pooled;
+        pooled += l;
+        return r;
+    }
+
+    uint locate( const char * k, uint l, uint h ) const {
+        uint mask = slots / 8 - 1;
+        uint g = ( h >> 7 ) & mask;
+        uint step = 0;
+        while ( true ) {
+            Word w = group( g );
+            Word m = match( w, h & 0x7f );
+            while ( m ) {
+                uint s = g * 8 + lowest( m );
+                const Entry & e = entries[index[s]];
+                if ( e.hash == h && e.length == l &&
+                     !memcmp( e.k(), k, l ) )
+                    return s;
+                m &= m - 1;
+            }
+            if ( matchEmpty( w ) )
+                return UINT_MAX;
+            step++;
+            g = ( g + step ) & mask;
+        }
+    }
+
+    void place( uint h, uint i ) {
+        uint mask = slots / 8 - 1;
+        uint g = ( h >> 7 ) & mask;
+        uint step = 0;
+        Word m = matchFree( group( g ) );
+        while ( !m ) {
+            step++;
+            g = ( g + step ) & mask;
+            m = matchFree( group( g ) );
+        }
+        uint s = g * 8 + lowest( m );
+        if ( control[s] == Empty )
+            filled++;
+        control[s] = h & 0x7f;
+        index[s] = i;
+    }
+
+    void rehash( uint n ) {
+        uint s = 8;
+        while ( s / 8 * 7 < n * 2 )
+            s *= 2;
+        Entry * old = entries;
+        uint oldUsed = used;
+
+        entries = (Entry*)Allocator::alloc( s / 8 * 7 * sizeof( Entry ) );
+        control = (unsigned char*)Allocator::alloc( s, 0 );
+        index = (uint*)Allocator::alloc( s * sizeof( uint ), 0 );
+        memset( control, Empty, s );
+        slots = s;
+        used = 0;
+        filled = 0;
+
+        uint i = 0;
+        while ( i < oldUsed ) {
+            if ( old[i].data ) {
+                entries[used] = old[i];
+                place( old[i].hash, used );
+                used++;
+            }
+            i++;
+        }
+    }
+
+    Entry * entries;
+    unsigned char * control;
+    uint * index;
+    char * pool;
+    uint used;
+    uint live;
+    uint filled;
+    uint slots;
+    uint pooled;
+};
+
+
+template<class T>
+class HashDict
+    : public HashTable<T>
+{
+public:
+    HashDict(): HashTable<T>() {}
+
+    T * find( const EString & s ) const {
+        return HashTable<T>::find( s.data(), s.length() );
+    }
+    void insert( const EString & s, T* r ) {
+        HashTable<T>::insert( s.data(), s.length(), r );
+    }
+    T* remove( const EString & s ) {
+        return HashTable<T>::remove( s.data(), s.length() );
+    }
+    bool contains( const EString & s ) const {
+        return find( s ) != 0;
+    }
+
+private:
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    HashDict< T > &operator =( const HashDict< T > & ) { return *this; }
+    bool operator ==( const HashDict< T > & ) const { return false; }
+    bool operator !=( const HashDict< T > & ) const { return false; }
+};
+
+
+template<class T>
+class HashUDict
+    : public HashTable<T>
+{
+public:
+    HashUDict(): HashTable<T>() {}
+
+    T * find( const UString & s ) const {
+        uint b[64];
+        return HashTable<T>::find( (const char *)s.codepoints( b, 64 ),
+                                   s.length() * sizeof( uint ) );
+    }
+    void insert( const UString & s, T* r ) {
+        uint b[64];
+        HashTable<T>::insert( (const char *)s.codepoints( b, 64 ),
+                              s.length() * sizeof( uint ), r );
+    }
+    T* remove( const UString & s ) {
+        uint b[64];
+        return HashTable<T>::remove( (const char *)s.codepoints( b, 64 ),
+                                     s.length() * sizeof( uint ) );
+    }
+    bool contains( const UString & s ) const {
+        return find( s ) != 0;
+    }
+
+private:
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    HashUDict< T > &operator =( const HashUDict< T > & ) { return *this; }
+    bool operator ==( const HashUDict< T > & ) const { return false; }
+    bool operator !=( const HashUDict< T > & ) const { return false; }
+};
+
+
+template<class T>
+class HashMap
+    : public HashTable<T>
+{
+public:
+    HashMap(): HashTable<T>() {}
+
+    T * find( uint i ) const {
+        return HashTable<T>::find( (const char *)&i, sizeof( i ) );
+    }
+    void insert( uint i, T * r ) {
+        HashTable<T>::insert( (const char *)&i, sizeof( i ), r );
+    }
+    T * remove( uint i ) {
+        return HashTable<T>::remove( (const char *)&i, sizeof( i ) );
+    }
+    bool contains( uint i ) const { return find( i ) != 0; }
+
+private:
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    HashMap< T > &operator =( const HashMap< T > & ) { return *this; }
+    bool operator ==( const HashMap< T > & ) const { return false; }
+    bool operator !=( const HashMap< T > & ) const { return false; }
+};
+
+
+#endif
@@ -14,9 +14,15 @@
 /*! \class UStringData ustring.h
 
     This private helper class contains the actual string data. It has
-    three fields, all accessible only to UString. The only noteworthy
-    field is max, which is 0 in the case of a shared/read-only string,
-    and nonzero in the case of a string which can be modified.
+    four fields, all accessible only to UString. max is 0 in the case
+    of a shared/read-only string, and nonzero in the case of a string
+    which can be modified.
+
+    width is the number of bytes used per code point: 1 if all code
+    points are in ISO-8859-1 (as they usually are), 2 if they're all
+    in the BMP, and otherwise 4. A string is widened when something
+    wider is appended, and never narrowed. at() and set() hide the
+    difference.
 */
 
 
@@ -28,16 +34,25 @@
 /*! Creates a new EString with \a words capacity. */
 
 UStringData::UStringData( int words )
-    : str( 0 ), len( 0 ), max( words )
+    : str( 0 ), len( 0 ), max( words ), width( 1 )
 {
-    if ( str )
-        str = (uint*)Allocator::alloc( words*sizeof(uint), 0 );
+    setFirstNonPointer( &len );
 }
 
 
 void * UStringData::operator new( size_t ownSize, uint extra )
 {
-    return Allocator::alloc( ownSize + extra*sizeof(uint), 1 );
+    return Allocator::alloc( ownSize + extra, 1 );
+}
+
+
+static uint widthOf( uint cp )
+{
+    if ( cp < 256 )
+        return 1;
+    if ( cp < 65536 )
+        return 2;
+    return 4;
 }
 
 
@@ -54,6 +69,10 @@ void * UStringData::operator new( size_t ownSize, uint extra )
     functionality is intentionally kept to a minimum, to lighten the
     testing burden.
 
+    Internally, a UString uses one byte per code point as long as it
+    contains only ISO-8859-1, and two or four only when it has to, so
+    most strings take no more memory than their EString equivalent.
+
     Two functions note particular mention are ascii() and the equality
     operator. ascii() returns something that's useful for logging, but
     which can often not be converted back to unicode.
@@ -174,8 +193,18 @@ void UString::append( const UString & other )
         *this = other;
         return;
     }
-    reserve( length() + other.length() );
-    memmove( d->str+d->len, other.d->str, sizeof(uint)*other.d->len );
+    prepare( length() + other.length(), other.d->width );
+    if ( d->width == other.d->width ) {
+        memmove( d->str + d->len * d->width, other.d->str,
+                 other.d->len * d->width );
+    }
+    else {
+        uint i = 0;
+        while ( i < other.d->len ) {
+            d->set( d->len + i, other.d->at( i ) );
+            i++;
+        }
+    }
     d->len += other.d->len;
 }
 
@@ -184,8 +213,8 @@ void UString::append( const UString & other )
 
 void UString::append( const uint cp )
 {
-    reserve( length() + 1 );
-    d->str[d->len] = cp;
+    prepare( length() + 1, widthOf( cp ) );
+    d->set( d->len, cp );
     d->len++;
 }
 
@@ -200,7 +229,7 @@ void UString::append( const char * s )
         return;
     reserve( length() + strlen( s ) );
     while ( s && *s )
-        d->str[d->len++] = (uint)*s++; // I feel naughty today
+        d->set( d->len++, (unsigned char)*s++ );
 }
 
 
@@ -214,7 +243,21 @@ void UString::reserve( uint num )
     if ( !num )
         num = 1;
     if ( !d || d->max < num )
-        reserve2( num );
+        reserve2( num, d ? d->width : 1 );
+}
+
+
+/*! This private helper ensures that this string is modifiable, has
+    room for \a num characters and uses at least \a width bytes per
+    character.
+*/
+
+void UString::prepare( uint num, uint width )
+{
+    if ( !num )
+        num = 1;
+    if ( !d || d->max < num || d->width < width )
+        reserve2( num, width );
 }
 
 
@@ -223,28 +266,43 @@ void UString::reserve( uint num )
     is, and calls to this function should be interesting wrt. memory
     allocation statistics.
 
-    Noone except reserve() should call reserve2().
+    The new storage uses \a width bytes per character, or as many as
+    the current storage if that's more.
+
+    Noone except reserve() and prepare() should call reserve2().
 */
 
-void UString::reserve2( uint num )
+void UString::reserve2( uint num, uint width )
 {
+    if ( d && d->width > width )
+        width = d->width;
     const uint std = sizeof( UStringData );
-    const uint si = sizeof( uint );
-    num = ( Allocator::rounded( num * si + std ) - std ) / si;
+    num = ( Allocator::rounded( num * width + std ) - std ) / width;
 
     UStringData * freeable = 0;
     if ( d && d->max )
         freeable = d;
 
-    UStringData * nd = new( num ) UStringData( 0 );
+    UStringData * nd = new( num * width ) UStringData( 0 );
     nd->max = num;
-    nd->str = (uint*)(std + (char*)nd);
+    nd->width = width;
+    nd->str = std + (char*)nd;
     if ( d )
         nd->len = d->len;
     if ( nd->len > num )
         nd->len = num;
-    if ( d && d->len )
-        memmove( nd->str, d->str, nd->len*si );
+    if ( d && d->len ) {
+        if ( d->width == width ) {
+            memmove( nd->str, d->str, nd->len * width );
+        }
+        else {
+            uint i = 0;
+            while ( i < nd->len ) {
+                nd->set( i, d->at( i ) );
+                i++;
+            }
+        }
+    }
     d = nd;
 
     if ( freeable )
@@ -277,9 +335,8 @@ bool UString::isAscii() const
         return true;
     uint i = 0;
     while ( i < d->len ) {
-        if ( d->str[i] >= 128 ||
-             ( d->str[i] < 32 &&
-               d->str[i] != 9 && d->str[i] != 10 && d->str[i] != 13 ) )
+        uint c = d->at( i );
+        if ( c >= 128 || ( c < 32 && c != 9 && c != 10 && c != 13 ) )
             return false;
         i++;
     }
@@ -303,8 +360,9 @@ EString UString::ascii() const
     r.reserve( length() );
     uint i = 0;
     while ( i < length() ) {
-        if ( d->str[i] >= ' ' && d->str[i] < 127 )
-            r.append( (char)(d->str[i]) );
+        uint c = d->at( i );
+        if ( c >= ' ' && c < 127 )
+            r.append( (char)c );
         else
             r.append( '?' );
         i++;
@@ -335,12 +393,39 @@ UString UString::mid( uint start, uint num ) const
 
     d->max = 0;
     result.d = new UStringData;
-    result.d->str = d->str + start;
+    result.d->str = d->str + start * d->width;
     result.d->len = num;
+    result.d->width = d->width;
     return result;
 }
 
 
+/*! Returns a pointer to the code points in this string, one uint
+    each, e.g. for use as a dictionary key.
+
+    If the string is stored more compactly, the code points are
+    copied to \a buffer if it has room for length() of them (\a size
+    is its size), and otherwise to newly allocated memory.
+*/
+
+const uint * UString::codepoints( uint * buffer, uint size ) const
+{
+    if ( !d )
+        return buffer;
+    if ( d->width == sizeof( uint ) )
+        return (const uint *)d->str;
+    uint * r = buffer;
+    if ( d->len > size )
+        r = (uint*)Allocator::alloc( d->len * sizeof( uint ), 0 );
+    uint i = 0;
+    while ( i < d->len ) {
+        r[i] = d->at( i );
+        i++;
+    }
+    return r;
+}
+
+
 /*! Returns the number encoded by this string, and sets \a *ok to true
     if that number is valid, or to false if the number is invalid. By
     default the number is encoded in base 10, if \a base is specified
@@ -388,7 +473,7 @@ UString UString::simplified() const
     uint i = 0;
     uint first = 0;
     while ( i < length() && first == i ) {
-        if ( isSpace( d->str[i] ) )
+        if ( isSpace( d->at( i ) ) )
             first++;
         i++;
     }
@@ -400,7 +485,7 @@ UString UString::simplified() const
     uint spaces = 0;
     bool identity = true;
     while ( identity && i < length() ) {
-        if ( isSpace( d->str[i] ) ) {
+        if ( isSpace( d->at( i ) ) ) {
             spaces++;
         }
         else {
@@ -421,7 +506,7 @@ UString UString::simplified() const
     bool ogham = false;
     bool zwnbsp = true;
     while ( i < length() ) {
-        int c = d->str[i];
+        int c = d->at( i );
         if ( isSpace( c ) ) {
             if ( c == 0x1680 )
                 ogham = true;
@@ -459,7 +544,7 @@ UString UString::trimmed() const
     uint first = length();
     uint last = 0;
     while ( i < length() ) {
-        if ( !isSpace( d->str[i] ) ) {
+        if ( !isSpace( d->at( i ) ) ) {
             if ( i < first )
                 first = i;
             if ( i > last )
@@ -506,7 +591,7 @@ int UString::compare( const UString & other ) const
         return 0;
     uint i = 0;
     while ( i < length() && i < other.length() &&
-            d->str[i] == other.d->str[i] )
+            d->at( i ) == other.d->at( i ) )
         i++;
     if ( i >= length() && i >= other.length() )
         return 0;
@@ -514,7 +599,7 @@ int UString::compare( const UString & other ) const
         return -1;
     if ( i >= other.length() )
         return 1;
-    if ( d->str[i] < other.d->str[i] )
+    if ( d->at( i ) < other.d->at( i ) )
         return -1;
     return 1;
 }
@@ -566,7 +651,7 @@ bool UString::startsWith( const char * prefix ) const
     if ( !length() )
         return false;
     uint i = 0;
-    while ( i < d->len && prefix[i] && prefix[i] == d->str[i] )
+    while ( i < d->len && prefix[i] && (uint)prefix[i] == d->at( i ) )
         i++;
     if ( i > d->len )
         return false;
@@ -599,7 +684,7 @@ bool UString::endsWith( const char * suffix ) const
     if ( l > length() )
         return false;
     uint i = 0;
-    while ( i < l && suffix[i] == d->str[d->len - l + i] )
+    while ( i < l && (uint)suffix[i] == d->at( d->len - l + i ) )
         i++;
     if ( i < l )
         return false;
@@ -613,7 +698,7 @@ bool UString::endsWith( const char * suffix ) const
 
 int UString::find( char c, int i ) const
 {
-    while ( i < (int)length() && d->str[i] != c )
+    while ( i < (int)length() && d->at( i ) != (uint)c )
         i++;
     if ( i < (int)length() )
         return i;
@@ -629,7 +714,7 @@ int UString::find( const UString & s, int i ) const
 {
     uint j = 0;
     while ( j < s.length() && i+j < length() ) {
-        if ( d->str[i+j] == s.d->str[j] ) {
+        if ( d->at( i+j ) == s.d->at( j ) ) {
             j++;
         }
         else {
@@ -674,7 +759,7 @@ bool UString::contains( const char * s ) const
         uint l = strlen( s );
         uint j = 0;
         while ( j < l && i + j < length() &&
-                d->str[i+j] == s[j] )
+                d->at( i+j ) == (uint)s[j] )
             j++;
         if ( j == l )
             return true;
@@ -696,12 +781,13 @@ UString UString::titlecased() const
     UString r = *this;
     uint i = 0;
     while ( i < length() ) {
-        uint cp = d->str[i];
+        uint cp = d->at( i );
         if ( cp < numTitlecaseCodepoints &&
              titlecaseCodepoints[cp] &&
              cp != titlecaseCodepoints[cp] ) {
-            r.detach();
-            r.d->str[i] = titlecaseCodepoints[cp];
+            uint tc = titlecaseCodepoints[cp];
+            r.prepare( r.length(), widthOf( tc ) );
+            r.d->set( i, tc );
         }
         i++;
     }
@@ -12,7 +12,7 @@ class UStringData
     : public Garbage
 {
 private:
-    UStringData(): str( 0 ), len( 0 ), max( 0 ) {
+    UStringData(): str( 0 ), len( 0 ), max( 0 ), width( 1 ) {
         setFirstNonPointer( &len );
     }
     UStringData( int );
@@ -23,9 +23,27 @@ private:
     void * operator new( size_t, uint );
     void * operator new( size_t s ) { return Garbage::operator new( s); }
 
-    uint * str;
+    uint at( uint i ) const {
+        if ( width == 1 )
+            return ((const unsigned char *)str)[i];
+        if ( width == 2 )
+            return ((const ushort *)str)[i];
+        return ((const uint *)str)[i];
+    }
+    void set( uint i, uint c ) {
+        if ( width == 1 )
+            ((unsigned char *)str)[i] = c;
+        else if ( width == 2 )
+            ((ushort *)str)[i] = c;
+        else
+            ((uint *)str)[i] = c;
+    }
+
+    char * str;
     uint len;
     uint max;
+    // bytes per code point: 1, 2 or 4
+    uint width;
 };
 
 
@@ -46,7 +64,7 @@ public:
     uint operator[]( uint i ) const {
         if ( !d || i >= d->len )
             return 0;
-        return d->str[i];
+        return d->at( i );
     }
 
     bool isEmpty() const { return !d || d->len == 0; }
@@ -74,7 +92,7 @@ public:
     UString simplified() const;
     UString trimmed() const;
 
-    inline const uint * data() const { return d ? (const uint*)d->str : 0; }
+    const uint * codepoints( uint *, uint ) const;
 
     UString titlecased() const;
 
@@ -101,7 +119,8 @@ public:
     static bool isSpace( uint );
 
 private:
-    void reserve2( uint );
+    void reserve2( uint, uint = 1 );
+    void prepare( uint, uint );
 
 
 private:
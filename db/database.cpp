@@ -4,6 +4,7 @@
 
 #include "list.h"
 #include "estring.h"
+#include "estringlist.h"
 #include "allocator.h"
 #include "configuration.h"
 #include "eventloop.h"
@@ -14,6 +15,7 @@
 #include "query.h"
 #include "file.h"
 #include "log.h"
+#include "timerwheel.h"
 
 #include "postgres.h"
 
@@ -23,12 +25,18 @@
 
 static uint backendNumber;
 List< Query > *Database::queries;
+List< Query > *Database::replicaQueries;
 static GraphableNumber * queryQueueLength = 0;
 static GraphableNumber * busyDbConnections = 0;
 static GraphableNumber * totalDbConnections = 0;
 static List< Database > *handles;
+static List< Database > *replicas;
 static time_t lastExecuted;
 static time_t lastCreated;
+static time_t lastReplicaCreated;
+static time_t lastQueueGraphed;
+static GraphableNumber * priorityQueueLength[3];
+static GraphableDataSet * priorityWait[3];
 static Database::User loginAs;
 static EString * username;
 static EString * password;
@@ -49,6 +57,39 @@ static void newHandle()
 }
 
 
+// Returns the name used in graphs for priority p.
+
+static EString priorityName( uint p )
+{
+    switch ( p ) {
+    case Query::Interactive:
+        return "interactive";
+    case Query::Delivery:
+        return "delivery";
+    case Query::Background:
+        return "background";
+    }
+    return "";
+}
+
+
+// Returns the number of handles db-interactive-handles and its
+// siblings keep free for queries with priority p.
+
+static uint reservedHandles( uint p )
+{
+    switch ( p ) {
+    case Query::Interactive:
+        return Configuration::scalar( Configuration::DbInteractiveHandles );
+    case Query::Delivery:
+        return Configuration::scalar( Configuration::DbDeliveryHandles );
+    case Query::Background:
+        return Configuration::scalar( Configuration::DbBackgroundHandles );
+    }
+    return 0;
+}
+
+
 /*! \class Database database.h
     This class represents a connection to the database server.
 
@@ -59,10 +100,18 @@ static void newHandle()
     interface classes we implement). It's responsible for validating the
     database configuration, maintaining a pool of database handles, and
     accepting queries into a common queue via submit().
+
+    If db-replicas is set, it also keeps a pool of handles connected
+    to those hot standbys, and a separate queue for the queries that
+    Query::allowReplica() permits to run there.
+*/
+
+/*! Constructs a handle for the database server or, if \a replica is
+    nonempty, for the hot standby with that address.
 */
 
-Database::Database()
-    : Connection()
+Database::Database( const EString & replica )
+    : Connection(), busyWith( Query::Interactive ), rep( replica )
 {
     number = ++::backendNumber;
     setType( Connection::DatabaseClient );
@@ -94,6 +143,16 @@ void Database::setup( uint desired, const EString & user,
         Allocator::addEternal( handles, "list of database handles" );
     }
 
+    if ( !replicaQueries ) {
+        replicaQueries = new List< Query >;
+        Allocator::addEternal( replicaQueries, "list of replica queries" );
+    }
+
+    if ( !replicas ) {
+        replicas = new List< Database >;
+        Allocator::addEternal( replicas, "list of replica handles" );
+    }
+
     if ( ::username )
         Allocator::removeEternal( ::username );
     ::username = new EString( user );
@@ -114,6 +173,7 @@ void Database::setup( uint desired, const EString & user,
     }
 
     addInitialHandles( desired );
+    addReplicaHandles();
 }
 
 
@@ -141,6 +201,50 @@ void Database::addInitialHandles( uint desired )
 }
 
 
+/*! Opens db-replica-handles connections to each of the db-replicas,
+    less those that are already open. This is done at most once per
+    db-handle-interval, so that a replica which is down isn't retried
+    for every query.
+*/
+
+void Database::addReplicaHandles()
+{
+    EString r( Configuration::text( Configuration::DbReplicas ) );
+    if ( r.isEmpty() || !replicas )
+        return;
+
+    time_t now = time( 0 );
+    if ( lastReplicaCreated &&
+         now - lastReplicaCreated <
+         (int)Configuration::scalar( Configuration::DbHandleInterval ) )
+        return;
+    lastReplicaCreated = now;
+
+    uint desired = Configuration::scalar( Configuration::DbReplicaHandles );
+    EStringList::Iterator a( EStringList::split( ',', r ) );
+    while ( a ) {
+        EString address( a->simplified() );
+        ++a;
+        if ( address.isEmpty() )
+            continue;
+        uint n = 0;
+        List< Database >::Iterator it( replicas );
+        while ( it ) {
+            if ( it->replica() == address )
+                n++;
+            ++it;
+        }
+        while ( n < desired ) {
+            Database * h = new Postgres( address );
+            if ( !h->valid() )
+                break;
+            replicas->append( h );
+            n++;
+        }
+    }
+}
+
+
 /*! \overload
     This function is provided as a convenience for the (majority of)
     callers that use the default values for \a desired (0) and \a login
@@ -177,7 +281,11 @@ void Database::setup( uint desired, Database::User login )
 
 void Database::submit( Query *q )
 {
-    queries->append( q );
+    if ( q->replicaAllowed() && !q->transaction() &&
+         replicas && !replicas->isEmpty() )
+        replicaQueries->append( q );
+    else
+        queries->append( q );
     q->setState( Query::Submitted );
     runQueue();
 }
@@ -194,7 +302,11 @@ void Database::submit( List< Query > *q )
     List< Query >::Iterator it( q );
     while ( it ) {
         it->setState( Query::Submitted );
-        queries->append( it );
+        if ( it->replicaAllowed() && !it->transaction() &&
+             replicas && !replicas->isEmpty() )
+            replicaQueries->append( it );
+        else
+            queries->append( it );
         ++it;
     }
     runQueue();
@@ -217,6 +329,12 @@ void Database::disconnect()
         it->react( Shutdown );
         ++it;
     }
+    List< Database >::Iterator r( replicas );
+    replicas = 0;
+    while ( r ) {
+        r->react( Shutdown );
+        ++r;
+    }
 }
 
 
@@ -235,6 +353,9 @@ void Database::runQueue()
     if ( !busyDbConnections )
         busyDbConnections = new GraphableNumber( "active-db-connections" );
 
+    if ( replicaQueries && !replicaQueries->isEmpty() )
+        runReplicas();
+
     // First, we give each idle handle a Query to process
 
     Query * first = queries->firstElement();
@@ -265,9 +386,41 @@ void Database::runQueue()
         ++it;
     }
 
+    // Then we let handles that are working on standalone queries
+    // take a few more, so they don't have to wait for the answers
+    // first.
+
+    List< Database >::Iterator h( handles );
+    while ( h && !queries->isEmpty() ) {
+        if ( h->state() == Idle && h->hasRoom() )
+            h->processQueue();
+        ++h;
+    }
+
     queryQueueLength->setValue( queries->count() );
     busyDbConnections->setValue( busy );
 
+    // The per-priority lengths need a walk through the queue, so we
+    // do that once per second only.
+    time_t now = time( 0 );
+    if ( now != lastQueueGraphed ) {
+        lastQueueGraphed = now;
+        uint length[3] = { 0, 0, 0 };
+        List< Query >::Iterator q( queries );
+        while ( q ) {
+            length[q->priority()]++;
+            ++q;
+        }
+        uint p = 0;
+        while ( p < 3 ) {
+            if ( !priorityQueueLength[p] )
+                priorityQueueLength[p] = new GraphableNumber(
+                    priorityName( p ) + "-query-queue-length" );
+            priorityQueueLength[p]->setValue( length[p] );
+            p++;
+        }
+    }
+
     // If there's nothing to do, or we did get something done, then we
     // don't even consider opening a new database connection.
     if ( queries->isEmpty() || first != queries->firstElement() )
@@ -296,6 +449,42 @@ void Database::runQueue()
 }
 
 
+/*! This private helper is runQueue() for the replica handles and
+    their queue. If there are no replica handles left, it moves the
+    queries to the primary queue, so that runQueue() can deal with
+    them.
+*/
+
+void Database::runReplicas()
+{
+    addReplicaHandles();
+
+    bool alive = false;
+    List< Database >::Iterator it( replicas );
+    while ( it ) {
+        if ( it->state() != Broken )
+            alive = true;
+        if ( it->state() == Idle && it->usable() &&
+             !replicaQueries->isEmpty() )
+            it->processQueue();
+        ++it;
+    }
+
+    List< Database >::Iterator h( replicas );
+    while ( h && !replicaQueries->isEmpty() ) {
+        if ( h->state() == Idle && h->hasRoom() )
+            h->processQueue();
+        ++h;
+    }
+
+    if ( alive )
+        return;
+
+    while ( !replicaQueries->isEmpty() )
+        queries->append( replicaQueries->shift() );
+}
+
+
 /*! \fn virtual void Database::processQueue()
     Instructs the Database object to send any queries whose state is
     Query::Submitted to the server.
@@ -324,6 +513,12 @@ Database::State Database::state() const
 
 void Database::addHandle( Database * d )
 {
+    if ( !d->replica().isEmpty() ) {
+        if ( replicas && !replicas->find( d ) )
+            replicas->append( d );
+        return;
+    }
+
     handles->append( d );
     if ( !totalDbConnections )
         totalDbConnections = new GraphableNumber( "total-db-connections" );
@@ -335,6 +530,19 @@ void Database::addHandle( Database * d )
 
 void Database::removeHandle( Database * d )
 {
+    if ( !d->replica().isEmpty() ) {
+        if ( !replicas )
+            return;
+        replicas->remove( d );
+        if ( replicas->isEmpty() && !replicaQueries->isEmpty() ) {
+            ::log( "No replica handles left; sending " +
+                   fn( replicaQueries->count() ) +
+                   " queued queries to the primary server", Log::Info );
+            runQueue();
+        }
+        return;
+    }
+
     if ( !handles )
         return;
 
@@ -462,6 +670,18 @@ bool Database::usable() const
 }
 
 
+/*! Returns true if this Database handle is busy but can accept
+    more standalone queries without waiting for the ones it's working
+    on, and false otherwise. The default implementation always returns
+    false.
+*/
+
+bool Database::hasRoom() const
+{
+    return false;
+}
+
+
 /*! Returns an nonzero positive integer which is unique to this
     database handler.
 */
@@ -472,6 +692,30 @@ uint Database::connectionNumber() const
 }
 
 
+/*! Returns the address of the hot standby this handle is connected
+    to, or an empty string if it's connected to the primary database
+    server (db-address).
+*/
+
+EString Database::replica() const
+{
+    return rep;
+}
+
+
+/*! Returns the queue of submitted queries this handle serves, which
+    is either the queue of queries for the primary server or the one
+    for replicas.
+*/
+
+List< Query > * Database::queue() const
+{
+    if ( rep.isEmpty() )
+        return queries;
+    return replicaQueries;
+}
+
+
 /*! This function returns DbOwner or DbUser, as specified in the call to
     Database::setup().
 */
@@ -517,6 +761,16 @@ bool Database::idle()
     if ( queries && !queries->isEmpty() )
         return false;
 
+    List< Database >::Iterator r( replicas );
+    while ( r ) {
+        if ( !r->usable() )
+            return false;
+        ++r;
+    }
+
+    if ( replicaQueries && !replicaQueries->isEmpty() )
+        return false;
+
     return true;
 }
 
@@ -528,7 +782,8 @@ bool Database::idle()
 
 void Database::reactToIdleness()
 {
-    if ( !queries->isEmpty() )
+    if ( !queries->isEmpty() ||
+         ( replicaQueries && !replicaQueries->isEmpty() ) )
         return;
 
     if ( !::whenIdle )
@@ -678,12 +933,37 @@ uint Database::idleHandles()
 }
 
 
+/*! Returns the number of handles that are usable() at the moment,
+    counting the replica handles if \a replica is true, and the
+    others if not.
+*/
+
+uint Database::usableHandles( bool replica )
+{
+    uint r = 0;
+    List< Database >::Iterator it( replica ? replicas : handles );
+    while ( it ) {
+        if ( it->usable() )
+            r++;
+        ++it;
+    }
+    return r;
+}
+
+
 /*! \fn void Database::cancel( class Query * query )
     Cancels the given \a query if it is being executed by this database object.
     Does nothing otherwise.
 */
 
 
+/*! \fn void Database::resume( class Query * query )
+    Asks the server for more rows for \a query, which this database
+    object previously suspended because of its Query::rowLimit(). If
+    \a query is done() by then, the rest of its rows are discarded.
+*/
+
+
 /*! This function issues a cancel request for the query \a q, if it is
     currently being executed. If not, it does nothing.
 */
@@ -695,6 +975,11 @@ void Database::cancelQuery( Query * q )
         it->cancel( q );
         ++it;
     }
+    List<Database>::Iterator r( replicas );
+    while ( r ) {
+        r->cancel( q );
+        ++r;
+    }
 }
 
 
@@ -704,7 +989,7 @@ void Database::cancelQuery( Query * q )
 
 uint Database::currentRevision()
 {
-    return 95;
+    return 99;
 }
 
 
@@ -714,19 +999,92 @@ uint Database::currentRevision()
     If \a transactionOK is true, the list is permitted to start a
     Transaction. If not, only standalone queries are considered.
 
+    Queries are chosen by Query::priority(), and in order of submission
+    within each priority. A query which has waited db-priority-aging
+    seconds counts as though its priority were one higher, and so on.
+    If this handle is idle, it doesn't start anything that would leave
+    too few free handles for the other priorities, unless all handles
+    are idle or there are too few handles to reserve any.
+
     Returns an empty list if no suitable queries can be found.
 */
 
 List< Query > * Database::firstSubmittedQuery( bool transactionOK )
 {
-    List<Query>::Iterator i( queries );
-    if ( !transactionOK )
-        while ( i && i->transaction() )
-            ++i;
+    bool allowed[3] = { true, true, true };
+    if ( queue() == queries && usable() ) {
+        uint busy[3] = { 0, 0, 0 };
+        uint free = 0;
+        uint working = 0;
+        List< Database >::Iterator h( handles );
+        while ( h ) {
+            State st = h->state();
+            if ( st == Idle && h->usable() ) {
+                free++;
+            }
+            else if ( st != Connecting && st != Broken ) {
+                busy[h->busyWith]++;
+                working++;
+            }
+            ++h;
+        }
+        uint unmet[3];
+        uint total = 0;
+        uint reserved = 0;
+        uint p = 0;
+        while ( p < 3 ) {
+            uint r = reservedHandles( p );
+            unmet[p] = r > busy[p] ? r - busy[p] : 0;
+            total += unmet[p];
+            reserved += r;
+            p++;
+        }
+        p = 0;
+        while ( working && free + working > reserved && p < 3 ) {
+            allowed[p] = free > total - unmet[p];
+            p++;
+        }
+    }
+
+    int64 now = TimerWheel::now();
+    int64 aging = 1000 *
+        (int64)Configuration::scalar( Configuration::DbPriorityAging );
+
+    // the queue is (nearly) in order of submission, so the first
+    // interactive query beats any later one, and we can stop there.
+    List<Query>::Iterator i( queue() );
+    List<Query>::Iterator best;
+    int64 bestRank = 0;
+    while ( i ) {
+        uint p = i->priority();
+        if ( ( transactionOK || !i->transaction() ) && allowed[p] ) {
+            int64 rank = p;
+            if ( aging && i->submissionTime() )
+                rank -= ( now - i->submissionTime() ) / aging;
+            if ( !best || rank < bestRank ) {
+                best = i;
+                bestRank = rank;
+            }
+            if ( p == Query::Interactive )
+                break;
+        }
+        ++i;
+    }
+
     List<Query> * r = new List<Query>();
-    if ( i ) {
-        r->append( i );
-        queries->take( i );
+    if ( best ) {
+        Query * q = best;
+        if ( usable() )
+            busyWith = q->priority();
+        if ( queue() == queries && q->submissionTime() ) {
+            uint p = q->priority();
+            if ( !priorityWait[p] )
+                priorityWait[p] = new GraphableDataSet(
+                    priorityName( p ) + "-query-wait" );
+            priorityWait[p]->addNumber( now - q->submissionTime() );
+        }
+        r->append( q );
+        queue()->take( best );
     }
     return r;
 }
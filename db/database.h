@@ -14,7 +14,7 @@ class Database
     : public Connection
 {
 public:
-    Database();
+    Database( const EString & = "" );
 
     enum User {
         Superuser, DbOwner, DbUser
@@ -33,13 +33,16 @@ public:
     virtual void processQueue() = 0;
 
     virtual bool usable() const;
+    virtual bool hasRoom() const;
 
     static uint numHandles();
     static uint handlesNeeded();
     static uint idleHandles();
+    static uint usableHandles( bool = false );
     static EString type();
 
     uint connectionNumber() const;
+    EString replica() const;
 
     static uint currentRevision();
 
@@ -50,12 +53,15 @@ public:
     static bool idle();
 
     virtual void cancel( Query * ) = 0;
+    virtual void resume( Query * ) = 0;
 
     static void cancelQuery( Query * );
 
 protected:
     static List< Query > *queries;
+    static List< Query > *replicaQueries;
 
+    List< Query > * queue() const;
     List< Query > * firstSubmittedQuery( bool transactionOK );
 
     void setState( State );
@@ -66,6 +72,7 @@ protected:
     static void addHandle( Database * );
     static void removeHandle( Database * );
     static void addInitialHandles( uint = 3);
+    static void addReplicaHandles();
 
     static Endpoint server();
     static EString address();
@@ -82,6 +89,10 @@ protected:
 private:
     State st;
     uint number;
+    uint busyWith;
+    EString rep;
+
+    static void runReplicas();
 };
 
 
@@ -17,6 +17,7 @@ class DatabaseSignalData
 public:
     DatabaseSignalData(): o( 0 ), l( new Log ) {}
     EString n;
+    EString p;
     EventHandler * o;
     Log * l;
 };
@@ -56,21 +57,39 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name. \a payload is the string the sender supplied with the
+    NOTIFY, if any, and is available via payload() while the owners
+    are being notified.
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
+        if ( name == s->d->n && s->d->o ) {
+            s->d->p = payload;
             s->d->o->notify();
+            s->d->p.truncate();
+        }
     }
 }
 
 
+/*! Returns the payload of the notification currently being delivered,
+    or an empty string if there is none (either because the sender
+    didn't supply one or because the owner was called for some other
+    reason, e.g. by a Timer).
+*/
+
+EString DatabaseSignal::payload() const
+{
+    return d->p;
+}
+
+
 /*! This destructor is private, so noone can ever call it. Objects of
     this class are indestructible by nature.
 */
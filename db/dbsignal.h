@@ -14,7 +14,9 @@ class DatabaseSignal
 public:
     DatabaseSignal( const EString &, EventHandler * );
 
-    static void notifyAll( const EString & );
+    static void notifyAll( const EString &, const EString & = "" );
+
+    EString payload() const;
 
     static EStringList * names();
 
@@ -5,6 +5,10 @@
 #include "log.h"
 #include "estring.h"
 #include "buffer.h"
+#include "allocator.h"
+
+// strlen
+#include <string.h>
 
 
 /*! \class PgServerMessage pgmessage.h
@@ -732,6 +736,46 @@ void PgDescribe::encodeData()
 
 
 
+/*! \class PgClose pgmessage.h
+    C: Closes a prepared statement or portal.
+
+    This message consists of one byte ('S' for a prepared statement, and
+    'P' for a portal) followed by a name (EString).
+*/
+
+/*! Creates a Close message for the name \a n (empty by default) of
+    type \a t, which must be S or P ('S' by default).
+*/
+
+PgClose::PgClose( char t, const EString &n )
+    : PgClientMessage( 'C' ),
+      type( t ), name( n )
+{
+}
+
+
+void PgClose::encodeData()
+{
+    appendByte( type );
+    appendString( name );
+}
+
+
+
+/*! \class PgCloseComplete pgmessage.h
+    S: This indicates that a Close message was successfully processed.
+
+    This message contains no data.
+*/
+
+PgCloseComplete::PgCloseComplete( Buffer *b )
+    : PgServerMessage( b )
+{
+    end();
+}
+
+
+
 /*! \class PgNoData pgmessage.h
     S: The description of something that cannot return data.
 
@@ -747,6 +791,22 @@ PgNoData::PgNoData( Buffer *b )
 
 
 
+/*! \class PgPortalSuspended pgmessage.h
+    S: The portal has more rows than the client asked for.
+
+    The server sends this instead of PgCommandComplete when a PgExecute
+    with a row limit has returned that many rows. The client can send
+    another PgExecute for the same portal to get more.
+*/
+
+PgPortalSuspended::PgPortalSuspended( Buffer *b )
+    : PgServerMessage( b )
+{
+    end();
+}
+
+
+
 /*! \class PgParameterDescription pgmessage.h
     S: The description of a single parameter to a prepared statement.
 
@@ -776,9 +836,10 @@ PgParameterDescription::PgParameterDescription( Buffer *b )
 */
 
 PgRowDescription::PgRowDescription( Buffer * b )
-    : PgServerMessage( b )
+    : PgServerMessage( b ), byNumber( 0 )
 {
     count = decodeInt16();
+    byNumber = (Column**)Allocator::alloc( count * sizeof( Column * ) );
     uint c = 0;
     while ( c < count ) {
         Column *col = new Column;
@@ -793,8 +854,38 @@ PgRowDescription::PgRowDescription( Buffer * b )
         // pg sends us 0 for all columns, but we need a number, so we
         // count the columns ourselves.
         col->column2 = c;
+        col->alias = 0;
+
+        switch ( col->type ) {
+        case 16:    // BOOL
+            col->kind = ::Column::Boolean;
+            break;
+        case 20:    // INT8
+            col->kind = ::Column::Bigint;
+            break;
+        case 21:    // INT2
+        case 23:    // INT4
+            col->kind = ::Column::Integer;
+            break;
+        case 17:    // BYTEA
+        case 18:    // CHAR
+        case 25:    // TEXT
+        case 1043:  // VARCHAR
+            col->kind = ::Column::Bytes;
+            break;
+        case 1184:
+            col->kind = ::Column::Timestamp;
+            break;
+        default:
+            log( "PostgreSQL: Unknown field type " + fn( col->type ) +
+                 " for column " + col->name.quoted(),
+                 Log::Error );
+            col->kind = ::Column::Unknown;
+            break;
+        }
 
         columns.append( col );
+        byNumber[c] = col;
         names.insert( col->name.data(), 8 * col->name.length(),
                       &col->column2 );
 
@@ -804,6 +895,41 @@ PgRowDescription::PgRowDescription( Buffer * b )
 }
 
 
+/*! Returns the number of the column named \a name, or -1 if there is
+    no such column.
+
+    Callers generally use the same string constant for every row, so
+    each column remembers the last pointer that found it, and only the
+    first lookup per result needs to search the names.
+*/
+
+int PgRowDescription::column( const char * name ) const
+{
+    uint i = 0;
+    while ( i < count ) {
+        if ( byNumber[i]->alias == name && byNumber[i]->name == name )
+            return i;
+        i++;
+    }
+
+    int * x = names.find( name, strlen( name ) * 8 );
+    if ( !x )
+        return -1;
+    byNumber[*x]->alias = name;
+    return *x;
+}
+
+
+/*! Returns the type of column \a i, which must be smaller than
+    count.
+*/
+
+::Column::Type PgRowDescription::kind( uint i ) const
+{
+    return byNumber[i]->kind;
+}
+
+
 
 /*! \class PgExecute pgmessage.h
     C: A request to execute a portal.
@@ -843,126 +969,39 @@ void PgExecute::encodeData()
 */
 
 PgDataRow::PgDataRow( Buffer *b, const PgRowDescription *d )
-    : PgServerMessage( b )
+    : PgServerMessage( b ), r( 0 )
 {
     uint c = decodeInt16();
-    if ( c != d->columns.count() )
+    if ( c != d->count )
         // Is this really "Syntax"?
         throw Syntax;
 
-    int i = 0;
-    Column *columns = new Column[c];
-    List< PgRowDescription::Column >::Iterator it( d->columns );
-    while ( it ) {
-        Column *cv = &columns[i];
-
-        switch ( it->type ) {
-        case 16:    // BOOL
-            cv->type = Column::Boolean;
-            break;
-        case 20:    // INT8
-            cv->type = Column::Bigint;
-            break;
-        case 21:    // INT2
-        case 23:    // INT4
-            cv->type = Column::Integer;
-            break;
-        case 17:    // BYTEA
-        case 18:    // CHAR
-        case 25:    // TEXT
-        case 1043:  // VARCHAR
-            cv->type = Column::Bytes;
-            break;
-        case 1184:
-            cv->type = Column::Timestamp;
-            break;
-        default:
-            log( "PostgreSQL: Unknown field type " + fn( it->type ) +
-                 " for column " + it->name.quoted(),
-                 Log::Error );
-            cv->type = Column::Unknown;
-            break;
-        }
-
-        int length = decodeInt32();
-        if ( length == -1 )
-            cv->type = Column::Null;
-
-        switch ( cv->type ) {
-        case Column::Unknown:
-            // we've just logged the error, but supplement it
-            if ( length > 0 )
-                log( "Unknown column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            break;
-        case Column::Boolean:
-            if ( length != 1 ) {
-                log( "Boolean column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
-            else {
-                cv->b = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-            }
-            break;
-        case Column::Integer:
-            switch ( length ) {
-            case 1:
-                cv->i = (*buf)[0];
-                buf->remove( 1 );
-                n++;
-                break;
-            case 2:
-                cv->i = ((*buf)[0] << 8) | (*buf)[1];
-                buf->remove( 2 );
-                n += 2;
-                break;
-            case 4:
-                cv->i = ((*buf)[0] << 24) | ((*buf)[1] << 16) |
-                        ((*buf)[2] <<  8) | (*buf)[3];
-                buf->remove( 4 );
-                n += 4;
-                break;
-            default:
-                log( "Integer column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            }
-            break;
-        case Column::Bigint:
-            if ( length == 8 ) {
-                cv->bi = (((int64)(*buf)[0]) << 56) |
-                         (((int64)(*buf)[1]) << 48) |
-                         (((int64)(*buf)[2]) << 40) |
-                         (((int64)(*buf)[3]) << 32) |
-                         (((int64)(*buf)[4]) << 24) |
-                         (((int64)(*buf)[5]) << 16) |
-                         (((int64)(*buf)[6]) <<  8) |
-                         (*buf)[7];
-                buf->remove( 8 );
-                n += 8;
-            }
-            else
-                log( "Bigint column " + it->name.quoted() +
-                     " has value " + decodeByten( length ).quoted() );
-            break;
-        case Column::Bytes:
-            cv->s = decodeByten( length );
-            break;
-        case Column::Timestamp:
-            cv->s = decodeByten( length );
-            break;
-        case Column::Null:
-            // nothing needed
-            break;
-        }
+    // The values are copied out of the buffer in one piece, and Row
+    // decodes each one only if and when it's used.
+    EString raw;
+    if ( n < l )
+        raw = decodeByten( l - n );
+    end();
 
-        ++it;
+    const unsigned char * p = (const unsigned char *)raw.data();
+    uint i = 0;
+    uint o = 0;
+    while ( i < c ) {
+        if ( o + 4 > raw.length() )
+            throw Syntax;
+        int length = ( p[o] << 24 ) | ( p[o+1] << 16 ) |
+                     ( p[o+2] << 8 ) | p[o+3];
+        o += 4;
+        if ( length > 0 )
+            o += length;
+        if ( o > raw.length() )
+            throw Syntax;
         i++;
     }
-    end();
+    if ( o != raw.length() )
+        throw Syntax;
 
-    r = new Row( d, columns );
+    r = new Row( d, raw );
 }
 
 
@@ -223,6 +223,28 @@ public:
 };
 
 
+class PgClose
+    : public PgClientMessage
+{
+public:
+    PgClose( char = 'S', const EString & = "" );
+
+private:
+    void encodeData();
+
+    char type;
+    EString name;
+};
+
+
+class PgCloseComplete
+    : public PgServerMessage
+{
+public:
+    PgCloseComplete( Buffer * );
+};
+
+
 class PgDescribe
     : public PgClientMessage
 {
@@ -245,6 +267,14 @@ public:
 };
 
 
+class PgPortalSuspended
+    : public PgServerMessage
+{
+public:
+    PgPortalSuspended( Buffer * );
+};
+
+
 class PgParameterDescription
     : public PgServerMessage
 {
@@ -265,11 +295,19 @@ public:
     public:
         EString name;
         int table, column, type, size, mod, format, column2;
+        ::Column::Type kind;
+        const char * alias;
     };
 
     List<Column> columns;
     PatriciaTree<int> names;
     uint count;
+
+    int column( const char * ) const;
+    ::Column::Type kind( uint ) const;
+
+private:
+    Column ** byNumber;
 };
 
 
@@ -1,8 +1,13 @@
 // Copyright 2009 The Archiveopteryx Developers <info@aox.org>
 
+// crypt(), setreuid(), getpwnam(). this must precede all includes,
+// since some of ours include system headers.
+#define _XOPEN_SOURCE 600
+
 #include "postgres.h"
 
 #include "dict.h"
+#include "hashtable.h"
 #include "list.h"
 #include "estring.h"
 #include "buffer.h"
@@ -10,6 +15,7 @@
 #include "allocator.h"
 #include "configuration.h"
 #include "transaction.h"
+#include "querystatistics.h"
 #include "estringlist.h"
 #include "pgmessage.h"
 #include "eventloop.h"
@@ -21,15 +27,125 @@
 #include "log.h"
 
 // crypt(), setreuid(), getpwnam()
-#define _XOPEN_SOURCE 600
 #include <sys/types.h>
 #include <unistd.h>
 #include <pwd.h>
 
 
 static bool hasMessage( Buffer * );
+static bool shareable( Query * );
 static uint serverVersion;
 static Postgres * listener = 0;
+static GraphableCounter * roundTripsSaved = 0;
+static GraphableCounter * syncsSaved = 0;
+static GraphableCounter * queriesParsed = 0;
+static GraphableCounter * queriesPrepared = 0;
+
+// the portal used for queries with a row limit
+static const char * portalName = "rows";
+
+
+// Checks that a replica has seen the modseq a query wants. It fails
+// with a division by zero if not.
+static const char * replicaCheck =
+    "select 1/count(*)::int as ok from mailboxes "
+    "where id=$1 and nextmodseq>=$2";
+
+
+static GraphableCounter * replicaFallbacks = 0;
+
+
+// The owner of a replica check. If the check fails, it makes sure the
+// query it guards is sent to the primary instead.
+class PgGuard
+    : public EventHandler
+{
+public:
+    PgGuard( Query * query ): q( 0 ), guarded( query ) {}
+
+    void execute() {
+        if ( !q->failed() || !guarded->replicaAllowed() )
+            return;
+        guarded->denyReplica();
+        if ( !replicaFallbacks )
+            replicaFallbacks = new GraphableCounter( "replica-fallbacks" );
+        replicaFallbacks->tick();
+        ::log( "Replica has not yet seen modseq " +
+               fn( guarded->replicaModSeq() ) + " of mailbox " +
+               fn( guarded->replicaMailbox() ) +
+               "; sending query to the primary", Log::Debug );
+    }
+
+    Query * q;
+    Query * guarded;
+};
+
+
+// A query string seen on one handle. It gets a name once it has been
+// seen twice, and is then prepared on the server.
+class PgStatement
+    : public Garbage
+{
+public:
+    PgStatement( const EString & t )
+        : text( t ), older( 0 ), newer( 0 ) {}
+
+    EString text;
+    EString name;
+    PgStatement * older;
+    PgStatement * newer;
+};
+
+
+// The PgStatements with or without names, most recently used first.
+class PgStatementList
+    : public Garbage
+{
+public:
+    PgStatementList(): newest( 0 ), oldest( 0 ), count( 0 ) {}
+
+    void take( PgStatement * s ) {
+        if ( s->older )
+            s->older->newer = s->newer;
+        else
+            oldest = s->newer;
+        if ( s->newer )
+            s->newer->older = s->older;
+        else
+            newest = s->older;
+        s->older = 0;
+        s->newer = 0;
+        count--;
+    }
+
+    void prepend( PgStatement * s ) {
+        s->older = newest;
+        s->newer = 0;
+        if ( newest )
+            newest->newer = s;
+        else
+            oldest = s;
+        newest = s;
+        count++;
+    }
+
+    PgStatement * newest;
+    PgStatement * oldest;
+    uint count;
+};
+
+
+// A named statement we've sent Parse for, but which the server
+// hasn't yet acknowledged.
+class PgParsing
+    : public Garbage
+{
+public:
+    PgParsing( Query * q, const EString & n ): query( q ), name( n ) {}
+
+    Query * query;
+    EString name;
+};
 
 
 class PgData
@@ -43,7 +159,8 @@ public:
           sendingCopy( false ), error( false ),
           keydata( 0 ),
           description( 0 ), transaction( 0 ),
-          needNotify( 0 ), backendPid( 0 )
+          needNotify( 0 ), portal( 0 ), backendPid( 0 ),
+          statementNumber( 0 )
         {}
 
     bool active;
@@ -59,15 +176,22 @@ public:
     PgKeyData *keydata;
     PgRowDescription *description;
     Dict<Postgres> prepared;
-    EStringList preparesPending;
+    List<PgParsing> preparesPending;
+    HashDict<PgStatement> statements;
+    PgStatementList named;
+    PgStatementList unnamed;
+    EStringList closing;
 
     List< Query > queries;
+    List< Query > syncs;
     Transaction *transaction;
     Query * needNotify;
+    Query * portal;
 
     EString user;
 
     uint backendPid;
+    uint statementNumber;
 
     class LockSpotter
         : public EventHandler {
@@ -124,6 +248,14 @@ public:
     and <http://www.postgresql.org/docs/current/static/protocol.html>.
     The version implemented here is used by PostgreSQL 7.4 and later.
 
+    Queries that aren't part of a transaction are pipelined: A handle
+    sends up to db-pipeline-depth of them without waiting for the
+    answers, and consecutive read-only queries share a single Sync
+    message. If one of those fails, the server skips the rest of the
+    group, so they're put back at the front of the queue and sent
+    again. The counters db-round-trips-saved and db-syncs-saved show
+    how much this helps.
+
     At the time of writing, there do not seem to be any other suitable
     PostgreSQL client libraries available. For example, libpqxx doesn't
     support asynchronous operation or prepared statements. Its interface
@@ -134,26 +266,35 @@ public:
 /*! Creates a Postgres object, initiates a TCP connection to the server,
     registers with the main loop, and adds this Database to the list of
     available handles.
+
+    If \a replica is nonempty, this handle connects to the hot standby
+    at that address instead of the primary server, and executes only
+    the queries Query::allowReplica() permits.
 */
 
-Postgres::Postgres()
-    : Database(), d( new PgData )
+Postgres::Postgres( const EString & replica )
+    : Database( replica ), d( new PgData )
 {
+    EString server( replica );
+    if ( server.isEmpty() )
+        server = address();
+
     d->user = Database::user();
     struct passwd * p = getpwnam( d->user.cstr() );
     if ( p && getuid() != p->pw_uid ) {
         // Try to cooperate with ident authentication.
         uid_t e = geteuid();
         setreuid( 0, p->pw_uid );
-        connect( address(), port() );
+        connect( server, port() );
         setreuid( 0, e );
     }
     else {
-        connect( address(), port() );
+        connect( server, port() );
     }
 
-    log( "Connecting to PostgreSQL server at " +
-         address() + ":" + fn( port() ) + " "
+    log( "Connecting to PostgreSQL " +
+         EString( replica.isEmpty() ? "server" : "replica" ) + " at " +
+         server + ":" + fn( port() ) + " "
          "(backend " + fn( connectionNumber() ) + ", fd " + fn( fd() ) +
          ", user " + d->user + ")", Log::Debug );
 
@@ -172,10 +313,10 @@ Postgres::~Postgres()
 
 void Postgres::processQueue()
 {
-    if ( !d->queries.isEmpty() )
+    if ( d->sendingCopy )
         return;
 
-    if ( d->sendingCopy )
+    if ( !d->queries.isEmpty() && !hasRoom() )
         return;
 
     if ( d->transaction &&
@@ -183,7 +324,7 @@ void Postgres::processQueue()
            d->transaction->state() == Transaction::RolledBack ) )
         d->transaction = 0;
 
-    if ( !::listener && !d->transaction )
+    if ( !::listener && !d->transaction && replica().isEmpty() )
         ::listener = this;
     if ( ::listener == this )
         sendListen();
@@ -193,7 +334,9 @@ void Postgres::processQueue()
         l = d->transaction->submittedQueries();
     }
     else {
-        if ( listener == this && numHandles() > 1 )
+        if ( !d->queries.isEmpty() )
+            l = new List< Query >;
+        else if ( listener == this && numHandles() > 1 )
             l = Database::firstSubmittedQuery( false );
         else
             l = Database::firstSubmittedQuery( true );
@@ -203,19 +346,40 @@ void Postgres::processQueue()
             d->transaction = t;
             t->setDatabase( this );
         }
+        else if ( !l->firstElement() ||
+                  ( !l->firstElement()->inputLines() &&
+                    !l->firstElement()->rowLimit() ) ) {
+            // we take more, but leave one for each other idle handle
+            uint depth =
+                Configuration::scalar( Configuration::DbPipelineDepth );
+            uint others = usableHandles( !replica().isEmpty() );
+            if ( usable() && others )
+                others--;
+            while ( d->queries.count() + l->count() < depth &&
+                    queue()->count() > others ) {
+                List< Query > * m = Database::firstSubmittedQuery( false );
+                Query * q = m->firstElement();
+                if ( !q )
+                    break;
+                l->append( q );
+                if ( q->inputLines() || q->rowLimit() )
+                    break;
+            }
+        }
     }
 
     Query * q = l->shift();
     while ( q ) {
+        Query * next = l->shift();
         q->setState( Query::Executing );
         if ( !d->error ) {
-            processQuery( q );
+            processQuery( q, !next || !shareable( q ) || !shareable( next ) );
         }
         else {
             q->setError( "Database handle no longer usable." );
             q->notify();
         }
-        q = l->shift();
+        q = next;
     }
 
     if ( d->queries.isEmpty() )
@@ -224,40 +388,98 @@ void Postgres::processQueue()
 
 
 /*! Sends whatever messages are required to make the backend process the
-    query \a q.
+    query \a q. If \a sync is false, the Sync message is left out, so
+    that the next query shares the Sync sent after it.
 */
 
-void Postgres::processQuery( Query * q )
+void Postgres::processQuery( Query * q, bool sync )
 {
     Scope x( q->log() );
+    if ( !replica().isEmpty() && q->replicaMailbox() ) {
+        // the check shares q's Sync, so if it fails, the server skips
+        // q and we resubmit it for the primary
+        PgGuard * g = new PgGuard( q );
+        g->q = new Query( replicaCheck, g );
+        g->q->bind( 1, q->replicaMailbox() );
+        g->q->bind( 2, q->replicaModSeq() );
+        g->q->allowFailure();
+        g->q->setState( Query::Executing );
+        processQuery( g->q, false );
+    }
+
+    if ( !d->transaction && !d->queries.isEmpty() ) {
+        if ( !roundTripsSaved )
+            roundTripsSaved = new GraphableCounter( "db-round-trips-saved" );
+        roundTripsSaved->tick();
+    }
     d->queries.append( q );
     EString s( "Sent " );
-    if ( q->name() == "" ||
-         !d->prepared.contains( q->name() ) )
-    {
-        PgParse a( queryString( q ), q->name() );
+    EString name( q->name() );
+    EString text;
+    if ( name.isEmpty() ) {
+        text = queryString( q );
+        name = statementName( q, text );
+    }
+    if ( name.isEmpty() || !d->prepared.contains( name ) ) {
+        if ( text.isEmpty() )
+            text = queryString( q );
+        PgParse a( text, name );
         a.enqueue( writeBuffer() );
 
-        if ( q->name() != "" ) {
-            d->prepared.insert( q->name(), this );
-            d->preparesPending.append( q->name() );
+        if ( !name.isEmpty() ) {
+            d->prepared.insert( name, this );
+            d->preparesPending.append( new PgParsing( q, name ) );
         }
 
         s.append( "parse/" );
+        if ( !queriesParsed )
+            queriesParsed = new GraphableCounter( "queries-parsed" );
+        queriesParsed->tick();
     }
+    else {
+        if ( !queriesPrepared )
+            queriesPrepared = new GraphableCounter( "queries-prepared" );
+        queriesPrepared->tick();
+    }
+
+    EString portal;
+    if ( q->rowLimit() )
+        portal = portalName;
 
-    PgBind b( q->name() );
+    PgBind b( name, portal );
     b.bind( q->values() );
     b.enqueue( writeBuffer() );
 
-    PgDescribe c;
+    PgDescribe c( 'P', portal );
     c.enqueue( writeBuffer() );
 
-    PgExecute ex;
+    PgExecute ex( portal, q->rowLimit() );
     ex.enqueue( writeBuffer() );
 
-    PgSync e;
-    e.enqueue( writeBuffer() );
+    if ( q->rowLimit() ) {
+        // a Sync would end the implicit transaction and close the
+        // portal, so we only flush until the query is finished
+        PgFlush f;
+        f.enqueue( writeBuffer() );
+        d->portal = q;
+    }
+    else if ( sync ) {
+        PgSync e;
+        e.enqueue( writeBuffer() );
+        d->syncs.append( q );
+
+        // statements are closed after a Sync, so that an error in the
+        // preceding queries can't make the server skip the Close
+        while ( !d->closing.isEmpty() ) {
+            PgClose c( 'S', *d->closing.shift() );
+            c.enqueue( writeBuffer() );
+        }
+    }
+    else {
+        if ( !syncsSaved )
+            syncsSaved = new GraphableCounter( "db-syncs-saved" );
+        syncsSaved->tick();
+    }
 
     s.append( "execute for " );
     s.append( q->description() );
@@ -346,7 +568,7 @@ void Postgres::react( Event e )
                 log( "Transaction unexpectedly slow; continuing " );
         }
         else if ( d->queries.isEmpty() &&
-                  ::listener != this &&
+                  ::listener != this && replica().isEmpty() &&
                   server().protocol() != Endpoint::Unix &&
                   handlesNeeded() < numHandles() ) {
             log( "Closing idle database backend " + fn( connectionNumber() ) +
@@ -360,8 +582,15 @@ void Postgres::react( Event e )
         break;
     }
 
-    if ( usable() ) {
+    if ( hasRoom() ) {
+        processQueue();
+    }
+    else if ( usable() ) {
         processQueue();
+        // if we left something in the queue, perhaps another idle
+        // handle may take it now that we're done
+        if ( usable() && !queue()->isEmpty() )
+            runQueue();
         if ( d->queries.isEmpty() && !d->transaction ) {
             uint interval =
                 Configuration::scalar( Configuration::DbHandleInterval );
@@ -453,14 +682,17 @@ void Postgres::backendStartup( char type )
 {
     switch ( type ) {
     case 'Z':
+        {
+            // This successfully concludes connection startup. We
+            // consume the message here, since process() pairs each
+            // PgReady with a Sync we sent, and we sent none for this.
+            PgReady msg( readBuffer() );
+            setState( msg.state() );
+        }
         setTimeout( 0 );
         d->startup = false;
         addHandle( this );
 
-        // This successfully concludes connection startup. We'll leave
-        // this message unparsed, so that process() can handle it like
-        // any other PgReady.
-
         if ( d->setSessionAuthorisation )
             processQuery( new Query( "SET SESSION AUTHORIZATION " +
                                      Database::user(), 0 ) );
@@ -499,7 +731,8 @@ void Postgres::process( char type )
     case '1':
         {
             PgParseComplete msg( readBuffer() );
-            if ( q && q->name() != "" )
+            PgParsing * p = d->preparesPending.firstElement();
+            if ( p && p->query == q )
                 d->preparesPending.shift();
         }
         break;
@@ -510,6 +743,20 @@ void Postgres::process( char type )
         }
         break;
 
+    case '3':
+        {
+            PgCloseComplete msg( readBuffer() );
+        }
+        break;
+
+    case 's':
+        {
+            PgPortalSuspended msg( readBuffer() );
+            if ( q && q == d->portal )
+                q->suspend( this );
+        }
+        break;
+
     case 'n':
         {
             PgNoData msg( readBuffer() );
@@ -600,6 +847,8 @@ void Postgres::process( char type )
                     countQueries( q );
                 }
                 d->queries.shift();
+                if ( q == d->portal )
+                    closePortal();
                 q->notify();
                 d->needNotify = 0;
             }
@@ -610,6 +859,9 @@ void Postgres::process( char type )
         {
             PgReady msg( readBuffer() );
             setState( msg.state() );
+            Query * last = d->syncs.shift();
+            if ( last && d->queries.find( last ) )
+                resubmit( last );
         }
         break;
 
@@ -621,7 +873,7 @@ void Postgres::process( char type )
                 s = " (" + msg.source() + ")";
             log( "Received notify " + msg.name().quoted() +
                  " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -881,14 +1133,19 @@ void Postgres::serverMessage()
         // while processing this query, but don't already know that
         // it succeeded, we'll assume that statement name does not
         // exist for future use.
-        EString * pp = d->preparesPending.first();
-        if ( q->name() != "" && pp && *pp == q->name() ) {
-            d->prepared.remove( q->name() );
+        PgParsing * pp = d->preparesPending.firstElement();
+        if ( pp && pp->query == q ) {
+            d->prepared.remove( pp->name );
             d->preparesPending.shift();
         }
         if ( q->inputLines() )
             d->sendingCopy = false;
         d->queries.shift();
+        if ( q == d->portal ||
+             ( d->portal && d->queries.firstElement() == d->portal &&
+               !d->syncs.find( q ) ) )
+            // if q shared the portal's Sync, the portal was skipped
+            closePortal();
         m = mapped( m );
         if ( !msg.detail().isEmpty() )
             s.append( " (" + msg.detail() + ")" );
@@ -1100,6 +1357,93 @@ bool Postgres::usable() const
 }
 
 
+/*! Returns true if this handle is busy with standalone queries, but
+    can send more without waiting for the answers, and false otherwise.
+*/
+
+bool Postgres::hasRoom() const
+{
+    if ( !d->active || d->startup || d->transaction || d->sendingCopy ||
+         d->portal ||
+         state() != Idle || d->queries.isEmpty() ||
+         d->queries.count() >=
+         Configuration::scalar( Configuration::DbPipelineDepth ) )
+        return false;
+
+    List< Query >::Iterator q( d->queries );
+    while ( q ) {
+        if ( q->inputLines() )
+            return false;
+        ++q;
+    }
+    return true;
+}
+
+
+/*! Returns true if \a q may share a Sync message with its neighbours,
+    and false if it needs one of its own.
+
+    Queries between two Syncs form an implicit transaction, and the
+    server skips the rest of the group if one fails. That's harmless
+    for a standalone select, which is resubmitted if skipped, and has
+    nothing to roll back if a later query fails.
+*/
+
+static bool shareable( Query * q )
+{
+    return !q->transaction() && !q->inputLines() && !q->rowLimit() &&
+        q->string().mid( 0, 7 ).lower() == "select ";
+}
+
+
+/*! Takes the queries up to and including \a last off this handle and
+    puts them back at the front of the queue. This is called when the
+    server has skipped them because an earlier query sharing their
+    Sync failed.
+*/
+
+void Postgres::resubmit( Query * last )
+{
+    List< Query > * l = new List< Query >;
+    Query * q = 0;
+    while ( q != last && !d->queries.isEmpty() ) {
+        q = d->queries.shift();
+        PgParsing * pp = d->preparesPending.firstElement();
+        if ( pp && pp->query == q ) {
+            d->prepared.remove( pp->name );
+            d->preparesPending.shift();
+        }
+        // a replica check is made anew if its query is resubmitted
+        if ( !q->done() && q->string() != replicaCheck )
+            l->append( q );
+    }
+
+    // a query that may not run on this replica (any more) goes to the
+    // primary's queue, and runQueue() finds a handle for it.
+    bool primary = false;
+    List< Query >::Iterator i( queries );
+    List< Query >::Iterator j( queue() );
+    List< Query >::Iterator r( l );
+    while ( r ) {
+        Scope x( r->log() );
+        ::log( "Resubmitting query " + r->description() +
+               " after an earlier query in its group failed on backend " +
+               fn( connectionNumber() ), Log::Debug );
+        r->setState( Query::Submitted );
+        if ( replica().isEmpty() || r->replicaAllowed() ) {
+            queue()->insert( j, r );
+        }
+        else {
+            queries->insert( i, r );
+            primary = true;
+        }
+        ++r;
+    }
+    if ( primary )
+        runQueue();
+}
+
+
 static GraphableCounter * goodQueries = 0;
 static GraphableCounter * badQueries = 0;
 
@@ -1119,8 +1463,7 @@ void Postgres::countQueries( class Query * q )
         badQueries->tick();
     ; // a query which fails but canFail is not counted anywhere.
 
-    // later also use GraphableDataSet to keep track of query
-    // execution times, but not right now.
+    QueryStatistics::record( q );
 }
 
 
@@ -1160,6 +1503,61 @@ void Postgres::sendListen()
 }
 
 
+/*! Returns the name under which \a text, the query string of \a q,
+    is or should be prepared on this handle, or an empty string if it
+    should be sent as an unnamed statement.
+
+    A query is prepared the second time this handle sees it, so that
+    queries which are used only once (e.g. those with literal values
+    in their text) don't fill up the server's memory. At most
+    db-prepared-statements queries are kept prepared, and the least
+    recently used one is closed when another needs its place.
+*/
+
+EString Postgres::statementName( Query * q, const EString & text )
+{
+    uint max = Configuration::scalar( Configuration::DbPreparedStatements );
+    if ( !max || q->inputLines() )
+        return "";
+
+    EString w( text.section( " ", 1 ).lower() );
+    if ( w != "select" && w != "insert" && w != "update" &&
+         w != "delete" && w != "with" )
+        return "";
+
+    PgStatement * s = d->statements.find( text );
+    if ( !s ) {
+        s = new PgStatement( text );
+        d->statements.insert( text, s );
+        d->unnamed.prepend( s );
+        if ( d->unnamed.count > max ) {
+            PgStatement * o = d->unnamed.oldest;
+            d->unnamed.take( o );
+            d->statements.remove( o->text );
+        }
+        return "";
+    }
+
+    if ( !s->name.isEmpty() ) {
+        d->named.take( s );
+        d->named.prepend( s );
+        return s->name;
+    }
+
+    d->unnamed.take( s );
+    s->name = "a" + fn( ++d->statementNumber );
+    d->named.prepend( s );
+    if ( d->named.count > max ) {
+        PgStatement * o = d->named.oldest;
+        d->named.take( o );
+        d->statements.remove( o->text );
+        d->prepared.remove( o->name );
+        d->closing.append( o->name );
+    }
+    return s->name;
+}
+
+
 /*! Returns the query string for \a q, after possibly applying
     version-specific hacks and workarounds. */
 
@@ -1285,10 +1683,55 @@ public:
 
 /*! Issues a cancel request for the query \a q if it is being executed
     by this Postgres object. If not, it does nothing.
+
+    A standalone query that's waiting behind another in the pipeline
+    isn't cancelled, since the server would cancel the other one.
 */
 
 void Postgres::cancel( Query * q )
 {
-    if ( d->queries.find( q ) )
+    if ( d->transaction ? (bool)d->queries.find( q )
+                        : d->queries.firstElement() == q )
         (void)new PgCanceller( d->keydata );
 }
+
+
+void Postgres::resume( Query * q )
+{
+    if ( d->error || !q || q != d->portal )
+        return;
+
+    Scope x( q->log() );
+    if ( q->done() ) {
+        // the query was cancelled while the server waited for us
+        d->queries.remove( q );
+        closePortal();
+        ::log( "Discarded remaining rows for " + q->description(),
+               Log::Debug );
+        return;
+    }
+
+    PgExecute ex( portalName, q->rowLimit() );
+    ex.enqueue( writeBuffer() );
+    PgFlush f;
+    f.enqueue( writeBuffer() );
+    ::log( "Sent execute for " + fn( q->rowLimit() ) + " more rows of " +
+           q->description() + " on backend " + fn( connectionNumber() ),
+           Log::Debug );
+}
+
+
+/*! Closes the portal used by the query with a row limit, and sends
+    the Sync we held back while it was open. This is called when the
+    query has finished, successfully or not.
+*/
+
+void Postgres::closePortal()
+{
+    PgClose c( 'P', portalName );
+    c.enqueue( writeBuffer() );
+    PgSync s;
+    s.enqueue( writeBuffer() );
+    d->syncs.append( d->portal );
+    d->portal = 0;
+}
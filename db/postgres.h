@@ -12,24 +12,28 @@ class Postgres
     : public Database
 {
 public:
-    Postgres();
+    Postgres( const EString & = "" );
     ~Postgres();
 
     void processQueue();
     void react( Event );
 
     bool usable() const;
+    bool hasRoom() const;
 
     static uint version();
 
     void sendListen();
 
     void cancel( Query * );
+    void resume( Query * );
 
 private:
     class PgData *d;
 
-    void processQuery( Query * );
+    void processQuery( Query *, bool = true );
+    void resubmit( Query * );
+    void closePortal();
     void authentication( char );
     void backendStartup( char );
     void process( char );
@@ -39,6 +43,7 @@ private:
     void shutdown();
     void countQueries( Query * );
     EString queryString( Query * );
+    EString statementName( Query *, const EString & );
     EString mapped( const EString & ) const;
 };
 
@@ -14,6 +14,7 @@
 #include "integerset.h"
 #include "estringlist.h"
 #include "transaction.h"
+#include "timerwheel.h"
 
 
 class QueryData
@@ -24,7 +25,9 @@ public:
         : state( Query::Inactive ), format( Query::Text ),
           values( new Query::InputLine ), inputLines( 0 ),
           transaction( 0 ), owner( 0 ), totalRows( 0 ),
-          canFail( false )
+          rowLimit( 0 ), suspended( 0 ), canFail( false ),
+          replica( false ), replicaMailbox( 0 ), replicaModSeq( 0 ),
+          priority( Query::Interactive ), submitted( 0 ), started( 0 )
     {}
 
     Query::State state;
@@ -40,11 +43,21 @@ public:
     EventHandler * owner;
     List< Row > rows;
     uint totalRows;
+    uint rowLimit;
+    Database * suspended;
 
     EString error;
 
     bool canFail;
     bool canBeSlow;
+
+    bool replica;
+    uint replicaMailbox;
+    int64 replicaModSeq;
+
+    Query::Priority priority;
+    int64 submitted;
+    int64 started;
 };
 
 
@@ -73,6 +86,10 @@ public:
     calling nextRow().  The query keeps track of the total number of
     rows() received.
 
+    A query that may return very many rows can be given a
+    setRowLimit(), so that the server sends only that many at a time,
+    and sends more only when the owner has read the previous ones.
+
     A Query can be part of a Transaction.
 */
 
@@ -145,6 +162,10 @@ Query::State Query::state() const
 void Query::setState( State s )
 {
     d->state = s;
+    if ( s == Submitted && !d->submitted )
+        d->submitted = TimerWheel::now();
+    else if ( s == Executing && !d->started )
+        d->started = TimerWheel::now();
 }
 
 
@@ -198,6 +219,126 @@ void Query::allowFailure()
 }
 
 
+/*! Permits the Database to execute this Query on a read-only replica
+    (a hot standby) instead of the primary server, provided that the
+    replica has already seen modseq \a modseq in mailbox \a mailbox.
+    If \a mailbox is 0, any replica will do.
+
+    This should only be called for queries that don't modify anything,
+    and not for queries in a Transaction. Typically, \a modseq is the
+    Mailbox::nextModSeq() of the mailbox in question, so that a client
+    never sees an older state than this server has already seen.
+
+    If the replica turns out to be lagging, the Database sends the
+    query to the primary after all.
+*/
+
+void Query::allowReplica( uint mailbox, int64 modseq )
+{
+    d->replica = true;
+    d->replicaMailbox = mailbox;
+    d->replicaModSeq = modseq;
+}
+
+
+/*! Forbids the Database to execute this Query on a replica. This is
+    the default, and the Database calls it if a replica can't provide
+    what allowReplica() asked for.
+*/
+
+void Query::denyReplica()
+{
+    d->replica = false;
+}
+
+
+/*! Returns true if allowReplica() has been called and denyReplica()
+    hasn't, and false otherwise.
+*/
+
+bool Query::replicaAllowed() const
+{
+    return d->replica;
+}
+
+
+/*! Returns the mailbox a replica must be up to date with before it
+    can execute this Query, as set by allowReplica(), or 0.
+*/
+
+uint Query::replicaMailbox() const
+{
+    return d->replicaMailbox;
+}
+
+
+/*! Returns the modseq a replica must have seen in replicaMailbox()
+    before it can execute this Query, as set by allowReplica(), or 0.
+*/
+
+int64 Query::replicaModSeq() const
+{
+    return d->replicaModSeq;
+}
+
+
+/*! \enum Query::Priority
+
+    The Database serves queued queries in order of priority, and keeps
+    some handles free for each priority (see db-interactive-handles
+    and its siblings).
+
+    \value Interactive Work a user is waiting for, such as an IMAP
+    command. This is the default.
+    \value Delivery Injection of incoming mail.
+    \value Background Work nobody is waiting for, such as the spool
+    manager's.
+*/
+
+
+/*! Sets this Query's priority to \a p. The default is Interactive.
+    The priority of a Query in a Transaction is that of the
+    Transaction, so this function has no effect in that case.
+*/
+
+void Query::setPriority( Priority p )
+{
+    d->priority = p;
+}
+
+
+/*! Returns the priority of this Query, as set by setPriority() or
+    Transaction::setPriority().
+*/
+
+Query::Priority Query::priority() const
+{
+    if ( d->transaction )
+        return d->transaction->priority();
+    return d->priority;
+}
+
+
+/*! Returns the time (as TimerWheel::now()) at which this Query was
+    first submitted, or 0 if it hasn't been.
+*/
+
+int64 Query::submissionTime() const
+{
+    return d->submitted;
+}
+
+
+/*! Returns the time (as TimerWheel::now()) at which this Query was
+    first sent to the database server, or 0 if it hasn't been.
+*/
+
+int64 Query::startTime() const
+{
+    return d->started;
+}
+
+
 /*! Returns a pointer to the Transaction that this Query is associated
     with, or 0 if this Query is self-contained.
 */
@@ -737,61 +878,155 @@ void Query::addRow( Row *r )
 
 Row *Query::nextRow()
 {
-    return d->rows.shift();
+    Row * r = d->rows.shift();
+    if ( d->suspended && d->rows.isEmpty() ) {
+        Database * db = d->suspended;
+        d->suspended = 0;
+        db->resume( this );
+    }
+    return r;
+}
+
+
+/*! Instructs the Database to fetch at most \a n rows at a time for
+    this Query, and to fetch more only when the owner has read the
+    previous ones using nextRow(). The default, 0, fetches all rows at
+    once.
+
+    This bounds the memory used by a query with a very large result
+    to about \a n rows, and lets the owner slow the server down: If
+    the owner stops reading rows, e.g. because its client isn't
+    reading its responses, the server stops sending them.
+
+    The owner must read rows as they arrive, not only when the query
+    is done(), and queries submitted later in the same Transaction
+    are not sent until this one has finished.
+*/
+
+void Query::setRowLimit( uint n )
+{
+    d->rowLimit = n;
+}
+
+
+/*! Returns the row limit set by setRowLimit(), or 0 if there is none
+    (the default).
+*/
+
+uint Query::rowLimit() const
+{
+    return d->rowLimit;
+}
+
+
+/*! The Database calls this function to record that the server has
+    sent rowLimit() rows and is holding the rest back. When the owner
+    has read all the rows, nextRow() asks \a db for more.
+
+    If the query is already done(), e.g. because it was cancelled
+    while the server sent the rows, nobody will read them, so \a db
+    is told at once and can discard the rest.
+*/
+
+void Query::suspend( Database * db )
+{
+    d->suspended = db;
+    if ( d->rows.isEmpty() || done() ) {
+        d->suspended = 0;
+        db->resume( this );
+    }
 }
 
 
 /*! \class Row query.h
     Represents a single row of data retrieved from the Database.
 
-    The Database creates Row objects for every row of data received, and
-    populates them with the appropriate Column objects before appending
-    them to the originating Query.
+    The Database creates Row objects for every row of data received,
+    and appends them to the originating Query.
 
     Users of Query can retrieve each row in turn with Query::nextRow(),
     and use the getInt()/getEString()/etc. accessor functions, each of
     which takes a column name, to retrieve the values of each column
     in the Row.
+
+    A Row keeps the values as the server sent them, in one string, and
+    decodes each value only when it's accessed. Strings are returned
+    as slices of that string, without copying.
 */
 
 
-/*! Creates a row of data based on the columns \a c, named as in \a
+/*! Creates a row of data based on \a bytes, which contains the
+    column values as sent by the server (a 32-bit length followed by
+    that many bytes, or a length of -1 for NULL), laid out as in \a
     desc.
 */
 
-Row::Row( const PgRowDescription * desc, Column * c )
-    : data( c ), layout( desc )
+Row::Row( const PgRowDescription * desc, const EString & bytes )
+    : layout( desc ), raw( bytes )
 {
 }
 
 
-extern "C" {
-    uint strlen( const char * );
-};
-
-
-/*! This private helper returns the column named \a f, or a null
-    pointer if \a f does not exist.
+/*! This private helper returns the number of the column named \a f,
+    or -1 if \a f does not exist.
 
     If \a warn is true and \a f does not exist or has a type other
     than \a type, then fetch() logs a warning.
 */
 
-const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
+int Row::fetch( const char * f, Column::Type type, bool warn ) const
 {
-    int * x = layout->names.find( f, strlen( f ) * 8 );
-    if ( !x ) {
+    int x = layout->column( f );
+    if ( x < 0 ) {
         if ( warn )
             log( "Note: Column " + EString( f ).quoted() + " does not exist",
                  Log::Error );
-        return 0;
+        return -1;
     }
 
-    if ( warn && type != data[*x].type )
+    if ( warn && type != this->type( x ) )
         log( "Note: Expected type " + Column::typeName( type ) +
              " for column " + EString( f ).quoted() + ", but received " +
-             Column::typeName( data[*x].type ), Log::Error );
-    return &data[*x];
+             Column::typeName( this->type( x ) ), Log::Error );
+    return x;
+}
+
+
+/*! This private helper returns a pointer to the value of column \a i
+    and stores its length in \a length. The length is -1 if the
+    value is NULL.
+*/
+
+const unsigned char * Row::value( uint i, int * length ) const
+{
+    const unsigned char * p = (const unsigned char *)raw.data();
+    int l = 0;
+    while ( true ) {
+        l = ( p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+        p += 4;
+        if ( !i )
+            break;
+        if ( l > 0 )
+            p += l;
+        i--;
+    }
+    *length = l;
+    return p;
+}
+
+
+/*! This private helper returns the type of column \a i in this row:
+    Column::Null if the value is NULL, and otherwise the type of the
+    column.
+*/
+
+Column::Type Row::type( uint i ) const
+{
+    int l;
+    (void)value( i, &l );
+    if ( l < 0 )
+        return Column::Null;
+    return layout->kind( i );
 }
 
 
@@ -801,11 +1036,11 @@ const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
 
 bool Row::isNull( const char *f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( !c )
+    int x = fetch( f, Column::Null, false );
+    if ( x < 0 )
         return true; // XXX the two isNull()s differed
 
-    if ( c->type == Column::Null )
+    if ( type( x ) == Column::Null )
         return true;
     return false;
 }
@@ -817,12 +1052,17 @@ bool Row::isNull( const char *f ) const
 
 bool Row::getBoolean( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Boolean, true );
-    if ( !c )
+    int x = fetch( f, Column::Boolean, true );
+    if ( x < 0 || type( x ) != Column::Boolean )
         return false;
-    if ( c->type != Column::Boolean )
+    int l;
+    const unsigned char * p = value( x, &l );
+    if ( l != 1 ) {
+        log( "Boolean column " + EString( f ).quoted() + " has value " +
+             EString( (const char *)p, l ).quoted() );
         return false;
-    return c->b;
+    }
+    return p[0];
 }
 
 
@@ -832,12 +1072,22 @@ bool Row::getBoolean( const char * f ) const
 
 int Row::getInt( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Integer, true );
-    if ( !c )
+    int x = fetch( f, Column::Integer, true );
+    if ( x < 0 || type( x ) != Column::Integer )
         return 0;
-    if ( c->type != Column::Integer )
-        return 0;
-    return c->i;
+    int l;
+    const unsigned char * p = value( x, &l );
+    switch ( l ) {
+    case 1:
+        return p[0];
+    case 2:
+        return ( p[0] << 8 ) | p[1];
+    case 4:
+        return ( p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+    }
+    log( "Integer column " + EString( f ).quoted() + " has value " +
+         EString( (const char *)p, l ).quoted() );
+    return 0;
 }
 
 
@@ -847,12 +1097,21 @@ int Row::getInt( const char * f ) const
 
 int64 Row::getBigint( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Bigint, true );
-    if ( !c )
+    int x = fetch( f, Column::Bigint, true );
+    if ( x < 0 || type( x ) != Column::Bigint )
         return 0;
-    if ( c->type != Column::Bigint )
+    int l;
+    const unsigned char * p = value( x, &l );
+    if ( l != 8 ) {
+        log( "Bigint column " + EString( f ).quoted() + " has value " +
+             EString( (const char *)p, l ).quoted() );
         return 0;
-    return c->bi;
+    }
+    int64 r = 0;
+    int i = 0;
+    while ( i < 8 )
+        r = ( r << 8 ) | p[i++];
+    return r;
 }
 
 
@@ -862,12 +1121,12 @@ int64 Row::getBigint( const char * f ) const
 
 EString Row::getEString( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Bytes, true );
-    if ( !c )
+    int x = fetch( f, Column::Bytes, true );
+    if ( x < 0 || type( x ) != Column::Bytes )
         return "";
-    if ( c->type != Column::Bytes )
-        return "";
-    return c->s;
+    int l;
+    const unsigned char * p = value( x, &l );
+    return raw.mid( p - (const unsigned char *)raw.data(), l );
 }
 
 
@@ -878,13 +1137,13 @@ EString Row::getEString( const char * f ) const
 UString Row::getUString( const char * f ) const
 {
     UString r;
-    const Column * c = fetch( f, Column::Bytes, true );
-    if ( !c )
-        return r;
-    if ( c->type != Column::Bytes )
+    int x = fetch( f, Column::Bytes, true );
+    if ( x < 0 || type( x ) != Column::Bytes )
         return r;
+    int l;
+    const unsigned char * p = value( x, &l );
     PgUtf8Codec uc;
-    r = uc.toUnicode( c->s );
+    r = uc.toUnicode( raw.mid( p - (const unsigned char *)raw.data(), l ) );
     return r;
 }
 
@@ -895,10 +1154,9 @@ UString Row::getUString( const char * f ) const
 
 bool Row::hasColumn( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( c )
-        return true;
-    return false;
+    if ( fetch( f, Column::Null, false ) < 0 )
+        return false;
+    return true;
 }
 
 
@@ -908,10 +1166,10 @@ bool Row::hasColumn( const char * f ) const
 
 Column::Type Row::columnType( const char * f ) const
 {
-    const Column * c = fetch( f, Column::Null, false );
-    if ( c )
-        return c->type;
-    return Column::Unknown;
+    int x = fetch( f, Column::Null, false );
+    if ( x < 0 )
+        return Column::Unknown;
+    return type( x );
 }
 
 
@@ -980,8 +1238,8 @@ EString PreparedStatement::query() const
 
 
 /*! \class Column query.h
-    This class represents a single column in a row.
-    Has no member functions or useful documentation yet.
+    This class names the types a column in a Row can have.
+    It has no members other than the Type enum and typeName().
 */
 
 
@@ -1049,6 +1307,14 @@ void Query::cancel()
         setError( "Cancelled" );
     notify();
 
+    if ( d->suspended ) {
+        // the server isn't working on it, so there's nothing to
+        // cancel, but the Database should stop waiting for nextRow()
+        Database * db = d->suspended;
+        d->suspended = 0;
+        db->resume( this );
+    }
+
     if ( d->canBeSlow && s == Executing )
         Database::cancelQuery( this );
     else if ( d->transaction )
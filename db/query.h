@@ -39,6 +39,18 @@ public:
     bool canFail() const;
     void allowFailure();
 
+    void allowReplica( uint, int64 );
+    void denyReplica();
+    bool replicaAllowed() const;
+    uint replicaMailbox() const;
+    int64 replicaModSeq() const;
+
+    enum Priority { Interactive, Delivery, Background };
+    void setPriority( Priority );
+    Priority priority() const;
+    int64 submissionTime() const;
+    int64 startTime() const;
+
     Transaction *transaction() const;
     void setTransaction( Transaction * );
 
@@ -116,6 +128,10 @@ public:
     void addRow( Row * );
     Row *nextRow();
 
+    void setRowLimit( uint );
+    uint rowLimit() const;
+    void suspend( Database * );
+
     class Log * log() const;
 
     void checkParameters();
@@ -131,12 +147,6 @@ class Column
 public:
     enum Type { Unknown, Boolean, Integer, Bigint, Bytes, Timestamp, Null };
 
-    Type type;
-    EString s;
-    bool b;
-    uint i;
-    int64 bi;
-
     static EString typeName( Type );
 };
 
@@ -145,7 +155,7 @@ class Row
     : public Garbage
 {
 public:
-    Row( const class PgRowDescription *, Column * );
+    Row( const class PgRowDescription *, const EString & );
 
     bool isNull( const char * ) const;
     int getInt( const char * ) const;
@@ -159,10 +169,12 @@ public:
     EStringList * columnNames() const;
 
 private:
-    const Column * data;
     const class PgRowDescription * layout;
+    EString raw;
 
-    const Column * fetch( const char *, Column::Type, bool ) const;
+    int fetch( const char *, Column::Type, bool ) const;
+    const unsigned char * value( uint, int * ) const;
+    Column::Type type( uint ) const;
 };
 
 
@@ -0,0 +1,299 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "querystatistics.h"
+
+#include "configuration.h"
+#include "transaction.h"
+#include "hashtable.h"
+#include "timerwheel.h"
+#include "allocator.h"
+#include "query.h"
+#include "event.h"
+#include "graph.h"
+#include "scope.h"
+#include "log.h"
+
+// time
+#include <time.h>
+
+
+// we keep track of this many different statements, and lump any
+// others together
+static const uint maxStatements = 1000;
+
+// and EXPLAIN each slow statement at most once per this many seconds
+static const uint explainInterval = 300;
+
+
+class QueryStatistic
+    : public Garbage
+{
+public:
+    QueryStatistic( const EString & f )
+        : fingerprint( f ), count( 0 ), total( 0 ), max( 0 ),
+          explained( 0 ) {
+        uint i = 0;
+        while ( i < QueryStatistics::Buckets )
+            buckets[i++] = 0;
+    }
+
+    EString fingerprint;
+    uint count;
+    int64 total;
+    uint max;
+    uint buckets[QueryStatistics::Buckets];
+    time_t explained;
+    EString plan;
+};
+
+
+static HashDict<QueryStatistic> * statements = 0;
+static List<QueryStatistic> * statistics = 0;
+
+
+class QueryExplainer
+    : public EventHandler
+{
+public:
+    QueryExplainer( QueryStatistic * s )
+        : q( 0 ), statistic( s ) {
+        setLog( new Log );
+    }
+
+    void execute() {
+        if ( !q->done() )
+            return;
+        if ( q->failed() ) {
+            log( "Could not explain slow query: " + q->error(),
+                 Log::Debug );
+            return;
+        }
+        EStringList plan;
+        Row * r;
+        while ( (r=q->nextRow()) != 0 )
+            plan.append( r->getEString( "QUERY PLAN" ) );
+        statistic->plan = plan.join( "\n" );
+        log( "Plan for slow query " + q->description() + ":",
+             Log::Significant );
+        EStringList::Iterator l( plan );
+        while ( l ) {
+            log( "  " + *l, Log::Significant );
+            ++l;
+        }
+    }
+
+    Query * q;
+    QueryStatistic * statistic;
+};
+
+
+/*! \class QueryStatistics querystatistics.h
+
+    The QueryStatistics class keeps track of how long the database
+    takes to answer each kind of query, and reports slow queries.
+
+    Queries are grouped by fingerprint(), and for each fingerprint,
+    record() counts the queries, their total and longest time, and a
+    histogram of times: Bucket 0 counts the queries that took less
+    than 1ms, bucket 1 those which took 1ms, bucket 2 2-3ms, bucket 3
+    4-7ms and so on, except that the last bucket also counts all the
+    slower ones.
+
+    Any query that takes db-slow-query-time milliseconds or more is
+    logged along with its bind values. If it's a select, an EXPLAIN
+    (or EXPLAIN ANALYZE, if db-explain-analyze is set) is submitted
+    with low priority, so that it runs on whatever handle is spare,
+    and its plan is logged and kept.
+
+    report() makes it all available to "aox show queries", via the
+    GraphDumper.
+*/
+
+
+/*! Records that \a q has finished. Does nothing if \a q hasn't been
+    sent to the server.
+*/
+
+void QueryStatistics::record( Query * q )
+{
+    if ( !q->startTime() )
+        return;
+
+    int64 elapsed = TimerWheel::now() - q->startTime();
+    uint ms = elapsed > 0 ? (uint)elapsed : 0;
+
+    if ( !statements ) {
+        statements = new HashDict<QueryStatistic>;
+        Allocator::addEternal( statements, "query statistics" );
+        statistics = new List<QueryStatistic>;
+        Allocator::addEternal( statistics, "query statistics list" );
+        GraphDumper::addReporter( QueryStatistics::report );
+    }
+
+    EString f = fingerprint( q->string() );
+    QueryStatistic * s = statements->find( f );
+    if ( !s ) {
+        if ( statistics->count() >= maxStatements )
+            f = "(other statements)";
+        s = statements->find( f );
+    }
+    if ( !s ) {
+        s = new QueryStatistic( f );
+        statements->insert( f, s );
+        statistics->append( s );
+    }
+
+    s->count++;
+    s->total += ms;
+    if ( ms > s->max )
+        s->max = ms;
+    uint b = 0;
+    uint m = ms;
+    while ( m && b < Buckets - 1 ) {
+        b++;
+        m = m >> 1;
+    }
+    s->buckets[b]++;
+
+    uint slow = Configuration::scalar( Configuration::DbSlowQueryTime );
+    if ( !slow || ms < slow )
+        return;
+
+    Scope x( q->log() );
+    ::log( "Slow query (" + fn( ms ) + "ms): " + q->description(),
+           Log::Significant );
+
+    EString t = q->string().mid( 0, 7 ).lower();
+    if ( !( t.startsWith( "select " ) || t.startsWith( "with " ) ) ||
+         q->inputLines() )
+        return;
+
+    time_t now = time( 0 );
+    if ( s->explained && s->explained + explainInterval > now )
+        return;
+    s->explained = now;
+
+    QueryExplainer * e = new QueryExplainer( s );
+    EString explain( "explain " );
+    if ( Configuration::toggle( Configuration::DbExplainAnalyze ) )
+        explain = "explain analyze ";
+    e->q = new Query( explain + q->string(), e );
+    List< Query::Value >::Iterator v( *q->values() );
+    while ( v ) {
+        if ( v->length() < 0 )
+            e->q->bindNull( v->position() );
+        else
+            e->q->bind( v->position(), v->data(), v->format() );
+        ++v;
+    }
+    e->q->setPriority( Query::Background );
+    e->q->allowFailure();
+    e->q->execute();
+}
+
+
+/*! Returns a normalised form of the SQL statement \a s, such that
+    statements which differ only in the constants they contain or in
+    their whitespace have the same fingerprint.
+
+    Quoted strings are replaced by '?', and numbers by ?. Bind
+    parameters ($1 etc.) and identifiers are left alone.
+*/
+
+EString QueryStatistics::fingerprint( const EString & s )
+{
+    EString r;
+    r.reserve( s.length() );
+    uint i = 0;
+    while ( i < s.length() ) {
+        char c = s[i];
+        if ( c == ' ' || c == '\t' || c == '\r' || c == '\n' ) {
+            while ( i < s.length() &&
+                    ( s[i] == ' ' || s[i] == '\t' ||
+                      s[i] == '\r' || s[i] == '\n' ) )
+                i++;
+            if ( !r.isEmpty() && i < s.length() )
+                r.append( ' ' );
+        }
+        else if ( c == '\'' ) {
+            i++;
+            while ( i < s.length() &&
+                    ( s[i] != '\'' || s[i+1] == '\'' ) ) {
+                if ( s[i] == '\'' )
+                    i++;
+                i++;
+            }
+            i++;
+            r.append( "'?'" );
+        }
+        else if ( c >= '0' && c <= '9' ) {
+            char p = r.isEmpty() ? ' ' : r[r.length()-1];
+            bool word = ( p == '_' || p == '$' ||
+                          ( p >= '0' && p <= '9' ) ||
+                          ( p >= 'a' && p <= 'z' ) ||
+                          ( p >= 'A' && p <= 'Z' ) );
+            if ( word ) {
+                r.append( c );
+                i++;
+            }
+            else {
+                while ( i < s.length() &&
+                        ( ( s[i] >= '0' && s[i] <= '9' ) || s[i] == '.' ) )
+                    i++;
+                r.append( '?' );
+            }
+        }
+        else {
+            r.append( c );
+            i++;
+        }
+    }
+    return r;
+}
+
+
+/*! Returns a list of lines describing what record() has seen, for the
+    GraphDumper. For each fingerprint there is one line of the form
+    "query n count total max b0,b1,...,b15 fingerprint", where n
+    numbers the fingerprints and the times are in milliseconds,
+    followed by one "query-plan n line" for each line of the last plan
+    seen for that fingerprint, if any.
+*/
+
+EStringList * QueryStatistics::report()
+{
+    EStringList * r = new EStringList;
+    uint n = 0;
+    List<QueryStatistic>::Iterator s( statistics );
+    while ( s ) {
+        n++;
+        EString l( "query " );
+        l.appendNumber( n );
+        l.append( " " );
+        l.appendNumber( s->count );
+        l.append( " " );
+        l.append( fn( s->total ) );
+        l.append( " " );
+        l.appendNumber( s->max );
+        l.append( " " );
+        uint b = 0;
+        while ( b < Buckets ) {
+            if ( b )
+                l.append( "," );
+            l.appendNumber( s->buckets[b] );
+            b++;
+        }
+        l.append( " " );
+        l.append( s->fingerprint );
+        r->append( l );
+        if ( !s->plan.isEmpty() ) {
+            EStringList::Iterator p( EStringList::split( '\n', s->plan ) );
+            while ( p ) {
+                r->append( "query-plan " + fn( n ) + " " + *p );
+                ++p;
+            }
+        }
+        ++s;
+    }
+    return r;
+}
@@ -0,0 +1,25 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef QUERYSTATISTICS_H
+#define QUERYSTATISTICS_H
+
+#include "estringlist.h"
+
+class Query;
+
+
+class QueryStatistics
+    : public Garbage
+{
+public:
+    static void record( Query * );
+
+    static EString fingerprint( const EString & );
+
+    static EStringList * report();
+
+    enum { Buckets = 16 };
+};
+
+
+#endif
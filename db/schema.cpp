@@ -619,6 +619,14 @@ bool Schema::singleStep()
         c = stepTo94(); break;
     case 94:
         c = stepTo95(); break;
+    case 95:
+        c = stepTo96(); break;
+    case 96:
+        c = stepTo97(); break;
+    case 97:
+        c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -4367,3 +4375,95 @@ bool Schema::stepTo95()
 
     return true;
 }
+
+
+/*! Make the mailbox update trigger say what changed, so that servers
+    can apply new uidnext/nextmodseq values directly instead of
+    rereading the mailboxes table. Notification payloads need
+    PostgreSQL 9.0, so older servers still get a bare NOTIFY.
+*/
+
+bool Schema::stepTo96()
+{
+    describeStep( "Sending uidnext/nextmodseq with mailboxes_updated" );
+    d->t->enqueue(
+        new Query( "create or replace function check_mailbox_update() "
+                   "returns trigger as $$"
+                   "declare address text; "
+                   "begin "
+                   "if new.name=old.name and new.deleted=old.deleted and "
+                   "new.uidvalidity=old.uidvalidity and "
+                   "coalesce(new.owner,0)=coalesce(old.owner,0) and "
+                   "substring(current_setting('server_version') "
+                   "from '^[0-9]+')::int>=9 "
+                   "then "
+                   "perform pg_notify('mailboxes_updated', "
+                   "new.id||' '||new.uidnext||' '||new.nextmodseq); "
+                   "else "
+                   "notify mailboxes_updated; "
+                   "end if; "
+                   "if new.deleted='t' and old.deleted='f' then "
+                   "perform * from mailbox_messages where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is not empty', new.name;"
+                   "end if; "
+                   "select a.localpart||'@'||a.domain into address"
+                   " from addresses a join aliases al on (a.id=al.address)"
+                   " where al.mailbox=new.id;"
+                   "if address is not null then "
+                   "raise exception '% used by alias %', new.name, address; "
+                   "end if; "
+                   "perform * from fileinto_targets where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is used by sieve fileinto', new.name;"
+                   "end if; "
+                   "end if; "
+                   "return new;"
+                   "end;$$ language 'plpgsql'", 0 ) );
+    return true;
+}
+
+
+/*! Add the raw_messages table, which can keep a compressed copy of
+    each message as Message::rfc822() formats it, so that fetching a
+    whole message needn't reassemble it.
+*/
+
+bool Schema::stepTo97()
+{
+    describeStep( "Adding raw_messages table for whole-message fetches" );
+    d->t->enqueue( "create table raw_messages ("
+                   "message integer primary key "
+                   "references messages(id) on delete cascade, "
+                   "data bytea not null)" );
+    return true;
+}
+
+
+/*! Add bodyparts.compressed, so that bodyparts can be stored
+    compressed. Existing rows have null, which means the same as
+    false, so the table needn't be rewritten.
+*/
+
+bool Schema::stepTo98()
+{
+    describeStep( "Adding bodyparts.compressed" );
+    d->t->enqueue( "alter table bodyparts add compressed boolean" );
+    d->t->enqueue( "alter table bodyparts "
+                   "alter compressed set default false" );
+    return true;
+}
+
+
+/*! Add bodyparts.blob, which is true when a bodypart's data is in
+    blob-directory rather than in the database.
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding bodyparts.blob" );
+    d->t->enqueue( "alter table bodyparts add blob boolean" );
+    d->t->enqueue( "alter table bodyparts "
+                   "alter blob set default false" );
+    return true;
+}
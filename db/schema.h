@@ -120,6 +120,10 @@ private:
     bool stepTo93();
     bool stepTo94();
     bool stepTo95();
+    bool stepTo96();
+    bool stepTo97();
+    bool stepTo98();
+    bool stepTo99();
 
     void describeStep( const EString & );
 };
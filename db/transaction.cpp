@@ -19,7 +19,8 @@ public:
           children( 0 ),
           submittedCommit( false ), submittedBegin( false ),
           committing( false ),
-          owner( 0 ), db( 0 ), queries( 0 ), failedQuery( 0 )
+          owner( 0 ), db( 0 ), queries( 0 ), failedQuery( 0 ),
+          priority( Query::Interactive )
     {}
 
     Transaction::State state;
@@ -38,6 +39,8 @@ public:
     Query * failedQuery;
     EString error;
 
+    Query::Priority priority;
+
     class CommitBouncer
         : public EventHandler
     {
@@ -658,6 +661,30 @@ Transaction * Transaction::activeSubTransaction()
 }
 
 
+/*! Sets the priority of this Transaction to \a p. The default is
+    Query::Interactive. The Database considers the priority when it
+    chooses which queued transaction or query to start next, and all
+    queries in this Transaction share it.
+*/
+
+void Transaction::setPriority( Query::Priority p )
+{
+    d->priority = p;
+}
+
+
+/*! Returns the priority set by setPriority(). A subTransaction() has
+    the priority of its parent.
+*/
+
+Query::Priority Transaction::priority() const
+{
+    if ( d->parent )
+        return d->parent->priority();
+    return d->priority;
+}
+
+
 /*! Removes all queries that can be sent to the server from the front
     of the queue and returns them. May change activeSubTransaction()
     as a side effect, if the last query starts a subtransaction.
@@ -684,9 +711,10 @@ List< Query > * Transaction::submittedQueries()
             t->d->activeChild = q->transaction();
             last = true;
         }
-        // if the query is a copy, we have to let it finish before we
-        // can send more queries.
-        if ( q->inputLines() ) {
+        // if the query is a copy, or returns its rows a few at a
+        // time, we have to let it finish before we can send more
+        // queries.
+        if ( q->inputLines() || q->rowLimit() ) {
             last = true;
         }
     }
@@ -4,9 +4,9 @@
 #define TRANSACTION_H
 
 #include "list.h"
+#include "query.h"
 
 
-class Query;
 class EString;
 class Database;
 class EventHandler;
@@ -51,6 +51,9 @@ public:
 
     Transaction * activeSubTransaction();
 
+    void setPriority( Query::Priority );
+    Query::Priority priority() const;
+
 private:
     class TransactionData *d;
 };
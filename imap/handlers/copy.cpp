@@ -104,6 +104,37 @@ void Copy::execute()
     if ( !transaction() ) {
         setTransaction( new Transaction( this ) );
 
+        // For COPY, we copy the source rows into a temporary table
+        // before locking the target mailbox, so that the lock (which
+        // is held until we commit) covers as little work as
+        // possible. For MOVE, the source mailbox has to be locked
+        // first, or a concurrent EXPUNGE or MOVE could remove rows
+        // after we've copied them to t. t.n numbers the messages
+        // from 1 in uid order; the new uid is computed from that
+        // once we know uidnext.
+
+        Query * q;
+
+        q = new Query( "create temporary table t ("
+                       "n serial,"
+                       "mailbox integer,"
+                       "uid integer,"
+                       "message integer,"
+                       "nuid integer,"
+                       "seen boolean"
+                       ")", 0 );
+        transaction()->enqueue( q );
+
+        q = new Query( "insert into t "
+                       "(mailbox, uid, message, seen) "
+                       "select mailbox, uid, message, seen "
+                       "from mailbox_messages "
+                       "where mailbox=$1 and uid=any($2) order by uid", 0 );
+        q->bind( 1, session()->mailbox()->id() );
+        q->bind( 2, d->set );
+        if ( !d->move )
+            transaction()->enqueue( q );
+
         d->findUid = new Query( "select id,uidnext,nextmodseq from mailboxes "
                                 "where id=$1 or id=$2 order by id for update",
                                 this );
@@ -113,6 +144,8 @@ void Copy::execute()
         else
             d->findUid->bind( 2, d->mailbox->id() );
         transaction()->enqueue( d->findUid );
+        if ( d->move )
+            transaction()->enqueue( q );
         transaction()->execute();
     }
 
@@ -136,38 +169,19 @@ void Copy::execute()
 
         Query * q;
 
-        q = new Query( "create temporary table t ("
-                       "mailbox integer,"
-                       "uid integer,"
-                       "message integer,"
-                       "nuid integer,"
-                       "seen boolean"
-                       ")", 0 );
-        transaction()->enqueue( q );
-
-        q = new Query( "create temporary sequence s start " + fn( d->toUid ),
-                       0 );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into t "
-                       "(mailbox, uid, message, nuid, seen) "
-                       "select mailbox, uid, message, nextval('s'), seen "
-                       "from mailbox_messages "
-                       "where mailbox=$1 and uid=any($2) order by uid", 0 );
-        q->bind( 1, session()->mailbox()->id() );
-        q->bind( 2, d->set );
+        q = new Query( "update t set nuid=n+$1", 0 );
+        q->bind( 1, d->toUid - 1 );
         transaction()->enqueue( q );
 
         q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
+                       "set uidnext=uidnext+(select count(*) from t), "
+                       "nextmodseq=$1 "
                        "where id=$2",
                        this );
         q->bind( 1, d->toMs+1 );
         q->bind( 2, d->mailbox->id() );
         transaction()->enqueue( q );
 
-        transaction()->enqueue( new Query( "drop sequence s", 0 ) );
-
         q = new Query( "insert into mailbox_messages "
                        "(mailbox, uid, message, modseq, seen, deleted) "
                        "select $1, t.nuid, message, $2, t.seen, false "
@@ -3,11 +3,13 @@
 #include "fetch.h"
 
 #include "messagecache.h"
+#include "sharedcache.h"
 #include "imapsession.h"
 #include "transaction.h"
 #include "annotation.h"
 #include "integerset.h"
 #include "estringlist.h"
+#include "blobstore.h"
 #include "mimefields.h"
 #include "imapparser.h"
 #include "bodypart.h"
@@ -21,11 +23,13 @@
 #include "iso8859.h"
 #include "codec.h"
 #include "query.h"
+#include "buffer.h"
 #include "scope.h"
 #include "store.h"
 #include "timer.h"
 #include "imap.h"
 #include "date.h"
+#include "file.h"
 #include "user.h"
 #include "dict.h"
 #include "map.h"
@@ -44,6 +48,19 @@ static const char * legalAnnotationAttributes[] = {
 };
 
 
+class FetchMetadata
+    : public Garbage
+{
+public:
+    enum Item { Size, InternalDate, Envelope, Body, BodyStructure,
+                NumItems };
+    EString items[NumItems];
+
+    bool parse( const EString & );
+    EString serialized() const;
+};
+
+
 class FetchData
     : public Garbage
 {
@@ -59,6 +76,7 @@ public:
           annotation( false ), modseq( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          wholeMessages( false ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
           annotationFetcher( 0 ), modseqFetcher( 0 )
     {}
@@ -92,6 +110,8 @@ public:
     bool needsAddresses;
     bool needsBody;
     bool needsPartNumbers;
+    // or only the whole text of each message
+    bool wholeMessages;
 
     EStringList entries;
     EStringList attribs;
@@ -106,6 +126,8 @@ public:
         List<Annotation> annotations;
     };
     Map<DynamicData> dynamics;
+    Map<FetchMetadata> metadata;
+
     Query * seenDeletedFetcher;
     Query * flagFetcher;
     Query * annotationFetcher;
@@ -251,6 +273,18 @@ void Fetch::parse()
         d->needsHeader = true; // Bodypart::asText() needs mime type etc
     if ( !ok() )
         return;
+    if ( !d->sections.isEmpty() &&
+         !d->envelope && !d->body && !d->bodystructure ) {
+        d->wholeMessages = true;
+        List<Section>::Iterator s( d->sections );
+        while ( s ) {
+            if ( !s->part.isEmpty() ||
+                 !( s->id.isEmpty() || s->id == "text" ||
+                    s->id == "rfc822" || s->id == "rfc822.text" ) )
+                d->wholeMessages = false;
+            ++s;
+        }
+    }
     EStringList l;
     l.append( new EString( "Fetch <=" + fn( d->set.count() ) + " messages: " ) );
     if ( d->needsAddresses )
@@ -677,11 +711,18 @@ void Fetch::execute()
                       d->needsAddresses || d->needsHeader ||
                       d->needsBody || d->needsPartNumbers ||
                       d->rfc822size || d->internaldate ) {
+                bool shared = SharedCache::enabled() &&
+                              d->sections.isEmpty();
                 IntegerSet r;
                 IntegerSet s( d->set );
                 while ( !s.isEmpty() ) {
                     uint uid = s.smallest();
                     s.remove( uid );
+                    if ( shared && findMetadata( uid ) ) {
+                        if ( d->modseq )
+                            r.add( uid );
+                        continue;
+                    }
                     Message * m = MessageCache::find( mb, uid );
                     if ( m )
                         d->messages.insert( uid, m );
@@ -730,12 +771,14 @@ void Fetch::execute()
                 r = d->those->nextRow();
                 uint uid = r->getInt( "uid" );
                 d->set.add( uid );
-                Message * m = d->messages.find( uid );
-                if ( !m ) {
-                    m = MessageCache::provide( mb, uid );
-                    d->messages.insert( uid, m );
+                if ( !d->metadata.contains( uid ) ) {
+                    Message * m = d->messages.find( uid );
+                    if ( !m ) {
+                        m = MessageCache::provide( mb, uid );
+                        d->messages.insert( uid, m );
+                    }
+                    m->setDatabaseId( r->getInt( "message" ) );
                 }
-                m->setDatabaseId( r->getInt( "message" ) );
                 if ( d->modseq || d->flags || d->annotation ) {
                     FetchData::DynamicData * dd = new FetchData::DynamicData;
                     d->dynamics.insert( uid, dd );
@@ -828,6 +871,7 @@ void Fetch::sendFetchQueries()
     bool haveBody = true;
     bool havePartNumbers = true;
     bool haveTrivia = true;
+    bool haveText = true;
 
     List<Message> * l = new List<Message>;
 
@@ -845,20 +889,34 @@ void Fetch::sendFetchQueries()
             haveBody = false;
         if ( !m->hasTrivia() )
             haveTrivia = false;
+        if ( !m->hasRfc822() &&
+             !( m->hasAddresses() && m->hasHeaders() && m->hasBodies() ) )
+            haveText = false;
         l->append( m );
     }
+    if ( l->isEmpty() )
+        return;
 
     Fetcher * f = new Fetcher( l, this, imap()->writeBuffer() );
-    if ( d->needsAddresses && !haveAddresses )
-        f->fetch( Fetcher::Addresses );
-    if ( d->needsHeader && !haveHeader )
-        f->fetch( Fetcher::OtherHeader );
-    if ( d->needsBody && !haveBody )
-        f->fetch( Fetcher::Body );
+    if ( d->wholeMessages ) {
+        if ( !haveText )
+            f->fetch( Fetcher::Rfc822 );
+    }
+    else {
+        if ( d->needsAddresses && !haveAddresses )
+            f->fetch( Fetcher::Addresses );
+        if ( d->needsHeader && !haveHeader )
+            f->fetch( Fetcher::OtherHeader );
+        if ( d->needsBody && !haveBody )
+            f->fetch( Fetcher::Body );
+    }
     if ( ( d->rfc822size || d->internaldate ) && !haveTrivia )
         f->fetch( Fetcher::Trivia );
     if ( d->needsPartNumbers && !havePartNumbers )
         f->fetch( Fetcher::PartNumbers );
+    if ( !transaction() )
+        f->allowReplica( session()->mailbox()->id(),
+                         session()->mailbox()->nextModSeq() );
     f->execute();
 }
 
@@ -1034,48 +1092,258 @@ EString Fetch::sectionData( Section * s, Message * m )
 }
 
 
-/* This function returns the response data for an element in
-   d->sections, to be included in the FETCH response by
-   fetchResponses() below.
+// section data at least this long is sent as a literal of its own
+static const uint separateLiteral = 2048;
+
+
+/* Returns a FetchFile describing the data for \a s in \a m, if that
+   data is exactly (a range of) a BlobStore file, and a null pointer
+   otherwise. That's the case for BINARY[x] of a non-text leaf part
+   whose data is in the BlobStore.
+*/
+
+static FetchFile * sectionFile( Section * s, Message * m )
+{
+    if ( !m || !s->binary || !s->id.isEmpty() || s->part.isEmpty() )
+        return 0;
+    Bodypart * bp = m->bodypart( s->part, false );
+    if ( !bp || bp->blob().isEmpty() || bp->message() ||
+         !bp->children()->isEmpty() )
+        return 0;
+    ContentType * ct = bp->contentType();
+    if ( !ct || ct->type() == "text" )
+        return 0;
+    uint size = BlobStore::size( bp->blob() );
+    if ( !size )
+        return 0;
+
+    FetchFile * f = new FetchFile;
+    f->name = File::chrooted( BlobStore::fileName( bp->blob() ) );
+    f->length = size;
+    s->item = "BINARY[" + s->part + "]";
+    if ( s->partial ) {
+        s->item.append( "<" + fn( s->offset ) + ">" );
+        f->offset = s->offset;
+        if ( f->offset > size )
+            f->offset = size;
+        f->length = size - f->offset;
+        if ( f->length > s->length )
+            f->length = s->length;
+    }
+    return f;
+}
+
+
+/* This function appends the response data for an element in
+   d->sections to \a r, to be included in the FETCH response by
+   makeFetchResponse() below. Large data is sent as a literal and
+   appended to \a r as a separate string, so that it need not be
+   copied.
+
+   If \a files is non-null and the data is in a BlobStore file, the
+   literal is represented by an empty string in \a r, and the file by
+   a FetchFile appended to \a files.
 */
 
-static EString sectionResponse( Section * s, Message * m )
+static void sectionResponse( Section * s, Message * m, EStringList * r,
+                             List<FetchFile> * files )
 {
+    FetchFile * f = 0;
+    if ( files )
+        f = sectionFile( s, m );
+    if ( f ) {
+        // BINARY permits literal8 whether there's a NUL or not
+        r->append( s->item + " ~{" + fn( f->length ) + "}\r\n" );
+        r->append( "" );
+        files->append( f );
+        return;
+    }
+
     EString data( Fetch::sectionData( s, m ) );
-    if ( !s->item.startsWith( "BINARY.SIZE" ) )
-        data = Command::imapQuoted( data, Command::NString );
+    EString item( s->item );
+    item.append( " " );
+    if ( s->item.startsWith( "BINARY.SIZE" ) ) {
+        item.append( data );
+        r->append( item );
+    }
+    else if ( data.length() < separateLiteral ) {
+        item.append( Command::imapQuoted( data, Command::NString ) );
+        r->append( item );
+    }
+    else {
+        // this is what imapQuoted() does, except that it copies
+        if ( data.contains( 0 ) )
+            item.append( '~' );
+        item.append( '{' );
+        item.appendNumber( data.length() );
+        item.append( "}\r\n" );
+        r->append( item );
+        r->append( data );
+    }
+}
+
+
+/*! Parses \a s, which is in the format made by serialized(), and
+    returns true if that went well.
+*/
+
+bool FetchMetadata::parse( const EString & s )
+{
+    uint i = 0;
+    uint n = 0;
+    while ( n < NumItems ) {
+        uint l = 0;
+        while ( i < s.length() && s[i] >= '0' && s[i] <= '9' )
+            l = l * 10 + s[i++] - '0';
+        if ( i >= s.length() || s[i] != ' ' || i + 1 + l > s.length() )
+            return false;
+        items[n] = s.mid( i + 1, l );
+        i += 1 + l;
+        n++;
+    }
+    return i == s.length();
+}
+
+
+/*! Returns the items in a form suitable for the SharedCache: each
+    item's length, a space and the item.
+*/
+
+EString FetchMetadata::serialized() const
+{
     EString r;
-    r.reserve( data.length() + s->item.length() + 1 );
-    r.append( s->item );
-    r.append( " " );
-    r.append( data );
+    uint n = 0;
+    while ( n < NumItems ) {
+        r.appendNumber( items[n].length() );
+        r.append( ' ' );
+        r.append( items[n] );
+        n++;
+    }
     return r;
 }
 
 
-/*! Emits a single FETCH response for the message \a m, which is
+/*! Returns the SharedCache key for the message with \a uid in \a mb.
+    The UIDVALIDITY is part of the key, so nothing needs to be
+    removed if a mailbox's UIDs are reused.
+*/
+
+static EString metadataKey( Mailbox * mb, uint uid )
+{
+    EString k( "fetch " );
+    k.appendNumber( mb->id() );
+    k.append( ' ' );
+    k.appendNumber( mb->uidvalidity() );
+    k.append( ' ' );
+    k.appendNumber( uid );
+    return k;
+}
+
+
+/*! Looks for the unchanging parts of the response for \a uid in the
+    SharedCache. Returns true and records them if all the parts this
+    command needs are there, and false if the message has to be
+    fetched.
+*/
+
+bool Fetch::findMetadata( uint uid )
+{
+    EString s( SharedCache::find( metadataKey( session()->mailbox(),
+                                                uid ) ) );
+    if ( s.isEmpty() )
+        return false;
+    FetchMetadata * md = new FetchMetadata;
+    if ( !md->parse( s ) )
+        return false;
+    if ( ( d->rfc822size &&
+           md->items[FetchMetadata::Size].isEmpty() ) ||
+         ( d->internaldate &&
+           md->items[FetchMetadata::InternalDate].isEmpty() ) ||
+         ( d->envelope &&
+           md->items[FetchMetadata::Envelope].isEmpty() ) ||
+         ( d->body &&
+           md->items[FetchMetadata::Body].isEmpty() ) ||
+         ( d->bodystructure &&
+           md->items[FetchMetadata::BodyStructure].isEmpty() ) )
+        return false;
+    d->metadata.insert( uid, md );
+    return true;
+}
+
+
+/*! Computes the unchanging parts of the response for \a m, which has
+    \a uid. If there is a SharedCache, stores them there for other
+    processes, and computes all the parts that can be computed from
+    what has been fetched, not just the ones this command needs.
+*/
+
+FetchMetadata * Fetch::metadata( Message * m, uint uid )
+{
+    bool all = SharedCache::enabled();
+    FetchMetadata * md = new FetchMetadata;
+    if ( m->hasTrivia() ) {
+        if ( all || d->rfc822size )
+            md->items[FetchMetadata::Size] = fn( m->rfc822Size() );
+        if ( all || d->internaldate )
+            md->items[FetchMetadata::InternalDate] = internalDate( m );
+    }
+    if ( m->hasHeaders() && m->hasAddresses() ) {
+        if ( all || d->envelope )
+            md->items[FetchMetadata::Envelope] = envelope( m );
+        if ( m->hasBytesAndLines() ) {
+            if ( all || d->body )
+                md->items[FetchMetadata::Body] = bodyStructure( m, false );
+            if ( all || d->bodystructure )
+                md->items[FetchMetadata::BodyStructure] =
+                    bodyStructure( m, true );
+        }
+    }
+    if ( all )
+        SharedCache::insert( metadataKey( session()->mailbox(), uid ),
+                             md->serialized() );
+    return md;
+}
+
+
+/*! Returns a single FETCH response for the message \a m, which is
     trusted to have UID \a uid and MSN \a msn.
 
-    The message must have all necessary content.
+    The response is returned as a list of strings, which should be
+    sent in order. Large literals are separate elements of the list,
+    so they can be sent without being copied.
+
+    The message must have all necessary content, except that \a m may
+    be null if the unchanging parts of the response were found in the
+    SharedCache and nothing else is needed.
+
+    If \a files is non-null, literals which can be sent directly from
+    BlobStore files are described by entries in \a files, and each is
+    represented by an empty string in the returned list.
 */
 
-EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
+EStringList * Fetch::makeFetchResponse( Message * m, uint uid, uint msn,
+                                        List<FetchFile> * files )
 {
+    FetchMetadata * md = d->metadata.find( uid );
+    if ( !md && ( d->rfc822size || d->internaldate || d->envelope ||
+                  d->body || d->bodystructure ) )
+        md = metadata( m, uid );
+
     EStringList l;
     if ( d->uid )
         l.append( "UID " + fn( uid ) );
     if ( d->rfc822size )
-        l.append( "RFC822.SIZE " + fn( m->rfc822Size() ) );
+        l.append( "RFC822.SIZE " + md->items[FetchMetadata::Size] );
     if ( d->flags )
         l.append( "FLAGS (" + flagList( uid ) + ")" );
     if ( d->internaldate )
-        l.append( "INTERNALDATE " + internalDate( m ) );
+        l.append( "INTERNALDATE " + md->items[FetchMetadata::InternalDate] );
     if ( d->envelope )
-        l.append( "ENVELOPE " + envelope( m ) );
+        l.append( "ENVELOPE " + md->items[FetchMetadata::Envelope] );
     if ( d->body )
-        l.append( "BODY " + bodyStructure( m, false ) );
+        l.append( "BODY " + md->items[FetchMetadata::Body] );
     if ( d->bodystructure )
-        l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
+        l.append( "BODYSTRUCTURE " + md->items[FetchMetadata::BodyStructure] );
     if ( d->annotation )
         l.append( "ANNOTATION " + annotation( imap()->user(), uid,
                                               d->entries, d->attribs ) );
@@ -1085,19 +1353,31 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
             l.append( "MODSEQ (" + fn( dd->modseq ) + ")" );
     }
 
+    EStringList * r = new EStringList;
+    EString s;
+    s.appendNumber( msn );
+    s.append( " FETCH (" );
+    s.append( l.join( " " ) );
+    bool first = l.isEmpty();
+
     List< Section >::Iterator it( d->sections );
     while ( it ) {
-        l.append( sectionResponse( it, m ) );
+        EStringList p;
+        sectionResponse( it, m, &p, files );
+        if ( !first )
+            s.append( " " );
+        first = false;
+        s.append( *p.first() );
+        if ( p.count() > 1 ) {
+            r->append( s );
+            r->append( *p.last() );
+            s.truncate();
+        }
         ++it;
     }
 
-    EString r;
-    EString payload = l.join( " " );
-    r.reserve( payload.length() + 30 );
-    r.appendNumber( msn );
-    r.append( " FETCH (" );
-    r.append( payload );
-    r.append( ")" );
+    s.append( ")" );
+    r->append( s );
     return r;
 }
 
@@ -1637,17 +1917,20 @@ void Fetch::pickup()
     uint done = 0;
     while ( ok && !d->remaining.isEmpty() ) {
         uint uid = d->remaining.smallest();
-        Message * m = d->messages.find( uid );
-        if ( d->needsAddresses && !m->hasAddresses() )
-            ok = false;
-        if ( d->needsHeader && !m->hasHeaders() )
-            ok = false;
-        if ( d->needsPartNumbers && !m->hasBytesAndLines() )
-            ok = false;
-        if ( d->needsBody && !m->hasBodies() )
-            ok = false;
-        if ( ( d->rfc822size || d->internaldate ) && !m->hasTrivia() )
-            ok = false;
+        if ( !d->metadata.contains( uid ) ) {
+            Message * m = d->messages.find( uid );
+            bool text = d->wholeMessages && m->hasRfc822();
+            if ( d->needsAddresses && !text && !m->hasAddresses() )
+                ok = false;
+            if ( d->needsHeader && !text && !m->hasHeaders() )
+                ok = false;
+            if ( d->needsPartNumbers && !m->hasBytesAndLines() )
+                ok = false;
+            if ( d->needsBody && !text && !m->hasBodies() )
+                ok = false;
+            if ( ( d->rfc822size || d->internaldate ) && !m->hasTrivia() )
+                ok = false;
+        }
         if ( ok ) {
             d->processed = uid;
             d->remaining.remove( uid );
@@ -1683,11 +1966,53 @@ ImapFetchResponse::ImapFetchResponse( ImapSession * s,
 
 
 EString ImapFetchResponse::text() const
+{
+    return pieces()->join( "" );
+}
+
+
+/*! Returns the response in pieces, so that large literals need not be
+    copied.
+*/
+
+EStringList * ImapFetchResponse::pieces() const
 {
     uint msn = session()->msn( u );
     if ( u && msn )
         return f->makeFetchResponse( f->message( u ), u, msn );
-    return "";
+    return new EStringList;
+}
+
+
+/*! Appends the response to \a w like ImapResponse::appendTo(),
+    except that literals in BlobStore files are appended using
+    Buffer::appendFile(), so that they're sent without being read.
+*/
+
+bool ImapFetchResponse::appendTo( Buffer * w ) const
+{
+    uint msn = session()->msn( u );
+    if ( !u || !msn )
+        return false;
+
+    List<FetchFile> files;
+    EStringList * l = f->makeFetchResponse( f->message( u ), u, msn,
+                                            &files );
+    List<FetchFile>::Iterator file( files );
+    w->append( "* ", 2 );
+    EStringList::Iterator i( l );
+    while ( i ) {
+        if ( i->isEmpty() && file ) {
+            w->appendFile( file->name, file->offset, file->length );
+            ++file;
+        }
+        else {
+            w->append( *i );
+        }
+        ++i;
+    }
+    w->append( "\r\n", 2 );
+    return true;
 }
 
 
@@ -1715,6 +2040,7 @@ void ImapFetchResponse::setSent()
 void Fetch::forget( uint uid )
 {
     d->messages.remove( uid );
+    d->metadata.remove( uid );
 }
 
 
@@ -1790,8 +2116,12 @@ void Fetch::sendModSeqQuery()
 
 void Fetch::enqueue( Query * q )
 {
-    if ( transaction() )
+    if ( transaction() ) {
         transaction()->enqueue( q );
-    else
+    }
+    else {
+        q->allowReplica( session()->mailbox()->id(),
+                         session()->mailbox()->nextModSeq() );
         q->execute();
+    }
 }
@@ -16,6 +16,18 @@ class ImapParser;
 class Transaction;
 
 
+class FetchFile
+    : public Garbage
+{
+public:
+    FetchFile(): offset( 0 ), length( 0 ) {}
+
+    EString name;
+    uint offset;
+    uint length;
+};
+
+
 class Fetch
     : public Command
 {
@@ -33,7 +45,8 @@ public:
     EString annotation( class User *, uint,
                        const EStringList &, const EStringList & );
 
-    EString makeFetchResponse( Message *, uint, uint );
+    EStringList * makeFetchResponse( Message *, uint, uint,
+                                     List<FetchFile> * = 0 );
 
     Message * message( uint ) const;
     void forget( uint );
@@ -54,6 +67,9 @@ private:
 
     void pickup();
 
+    bool findMetadata( uint );
+    class FetchMetadata * metadata( Message *, uint );
+
     void enqueue( Query * q );
 
 private:
@@ -67,6 +83,8 @@ class ImapFetchResponse
 public:
     ImapFetchResponse( ImapSession *, Fetch *, uint );
     EString text() const;
+    EStringList * pieces() const;
+    bool appendTo( class Buffer * ) const;
     void setSent();
 
 private:
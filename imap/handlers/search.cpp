@@ -437,6 +437,8 @@ void Search::execute()
 
         d->query = d->root->query( imap()->user(), s->mailbox(),
                                    s, this, false );
+        d->query->allowReplica( s->mailbox()->id(),
+                                 s->mailbox()->nextModSeq() );
         d->query->execute();
     }
 
@@ -188,6 +188,8 @@ void Sort::execute()
             ++c;
         }
         d->q->setString( t );
+        d->q->allowReplica( session()->mailbox()->id(),
+                            session()->mailbox()->nextModSeq() );
         d->q->execute();
     }
 
@@ -317,6 +317,8 @@ void Status::execute()
                          "from mailbox_messages "
                          "where mailbox=$1 and not seen", this );
         d->unseenCount->bind( 1, d->mailbox->id() );
+        d->unseenCount->allowReplica( d->mailbox->id(),
+                                      d->mailbox->nextModSeq() );
         d->unseenCount->execute();
     }
 
@@ -353,6 +355,8 @@ void Status::execute()
                          "$1::int as mailbox "
                          "from mailbox_messages where mailbox=$1", this );
         d->messageCount->bind( 1, d->mailbox->id() );
+        d->messageCount->allowReplica( d->mailbox->id(),
+                                       d->mailbox->nextModSeq() );
         d->messageCount->execute();
     }
 
@@ -4,11 +4,12 @@
 
 #include "imapsession.h"
 #include "imapparser.h"
+#include "mailbox.h"
 #include "message.h"
 #include "address.h"
 #include "field.h"
 #include "query.h"
-#include "dict.h"
+#include "hashtable.h"
 #include "list.h"
 #include "map.h"
 
@@ -54,7 +55,7 @@ public:
         List<Node> children;
     };
 
-    Dict<Node> nodes;
+    HashDict<Node> nodes;
     List<Node> roots;
 
     List<Node> result;
@@ -165,6 +166,8 @@ void Thread::execute()
                    " and tmid.part='') " + ts + x );
 
         d->find->setString( j );
+        d->find->allowReplica( d->session->mailbox()->id(),
+                               d->session->mailbox()->nextModSeq() );
 
         d->find->execute();
         return;
@@ -272,8 +275,8 @@ void Thread::execute()
 
     // if thread=references is used, we need to jump through extra hoops
     if ( d->threadAlg == ThreadData::References ) {
-        Dict<ThreadData::Node>::Iterator i( d->nodes );
-        UDict<ThreadData::Node> subjects;
+        HashDict<ThreadData::Node>::Iterator i( d->nodes );
+        HashUDict<ThreadData::Node> subjects;
         while ( i ) {
             if ( !i->parent ) {
                 ThreadData::Node * potential = subjects.find( i->subject );
@@ -287,7 +290,7 @@ void Thread::execute()
     }
 
     // set up child lists and the root list
-    Dict<ThreadData::Node>::Iterator i( d->nodes );
+    HashDict<ThreadData::Node>::Iterator i( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
@@ -306,7 +309,7 @@ void Thread::execute()
     // we need to sort root nodes (and children) by idate, so we
     // extend the definition until sorting works: a non-message's
     // idate is the oldest idate of a direct descendant.
-    i = Dict<ThreadData::Node>::Iterator( d->nodes );
+    i = HashDict<ThreadData::Node>::Iterator( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
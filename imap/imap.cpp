@@ -8,6 +8,7 @@
 #include "query.h"
 #include "scope.h"
 #include "estring.h"
+#include "estringlist.h"
 #include "buffer.h"
 #include "mailbox.h"
 #include "selector.h"
@@ -923,13 +924,8 @@ void IMAP::emitResponses()
             r->setSent();
         }
         else if ( !r->sent() && ( can || !r->changesMsn() ) ) {
-            EString t = r->text();
-            if ( !t.isEmpty() ) {
-                w->append( "* ", 2 );
-                w->append( t );
-                w->append( "\r\n", 2 );
+            if ( r->appendTo( w ) )
                 n++;
-            }
             r->setSent();
             any = true;
         }
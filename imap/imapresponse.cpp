@@ -3,6 +3,8 @@
 #include "imapresponse.h"
 
 #include "imapsession.h"
+#include "estringlist.h"
+#include "buffer.h"
 #include "imap.h"
 
 
@@ -145,6 +147,49 @@ EString ImapResponse::text() const
 }
 
 
+/*! Returns the text of the response as a list of strings which,
+    concatenated, make up text(). An empty list means the same as an
+    empty text().
+
+    This implementation returns a list containing just text().
+    Subclasses whose responses may contain large literals reimplement
+    it so that the literals can be sent without being copied into a
+    single string first.
+*/
+
+EStringList * ImapResponse::pieces() const
+{
+    EStringList * l = new EStringList;
+    EString t = text();
+    if ( !t.isEmpty() )
+        l->append( t );
+    return l;
+}
+
+
+/*! Appends the response to \a w, as an untagged response, and
+    returns true. If there is nothing to send, appendTo() does nothing
+    and returns false.
+
+    This implementation appends the pieces() one by one.
+*/
+
+bool ImapResponse::appendTo( Buffer * w ) const
+{
+    EStringList * l = pieces();
+    if ( l->isEmpty() )
+        return false;
+    w->append( "* ", 2 );
+    EStringList::Iterator i( l );
+    while ( i ) {
+        w->append( *i );
+        ++i;
+    }
+    w->append( "\r\n", 2 );
+    return true;
+}
+
+
 /*! Returns true if this response has meaning, and false if it may be
     discarded.
 
@@ -6,6 +6,8 @@
 #include "session.h"
 
 
+class EStringList;
+
 class ImapResponse
     : public Garbage
 {
@@ -20,6 +22,8 @@ public:
     virtual void setSent();
 
     virtual EString text() const;
+    virtual EStringList * pieces() const;
+    virtual bool appendTo( class Buffer * ) const;
 
     virtual bool meaningful() const;
     bool changesMsn() const;
@@ -0,0 +1,326 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "blobstore.h"
+
+#include "configuration.h"
+#include "estringlist.h"
+#include "file.h"
+#include "log.h"
+
+// stat, mkdir
+#include <sys/stat.h>
+// opendir, readdir, closedir
+#include <dirent.h>
+// open
+#include <fcntl.h>
+// read, write, fsync, close, link, unlink, getpid
+#include <unistd.h>
+// memcmp
+#include <string.h>
+// utime
+#include <utime.h>
+// time
+#include <time.h>
+// errno
+#include <errno.h>
+
+
+// aox vacuum leaves files which have been used more recently than
+// this (in seconds) alone, since an Injector may be about to refer
+// to them.
+static const uint gracePeriod = 86400;
+
+
+/*! \class BlobStore blobstore.h
+
+    The BlobStore class keeps the contents of large bodyparts in files
+    in blob-directory, so that they needn't pass through the database
+    each time they're stored, fetched or vacuumed.
+
+    Each file is named by the MD5 hash of its contents (the same hash
+    as in bodyparts.hash), in two levels of subdirectories. A
+    bodyparts row whose blob column is true has null data, and its
+    data is in the file named by its hash.
+
+    Since MD5 collisions can be made to order, a file is never
+    replaced once written, and store() compares the contents of an
+    existing file with the new data before reusing it.
+
+    The Injector calls store() before it inserts the bodyparts row.
+    aox vacuum uses stale() to find files which haven't been used for
+    a while, and calls remove() for those which no row refers to. That
+    also catches files stored by injections which failed later. Since
+    the file's name depends only on its contents, two injectors
+    storing the same data at the same time write the same file.
+*/
+
+
+// Returns true if the file \a n (already chrooted) contains exactly
+// \a data, and false if it differs or can't be read.
+
+static bool sameContents( const EString & n, const EString & data )
+{
+    int fd = ::open( n.cstr(), O_RDONLY );
+    if ( fd < 0 )
+        return false;
+    char b[65536];
+    uint done = 0;
+    bool same = true;
+    while ( same ) {
+        int r = ::read( fd, b, sizeof( b ) );
+        if ( r < 0 && errno == EINTR )
+            continue;
+        if ( r <= 0 ) {
+            same = r == 0 && done == data.length();
+            break;
+        }
+        if ( done + r > data.length() ||
+             memcmp( b, data.data() + done, r ) )
+            same = false;
+        done += r;
+    }
+    ::close( fd );
+    return same;
+}
+
+
+// Reuses the existing file \a n for \a data if that's safe, and
+// returns true if so.
+
+static bool reuse( const EString & n, const EString & data )
+{
+    if ( !sameContents( n, data ) ) {
+        log( "Blob " + n + " differs from new data with the same hash, "
+             "storing the new data in the database", Log::Error );
+        return false;
+    }
+    ::utime( n.cstr(), 0 );
+    return true;
+}
+
+
+/*! Returns true if blob-directory is set, and false if everything is
+    to be stored in the database.
+*/
+
+bool BlobStore::enabled()
+{
+    return !Configuration::text( Configuration::BlobDir ).isEmpty();
+}
+
+
+/*! Returns the size, in bytes, of the smallest bodypart which the
+    Injector should store using store().
+*/
+
+uint BlobStore::threshold()
+{
+    uint t = Configuration::scalar( Configuration::BlobThreshold );
+    if ( t > 4194303 )
+        t = 4194303;
+    if ( !t )
+        t = 1;
+    return t * 1024;
+}
+
+
+/*! Returns the name of the file which holds the blob with \a hash, or
+    an empty string if \a hash isn't a plausible hash. The name is not
+    adjusted for chroot; File::chrooted() does that.
+*/
+
+EString BlobStore::fileName( const EString & hash )
+{
+    EString r;
+    if ( hash.length() < 4 || !hash.boring() || hash.contains( '.' ) )
+        return r;
+    r = Configuration::text( Configuration::BlobDir );
+    if ( !r.endsWith( "/" ) )
+        r.append( "/" );
+    r.append( hash.mid( 0, 2 ) );
+    r.append( "/" );
+    r.append( hash.mid( 2, 2 ) );
+    r.append( "/" );
+    r.append( hash );
+    return r;
+}
+
+
+/*! Returns the size of the blob with \a hash, or 0 if there is no
+    such blob.
+*/
+
+uint BlobStore::size( const EString & hash )
+{
+    EString n( fileName( hash ) );
+    struct stat st;
+    if ( n.isEmpty() || ::stat( File::chrooted( n ).cstr(), &st ) < 0 )
+        return 0;
+    return st.st_size;
+}
+
+
+/*! Stores \a data as the blob named \a hash, which must be the MD5
+    hash of \a data, and returns true if the data is safely on disk
+    afterwards. If the blob exists already and has the same contents,
+    store() only marks it as recently used. If it has different
+    contents, store() leaves it alone and returns false.
+
+    Logs and returns false if anything goes wrong, in which case the
+    caller should store \a data in the database instead.
+
+    This blocks until the data is written and synced, or until the
+    existing file has been read and compared, so the event loop stalls
+    for as long as that takes. The allocator isn't thread-safe, so
+    store() cannot simply run in another thread; blob-threshold keeps
+    small bodyparts out of here.
+*/
+
+bool BlobStore::store( const EString & hash, const EString & data )
+{
+    EString n( fileName( hash ) );
+    if ( n.isEmpty() )
+        return false;
+    n = File::chrooted( n );
+
+    struct stat st;
+    if ( ::stat( n.cstr(), &st ) == 0 )
+        return reuse( n, data );
+
+    uint i = n.length() - hash.length() - 1;
+    EString parent( n.mid( 0, i ) );
+    // the first level may well exist already
+    ::mkdir( parent.mid( 0, i - 3 ).cstr(), 0750 );
+    if ( ::mkdir( parent.cstr(), 0750 ) < 0 && errno != EEXIST ) {
+        log( "Cannot create blob directory " + parent +
+             " (errno " + fn( errno ) + ")", Log::Error );
+        return false;
+    }
+
+    // write to a temporary name and link, so that nothing ever sees
+    // a partial file under the real name, and so that a file written
+    // meanwhile by someone else isn't replaced.
+    EString tmp( n + "." + fn( ::getpid() ) );
+    int fd = ::open( tmp.cstr(), O_WRONLY|O_CREAT|O_TRUNC, 0640 );
+    bool ok = fd >= 0;
+    uint done = 0;
+    while ( ok && done < data.length() ) {
+        int r = ::write( fd, data.data() + done, data.length() - done );
+        if ( r > 0 )
+            done += r;
+        else if ( r < 0 && errno != EINTR )
+            ok = false;
+    }
+    if ( ok && ::fsync( fd ) < 0 )
+        ok = false;
+    if ( fd >= 0 && ::close( fd ) < 0 )
+        ok = false;
+    bool exists = false;
+    if ( ok && ::link( tmp.cstr(), n.cstr() ) < 0 ) {
+        if ( errno == EEXIST )
+            exists = true;
+        else
+            ok = false;
+    }
+
+    if ( !ok )
+        log( "Cannot store blob " + n + " (errno " + fn( errno ) + ")",
+             Log::Error );
+    ::unlink( tmp.cstr() );
+    if ( exists )
+        return reuse( n, data );
+    return ok;
+}
+
+
+/*! Returns the contents of the blob with \a hash, or an empty string
+    if it cannot be read.
+*/
+
+EString BlobStore::fetch( const EString & hash )
+{
+    EString n( fileName( hash ) );
+    if ( n.isEmpty() )
+        return "";
+    File f( n );
+    if ( !f.valid() ) {
+        log( "Cannot read blob " + n, Log::Error );
+        return "";
+    }
+    return f.contents();
+}
+
+
+/*! Removes the blob with \a hash, provided it hasn't been stored or
+    touched by store() recently. The caller must have made sure that
+    no bodyparts row refers to it.
+*/
+
+void BlobStore::remove( const EString & hash )
+{
+    EString n( fileName( hash ) );
+    if ( n.isEmpty() )
+        return;
+    n = File::chrooted( n );
+    struct stat st;
+    if ( ::stat( n.cstr(), &st ) < 0 ||
+         (uint)st.st_mtime + gracePeriod > (uint)::time( 0 ) )
+        return;
+    ::unlink( n.cstr() );
+}
+
+
+// Looks at each entry in the directory \a dir, whose name relative
+// to blob-directory is \a prefix without the slashes, and appends
+// the hashes of the blobs not modified since \a before to \a r.
+
+static void findStale( const EString & dir, const EString & prefix,
+                       uint before, EStringList * r )
+{
+    DIR * d = ::opendir( dir.cstr() );
+    if ( !d )
+        return;
+    struct dirent * e;
+    while ( ( e = ::readdir( d ) ) != 0 ) {
+        EString name( e->d_name );
+        if ( name.startsWith( "." ) )
+            continue;
+        EString path( dir + "/" + name );
+        if ( prefix.length() < 4 ) {
+            if ( name.length() == 2 )
+                findStale( path, prefix + name, before, r );
+            continue;
+        }
+        struct stat st;
+        if ( ::stat( path.cstr(), &st ) < 0 || !S_ISREG( st.st_mode ) ||
+             (uint)st.st_mtime >= before )
+            continue;
+        if ( name.contains( '.' ) )
+            // a temporary file left by a store() which didn't finish
+            ::unlink( path.cstr() );
+        else if ( name.startsWith( prefix ) &&
+                  !BlobStore::fileName( name ).isEmpty() )
+            r->append( name );
+    }
+    ::closedir( d );
+}
+
+
+/*! Returns the hashes of all blobs which haven't been stored or
+    touched by store() recently, and removes any temporary files left
+    behind by an unfinished store(). The caller should find out which
+    of the blobs no bodyparts row refers to, and remove() those.
+*/
+
+EStringList * BlobStore::stale()
+{
+    EStringList * r = new EStringList;
+    EString dir( Configuration::text( Configuration::BlobDir ) );
+    if ( dir.isEmpty() )
+        return r;
+    while ( dir.length() > 1 && dir.endsWith( "/" ) )
+        dir.truncate( dir.length() - 1 );
+    findStale( File::chrooted( dir ), "",
+               (uint)::time( 0 ) - gracePeriod, r );
+    return r;
+}
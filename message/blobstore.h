@@ -0,0 +1,30 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include "estring.h"
+
+class EStringList;
+
+
+class BlobStore
+{
+public:
+    static bool enabled();
+    static uint threshold();
+
+    static EString fileName( const EString & );
+    static uint size( const EString & );
+
+    static bool store( const EString &, const EString & );
+    static EString fetch( const EString & );
+    static void remove( const EString & );
+    static EStringList * stale();
+
+private:
+    BlobStore();
+};
+
+
+#endif
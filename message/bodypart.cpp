@@ -12,6 +12,7 @@
 #include "unknown.h"
 #include "iso2022jp.h"
 #include "mimefields.h"
+#include "blobstore.h"
 
 
 class BodypartData
@@ -34,6 +35,7 @@ public:
     uint numEncodedLines;
 
     EString data;
+    EString blob;
     UString text;
     bool hasText;
     EString error;
@@ -161,6 +163,8 @@ EString::Encoding Bodypart::contentTransferEncoding() const
 
 EString Bodypart::data() const
 {
+    if ( d->data.isEmpty() && !d->blob.isEmpty() )
+        return BlobStore::fetch( d->blob );
     return d->data;
 }
 
@@ -175,6 +179,29 @@ void Bodypart::setData( const EString &s )
 }
 
 
+/*! Returns the hash of the BlobStore file which holds this
+    Bodypart's data(), or an empty string if the data is kept in
+    memory.
+*/
+
+EString Bodypart::blob() const
+{
+    return d->blob;
+}
+
+
+/*! Records that this Bodypart's data() is in the BlobStore file
+    named by \a hash. data() reads the file each time it's called
+    rather than keeping the contents in memory. For use only by
+    Fetcher.
+*/
+
+void Bodypart::setBlob( const EString & hash )
+{
+    d->blob = hash;
+}
+
+
 /*! Returns the text of this Bodypart. MUST NOT be called for non-text
     parts (whose contents are not known to be well-formed text).
 */
@@ -185,7 +212,7 @@ UString Bodypart::text() const
         return d->text;
 
     Utf8Codec c;
-    return c.toUnicode( d->data );
+    return c.toUnicode( data() );
 }
 
 
@@ -294,7 +321,7 @@ EString Bodypart::asText() const
               header()->contentType()->type() == "text" )
         r = c->fromUnicode( text() );
     else
-        r = d->data.e64( 72 );
+        r = data().e64( 72 );
 
     return r;
 }
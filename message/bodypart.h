@@ -30,6 +30,9 @@ public:
     EString data() const;
     void setData( const EString & );
 
+    EString blob() const;
+    void setBlob( const EString & );
+
     Message * message() const;
     void setMessage( Message * );
 
@@ -11,13 +11,15 @@
 #include "postgres.h"
 #include "mailbox.h"
 #include "message.h"
+#include "messagecache.h"
 #include "ustring.h"
 #include "buffer.h"
+#include "configuration.h"
 #include "query.h"
 #include "scope.h"
 #include "timer.h"
 #include "utf.h"
-#include "map.h"
+#include "hashtable.h"
 
 #include <time.h> // time()
 
@@ -41,12 +43,13 @@ public:
           lastBatchStarted( 0 ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
-          partnumbers( 0 ),
-          throttler( 0 )
+          partnumbers( 0 ), raw( 0 ), fallback( false ),
+          throttler( 0 ),
+          replicaMailbox( 0 ), replicaModSeq( 0 )
     {}
 
     List<Message> messages;
-    Map< List<Message> > batch;
+    HashMap< List<Message> > batch;
     EventHandler * owner;
     List<Query> * q;
     Transaction * transaction;
@@ -81,6 +84,10 @@ public:
     Decoder * body;
     Decoder * trivia;
     Decoder * partnumbers;
+    Decoder * raw;
+
+    // true while fetching the parts of messages that raw didn't find
+    bool fallback;
 
     class TriviaDecoder
         : public Decoder
@@ -133,7 +140,19 @@ public:
         bool isDone( Message * ) const;
     };
 
+    class RawDecoder
+        : public Decoder
+    {
+    public:
+        RawDecoder( FetcherData * fd ): Decoder( fd ) {}
+        void decode( Message *, List<Row> * );
+        void setDone( Message * );
+        bool isDone( Message * ) const;
+    };
+
     Buffer * throttler;
+    uint replicaMailbox;
+    int64 replicaModSeq;
 };
 
 
@@ -280,6 +299,10 @@ void Fetcher::start()
         n++;
         what.append( "bytes/lines" );
     }
+    if ( d->raw ) {
+        n++;
+        what.append( "rfc822" );
+    }
 
     if ( n < 1 || d->messages.isEmpty() ) {
         // nothing to do.
@@ -293,7 +316,7 @@ void Fetcher::start()
     // we'll use two steps. first, we find a good size for the first
     // batch.
     d->batchSize = 4096;
-    if ( d->body )
+    if ( d->body || d->raw )
         d->batchSize = d->batchSize / 2;
     if ( d->otherheader )
         d->batchSize = d->batchSize * 2 / 3;
@@ -318,16 +341,23 @@ void Fetcher::start()
 void Fetcher::waitForEnd()
 {
     List<FetcherData::Decoder> decoders;
-    if ( d->addresses )
-        decoders.append( d->addresses );
-    if ( d->otherheader )
-        decoders.append( d->otherheader );
-    if ( d->body )
-        decoders.append( d->body );
-    if ( d->trivia )
-        decoders.append( d->trivia );
-    if ( d->partnumbers )
-        decoders.append( d->partnumbers );
+    if ( d->raw && !d->fallback ) {
+        decoders.append( d->raw );
+    }
+    else {
+        if ( d->addresses )
+            decoders.append( d->addresses );
+        if ( d->otherheader )
+            decoders.append( d->otherheader );
+        if ( d->body )
+            decoders.append( d->body );
+    }
+    if ( !d->fallback ) {
+        if ( d->trivia )
+            decoders.append( d->trivia );
+        if ( d->partnumbers )
+            decoders.append( d->partnumbers );
+    }
 
     List<FetcherData::Decoder>::Iterator i( decoders );
     while ( i ) {
@@ -336,7 +366,7 @@ void Fetcher::waitForEnd()
         ++i;
     }
 
-    Map< List<Message> >::Iterator bi( d->batch );
+    HashMap< List<Message> >::Iterator bi( d->batch );
     while ( bi ) {
         List<Message>::Iterator li( *bi );
         ++bi;
@@ -344,13 +374,48 @@ void Fetcher::waitForEnd()
             Message * m = li;
             ++li;
 
+            // the fallback decoders didn't look at the messages
+            // whose stored text was found
+            if ( d->fallback && m->hasRfc822() )
+                continue;
+
             List<FetcherData::Decoder>::Iterator di( decoders );
             while ( di ) {
                 di->setDone( m );
                 ++di;
             }
+            MessageCache::update( m );
+        }
+    }
+
+    if ( d->raw && !d->fallback ) {
+        bool missing = false;
+        HashMap< List<Message> >::Iterator bi( d->batch );
+        while ( bi && !missing ) {
+            List<Message>::Iterator li( *bi );
+            ++bi;
+            while ( li && !missing ) {
+                Message * m = li;
+                ++li;
+                if ( !m->hasRfc822() &&
+                     !( m->hasAddresses() && m->hasHeaders() &&
+                        m->hasBodies() ) )
+                    missing = true;
+            }
+        }
+        if ( missing ) {
+            if ( !d->addresses )
+                d->addresses = new FetcherData::AddressDecoder( d );
+            if ( !d->otherheader )
+                d->otherheader = new FetcherData::HeaderDecoder( d );
+            if ( !d->body )
+                d->body = new FetcherData::BodyDecoder( d );
+            d->fallback = true;
+            makeQueries();
+            return;
         }
     }
+    d->fallback = false;
 
     if ( d->messages.isEmpty() ) {
         d->state = Done;
@@ -358,7 +423,7 @@ void Fetcher::waitForEnd()
             d->transaction->commit();
     }
     else if ( d->throttler && d->throttler->size() > 1024*1024 ) {
-        (void)new Timer( this, 2 );
+        (void)new Timer( this, 250, Timer::Milliseconds );
     }
     else {
         prepareBatch();
@@ -469,7 +534,7 @@ void Fetcher::prepareBatch()
 void Fetcher::bindIds( Query * query, uint n, Type type )
 {
     IntegerSet l;
-    Map< List<Message> >::Iterator bi( d->batch );
+    HashMap< List<Message> >::Iterator bi( d->batch );
     while ( bi ) {
         List<Message>::Iterator li( *bi );
         ++bi;
@@ -498,7 +563,15 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
                 if ( m->hasTrivia() )
                     need = false;
                 break;
+            case Rfc822:
+                if ( m->hasRfc822() ||
+                     ( m->hasAddresses() && m->hasHeaders() &&
+                       m->hasBodies() ) )
+                    need = false;
+                break;
             }
+            if ( d->fallback && m->hasRfc822() )
+                need = false;
             if ( need && m->databaseId() )
                 l.add( m->databaseId() );
         }
@@ -522,7 +595,21 @@ void Fetcher::makeQueries()
     Query * q = 0;
     EString r;
 
-    if ( d->partnumbers && !d->body ) {
+    // if we're fetching the stored text, then the addresses, headers
+    // and bodies are fetched in a second round, only for the messages
+    // that turn out to have no stored text.
+    bool first = !d->fallback;
+    bool parts = !d->raw || d->fallback;
+
+    if ( first && d->raw ) {
+        q = new Query( "select message, data from raw_messages "
+                       "where message=any($1)", d->raw );
+        bindIds( q, 1, Rfc822 );
+        submit( q );
+        d->raw->q = q;
+    }
+
+    if ( first && d->partnumbers && !d->body ) {
         // body (below) will handle this as a side effect
         q = new Query( "select message, part, bytes, lines "
                        "from part_numbers where message=any($1) "
@@ -533,7 +620,7 @@ void Fetcher::makeQueries()
         d->partnumbers->q = q;
     }
 
-    if ( d->trivia ) {
+    if ( first && d->trivia ) {
         // don't need to order this - just one row per message
         q = new Query( "select id as message, idate, rfc822size "
                        "from messages where id=any($1)", d->trivia );
@@ -542,7 +629,7 @@ void Fetcher::makeQueries()
         d->trivia->q = q;
     }
 
-    if ( d->addresses ) {
+    if ( parts && d->addresses ) {
         q = new Query( "select af.message, "
                        "af.part, af.position, af.field, af.number, "
                        "a.name, a.localpart, a.domain "
@@ -556,7 +643,7 @@ void Fetcher::makeQueries()
         d->addresses->q = q;
     }
 
-    if ( d->otherheader ) {
+    if ( parts && d->otherheader ) {
         q = new Query( "select hf.message, hf.part, hf.position, "
                        "fn.name, hf.value from header_fields hf "
                        "join field_names fn on (hf.field=fn.id) "
@@ -568,9 +655,11 @@ void Fetcher::makeQueries()
         d->otherheader->q = q;
     }
 
-    if ( d->body ) {
+    if ( parts && d->body ) {
         q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
-                       "bp.bytes as rawbytes, pn.bytes, pn.lines "
+                       "bp.compressed, bp.blob, bp.hash, "
+                       "bp.bytes as rawbytes, "
+                       "pn.bytes, pn.lines "
                        "from part_numbers pn "
                        "left join bodyparts bp on (pn.bodypart=bp.id) "
                        "where pn.message=any($1) "
@@ -752,7 +841,12 @@ void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
     if ( !part.endsWith( ".rfc822" ) ) {
         Bodypart * bp = m->bodypart( part, true );
 
-        if ( !r->isNull( "data" ) )
+        if ( !r->isNull( "blob" ) && r->getBoolean( "blob" ) )
+            bp->setBlob( r->getEString( "hash" ) );
+        else if ( !r->isNull( "data" ) && !r->isNull( "compressed" ) &&
+             r->getBoolean( "compressed" ) )
+            bp->setData( r->getEString( "data" ).uncompressed() );
+        else if ( !r->isNull( "data" ) )
             bp->setData( r->getEString( "data" ) );
         else if ( !r->isNull( "text" ) )
             bp->setText( r->getUString( "text" ) );
@@ -843,7 +937,32 @@ bool FetcherData::TriviaDecoder::isDone( Message * m ) const
 }
 
 
-/*! Instructs this Fetcher to fetch data of type \a t. */
+void FetcherData::RawDecoder::decode( Message * m, List<Row> * rows )
+{
+    m->setRfc822( rows->firstElement()->getEString( "data" ).uncompressed() );
+}
+
+
+void FetcherData::RawDecoder::setDone( Message * )
+{
+    // if there was no stored text, the other decoders will do the work
+}
+
+
+bool FetcherData::RawDecoder::isDone( Message * m ) const
+{
+    return m->hasRfc822();
+}
+
+
+/*! Instructs this Fetcher to fetch data of type \a t.
+
+    Rfc822 is special: It fetches enough that Message::rfc822() and
+    Message::body() work. If store-raw-messages is enabled, the
+    Fetcher looks for the stored copy of each message first, and
+    fetches Addresses, OtherHeader and Body only for the messages
+    that have none. Otherwise it's equivalent to those three.
+*/
 
 void Fetcher::fetch( Type t )
 {
@@ -870,6 +989,16 @@ void Fetcher::fetch( Type t )
         if ( !d->partnumbers )
             d->partnumbers = new FetcherData::PartNumberDecoder( d );
         break;
+    case Rfc822:
+        if ( !Configuration::toggle( Configuration::StoreRawMessages ) ) {
+            fetch( Addresses );
+            fetch( OtherHeader );
+            fetch( Body );
+        }
+        else if ( !d->raw ) {
+            d->raw = new FetcherData::RawDecoder( d );
+        }
+        break;
     }
 }
 
@@ -896,6 +1025,9 @@ bool Fetcher::fetching( Type t ) const
     case PartNumbers:
         return d->partnumbers != 0;
         break;
+    case Rfc822:
+        return d->raw != 0;
+        break;
     }
     return false; // not reached
 }
@@ -913,14 +1045,32 @@ void Fetcher::setTransaction( class Transaction * t )
 }
 
 
+/*! Records that the queries done by this Fetcher may be sent to a
+    hot standby which has seen \a modseq in \a mailbox. This has no
+    effect if setTransaction() is used.
+
+    \sa Query::allowReplica()
+*/
+
+void Fetcher::allowReplica( uint mailbox, int64 modseq )
+{
+    d->replicaMailbox = mailbox;
+    d->replicaModSeq = modseq;
+}
+
+
 /*! This internal helper makes sure \a q is executed by the
     database.
 */
 
 void Fetcher::submit( Query * q )
 {
-    if ( d->transaction )
+    if ( d->transaction ) {
         d->transaction->enqueue( q );
-    else
+    }
+    else {
+        if ( d->replicaMailbox )
+            q->allowReplica( d->replicaMailbox, d->replicaModSeq );
         q->execute();
+    }
 }
@@ -28,7 +28,8 @@ public:
         OtherHeader,
         Body,
         PartNumbers,
-        Trivia
+        Trivia,
+        Rfc822
     };
 
     void addMessage( Message * );
@@ -42,6 +43,7 @@ public:
     bool done() const;
 
     void setTransaction( class Transaction * );
+    void allowReplica( uint, int64 );
 
 private:
     class FetcherData * d;
@@ -2,7 +2,7 @@
 
 #include "helperrowcreator.h"
 
-#include "dict.h"
+#include "hashtable.h"
 #include "scope.h"
 #include "allocator.h"
 #include "transaction.h"
@@ -45,7 +45,7 @@ public:
     EString e;
     bool done;
     bool inserted;
-    Dict<uint> names;
+    HashDict<uint> names;
 };
 
 
@@ -433,7 +433,7 @@ Query * AnnotationNameCreator::makeCopy()
     for its work.
 */
 
-AddressCreator::AddressCreator( Dict<Address> * addresses,
+AddressCreator::AddressCreator( HashDict<Address> * addresses,
                                 Transaction * t )
     : HelperRowCreator( "addresses", t, "addresses_nld_key" ),
       a( addresses ), bulk( false ), decided( false ),
@@ -448,7 +448,7 @@ AddressCreator::AddressCreator( Dict<Address> * addresses,
 
 AddressCreator::AddressCreator( Address * address, class Transaction * t )
     : HelperRowCreator( "addresses", t, "addresses_nld_key" ),
-      a( new Dict<Address> ), bulk( false ), decided( false ),
+      a( new HashDict<Address> ), bulk( false ), decided( false ),
       base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
 {
     a->insert( AddressCreator::key( address ), address );
@@ -464,7 +464,7 @@ AddressCreator::AddressCreator( Address * address, class Transaction * t )
 AddressCreator::AddressCreator( List<Address> * addresses,
                                 class Transaction * t )
     : HelperRowCreator( "addresses", t, "addresses_nld_key" ),
-      a( new Dict<Address> ), bulk( false ), decided( false ),
+      a( new HashDict<Address> ), bulk( false ), decided( false ),
       base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
 {
     List<Address>::Iterator address( addresses );
@@ -484,7 +484,7 @@ AddressCreator::AddressCreator( List<Address> * addresses,
     think of a good alternative right now.
 */
 
-uint AddressCreator::param( Dict<uint> * b, const EString & s,
+uint AddressCreator::param( HashDict<uint> * b, const EString & s,
                             uint & n,
                             Query * q )
 {
@@ -508,10 +508,10 @@ Query * AddressCreator::makeSelect()
     EString s = "select id, name, localpart, domain from addresses where ";
     Query * q = new Query( "", this );
     uint n = 1;
-    Dict<uint> binds;
+    HashDict<uint> binds;
     PgUtf8Codec p;
     bool first = true;
-    Dict<Address>::Iterator i( a );
+    HashDict<Address>::Iterator i( a );
     asked.clear();
     while ( i && n < 128 ) {
         if ( !i->id() ) {
@@ -619,7 +619,7 @@ void AddressCreator::execute()
     Scope x( log() );
     if ( !decided ) {
         uint c = 0;
-        Dict<Address>::Iterator i( a );
+        HashDict<Address>::Iterator i( a );
         while ( c < useTempTable && i ) {
             if ( !i->id() )
                 ++c;
@@ -644,7 +644,7 @@ void AddressCreator::execute()
                                   "domain text )", 0 ) );
         Query * q = new Query( "copy na (id, f, name,localpart,domain) "
                                "from stdin with binary", this );
-        Dict<Address>::Iterator i( a );
+        HashDict<Address>::Iterator i( a );
         while ( i ) {
             if ( !i->id() ) {
                 q->bind( 1, 0 );
@@ -719,7 +719,7 @@ void AddressCreator::execute()
 ThreadRootCreator::ThreadRootCreator( List<ThreadRootCreator::Message> * l,
                                       Transaction * t )
     : HelperRowCreator( "thread_roots", t, "thread_roots_messageid_key" ),
-      messages( l ), nodes( new Dict<ThreadNode> ), first( true )
+      messages( l ), nodes( new HashDict<ThreadNode> ), first( true )
 {
     List<Message>::Iterator m( messages );
     while ( m ) {
@@ -780,7 +780,7 @@ Query * ThreadRootCreator::makeSelect()
 {
     Query * q = 0;
     EStringList l;
-    Dict<ThreadNode>::Iterator i( nodes );
+    HashDict<ThreadNode>::Iterator i( nodes );
     if ( first ) {
         // the first time around we might find IDs
         while ( i ) {
@@ -824,7 +824,7 @@ Query * ThreadRootCreator::makeCopy()
 {
     Query * q = new Query( "copy thread_roots( messageid ) "
                            "from stdin with binary", 0 );
-    Dict<ThreadNode>::Iterator i( nodes );
+    HashDict<ThreadNode>::Iterator i( nodes );
     while ( i ) {
         if ( !i->parent && !i->trid ) {
             q->bind( 1, i->id );
@@ -858,7 +858,7 @@ void ThreadRootCreator::add( const EString & id, uint i )
         if ( n->trid && n->trid != i ) {
             uint old = n->trid;
             if ( !merged.contains( old ) ) {
-                Dict<ThreadNode>::Iterator o( nodes );
+                HashDict<ThreadNode>::Iterator o( nodes );
                 while ( o ) {
                     if ( o->trid == old )
                         o->trid = i;
@@ -7,7 +7,7 @@
 #include "estringlist.h"
 #include "ustringlist.h"
 #include "integerset.h"
-#include "dict.h"
+#include "hashtable.h"
 
 
 class HelperRowCreator
@@ -88,7 +88,7 @@ class AddressCreator
     : public HelperRowCreator
 {
 public:
-    AddressCreator( Dict<Address> *, class Transaction * );
+    AddressCreator( HashDict<Address> *, class Transaction * );
     AddressCreator( Address *, class Transaction * );
     AddressCreator( List<Address> *, class Transaction * );
 
@@ -102,10 +102,10 @@ private:
     Query * makeCopy();
 
 private:
-    uint param( Dict<uint> *, const EString &, uint &, Query * );
+    uint param( HashDict<uint> *, const EString &, uint &, Query * );
 
 private:
-    Dict<Address> * a;
+    HashDict<Address> * a;
     List<Address> asked;
     bool bulk;
     bool decided;
@@ -148,7 +148,7 @@ public:
         uint trid;
     };
 
-    Dict<ThreadNode> * threadNodes() const { return nodes; }
+    HashDict<ThreadNode> * threadNodes() const { return nodes; }
 
     uint id( const EString & );
 
@@ -160,7 +160,7 @@ private:
 
 private:
     List<Message> * messages;
-    Dict<ThreadNode> * nodes;
+    HashDict<ThreadNode> * nodes;
     bool first;
     IntegerSet merged;
 };
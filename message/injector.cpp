@@ -4,6 +4,7 @@
 
 #include "map.h"
 #include "dict.h"
+#include "hashtable.h"
 #include "flag.h"
 #include "query.h"
 #include "timer.h"
@@ -15,6 +16,7 @@
 #include "datefield.h"
 #include "mimefields.h"
 #include "messagecache.h"
+#include "blobstore.h"
 #include "helperrowcreator.h"
 #include "addressfield.h"
 #include "transaction.h"
@@ -23,6 +25,7 @@
 #include "session.h"
 #include "scope.h"
 #include "graph.h"
+#include "configuration.h"
 #include "html.h"
 #include "md5.h"
 #include "utf.h"
@@ -38,7 +41,8 @@ struct BodypartRow
     : public Garbage
 {
     BodypartRow()
-        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 )
+        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 ),
+          compressed( false ), blob( false )
     {}
 
     uint id;
@@ -46,6 +50,8 @@ struct BodypartRow
     EString * text;
     EString * data;
     uint bytes;
+    bool compressed;
+    bool blob;
     List<Bodypart> bodyparts;
 };
 
@@ -61,8 +67,10 @@ enum State {
     ConvertingThreadIndex,
     CreatingThreadRoots,
     InsertingBodyparts,
-    SelectingMessageIds, SelectingUids,
+    SelectingMessageIds,
     InsertingMessages,
+    SelectingUids,
+    InsertingMailboxMessages,
     AwaitingCompletion, Done
 };
 
@@ -80,7 +88,7 @@ public:
           substate( 0 ), subtransaction( 0 ),
           findParents( 0 ), findReferences( 0 ),
           findBlah( 0 ), findMessagesInOutlookThreads( 0 ),
-          threads( 0 )
+          threads( 0 ), batchable( false ), shared( false ), batch( 0 )
     {}
 
     struct Delivery
@@ -112,7 +120,7 @@ public:
     EStringList fields;
     EStringList annotationNames;
     UStringList baseSubjects;
-    Dict<Address> addresses;
+    HashDict<Address> addresses;
     List< ::Mailbox > * mailboxesCreated;
 
     struct Mailbox
@@ -136,7 +144,7 @@ public:
     uint substate;
     Transaction * subtransaction;
 
-    Dict<BodypartRow> hashes;
+    HashDict<BodypartRow> hashes;
     List<BodypartRow> bodyparts;
 
     // for convertInReplyTo()
@@ -202,9 +210,162 @@ public:
     };
 
     ThreadRootCreator * threads;
+
+    bool batchable;
+    bool shared;
+    class InjectionBatch * batch;
 };
 
 
+// This helper collects injections which arrive within a few
+// milliseconds of each other, and injects all of them using a single
+// Injector, so that they share one transaction (and one commit).
+
+class InjectionBatch
+    : public EventHandler
+{
+public:
+    InjectionBatch()
+        : EventHandler(), injector( 0 ), messages( 0 ), started( false ) {
+        setLog( new Log );
+    }
+
+    static InjectionBatch * join( Injector * );
+
+    void start();
+    void execute();
+
+    List<Injector> members;
+    Injector * injector;
+    uint messages;
+    bool started;
+};
+
+
+static InjectionBatch * pendingBatch = 0;
+
+
+/*! Adds \a i to the batch which is currently collecting injections,
+    creating one if necessary, and returns that batch. Returns a null
+    pointer if batching is disabled.
+*/
+
+InjectionBatch * InjectionBatch::join( Injector * i )
+{
+    uint window =
+        Configuration::scalar( Configuration::InjectionBatchWindow );
+    if ( !window )
+        return 0;
+
+    if ( !pendingBatch ) {
+        pendingBatch = new InjectionBatch;
+        (void)new Timer( pendingBatch, window, Timer::Milliseconds );
+    }
+
+    InjectionBatch * b = pendingBatch;
+    b->members.append( i );
+    b->messages += i->d->injectables.count() + i->d->deliveries.count();
+    if ( b->messages >=
+         Configuration::scalar( Configuration::InjectionBatchSize ) )
+        b->start();
+    return b;
+}
+
+
+/*! Starts injecting all the members' messages. If there's only one
+    member, it simply does its own work. Does nothing if the batch has
+    been started already, e.g. when the window's timer runs out after
+    the batch was started because it was full.
+*/
+
+void InjectionBatch::start()
+{
+    if ( pendingBatch == this )
+        pendingBatch = 0;
+    if ( started )
+        return;
+    started = true;
+
+    if ( members.count() == 1 ) {
+        Injector * i = members.first();
+        i->d->batch = 0;
+        i->d->batchable = false;
+        i->execute();
+        return;
+    }
+
+    Scope x( log() );
+    log( "Injecting " + fn( messages ) + " messages from " +
+         fn( members.count() ) + " sources together" );
+
+    injector = new Injector( this );
+    injector->setLog( log() );
+    injector->d->shared = true;
+    List<Injector>::Iterator i( members );
+    while ( i ) {
+        injector->addInjection( &i->d->injectables );
+        List<InjectorData::Delivery>::Iterator di( i->d->deliveries );
+        while ( di ) {
+            injector->d->deliveries.append( di );
+            ++di;
+        }
+        HashDict<Address>::Iterator ai( i->d->addresses );
+        while ( ai ) {
+            injector->addAddress( ai );
+            ++ai;
+        }
+        ++i;
+    }
+    injector->execute();
+}
+
+
+void InjectionBatch::execute()
+{
+    if ( !injector ) {
+        // our timer has run out (or we handed our only member back)
+        start();
+        return;
+    }
+
+    if ( !injector->done() || members.isEmpty() )
+        return;
+
+    bool failed = injector->failed();
+    if ( failed ) {
+        // something in one of the members' messages made the shared
+        // transaction fail. we don't know which, so we forget any
+        // addresses created in it and retry each member on its own.
+        log( "Batched injection failed (" + injector->error() +
+             "), retrying individually" );
+        Transaction * t = injector->d->transaction;
+        if ( t && !t->done() )
+            t->rollback();
+        HashDict<Address>::Iterator ai( injector->d->addresses );
+        while ( ai ) {
+            ai->setId( 0 );
+            ++ai;
+        }
+    }
+
+    List<Injector>::Iterator i( members );
+    while ( i ) {
+        Injector * m = i;
+        ++i;
+        m->d->batch = 0;
+        if ( failed ) {
+            m->d->batchable = false;
+        }
+        else {
+            ::successes->tick();
+            m->d->state = Done;
+        }
+        m->execute();
+    }
+    members.clear();
+}
+
+
 /*! \class Injector injector.h
     Stores message objects in the database.
 
@@ -324,6 +485,22 @@ void Injector::setTransaction( class Transaction * t )
 }
 
 
+/*! Permits this Injector to share its transaction with other
+    Injectors that are started within injection-batch-window
+    milliseconds, so that several injections need only one commit.
+    The owner is still notified separately, and if the shared
+    transaction fails, this Injector retries on its own.
+
+    Batching is used only if the Injector has no transaction of its
+    own (see setTransaction()).
+*/
+
+void Injector::allowBatching()
+{
+    d->batchable = true;
+}
+
+
 void Injector::execute()
 {
     Scope x( log() );
@@ -341,14 +518,23 @@ void Injector::execute()
         last = d->state;
         switch ( d->state ) {
         case Inactive:
+            if ( d->batch )
+                return;
+            if ( d->batchable && !d->transaction ) {
+                d->batch = InjectionBatch::join( this );
+                if ( d->batch )
+                    return;
+            }
             findMessages();
             logDescription();
             if ( d->messages.isEmpty() ) {
                 d->state = Done;
             }
             else {
-                if ( !d->transaction )
+                if ( !d->transaction ) {
                     d->transaction = new Transaction( this );
+                    d->transaction->setPriority( Query::Delivery );
+                }
                 next();
             }
             break;
@@ -392,15 +578,20 @@ void Injector::execute()
             selectMessageIds();
             break;
 
-        case SelectingUids:
-            selectUids();
-            break;
-
         case InsertingMessages:
             insertMessages();
             insertDeliveries();
             insertThreadIndexes();
             next();
+            break;
+
+        case SelectingUids:
+            selectUids();
+            break;
+
+        case InsertingMailboxMessages:
+            insertMailboxMessages();
+            next();
             if ( !d->mailboxes.isEmpty() ) {
                 cache();
                 Mailbox::refreshMailboxes( d->transaction );
@@ -413,10 +604,11 @@ void Injector::execute()
                 return;
 
             if ( d->failed || d->transaction->failed() ) {
-                ::failures->tick();
+                if ( !d->shared )
+                    ::failures->tick();
                 Cache::clearAllCaches( false );
             }
-            else {
+            else if ( !d->shared ) {
                 ::successes->tick();
             }
 
@@ -432,7 +624,7 @@ void Injector::execute()
     }
     while ( last != d->state && d->state != Done && !d->failed );
 
-    if ( d->state == Done && d->owner ) {
+    if ( done() && d->owner ) {
         if ( d->failed )
             log( "Injection failed: " + error() );
         else
@@ -1143,10 +1335,12 @@ void Injector::insertBodyparts()
                 new Query( "create temporary table bp ("
                            "bid integer, bytes integer, "
                            "hash text, text text, data bytea, "
+                           "compressed boolean, blob boolean, "
                            "i integer, n boolean default 'f')", 0 );
 
             Query * copy =
-                new Query( "copy bp (bytes,hash,text,data,i) "
+                new Query( "copy bp "
+                           "(bytes,hash,text,data,compressed,blob,i) "
                            "from stdin with binary", this );
 
             uint i = 0;
@@ -1164,7 +1358,9 @@ void Injector::insertBodyparts()
                     copy->bind( 4, *br->data );
                 else
                     copy->bindNull( 4 );
-                copy->bind( 5, i++ );
+                copy->bind( 5, br->compressed );
+                copy->bind( 6, br->blob );
+                copy->bind( 7, i++ );
                 copy->submitLine();
 
                 ++bi;
@@ -1178,10 +1374,25 @@ void Injector::insertBodyparts()
         }
 
         if ( d->substate == 2 ) {
+            // an existing row matches if its contents are the same,
+            // however either row is stored. plain data is compared
+            // with plain data and compressed with compressed, and
+            // BlobStore::store() has checked that blobs with the same
+            // hash are the same. a new part stored in some other form
+            // matches a plain row with the same size whose data has
+            // the new part's hash, so that we needn't send the
+            // uncompressed data along too.
             Query * setId =
                 new Query( "update bp set bid=b.id from bodyparts b where "
                            "bp.hash=b.hash and not bp.text is distinct from "
-                           "b.text and not bp.data is distinct from b.data",
+                           "b.text and "
+                           "(b.blob is not true and b.compressed is not true "
+                           "and (not bp.data is distinct from b.data "
+                           "or (bp.compressed or bp.blob) "
+                           "and b.bytes=bp.bytes and md5(b.data)=bp.hash) "
+                           "or b.compressed and bp.compressed "
+                           "and b.data=bp.data "
+                           "or b.blob and bp.blob)",
                            0 );
 
             Query * setNew =
@@ -1190,8 +1401,8 @@ void Injector::insertBodyparts()
 
             d->insert =
                 new Query( "insert into bodyparts "
-                           "(id,bytes,hash,text,data) "
-                           "select bid,bytes,hash,text,data "
+                           "(id,bytes,hash,text,data,compressed,blob) "
+                           "select bid,bytes,hash,text,data,compressed,blob "
                            "from bp where n", this );
 
             d->substate++;
@@ -1336,6 +1547,24 @@ void Injector::addBodypartRow( Bodypart * b )
         br->text = text;
         br->data = data;
         br->bytes = b->numBytes();
+        // store() blocks while it writes and syncs the file, which is
+        // why blob-threshold defaults to a fairly large size.
+        if ( data && BlobStore::enabled() &&
+             data->length() >= BlobStore::threshold() &&
+             BlobStore::store( hash, *data ) ) {
+            br->data = 0;
+            br->blob = true;
+        }
+        else if ( data &&
+                  Configuration::toggle( Configuration::CompressBodyparts ) ) {
+            // images and the like are usually compressed already, and
+            // aren't worth inflating each time they're fetched.
+            EString c( data->compressed() );
+            if ( c.length() < data->length() - data->length() / 8 ) {
+                br->data = new EString( c );
+                br->compressed = true;
+            }
+        }
         d->hashes.insert( hash, br );
         d->bodyparts.append( br );
     }
@@ -1368,15 +1597,28 @@ void Injector::selectMessageIds()
                      "(id,rfc822size,idate,thread_root) "
                      "from stdin with binary", this );
 
+    Query * raw = 0;
+    if ( Configuration::toggle( Configuration::StoreRawMessages ) )
+        raw = new Query( "copy raw_messages (message,data) "
+                         "from stdin with binary", 0 );
+
     List<Injectee>::Iterator m( d->messages );
     while ( m && d->select->hasResults() ) {
         Row * r = d->select->nextRow();
         m->setDatabaseId( r->getInt( "id" ) );
         copy->bind( 1, m->databaseId() );
+        EString text;
+        if ( raw || !m->hasTrivia() )
+            text = m->rfc822();
         if ( !m->hasTrivia() ) {
-            m->setRfc822Size( m->rfc822().length() );
+            m->setRfc822Size( text.length() );
             m->setTriviaFetched( true );
         }
+        if ( raw ) {
+            raw->bind( 1, m->databaseId() );
+            raw->bind( 2, text.compressed() );
+            raw->submitLine();
+        }
         copy->bind( 2, m->rfc822Size() );
         copy->bind( 3, internalDate( m ) );
         uint tr = d->threads->id( m->header()->messageId() );
@@ -1389,6 +1631,8 @@ void Injector::selectMessageIds()
     }
 
     d->transaction->enqueue( copy );
+    if ( raw )
+        d->transaction->enqueue( raw );
 
     next();
 }
@@ -1422,6 +1666,16 @@ void Injector::selectUids()
     // mailboxes, we hold a write lock on the mailboxes during
     // injection; thus, the Injectors try to acquire locks in the same
     // order to avoid deadlock.
+    //
+    // The lock has to be held until we commit: if two transactions
+    // could allocate UIDs in the same mailbox concurrently, the one
+    // with the higher UIDs might commit first, and a client could
+    // see uidnext move past a message that isn't visible yet. But
+    // we can at least make sure that we take the lock as late as
+    // possible. Everything that doesn't depend on the UIDs (the
+    // messages, bodyparts, header fields, etc.) is already queued by
+    // the time we get here, so the lock is held only while the
+    // mailbox_messages rows are inserted and the transaction commits.
 
     if ( !d->lockUidnext ) {
         if ( d->mailboxes.isEmpty() ) {
@@ -1512,7 +1766,9 @@ void Injector::selectUids()
 }
 
 
-/*! Injects messages into the correct tables. */
+/*! Injects messages into the correct tables, except for the
+    mailbox-specific tables, which insertMailboxMessages() handles.
+*/
 
 void Injector::insertMessages()
 {
@@ -1528,25 +1784,11 @@ void Injector::insertMessages()
                    "from stdin with binary", 0 );
     Query * qd =
         new Query( "copy date_fields (message,value) from stdin", 0 );
-
-    Query * qm =
-        new Query( "copy mailbox_messages "
-                   "(mailbox,uid,message,modseq,seen,deleted) "
-                   "from stdin with binary", 0 );
-    Query * qf =
-        new Query( "copy flags (mailbox,uid,flag) "
-                   "from stdin with binary", 0 );
-    Query * qn =
-        new Query( "copy annotations (mailbox,uid,name,value,owner) "
-                   "from stdin with binary", 0 );
     Query * qw =
         new Query( "copy unparsed_messages (bodypart) "
                    "from stdin with binary", 0 );
 
-    uint flags = 0;
     uint wrapped = 0;
-    uint mailboxes = 0;
-    uint annotations = 0;
 
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
@@ -1605,6 +1847,36 @@ void Injector::insertMessages()
         ++it;
     }
 
+    d->transaction->enqueue( qp );
+    d->transaction->enqueue( qh );
+    d->transaction->enqueue( qa );
+    d->transaction->enqueue( qd );
+    if ( wrapped )
+        d->transaction->enqueue( qw );
+}
+
+
+/*! Inserts the mailbox_messages, flags and annotations rows for each
+    message, using the UIDs and modseqs allocated by selectUids().
+*/
+
+void Injector::insertMailboxMessages()
+{
+    Query * qm =
+        new Query( "copy mailbox_messages "
+                   "(mailbox,uid,message,modseq,seen,deleted) "
+                   "from stdin with binary", 0 );
+    Query * qf =
+        new Query( "copy flags (mailbox,uid,flag) "
+                   "from stdin with binary", 0 );
+    Query * qn =
+        new Query( "copy annotations (mailbox,uid,name,value,owner) "
+                   "from stdin with binary", 0 );
+
+    uint flags = 0;
+    uint mailboxes = 0;
+    uint annotations = 0;
+
     List<Injectee>::Iterator imi( d->injectables );
     while ( imi ) {
         Injectee * m = imi;
@@ -1626,18 +1898,12 @@ void Injector::insertMessages()
         }
     }
 
-    d->transaction->enqueue( qp );
-    d->transaction->enqueue( qh );
-    d->transaction->enqueue( qa );
-    d->transaction->enqueue( qd );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
         d->transaction->enqueue( qf );
     if ( annotations )
         d->transaction->enqueue( qn );
-    if ( wrapped )
-        d->transaction->enqueue( qw );
 }
 
 
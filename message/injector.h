@@ -62,12 +62,14 @@ public:
                       class Date * = 0 );
 
     void setTransaction( class Transaction * );
+    void allowBatching();
 
     void addAddress( Address * );
     uint addressId( Address * );
 
 private:
     class InjectorData * d;
+    friend class InjectionBatch;
 
     void next();
     void createMailboxes();
@@ -85,6 +87,7 @@ private:
     void selectMessageIds();
     void selectUids();
     void insertMessages();
+    void insertMailboxMessages();
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
     void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
@@ -39,6 +39,8 @@ public:
     uint rfc822Size;
     uint internalDate;
 
+    EString rfc822;
+
     bool hasHeaders: 1;
     bool hasAddresses: 1;
     bool hasBodies: 1;
@@ -271,10 +273,16 @@ EString Message::error() const
 /*! Returns the message formatted in RFC 822 (actually 2822) format.
     The return value is a canonical expression of the message, not
     whatever was parsed.
+
+    If setRfc822() has been called, rfc822() returns what was set
+    instead of formatting the message.
 */
 
 EString Message::rfc822() const
 {
+    if ( !d->rfc822.isEmpty() )
+        return d->rfc822;
+
     EString r;
     if ( d->rfc822Size )
         r.reserve( d->rfc822Size );
@@ -293,6 +301,14 @@ EString Message::rfc822() const
 
 EString Message::body() const
 {
+    if ( !d->rfc822.isEmpty() ) {
+        if ( d->rfc822.startsWith( crlf ) )
+            return d->rfc822.mid( 2 );
+        int i = d->rfc822.find( "\r\n\r\n" );
+        if ( i >= 0 )
+            return d->rfc822.mid( i + 4 );
+    }
+
     EString r;
 
     ContentType *ct = header()->contentType();
@@ -854,6 +870,28 @@ void Message::setBytesAndLinesFetched()
 }
 
 
+/*! Records that \a s is the message formatted in RFC 822 format, as
+    rfc822() would return it. This lets the Fetcher use the stored
+    copy of a message rather than fetch and reassemble all its parts.
+
+    The header() and bodyparts aren't changed, so hasHeaders() and
+    friends don't change either.
+*/
+
+void Message::setRfc822( const EString & s )
+{
+    d->rfc822 = s;
+}
+
+
+/*! Returns true if setRfc822() has been called, and false if not. */
+
+bool Message::hasRfc822() const
+{
+    return !d->rfc822.isEmpty();
+}
+
+
 /*! Adds a message-id header unless this message already has one. The
     message-id is based on the contents of the message, so if
     possible, addMessageId() should be called late (or better yet,
@@ -29,6 +29,9 @@ public:
     EString rfc822() const;
     EString body() const;
 
+    void setRfc822( const EString & );
+    bool hasRfc822() const;
+
     void setWrapped( bool ) const;
     bool isWrapped() const;
 
@@ -2,32 +2,91 @@
 
 #include "messagecache.h"
 
+#include "configuration.h"
+#include "addressfield.h"
+#include "bodypart.h"
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
+#include "hashtable.h"
+#include "graph.h"
 #include "map.h"
 
-#include <time.h> // time(0)
-
 
 static class MessageCache * c = 0;
 
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+static GraphableCounter * evictions = 0;
+static GraphableNumber * cached = 0;
+
+
+class MessageCacheEntry
+    : public Garbage
+{
+public:
+    MessageCacheEntry()
+        : Garbage(), mailbox( 0 ), uid( 0 ), uidvalidity( 0 ), m( 0 ),
+          bytes( 0 ), fetched( 0 ), prev( 0 ), next( 0 ) {}
+
+    uint mailbox;
+    uint uid;
+    uint uidvalidity;
+    Message * m;
+    uint bytes;
+    uint fetched;
+    MessageCacheEntry * prev;
+    MessageCacheEntry * next;
+};
+
 
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData()
+        : Garbage(), first( 0 ), last( 0 ), bytes( 0 ), limit( 0 ) {}
+
+    Map<Map<MessageCacheEntry> > m;
+
+    // the same entries, keyed by the address of their messages
+    HashTable<MessageCacheEntry> messages;
+
+    // most recently used first
+    MessageCacheEntry * first;
+    MessageCacheEntry * last;
+
+    uint bytes;
+    uint limit;
+
+    void link( MessageCacheEntry * );
+    void unlink( MessageCacheEntry * );
+    void setMessage( MessageCacheEntry *, Message * );
+    void remove( MessageCacheEntry * );
+    void estimate( MessageCacheEntry * );
+    void shrink();
 };
 
 
 /*! \class MessageCache messagecache.h
 
-  The MessageCache class caches messages until the Allocator decides
-  to clear out old Garbage. As a special feature, it can also cache
-  messages a few seconds longer, although that should be used
-  sparingly.
+    The MessageCache class keeps recently used messages in RAM, so
+    that a client which fetches the same messages repeatedly (as many
+    do) needn't wait for the database each time.
+
+    The cache is bounded by message-cache-size, measured using an
+    estimate of the memory used by each message, which the Fetcher
+    updates using update() as it fills in each batch of messages.
+    When it's full, the
+    bodies of the least recently used messages are dropped first,
+    since they're large and less likely to be wanted again than the
+    header fields, addresses and trivia, and only if that doesn't
+    free enough are entire messages dropped.
+
+    Unlike most other Caches, the MessageCache isn't emptied when the
+    Allocator collects garbage, since a message's uid and mailbox
+    always identify the same message. GC only makes the cache
+    reestimate its size, since Fetcher fills in cached messages.
 */
 
 
@@ -38,7 +97,16 @@ public:
 MessageCache::MessageCache()
     : Cache( 1 ), d( new MessageCacheData )
 {
-    // nothing
+    d->limit = Configuration::scalar( Configuration::MessageCacheSize );
+    if ( d->limit > 4095 )
+        d->limit = 4095;
+    d->limit = d->limit * 1024 * 1024;
+    if ( !hits ) {
+        hits = new GraphableCounter( "message-cache-hits" );
+        misses = new GraphableCounter( "message-cache-misses" );
+        evictions = new GraphableCounter( "message-cache-evictions" );
+        cached = new GraphableNumber( "message-cache-size" );
+    }
 }
 
 
@@ -53,12 +121,30 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
         return;
     if ( !c )
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+    if ( !c->d->limit )
+        return;
+    Map<MessageCacheEntry> * mbcache = c->d->m.find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
+        mbcache = new Map<MessageCacheEntry>;
         c->d->m.insert( mb->id(), mbcache );
     }
-    mbcache->insert( uid, m );
+    MessageCacheEntry * e = mbcache->find( uid );
+    if ( e ) {
+        c->d->unlink( e );
+        c->d->bytes -= e->bytes;
+        e->bytes = 0;
+    }
+    else {
+        e = new MessageCacheEntry;
+        e->mailbox = mb->id();
+        e->uid = uid;
+        mbcache->insert( uid, e );
+    }
+    e->uidvalidity = mb->uidvalidity();
+    c->d->setMessage( e, m );
+    c->d->link( e );
+    c->d->estimate( e );
+    c->d->shrink();
 }
 
 
@@ -70,29 +156,316 @@ class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
     if ( !c )
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
+    MessageCacheEntry * e = lookup( mailbox, uid );
+    if ( !e ) {
+        misses->tick();
+        return 0;
+    }
+    hits->tick();
+    return e->m;
+}
+
+
+/*! This private helper returns the entry for \a uid in \a mailbox
+    and makes it the most recently used, or returns a null pointer if
+    there is no such entry. Unlike find(), it doesn't count hits and
+    misses.
+*/
+
+MessageCacheEntry * MessageCache::lookup( class Mailbox * mailbox, uint uid )
+{
+    if ( !c )
+        return 0;
+    MessageCacheEntry * e = 0;
+    Map<MessageCacheEntry> * mbcache = c->d->m.find( mailbox->id() );
     if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+        e = mbcache->find( uid );
+    if ( e && e->uidvalidity != mailbox->uidvalidity() ) {
+        c->d->remove( e );
+        e = 0;
+    }
+    if ( !e )
+        return 0;
+    c->d->unlink( e );
+    c->d->link( e );
+    c->d->estimate( e );
+    c->d->shrink();
+    return e;
 }
 
 
+/*! Discards the entire contents of the cache. */
+
 void MessageCache::clear()
 {
     d->m.clear();
+    d->messages.clear();
+    d->first = 0;
+    d->last = 0;
+    d->bytes = 0;
+    cached->setValue( 0 );
+}
+
+
+/*! Reestimates the size of each cached message, and drops the least
+    recently used ones if that's necessary to stay within
+    message-cache-size.
+*/
+
+void MessageCache::shrink()
+{
+    MessageCacheEntry * e = d->first;
+    while ( e ) {
+        d->estimate( e );
+        e = e->next;
+    }
+    d->shrink();
 }
 
 
 /*! Ensures that there is a message with \a mailbox and \a uid in the
     cache, and returns a pointer to it.
+
+    Unlike find(), provide() doesn't count cache hits and misses,
+    since its callers generally have used find() already.
 */
 
 class Message * MessageCache::provide( class Mailbox * mailbox, uint uid )
 {
-    Message * m = find( mailbox, uid );
-    if ( m )
-        return m;
-    m = new Message;
+    MessageCacheEntry * e = lookup( mailbox, uid );
+    if ( e )
+        return e->m;
+    Message * m = new Message;
     insert( mailbox, uid, m );
     return m;
 }
+
+
+/*! Reestimates the size of \a m, if it's in the cache, and drops the
+    least recently used messages if necessary. The Fetcher calls this
+    after filling in \a m, since the cache otherwise wouldn't notice
+    that \a m has grown.
+*/
+
+void MessageCache::update( class Message * m )
+{
+    if ( !c || !m )
+        return;
+    MessageCacheEntry * e
+        = c->d->messages.find( (const char *)&m, sizeof( m ) );
+    if ( !e )
+        return;
+    c->d->estimate( e );
+    c->d->shrink();
+}
+
+
+/*! Makes \a e the most recently used entry. */
+
+void MessageCacheData::link( MessageCacheEntry * e )
+{
+    e->prev = 0;
+    e->next = first;
+    if ( first )
+        first->prev = e;
+    first = e;
+    if ( !last )
+        last = e;
+}
+
+
+/*! Removes \a e from the LRU list, but not from the map. */
+
+void MessageCacheData::unlink( MessageCacheEntry * e )
+{
+    if ( e->prev )
+        e->prev->next = e->next;
+    else if ( first == e )
+        first = e->next;
+    if ( e->next )
+        e->next->prev = e->prev;
+    else if ( last == e )
+        last = e->prev;
+    e->prev = 0;
+    e->next = 0;
+}
+
+
+/*! Makes \a e refer to \a msg, and keeps track of that. */
+
+void MessageCacheData::setMessage( MessageCacheEntry * e, Message * msg )
+{
+    if ( e->m )
+        messages.remove( (const char *)&e->m, sizeof( e->m ) );
+    e->m = msg;
+    if ( msg )
+        messages.insert( (const char *)&msg, sizeof( msg ), e );
+}
+
+
+/*! Removes \a e from the cache entirely. */
+
+void MessageCacheData::remove( MessageCacheEntry * e )
+{
+    unlink( e );
+    setMessage( e, 0 );
+    Map<MessageCacheEntry> * mbcache = m.find( e->mailbox );
+    if ( mbcache )
+        mbcache->remove( e->uid );
+    bytes -= e->bytes;
+    e->bytes = 0;
+}
+
+
+static uint headerSize( Header * h )
+{
+    if ( !h )
+        return 0;
+    uint n = 64;
+    List<HeaderField>::Iterator f( h->fields() );
+    while ( f ) {
+        n += 64 + f->name().length() + f->unparsedValue().length();
+        if ( f->type() <= HeaderField::LastAddressField ) {
+            List<Address> * a = ((AddressField *)((HeaderField *)f))
+                                ->addresses();
+            if ( a )
+                n += 96 * a->count();
+        }
+        ++f;
+    }
+    return n;
+}
+
+
+static uint bodySize( Bodypart * bp )
+{
+    // data() would read the blob, which isn't kept in RAM anyway
+    if ( !bp->blob().isEmpty() )
+        return 0;
+    return bp->data().length() + bp->text().length() * 2;
+}
+
+
+/*! Updates the estimated size of \a e if its message has been filled
+    in (or emptied) since the last estimate.
+*/
+
+void MessageCacheData::estimate( MessageCacheEntry * e )
+{
+    Message * msg = e->m;
+    uint f = 0;
+    if ( msg->hasHeaders() )
+        f |= 1;
+    if ( msg->hasAddresses() )
+        f |= 2;
+    if ( msg->hasTrivia() )
+        f |= 4;
+    if ( msg->hasBodies() )
+        f |= 8;
+    if ( msg->hasBytesAndLines() )
+        f |= 16;
+    if ( msg->hasRfc822() )
+        f |= 32;
+    if ( e->bytes && f == e->fetched )
+        return;
+
+    uint n = 256 + headerSize( msg->header() );
+    if ( msg->hasRfc822() )
+        n += msg->rfc822().length();
+    List<Bodypart>::Iterator bp( msg->allBodyparts() );
+    while ( bp ) {
+        n += 128 + headerSize( bp->header() ) + bodySize( bp );
+        if ( bp->message() )
+            n += 64 + headerSize( bp->message()->header() );
+        ++bp;
+    }
+    bytes = bytes - e->bytes + n;
+    e->bytes = n;
+    e->fetched = f;
+}
+
+
+// Returns a copy of \a m which shares everything except the bodies
+// and the stored text, or a null pointer if there isn't enough in \a
+// m to be worth keeping. We copy rather than modify \a m because
+// someone may be using it.
+
+static Message * withoutBodies( Message * m )
+{
+    if ( !m->hasHeaders() || !m->hasAddresses() )
+        return 0;
+
+    Message * r = new Message;
+    r->setDatabaseId( m->databaseId() );
+    r->setHeader( m->header() );
+    if ( m->hasTrivia() ) {
+        r->setRfc822Size( m->rfc822Size() );
+        r->setInternalDate( m->internalDate() );
+        r->setTriviaFetched( true );
+    }
+
+    List<Bodypart>::Iterator bp( m->allBodyparts() );
+    while ( bp ) {
+        Bodypart * n = r->bodypart( m->partNumber( bp ), true );
+        n->setHeader( bp->header() );
+        n->setNumEncodedBytes( bp->numEncodedBytes() );
+        n->setNumEncodedLines( bp->numEncodedLines() );
+        if ( bp->message() ) {
+            Message * nm = new Message;
+            nm->setParent( n );
+            nm->setHeader( bp->message()->header() );
+            n->setMessage( nm );
+        }
+        ++bp;
+    }
+
+    // the parts inside a message/rfc822 are also the children of its
+    // message, as in Fetcher's PartNumberDecoder.
+    List<Bodypart>::Iterator np( r->allBodyparts() );
+    while ( np ) {
+        if ( np->message() ) {
+            List<Bodypart>::Iterator i( np->children() );
+            while ( i ) {
+                np->message()->children()->append( i );
+                ++i;
+            }
+        }
+        ++np;
+    }
+
+    r->setHeadersFetched();
+    r->setAddressesFetched();
+    if ( m->hasBytesAndLines() )
+        r->setBytesAndLinesFetched();
+    return r;
+}
+
+
+/*! Drops bodies, starting with the least recently used message,
+    until the cache uses no more than the limit. If that isn't enough,
+    drops entire messages, again starting with the least recently
+    used.
+*/
+
+void MessageCacheData::shrink()
+{
+    MessageCacheEntry * e = last;
+    while ( e && bytes > limit ) {
+        if ( e->m->hasBodies() || e->m->hasRfc822() ) {
+            Message * light = withoutBodies( e->m );
+            if ( light ) {
+                setMessage( e, light );
+                estimate( e );
+            }
+        }
+        e = e->prev;
+    }
+    e = last;
+    while ( e && bytes > limit ) {
+        MessageCacheEntry * p = e->prev;
+        remove( e );
+        evictions->tick();
+        e = p;
+    }
+    cached->setValue( bytes / 1024 );
+}
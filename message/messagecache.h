@@ -16,11 +16,15 @@ public:
     static void insert( class Mailbox *, uint, class Message * );
     static class Message * find( class Mailbox *, uint );
     static class Message * provide( class Mailbox *, uint );
+    static void update( class Message * );
 
     void clear();
+    void shrink();
 
 private:
     class MessageCacheData * d;
+
+    static class MessageCacheEntry * lookup( class Mailbox *, uint );
 };
 
 
@@ -645,49 +645,67 @@ bool PopCommand::retr( bool lines )
 
         d->started = true;
         Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
-            f->fetch( Fetcher::Body );
-        if ( !d->message->hasHeaders() )
-            f->fetch( Fetcher::OtherHeader );
-        if ( !d->message->hasAddresses() )
-            f->fetch( Fetcher::Addresses );
+        if ( !d->message->hasRfc822() &&
+             !( d->message->hasBodies() &&
+                d->message->hasHeaders() &&
+                d->message->hasAddresses() ) )
+            f->fetch( Fetcher::Rfc822 );
         f->execute();
     }
 
-    if ( !( d->message->hasBodies() &&
+    if ( !d->message->hasRfc822() &&
+         !( d->message->hasBodies() &&
             d->message->hasHeaders() &&
             d->message->hasAddresses() ) )
         return false;
 
     d->pop->ok( "Done" );
 
-    Buffer * b = new Buffer;
-    b->append( d->message->rfc822() );
-
+    // we send the message in as few pieces as possible. mid() doesn't
+    // copy, and large strings aren't copied into the write buffer, so
+    // the message is sent without being copied at all.
+    EString m = d->message->rfc822();
     int ln = d->n;
     bool header = true;
 
-    EString * t;
-    while ( ( t = b->removeLine() ) != 0 ) {
-        if ( header && t->isEmpty() )
+    uint start = 0;
+    uint i = 0;
+    while ( i < m.length() ) {
+        int lf = m.find( '\n', i );
+        uint next = m.length();
+        uint end = m.length();
+        if ( lf >= 0 ) {
+            next = lf + 1;
+            end = lf;
+            if ( end > i && m[end-1] == '\r' )
+                end--;
+        }
+
+        if ( header && end == i )
             header = false;
 
         if ( !header && lines && ln-- < 0 )
             break;
 
-        if ( t->startsWith( "." ) )
+        if ( m[i] == '.' ) {
+            if ( i > start )
+                d->pop->enqueue( m.mid( start, i - start ) );
             d->pop->enqueue( "." );
-        d->pop->enqueue( *t );
-        d->pop->enqueue( "\r\n" );
-    }
+            start = i;
+        }
 
-    EString st = b->string( b->size() );
-    if ( !st.isEmpty() && !( !header && lines && ln-- < 0 ) ) {
-        if ( st.startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( st );
-        d->pop->enqueue( "\r\n" );
+        if ( lf < 0 || end == (uint)lf ) {
+            // the line doesn't end with CRLF, so we make it
+            if ( end > start )
+                d->pop->enqueue( m.mid( start, end - start ) );
+            d->pop->enqueue( "\r\n" );
+            start = next;
+        }
+
+        i = next;
     }
+    if ( i > start )
+        d->pop->enqueue( m.mid( start, i - start ) );
 
     d->pop->enqueue( ".\r\n" );
     return true;
@@ -13,8 +13,8 @@
 #include "estring.h"
 #include "endpoint.h"
 #include "eventloop.h"
-#include "allocator.h"
 #include "resolver.h"
+#include "timerwheel.h"
 #include "user.h"
 
 // errno
@@ -35,16 +35,16 @@ class ConnectionData
 {
 public:
     ConnectionData()
-        : fd( -1 ), timeout( 0 ), r( 0 ), w( 0 ),
+        : fd( -1 ), deadline( 0 ), r( 0 ), w( 0 ),
           wbt( 0 ), wbs( 0 ),
           state( Connection::Invalid ),
           type( Connection::Client ),
           tls( false ), pending( false ),
-          l( 0 )
+          l( 0 ), loop( 0 )
     {}
 
     int fd;
-    uint timeout;
+    int64 deadline;
     Buffer *r, *w;
     uint wbt, wbs;
     Connection::State state;
@@ -55,6 +55,7 @@ public:
     Endpoint self, peer;
     Connection::Event event;
     Log *l;
+    LoopEntry * loop;
 };
 
 
@@ -110,7 +111,7 @@ void Connection::init( int fd )
 
     d->fd = fd;
     d->state = Inactive;
-    d->timeout = 0;
+    d->deadline = 0;
     d->r = new Buffer;
     d->w = new Buffer;
     setBlocking( false );
@@ -159,6 +160,8 @@ void Connection::setState( Connection::State st )
              fn( EventLoop::global()->connections()->count() ) + " connections)",
              internal ? Log::Debug : Log::Info );
     d->state = st;
+    if ( d->loop )
+        EventLoop::global()->touch( this );
 }
 
 
@@ -399,24 +402,43 @@ EString Connection::description() const
 
 uint Connection::timeout() const
 {
-    return d->timeout;
+    if ( !d->deadline )
+        return 0;
+    int64 ms = d->deadline - TimerWheel::now();
+    if ( ms < 0 )
+        ms = 0;
+    return (uint)time( 0 ) + (uint)( ( ms + 999 ) / 1000 );
 }
 
 
-/*! Sets the connection timeout to \a tm seconds from the epoch. */
+/*! Sets the connection timeout to \a tm seconds from the epoch. 0
+    means that the connection does not want a Timeout event.
+*/
 
 void Connection::setTimeout( uint tm )
 {
-    d->timeout = tm;
+    if ( tm )
+        d->deadline = TimerWheel::now() +
+                      ( (int64)tm - (int64)time( 0 ) ) * 1000;
+    else
+        d->deadline = 0;
+    if ( d->loop )
+        EventLoop::global()->touch( this );
 }
 
 
-/*! Sets the connection timeout to \a n seconds from the current time.
+/*! Sets the connection timeout to \a n seconds from the current time,
+    or \a n milliseconds if \a unit is Timer::Milliseconds.
 */
 
-void Connection::setTimeoutAfter( uint n )
+void Connection::setTimeoutAfter( uint n, Timer::Unit unit )
 {
-    d->timeout = n + (uint)time(0);
+    if ( unit == Timer::Seconds )
+        d->deadline = TimerWheel::now() + (int64)n * 1000;
+    else
+        d->deadline = TimerWheel::now() + n;
+    if ( d->loop )
+        EventLoop::global()->touch( this );
 }
 
 
@@ -426,8 +448,11 @@ void Connection::setTimeoutAfter( uint n )
 
 void Connection::extendTimeout( uint n )
 {
-    if ( d->timeout != 0 )
-        d->timeout += n;
+    if ( !d->deadline )
+        return;
+    d->deadline += (int64)n * 1000;
+    if ( d->loop )
+        EventLoop::global()->touch( this );
 }
 
 
@@ -466,6 +491,8 @@ Buffer *Connection::readBuffer() const
 
 Buffer *Connection::writeBuffer() const
 {
+    if ( d->loop )
+        EventLoop::global()->touch( this );
     return d->w;
 }
 
@@ -516,8 +543,11 @@ Endpoint Connection::peer() const
 
 void Connection::close()
 {
-    if ( valid() && d->fd >= 0 )
+    if ( valid() && d->fd >= 0 ) {
+        if ( d->loop )
+            EventLoop::global()->forget( this );
         ::close( d->fd );
+    }
     setState( Invalid );
     EventLoop::global()->removeConnection( this );
 }
@@ -627,7 +657,6 @@ void Connection::startTls( TlsServer * s )
         ::close( sv[1] );
         return;
     }
-    Allocator::addEternal( t, "another TLS thread" );
 
     int flags = fcntl( sv[0], F_GETFL, 0 );
     if ( flags < 0 )
@@ -638,9 +667,13 @@ void Connection::startTls( TlsServer * s )
     if ( fcntl( sv[1], F_SETFL, flags ) < 0 )
         die( FD );
 
+    if ( d->loop )
+        EventLoop::global()->forget( this );
     t->setClientFD( d->fd );
     t->setServerFD( sv[0] );
     d->fd = sv[1];
+    if ( d->loop )
+        EventLoop::global()->touch( this );
 
     if ( s )
         log( "Note: TlsServer was created and need not be", Log::Debug );
@@ -1049,3 +1082,31 @@ void Connection::substitute( Connection * other, Event event )
     other->d->event = event;
     EventLoop::global()->addConnection( other );
 }
+
+
+/*! Returns the EventLoop's private bookkeeping for this Connection,
+    or a null pointer if the EventLoop does not keep any.
+*/
+
+LoopEntry * Connection::loopEntry() const
+{
+    return d->loop;
+}
+
+
+/*! Records \a e as the EventLoop's bookkeeping for this Connection. */
+
+void Connection::setLoopEntry( LoopEntry * e )
+{
+    d->loop = e;
+}
+
+
+/*! Returns the time (as returned by TimerWheel::now()) at which this
+    Connection wants a Timeout event, or 0 if it doesn't want one.
+*/
+
+int64 Connection::deadline() const
+{
+    return d->deadline;
+}
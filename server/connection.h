@@ -4,6 +4,7 @@
 #define CONNECTION_H
 
 #include "log.h"
+#include "timer.h"
 #include "endpoint.h"
 
 class User;
@@ -51,7 +52,7 @@ public:
     int fd() const;
     uint timeout() const;
     void setTimeout( uint );
-    void setTimeoutAfter( uint );
+    void setTimeoutAfter( uint, Timer::Unit = Timer::Seconds );
     void extendTimeout( uint );
     void setBlocking( bool );
 
@@ -106,6 +107,11 @@ protected:
 
 private:
     class ConnectionData *d;
+
+    friend class EventLoop;
+    class LoopEntry * loopEntry() const;
+    void setLoopEntry( class LoopEntry * );
+    int64 deadline() const;
 };
 
 
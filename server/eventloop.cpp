@@ -9,10 +9,12 @@
 #include "server.h"
 #include "scope.h"
 #include "timer.h"
+#include "timerwheel.h"
 #include "graph.h"
 #include "event.h"
 #include "list.h"
 #include "log.h"
+#include "configuration.h"
 
 // time
 #include <time.h>
@@ -32,6 +34,11 @@
 // memset (for FD_* under OpenBSD)
 #include <string.h>
 
+#if defined(HAVE_EPOLL)
+// epoll_create1, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+#endif
+
 
 static bool freeMemorySoon;
 
@@ -39,21 +46,48 @@ static bool freeMemorySoon;
 static EventLoop * loop;
 
 
+class LoopEntry
+    : public Garbage
+{
+public:
+    LoopEntry( Connection * connection )
+        : c( connection ), timeout( new WheelEntry ),
+          fd( -1 ), events( 0 ),
+          touched( false ), polled( true )
+    {
+        timeout->connection = connection;
+    }
+
+    Connection * c;
+    WheelEntry * timeout;
+    int fd;
+    uint events;
+    bool touched;
+    bool polled;
+
+    enum { Read = 1, Write = 2 };
+};
+
+
 class LoopData
     : public Garbage
 {
 public:
     LoopData()
         : log( new Log ), startup( false ),
-          stop( false ), limit( 0 )
+          stop( false ), limit( 0 ), epoll( -1 ),
+          wheel( new TimerWheel )
     {}
 
     Log *log;
     bool startup;
     bool stop;
     List< Connection > connections;
-    List< Timer > timers;
     uint limit;
+    int epoll;
+    TimerWheel * wheel;
+    List< LoopEntry > touched;
+    List< LoopEntry > unpolled;
 
     class Stopper
         : public EventHandler
@@ -84,6 +118,18 @@ public:
     and periodically informs them about any events (e.g., read/write,
     errors, timeouts) that occur. The loop continues until something
     calls stop().
+
+    Where the OS provides epoll(), the loop uses that: Each Connection
+    is registered with the kernel once, and its interest is updated
+    only when touch() says that something may have changed, so each
+    pass costs O(ready connections) and the number of connections is
+    not limited by FD_SETSIZE. Elsewhere, or if epoll cannot be used,
+    the loop falls back to select() and looks at every Connection on
+    every pass.
+
+    Timer objects and Connection timeouts are kept in a TimerWheel, so
+    the loop sleeps until the next one is due (with millisecond
+    resolution), and each pass looks only at those that have expired.
 */
 
 
@@ -134,10 +180,13 @@ void EventLoop::addConnection( Connection * c )
 
     Scope x( d->log );
 
-    if ( d->connections.find( c ) )
+    if ( c->loopEntry() || d->connections.find( c ) )
         return;
 
     d->connections.prepend( c );
+    LoopEntry * e = new LoopEntry( c );
+    c->setLoopEntry( e );
+    refresh( e );
     setConnectionCounts();
 }
 
@@ -150,6 +199,21 @@ void EventLoop::removeConnection( Connection * c )
 {
     Scope x( d->log );
 
+    LoopEntry * e = c->loopEntry();
+    if ( e ) {
+#if defined(HAVE_EPOLL)
+        if ( e->fd >= 0 && e->polled )
+            ::epoll_ctl( d->epoll, EPOLL_CTL_DEL, e->fd, 0 );
+#endif
+        if ( !e->polled )
+            d->unpolled.remove( e );
+        d->wheel->remove( e->timeout );
+        e->c = 0;
+        e->timeout->connection = 0;
+        e->fd = -1;
+        c->setLoopEntry( 0 );
+    }
+
     if ( d->connections.remove( c ) == 0 )
         return;
     setConnectionCounts();
@@ -190,6 +254,42 @@ static GraphableNumber * sizeinram = 0;
 static const uint gcDelay = 30;
 
 
+/*! Graphs our memory usage. Called before and after processing
+    events.
+*/
+
+static void graphMemoryUsage()
+{
+    if ( !sizeinram )
+        sizeinram = new GraphableNumber( "memory-used" );
+    sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+}
+
+
+static GraphableNumber * gcpause = 0;
+
+
+/*! Graphs how long the garbage collector stalled the loop since \a
+    start, in microseconds. If there are several pauses in one second,
+    the longest is recorded.
+*/
+
+static void graphGcPause( const struct timeval & start )
+{
+    struct timeval now;
+    gettimeofday( &now, 0 );
+    uint us = ( now.tv_sec - start.tv_sec ) * 1000000 +
+              ( now.tv_usec - start.tv_usec );
+    if ( !gcpause )
+        gcpause = new GraphableNumber( "gc-pause" );
+    if ( gcpause->youngestTime() == (uint)now.tv_sec &&
+         gcpause->lastValue() > us )
+        return;
+    gcpause->setValue( us );
+}
+
+
+
 /*! Starts the EventLoop and runs it until stop() is called. */
 
 void EventLoop::start()
@@ -197,9 +297,30 @@ void EventLoop::start()
     Scope x( d->log );
     time_t gc = time(0);
     bool haveLoggedStartup = false;
+    uint slice = 1000 * Configuration::scalar( Configuration::GcSliceTime );
+    if ( !slice )
+        slice = UINT_MAX;
 
     log( "Starting event loop", Log::Debug );
 
+#if defined(HAVE_EPOLL)
+    if ( d->epoll < 0 )
+        d->epoll = ::epoll_create1( EPOLL_CLOEXEC );
+    if ( d->epoll < 0 ) {
+        log( "Cannot use epoll (errno " + fn( errno ) + "), "
+             "falling back to select()", Log::Info );
+    }
+    else {
+        List< Connection >::Iterator it( d->connections );
+        while ( it ) {
+            Connection * c = it;
+            ++it;
+            if ( c->loopEntry() )
+                updateInterest( c->loopEntry() );
+        }
+    }
+#endif
+
     while ( !d->stop && !Log::disastersYet() ) {
         if ( !haveLoggedStartup && !inStartup() ) {
             if ( !Server::name().isEmpty() )
@@ -208,120 +329,30 @@ void EventLoop::start()
             haveLoggedStartup = true;
         }
 
-        Connection * c;
-
-        uint timeout = gcDelay;
-        int maxfd = -1;
-
-        fd_set r, w;
-        FD_ZERO( &r );
-        FD_ZERO( &w );
-
-        // Figure out what events each connection wants.
-
-        List< Connection >::Iterator it( d->connections );
-        while ( it ) {
-            c = it;
-            ++it;
-
-            int fd = c->fd();
-            if ( fd < 0 ) {
-                removeConnection( c );
-            }
-            else if ( c->type() == Connection::Listener && inStartup() ) {
-                // we don't accept new connections until we've
-                // completed startup
-            }
-            else {
-                if ( fd > maxfd )
-                    maxfd = fd;
-                FD_SET( fd, &r );
-                if ( c->canWrite() ||
-                     c->state() == Connection::Connecting ||
-                     c->state() == Connection::Closing )
-                    FD_SET( fd, &w );
-                if ( c->timeout() > 0 && c->timeout() < timeout )
-                    timeout = c->timeout();
-            }
-        }
-
-        // Figure out whether any timers need attention soon
-
-        List< Timer >::Iterator t( d->timers );
-        while ( t ) {
-            if ( t->active() && t->timeout() < timeout )
-                timeout = t->timeout();
-            ++t;
-        }
-
-        // Look for interesting input
-
-        struct timeval tv;
-        tv.tv_sec = timeout - time( 0 );
-        tv.tv_usec = 0;
-
-        if ( tv.tv_sec < 0 )
-            tv.tv_sec = 0;
-        if ( tv.tv_sec > 60 )
-            tv.tv_sec = 60;
+        if ( d->epoll >= 0 )
+            epollOnce();
+        else
+            selectOnce();
 
-        // we never ask the OS to sleep shorter than .2 seconds
-        if ( tv.tv_sec < 1 )
-            tv.tv_usec = 200000;
-
-        if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
-            // r and w are undefined. we clear them, and dispatch()
-            // won't jump to conclusions
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-        }
         time_t now = time( 0 );
 
-        // Graph our size before processing events
-        if ( !sizeinram )
-            sizeinram = new GraphableNumber( "memory-used" );
-        sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
-
-        // Any interesting timers?
-
-        if ( !d->timers.isEmpty() ) {
-            uint now = time( 0 );
-            t = d->timers.first();
-            while ( t ) {
-                Timer * tmp = t;
-                ++t;
-                if ( tmp->active() && tmp->timeout() <= now )
-                    tmp->execute();
-            }
-        }
-
-        // Figure out what each connection cares about.
-
-        it = d->connections.first();
-        while ( it ) {
-            c = it;
-            ++it;
-            int fd = c->fd();
-            if ( fd >= 0 ) {
-                dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
-                FD_CLR( fd, &r );
-                FD_CLR( fd, &w );
-            }
-            else {
-                removeConnection( c );
-            }
-        }
-
         // Graph our size after processing all the events too
 
-        sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
+        graphMemoryUsage();
 
         // Collect garbage if someone asks for it, or if we've passed
         // the memory usage goal. This has to be at the end of the
         // scope, since anything referenced by local variables might
-        // be freed here.
-
-        if ( !d->stop ) {
+        // be freed here. Marking is done all at once, sweeping in
+        // slices of at most gc-slice-time, one per pass.
+
+        if ( !d->stop && Allocator::sweeping() ) {
+            struct timeval start;
+            gettimeofday( &start, 0 );
+            Allocator::sweep( slice );
+            graphGcPause( start );
+        }
+        else if ( !d->stop ) {
             if ( !::freeMemorySoon ) {
                 uint a = Allocator::inUse() + Allocator::allocated();
                 if ( now < gc ) {
@@ -355,7 +386,10 @@ void EventLoop::start()
                 }
             }
             if ( ::freeMemorySoon ) {
-                Allocator::free();
+                struct timeval start;
+                gettimeofday( &start, 0 );
+                Allocator::free( slice );
+                graphGcPause( start );
                 gc = time( 0 );
                 ::freeMemorySoon = false;
             }
@@ -389,14 +423,347 @@ void EventLoop::start()
 }
 
 
+/*! Runs one pass of the select()-based loop: Finds out what each
+    Connection wants, waits until something happens or a timeout is
+    reached, and dispatches events to all Connections.
+*/
+
+void EventLoop::selectOnce()
+{
+    Connection * c;
+
+    int maxfd = -1;
+
+    refreshTouched();
+
+    fd_set r, w;
+    FD_ZERO( &r );
+    FD_ZERO( &w );
+
+    // Figure out what events each connection wants.
+
+    List< Connection >::Iterator it( d->connections );
+    while ( it ) {
+        c = it;
+        ++it;
+
+        int fd = c->fd();
+        if ( fd < 0 ) {
+            removeConnection( c );
+        }
+        else if ( c->type() == Connection::Listener && inStartup() ) {
+            // we don't accept new connections until we've
+            // completed startup
+        }
+        else {
+            if ( fd > maxfd )
+                maxfd = fd;
+            FD_SET( fd, &r );
+            if ( c->canWrite() ||
+                 c->state() == Connection::Connecting ||
+                 c->state() == Connection::Closing )
+                FD_SET( fd, &w );
+        }
+    }
+
+    // Look for interesting input
+
+    uint ms = sleepTime();
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ( ms % 1000 ) * 1000;
+
+    if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
+        // r and w are undefined. we clear them, and dispatch()
+        // won't jump to conclusions
+        FD_ZERO( &r );
+        FD_ZERO( &w );
+    }
+    int64 now = TimerWheel::now();
+
+    // Graph our size before processing events
+    graphMemoryUsage();
+
+    // Any interesting timers or timeouts?
+
+    runTimers( now );
+
+    // Figure out what each connection cares about.
+
+    it = d->connections.first();
+    while ( it ) {
+        c = it;
+        ++it;
+        int fd = c->fd();
+        if ( fd >= 0 ) {
+            dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
+            FD_CLR( fd, &r );
+            FD_CLR( fd, &w );
+        }
+        else {
+            removeConnection( c );
+        }
+    }
+}
+
+
+static const int epollBatch = 256;
+
+
+/*! Runs one pass of the epoll()-based loop: Tells the kernel about
+    any Connections whose interest may have changed since the last
+    pass, waits until something happens or a timeout is reached, and
+    dispatches events to the Connections that are ready, or whose
+    timeout has been reached.
+*/
+
+void EventLoop::epollOnce()
+{
+#if defined(HAVE_EPOLL)
+    refreshTouched();
+
+    int ms = sleepTime();
+    if ( !d->unpolled.isEmpty() )
+        ms = 0;
+
+    struct epoll_event events[epollBatch];
+    int n = ::epoll_wait( d->epoll, events, epollBatch, ms );
+    if ( n < 0 )
+        n = 0;
+    int64 now = TimerWheel::now();
+
+    graphMemoryUsage();
+
+    runTimers( now );
+
+    // Dispatch to the connections that are ready. An entry whose
+    // connection has been removed during this pass has a null c.
+
+    int i = 0;
+    while ( i < n ) {
+        LoopEntry * e = (LoopEntry *)events[i].data.ptr;
+        uint ev = events[i].events;
+        ++i;
+        if ( !e->c )
+            continue;
+        bool r = ( ev & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) != 0;
+        bool w = ( ev & ( EPOLLOUT | EPOLLERR ) ) != 0;
+        if ( e->c->fd() >= 0 )
+            dispatch( e->c, r, w, now );
+        else
+            removeConnection( e->c );
+    }
+
+    // FDs that epoll cannot watch (e.g. plain files) are always ready,
+    // as select() would say.
+
+    List< LoopEntry >::Iterator u( d->unpolled );
+    while ( u ) {
+        LoopEntry * e = u;
+        ++u;
+        if ( e->c && e->events )
+            dispatch( e->c, true, ( e->events & LoopEntry::Write ) != 0, now );
+    }
+#endif
+}
+
+
+/*! Executes all the Timers whose timeout is at or before \a now, and
+    sends a Timeout event to each Connection whose timeout is.
+*/
+
+void EventLoop::runTimers( int64 now )
+{
+    WheelEntry * e = d->wheel->take( now );
+    while ( e ) {
+        if ( e->timer ) {
+            e->timer->execute();
+        }
+        else if ( e->connection ) {
+            Connection * c = e->connection;
+            int64 deadline = c->deadline();
+            if ( deadline > now )
+                d->wheel->add( e, deadline ); // extended meanwhile
+            else if ( !deadline )
+                ; // the timeout was cancelled meanwhile
+            else if ( c->fd() >= 0 )
+                dispatch( c, false, false, now );
+            else
+                removeConnection( c );
+        }
+        e = d->wheel->take( now );
+    }
+}
+
+
+/*! Returns the number of milliseconds the loop can wait for events
+    before the next Timer or Connection timeout needs attention, or 0
+    if the Allocator has unfinished sweeping to do. Never returns more
+    than a minute.
+*/
+
+uint EventLoop::sleepTime() const
+{
+    if ( Allocator::sweeping() )
+        return 0;
+    int64 now = TimerWheel::now();
+    int64 next = d->wheel->nextDeadline( now + 60000 );
+    if ( next <= now )
+        return 0;
+    return (uint)( next - now );
+}
+
+
+/*! Brings the kernel and the TimerWheel up to date regarding all the
+    Connections that have been touched since the last time.
+*/
+
+void EventLoop::refreshTouched()
+{
+    while ( !d->touched.isEmpty() ) {
+        LoopEntry * e = d->touched.shift();
+        e->touched = false;
+        if ( e->c )
+            refresh( e );
+    }
+}
+
+
+/*! Brings the kernel (if epoll is in use) and the TimerWheel up to
+    date regarding the Connection in \a e.
+*/
+
+void EventLoop::refresh( LoopEntry * e )
+{
+    if ( d->epoll >= 0 )
+        updateInterest( e );
+    if ( !e->c )
+        return;
+    int64 deadline = e->c->deadline();
+    if ( !deadline )
+        d->wheel->remove( e->timeout );
+    else if ( deadline != e->timeout->at || e->timeout->slot < 0 )
+        d->wheel->add( e->timeout, deadline );
+}
+
+
+/*! Returns the events \a c is interested in at the moment, as a
+    combination of LoopEntry::Read and LoopEntry::Write.
+*/
+
+uint EventLoop::interest( Connection * c ) const
+{
+    if ( c->type() == Connection::Listener && inStartup() )
+        return 0; // we don't accept new connections during startup
+    uint events = LoopEntry::Read;
+    if ( c->canWrite() ||
+         c->state() == Connection::Connecting ||
+         c->state() == Connection::Closing )
+        events |= LoopEntry::Write;
+    return events;
+}
+
+
+/*! Tells the kernel what the connection in \a e wants, if that has
+    changed since the last time. If the connection has changed its FD
+    (as Connection::startTls() does), the old FD is forgotten first.
+*/
+
+void EventLoop::updateInterest( LoopEntry * e )
+{
+    Connection * c = e->c;
+    int fd = c->fd();
+    if ( fd < 0 ) {
+        removeConnection( c );
+        return;
+    }
+
+    uint events = interest( c );
+    if ( fd == e->fd && events == e->events )
+        return;
+
+#if defined(HAVE_EPOLL)
+    struct epoll_event ev;
+    memset( &ev, 0, sizeof( ev ) );
+    if ( events & LoopEntry::Read )
+        ev.events |= EPOLLIN;
+    if ( events & LoopEntry::Write )
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = e;
+
+    if ( fd != e->fd ) {
+        if ( e->fd >= 0 && e->polled )
+            ::epoll_ctl( d->epoll, EPOLL_CTL_DEL, e->fd, 0 );
+        if ( !e->polled )
+            d->unpolled.remove( e );
+        e->polled = true;
+        if ( ::epoll_ctl( d->epoll, EPOLL_CTL_ADD, fd, &ev ) < 0 ) {
+            if ( errno != EPERM )
+                log( "epoll_ctl( ADD, " + fn( fd ) + " ) returned errno " +
+                     fn( errno ) + " for " + c->description(), Log::Error );
+            e->polled = false;
+            d->unpolled.append( e );
+        }
+    }
+    else if ( e->polled ) {
+        ::epoll_ctl( d->epoll, EPOLL_CTL_MOD, fd, &ev );
+    }
+#endif
+
+    e->fd = fd;
+    e->events = events;
+}
+
+
+/*! Records that the Connection \a c may want different events than
+    before, e.g. because it has something to write or has changed its
+    state. The EventLoop brings the kernel up to date before waiting
+    for events next time.
+
+    Connection calls this whenever its writeBuffer() is used or its
+    state changes, so others rarely need to.
+*/
+
+void EventLoop::touch( const Connection * c )
+{
+    LoopEntry * e = c->loopEntry();
+    if ( !e || e->touched )
+        return;
+    e->touched = true;
+    d->touched.append( e );
+}
+
+
+/*! Tells the kernel to stop watching the fd of \a c, which is about
+    to be closed or handed to someone else. This must happen before
+    the fd is closed, since another Connection may get the same fd
+    number as soon as it is.
+
+    Connection calls this as needed, so others rarely need to.
+*/
+
+void EventLoop::forget( const Connection * c )
+{
+    LoopEntry * e = c->loopEntry();
+    if ( !e || e->fd < 0 || !e->polled )
+        return;
+#if defined(HAVE_EPOLL)
+    ::epoll_ctl( d->epoll, EPOLL_CTL_DEL, e->fd, 0 );
+#endif
+    // updateInterest() will add the new fd, if any
+    e->fd = -1;
+    e->events = 0;
+}
+
+
 /*! Dispatches events to the connection \a c, based on its current
-    state, the time \a now and the results from select: \a r is true
-    if the FD may be read, and \a w is true if we know that the FD may
-    be written to. If \a now is past that Connection's timeout, we
-    must send a Timeout event.
+    state, the time \a now (as returned by TimerWheel::now()) and the
+    results from select/epoll: \a r is true if the FD may be read, and
+    \a w is true if we know that the FD may be written to. If \a now
+    is past that Connection's timeout, we must send a Timeout event.
 */
 
-void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
+void EventLoop::dispatch( Connection * c, bool r, bool w, int64 now )
 {
     int dummy1;
     socklen_t dummy2;
@@ -409,7 +776,7 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
 
     try {
         Scope x( c->log() );
-        if ( c->timeout() != 0 && now >= c->timeout() ) {
+        if ( c->deadline() != 0 && now >= c->deadline() ) {
             c->setTimeout( 0 );
             c->react( Connection::Timeout );
         }
@@ -602,6 +969,13 @@ bool EventLoop::inStartup() const
 void EventLoop::setStartup( bool p )
 {
     d->startup = p;
+
+    List< Connection >::Iterator it( d->connections );
+    while ( it ) {
+        if ( it->type() == Connection::Listener )
+            touch( it );
+        ++it;
+    }
 }
 
 
@@ -641,7 +1015,7 @@ void EventLoop::shutdown()
 
 void EventLoop::addTimer( Timer * t )
 {
-    d->timers.append( t );
+    d->wheel->add( t->wheelEntry(), t->wheelEntry()->at );
 }
 
 
@@ -651,9 +1025,7 @@ void EventLoop::addTimer( Timer * t )
 
 void EventLoop::removeTimer( Timer * t )
 {
-    List<Timer>::Iterator i( d->timers.find( t ) );
-    if ( i )
-        d->timers.take( i );
+    d->wheel->remove( t->wheelEntry() );
 }
 
 static GraphableNumber * imapgraph = 0;
@@ -24,7 +24,7 @@ public:
     void closeAllExceptListeners();
     void flushAll();
 
-    void dispatch( Connection *, bool, bool, uint );
+    void dispatch( Connection *, bool, bool, int64 );
 
     bool inStartup() const;
     void setStartup( bool );
@@ -48,8 +48,20 @@ public:
     void setMemoryUsage( uint );
     uint memoryUsage() const;
 
+    void touch( const Connection * );
+    void forget( const Connection * );
+
 private:
     class LoopData *d;
+
+    void selectOnce();
+    void epollOnce();
+    void runTimers( int64 );
+    uint sleepTime() const;
+    void refreshTouched();
+    void refresh( class LoopEntry * );
+    uint interest( Connection * ) const;
+    void updateInterest( class LoopEntry * );
 };
 
 
@@ -4,6 +4,7 @@
 
 #include "allocator.h"
 #include "eventloop.h"
+#include "estringlist.h"
 #include "list.h"
 
 #include <time.h> // time()
@@ -11,6 +12,11 @@
 
 static List<GraphableNumber> * numbers = 0;
 
+// functions which supply lines of their own, see addReporter()
+static const uint maxReporters = 8;
+static EStringList * (*reporters[maxReporters])();
+static uint numReporters = 0;
+
 
 static const uint graphableHistorySize = 960; // 15 minutes and a little bit
 
@@ -221,7 +227,7 @@ class GraphableDataSetData
     : public Garbage
 {
 public:
-    GraphableDataSetData(): t( 0 ), n( 0 ) {}
+    GraphableDataSetData(): t( 0 ), s( 0 ), n( 0 ) {}
     uint t;
     uint s;
     uint n;
@@ -241,7 +247,7 @@ public:
 /*! Constructs an empty data set named \a name. */
 
 GraphableDataSet::GraphableDataSet( const EString & name )
-    : GraphableNumber( name )
+    : GraphableNumber( name ), d( new GraphableDataSetData )
 {
 }
 
@@ -256,10 +262,9 @@ void GraphableDataSet::addNumber( uint n )
         d->n = 0;
         d->s = 0;
     }
-    n++;
+    d->n++;
     d->s += n;
-    if ( d->n )
-        setValue( ( d->s + (d->n/2) ) / d->n );
+    setValue( ( d->s + (d->n/2) ) / d->n );
 }
 
 
@@ -307,10 +312,49 @@ GraphDumper::GraphDumper( int fd )
         }
         ++i;
     }
+
+    // the heap profile (if any) uses the same format, with a single
+    // value for each name
+    EString now = " " + fn( (uint)time( 0 ) ) + ":";
+    EStringList::Iterator h( Allocator::heapProfile() );
+    while ( h ) {
+        int s = h->find( ' ' );
+        if ( s > 0 )
+            enqueue( h->mid( 0, s ) + now + h->mid( s+1 ) + "\r\n" );
+        ++h;
+    }
+
+    // other statistics (e.g. the QueryStatistics) don't fit that
+    // format, and have lines of their own
+    uint r = 0;
+    while ( r < numReporters ) {
+        EStringList::Iterator q( reporters[r]() );
+        while ( q ) {
+            enqueue( *q + "\r\n" );
+            ++q;
+        }
+        r++;
+    }
     setTimeoutAfter( 0 );
 }
 
 
+/*! Registers \a reporter, which the GraphDumper calls to obtain extra
+    lines for each dump. This lets libraries which the server library
+    doesn't depend on (such as db) contribute statistics. Registering
+    the same function twice has no effect.
+*/
+
+void GraphDumper::addReporter( EStringList * (*reporter)() )
+{
+    uint i = 0;
+    while ( i < numReporters && reporters[i] != reporter )
+        i++;
+    if ( i == numReporters && numReporters < maxReporters )
+        reporters[numReporters++] = reporter;
+}
+
+
 void GraphDumper::react( Event )
 {
     setState( Closing );
@@ -4,6 +4,7 @@
 #define GRAPH_H
 
 #include "estring.h"
+#include "estringlist.h"
 #include "connection.h"
 
 
@@ -60,6 +61,8 @@ public:
     GraphDumper( int );
 
     void react( Event );
+
+    static void addReporter( EStringList * (*)() );
 };
 
 
@@ -3,116 +3,910 @@
 #include "integerset.h"
 
 #include "estringlist.h"
-#include "map.h"
-
-
-static inline uint bitsSet( uint b )
-{
-    uint r = 0;
-    while ( b ) {
-        switch ( b & 15 ) {
-        case 0:
-            r += 0;
-            break;
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-            r += 1;
-            break;
-        case 3:
-        case 5:
-        case 6:
-        case 9:
-        case 10:
-        case 12:
-            r += 2;
-            break;
-        case 7:
-        case 11:
-        case 13:
-        case 14:
-            r += 3;
-            break;
-        case 15:
-            r += 4;
-            break;
-        }
-        b >>= 4;
+#include "allocator.h"
+
+// memcpy, memmove, memset
+#include <string.h>
+
+
+typedef unsigned long long Word;
+
+static const uint WordBits = 64;
+static const uint Words = 65536 / WordBits;
+static const uint BitmapBytes = Words * sizeof( Word );
+// arrays with more members than this are stored as bitmaps
+static const uint ArrayMax = 4096;
+
+
+static inline uint bitsSet( Word w )
+{
+    return __builtin_popcountll( w );
+}
+
+
+static inline uint lowestBit( Word w )
+{
+    return __builtin_ctzll( w );
+}
+
+
+// scratch bitmaps for operations which mix container types. only the
+// main thread uses IntegerSet.
+static Word scratch1[Words];
+static Word scratch2[Words];
+
+
+/* Sets bits \a lo to \a hi (inclusive) in the bitmap \a w. */
+
+static void setRange( Word * w, uint lo, uint hi )
+{
+    uint a = lo / WordBits;
+    uint b = hi / WordBits;
+    Word first = ~(Word)0 << ( lo % WordBits );
+    Word last = ~(Word)0 >> ( WordBits - 1 - hi % WordBits );
+    if ( a == b ) {
+        w[a] |= first & last;
+        return;
     }
-    return r;
-};
+    w[a] |= first;
+    uint i = a + 1;
+    while ( i < b )
+        w[i++] = ~(Word)0;
+    w[b] |= last;
+}
+
 
+/* Clears bits \a lo to \a hi (inclusive) in the bitmap \a w. */
 
-static const uint BlockSize = 8192;
-static const uint BitsPerUint = 8 * sizeof(uint);
-static const uint ArraySize = (BlockSize + BitsPerUint - 1) / BitsPerUint;
+static void clearRange( Word * w, uint lo, uint hi )
+{
+    uint a = lo / WordBits;
+    uint b = hi / WordBits;
+    Word first = ~(Word)0 << ( lo % WordBits );
+    Word last = ~(Word)0 >> ( WordBits - 1 - hi % WordBits );
+    if ( a == b ) {
+        w[a] &= ~( first & last );
+        return;
+    }
+    w[a] &= ~first;
+    uint i = a + 1;
+    while ( i < b )
+        w[i++] = 0;
+    w[b] &= ~last;
+}
 
 
-class SetData
+/* Returns the first bit at or after \a from in \a w which is set (if
+   \a set is true) or clear (if \a set is false), or 65536 if there
+   is none.
+*/
+
+static uint nextBit( const Word * w, uint from, bool set )
+{
+    if ( from >= 65536 )
+        return 65536;
+    uint i = from / WordBits;
+    Word x = set ? w[i] : ~w[i];
+    x &= ~(Word)0 << ( from % WordBits );
+    while ( !x ) {
+        i++;
+        if ( i >= Words )
+            return 65536;
+        x = set ? w[i] : ~w[i];
+    }
+    return i * WordBits + lowestBit( x );
+}
+
+
+/* A Container holds the members of an IntegerSet which share the
+   same 16 most significant bits (the key).
+
+   Sparse containers are sorted arrays of the low 16 bits, dense ones
+   are bitmaps with one bit per possible member, and those which are
+   mostly contiguous are lists of runs, stored as pairs of first and
+   last member. fromBitmap() picks the smallest representation.
+*/
+
+class Container
     : public Garbage
 {
 public:
-    SetData() {}
-
-    class Block
-        : public Garbage
-    {
-    public:
-        Block( uint s )
-            : Garbage(), start( s ), count( 0 ) {
-            setFirstNonPointer( &start );
-            uint i = 0;
-            while ( i < ArraySize )
-                contents[i++] = 0;
+    enum Type { Array, Bitmap, Run };
+
+    Container( uint k )
+        : Garbage(), values( 0 ), bits( 0 ), sums( 0 ),
+          key( k ), type( Array ), size( 0 ), capacity( 0 ), count( 0 ) {
+        setFirstNonPointer( &key );
+    }
+
+    Container( const Container & other )
+        : Garbage(), values( 0 ), bits( 0 ), sums( 0 ),
+          key( other.key ), type( other.type ), size( other.size ),
+          capacity( 0 ), count( other.count ) {
+        setFirstNonPointer( &key );
+        if ( type == Bitmap ) {
+            bits = newBits();
+            memcpy( bits, other.bits, BitmapBytes );
         }
-        Block( const Block & other )
-            : Garbage(), start( other.start ), count( other.count ) {
-            setFirstNonPointer( &start );
-            uint i = 0;
-            while ( i < ArraySize ) {
-                contents[i] = other.contents[i];
-                ++i;
-            }
+        else if ( size ) {
+            capacity = type == Run ? size * 2 : size;
+            values = newValues( capacity );
+            memcpy( values, other.values, capacity * sizeof( ushort ) );
+        }
+    }
+
+    // Array: the members. Run: the first and last member of each run.
+    ushort * values;
+    // Bitmap: one bit per possible member.
+    Word * bits;
+    // Run: sums[i] is the number of members in the runs before run i,
+    // built by rank() and select() and discarded by any change.
+    uint * sums;
+    // no pointers after this line
+    uint key;
+    Type type;
+    // number of members (Array) or runs (Run)
+    uint size;
+    // number of ushorts allocated for values
+    uint capacity;
+    uint count;
+
+    static ushort * newValues( uint n ) {
+        return (ushort*)Allocator::alloc( n * sizeof( ushort ), 0 );
+    }
+    static Word * newBits() {
+        return (Word*)Allocator::alloc( BitmapBytes, 0 );
+    }
+
+    uint find( uint ) const;
+    bool contains( uint ) const;
+    uint rank( uint ) const;
+    uint select( uint ) const;
+    uint smallest() const;
+    uint largest() const;
+    bool range( uint, uint &, uint & ) const;
+
+    void insert( uint );
+    void erase( uint );
+    void add( uint, uint );
+    void remove( uint, uint );
+
+    void toBitmap( Word * ) const;
+    const Word * asBitmap( Word * ) const;
+    uint * runSums() const;
+    void fromBitmap( const Word * );
+
+    void unite( const Container * );
+    void subtract( const Container * );
+    Container * intersection( const Container * ) const;
+    bool contains( const Container * ) const;
+
+private:
+    void reserve( uint );
+};
+
+
+/* Returns the position of the first value/run whose (last) member is
+   at least \a x, or size if there is none. Not for bitmaps.
+*/
+
+uint Container::find( uint x ) const
+{
+    uint lo = 0;
+    uint hi = size;
+    if ( type == Array ) {
+        while ( lo < hi ) {
+            uint m = ( lo + hi ) / 2;
+            if ( values[m] < x )
+                lo = m + 1;
+            else
+                hi = m;
+        }
+    }
+    else {
+        while ( lo < hi ) {
+            uint m = ( lo + hi ) / 2;
+            if ( values[m*2+1] < x )
+                lo = m + 1;
+            else
+                hi = m;
+        }
+    }
+    return lo;
+}
+
+
+bool Container::contains( uint x ) const
+{
+    if ( type == Bitmap )
+        return ( bits[x/WordBits] >> ( x % WordBits ) ) & 1;
+    uint i = find( x );
+    if ( i >= size )
+        return false;
+    if ( type == Array )
+        return values[i] == x;
+    return values[i*2] <= x;
+}
+
+
+/* Returns the number of members less than or equal to \a x. */
+
+uint Container::rank( uint x ) const
+{
+    if ( type == Array ) {
+        uint i = find( x );
+        if ( i < size && values[i] == x )
+            i++;
+        return i;
+    }
+
+    if ( type == Bitmap ) {
+        uint r = 0;
+        uint i = 0;
+        uint n = x / WordBits;
+        while ( i < n )
+            r += bitsSet( bits[i++] );
+        uint b = x % WordBits;
+        Word mask = b == WordBits - 1 ? ~(Word)0 : ( (Word)1 << ( b + 1 ) ) - 1;
+        return r + bitsSet( bits[n] & mask );
+    }
+
+    uint i = find( x );
+    uint r = runSums()[i];
+    if ( i < size && values[i*2] <= x )
+        r += x - values[i*2] + 1;
+    return r;
+}
+
+
+/* Returns member number \a k, counting from 0. */
+
+uint Container::select( uint k ) const
+{
+    if ( type == Array )
+        return values[k];
+
+    if ( type == Bitmap ) {
+        uint i = 0;
+        uint c = bitsSet( bits[0] );
+        while ( c <= k ) {
+            k -= c;
+            c = bitsSet( bits[++i] );
+        }
+        Word w = bits[i];
+        while ( k-- )
+            w &= w - 1;
+        return i * WordBits + lowestBit( w );
+    }
+
+    // find the last run with at most k members before it
+    const uint * s = runSums();
+    uint lo = 0;
+    uint hi = size - 1;
+    while ( lo < hi ) {
+        uint m = ( lo + hi + 1 ) / 2;
+        if ( s[m] <= k )
+            lo = m;
+        else
+            hi = m - 1;
+    }
+    return values[lo*2] + k - s[lo];
+}
+
+
+/* Returns the cumulative run lengths of this run container, building
+   them if necessary.
+*/
+
+uint * Container::runSums() const
+{
+    if ( sums )
+        return sums;
+    uint * s = (uint*)Allocator::alloc( ( size + 1 ) * sizeof( uint ), 0 );
+    s[0] = 0;
+    uint i = 0;
+    while ( i < size ) {
+        s[i+1] = s[i] + values[i*2+1] - values[i*2] + 1;
+        i++;
+    }
+    ((Container*)this)->sums = s;
+    return s;
+}
+
+
+uint Container::smallest() const
+{
+    if ( type == Bitmap )
+        return nextBit( bits, 0, true );
+    return values[0];
+}
+
+
+uint Container::largest() const
+{
+    if ( type == Array )
+        return values[size-1];
+    if ( type == Run )
+        return values[size*2-1];
+    uint i = Words - 1;
+    while ( !bits[i] )
+        i--;
+    return i * WordBits + WordBits - 1 - __builtin_clzll( bits[i] );
+}
+
+
+/* Finds the first range of consecutive members whose last member is
+   at least \a from, and stores its first and last member in \a first
+   and \a last. Returns false if there is no such range.
+*/
+
+bool Container::range( uint from, uint & first, uint & last ) const
+{
+    if ( type == Bitmap ) {
+        first = nextBit( bits, from, true );
+        if ( first >= 65536 )
+            return false;
+        last = nextBit( bits, first, false ) - 1;
+        return true;
+    }
+
+    uint i = find( from );
+    if ( i >= size )
+        return false;
+    if ( type == Run ) {
+        first = values[i*2];
+        last = values[i*2+1];
+        if ( first < from )
+            first = from;
+        return true;
+    }
+    first = values[i];
+    while ( i + 1 < size && values[i+1] == values[i] + 1 )
+        i++;
+    last = values[i];
+    return true;
+}
+
+
+/* Makes sure that values has room for at least \a n ushorts. */
+
+void Container::reserve( uint n )
+{
+    if ( capacity >= n )
+        return;
+    uint c = capacity * 2;
+    if ( c < 8 )
+        c = 8;
+    while ( c < n )
+        c *= 2;
+    ushort * v = newValues( c );
+    if ( values )
+        memcpy( v, values, capacity * sizeof( ushort ) );
+    values = v;
+    capacity = c;
+}
+
+
+/* Adds \a x to this container. */
+
+void Container::insert( uint x )
+{
+    sums = 0;
+    if ( type == Bitmap ) {
+        Word b = (Word)1 << ( x % WordBits );
+        if ( !( bits[x/WordBits] & b ) ) {
+            bits[x/WordBits] |= b;
+            count++;
         }
+        return;
+    }
 
-        uint start;
-        uint count;
-        uint contents[ArraySize];
+    uint i = find( x );
 
-        inline void insert( uint n ) {
-            if ( n < start )
-                return;
-            uint i = n - start;
-            if ( i >= BlockSize )
-                return;
+    if ( type == Array ) {
+        if ( i < size && values[i] == x )
+            return;
+        if ( size >= ArrayMax ) {
+            toBitmap( scratch1 );
+            setRange( scratch1, x, x );
+            fromBitmap( scratch1 );
+            return;
+        }
+        reserve( size + 1 );
+        memmove( values + i + 1, values + i, ( size - i ) * sizeof( ushort ) );
+        values[i] = x;
+        size++;
+        count++;
+        return;
+    }
 
-            if ( !(contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) )
-                count++;
-            contents[i/BitsPerUint] |= 1 << ( i % BitsPerUint );
+    // a run container. i is the first run whose last member >= x.
+    if ( i < size && values[i*2] <= x )
+        return;
+    bool joinsPrevious = i > 0 && (uint)values[i*2-1] + 1 == x;
+    bool joinsNext = i < size && values[i*2] == x + 1;
+    if ( joinsPrevious && joinsNext ) {
+        values[i*2-1] = values[i*2+1];
+        memmove( values + i*2, values + i*2 + 2,
+                 ( size - i - 1 ) * 2 * sizeof( ushort ) );
+        size--;
+    }
+    else if ( joinsPrevious ) {
+        values[i*2-1] = x;
+    }
+    else if ( joinsNext ) {
+        values[i*2] = x;
+    }
+    else {
+        if ( ( size + 1 ) * 2 * sizeof( ushort ) >= BitmapBytes ) {
+            toBitmap( scratch1 );
+            setRange( scratch1, x, x );
+            fromBitmap( scratch1 );
+            return;
         }
+        reserve( size * 2 + 2 );
+        memmove( values + i*2 + 2, values + i*2,
+                 ( size - i ) * 2 * sizeof( ushort ) );
+        values[i*2] = x;
+        values[i*2+1] = x;
+        size++;
+    }
+    count++;
+}
 
-        void recount() {
-            count = 0;
-            uint i = 0;
-            while ( i < ArraySize )
-                count += bitsSet( contents[i++] );
+
+/* Removes \a x from this container. */
+
+void Container::erase( uint x )
+{
+    sums = 0;
+    if ( type == Bitmap ) {
+        Word b = (Word)1 << ( x % WordBits );
+        if ( bits[x/WordBits] & b ) {
+            bits[x/WordBits] &= ~b;
+            count--;
+        }
+        return;
+    }
+
+    uint i = find( x );
+    if ( type == Array ) {
+        if ( i >= size || values[i] != x )
+            return;
+        memmove( values + i, values + i + 1,
+                 ( size - i - 1 ) * sizeof( ushort ) );
+        size--;
+        count--;
+        return;
+    }
+
+    if ( i >= size || values[i*2] > x )
+        return;
+    uint first = values[i*2];
+    uint last = values[i*2+1];
+    if ( first == last ) {
+        memmove( values + i*2, values + i*2 + 2,
+                 ( size - i - 1 ) * 2 * sizeof( ushort ) );
+        size--;
+    }
+    else if ( x == first ) {
+        values[i*2] = x + 1;
+    }
+    else if ( x == last ) {
+        values[i*2+1] = x - 1;
+    }
+    else {
+        if ( ( size + 1 ) * 2 * sizeof( ushort ) >= BitmapBytes ) {
+            toBitmap( scratch1 );
+            clearRange( scratch1, x, x );
+            fromBitmap( scratch1 );
+            return;
         }
+        reserve( size * 2 + 2 );
+        memmove( values + i*2 + 2, values + i*2,
+                 ( size - i ) * 2 * sizeof( ushort ) );
+        values[i*2+1] = x - 1;
+        values[i*2+2] = x + 1;
+        size++;
+    }
+    count--;
+}
+
 
-        void merge( Block * other ) {
-            count = 0;
-            uint i = 0;
-            while ( i < ArraySize ) {
-                contents[i] |= other->contents[i];
-                ++i;
+/* Adds \a lo, \a hi and everything in between to this container. */
+
+void Container::add( uint lo, uint hi )
+{
+    sums = 0;
+    if ( lo == hi ) {
+        insert( lo );
+        return;
+    }
+    if ( !count && hi - lo > 1 ) {
+        type = Run;
+        size = 0;
+        reserve( 2 );
+        values[0] = lo;
+        values[1] = hi;
+        size = 1;
+        count = hi - lo + 1;
+        bits = 0;
+        return;
+    }
+    if ( type == Bitmap ) {
+        setRange( bits, lo, hi );
+        fromBitmap( bits );
+        return;
+    }
+    toBitmap( scratch1 );
+    setRange( scratch1, lo, hi );
+    fromBitmap( scratch1 );
+}
+
+
+/* Removes \a lo, \a hi and everything in between from this container. */
+
+void Container::remove( uint lo, uint hi )
+{
+    sums = 0;
+    if ( lo == hi ) {
+        erase( lo );
+        return;
+    }
+    if ( type == Bitmap ) {
+        clearRange( bits, lo, hi );
+        fromBitmap( bits );
+        return;
+    }
+    toBitmap( scratch1 );
+    clearRange( scratch1, lo, hi );
+    fromBitmap( scratch1 );
+}
+
+
+/* Stores the members of this container in the bitmap \a w. */
+
+void Container::toBitmap( Word * w ) const
+{
+    if ( type == Bitmap ) {
+        if ( w != bits )
+            memcpy( w, bits, BitmapBytes );
+        return;
+    }
+    memset( w, 0, BitmapBytes );
+    uint i = 0;
+    if ( type == Array ) {
+        while ( i < size ) {
+            uint x = values[i++];
+            w[x/WordBits] |= (Word)1 << ( x % WordBits );
+        }
+    }
+    else {
+        while ( i < size ) {
+            setRange( w, values[i*2], values[i*2+1] );
+            i++;
+        }
+    }
+}
+
+
+/* Returns a bitmap containing the members of this container, using
+   \a w if necessary.
+*/
+
+const Word * Container::asBitmap( Word * w ) const
+{
+    if ( type == Bitmap )
+        return bits;
+    toBitmap( w );
+    return w;
+}
+
+
+/* Makes this container contain the members in the bitmap \a w, which
+   may be this container's own bitmap, using the most compact
+   representation.
+*/
+
+void Container::fromBitmap( const Word * w )
+{
+    sums = 0;
+    uint c = 0;
+    uint runs = 0;
+    Word carry = 0;
+    uint i = 0;
+    while ( i < Words ) {
+        Word x = w[i];
+        c += bitsSet( x );
+        runs += bitsSet( x & ~( ( x << 1 ) | carry ) );
+        carry = x >> ( WordBits - 1 );
+        i++;
+    }
+    count = c;
+
+    uint limit = BitmapBytes;
+    if ( c <= ArrayMax )
+        limit = c * sizeof( ushort );
+
+    if ( runs * 2 * sizeof( ushort ) < limit ) {
+        if ( type != Run )
+            capacity = 0;
+        type = Run;
+        size = 0;
+        reserve( runs * 2 );
+        uint x = nextBit( w, 0, true );
+        while ( x < 65536 ) {
+            uint e = nextBit( w, x, false );
+            values[size*2] = x;
+            values[size*2+1] = e - 1;
+            size++;
+            x = nextBit( w, e, true );
+        }
+        bits = 0;
+    }
+    else if ( c <= ArrayMax ) {
+        if ( type != Array )
+            capacity = 0;
+        type = Array;
+        size = 0;
+        reserve( c );
+        i = 0;
+        while ( i < Words ) {
+            Word x = w[i];
+            while ( x ) {
+                values[size++] = i * WordBits + lowestBit( x );
+                x &= x - 1;
             }
+            i++;
+        }
+        bits = 0;
+    }
+    else {
+        if ( type != Bitmap || !bits )
+            bits = newBits();
+        if ( w != bits )
+            memcpy( bits, w, BitmapBytes );
+        type = Bitmap;
+        values = 0;
+        capacity = 0;
+        size = 0;
+    }
+}
+
+
+/* Adds all members of \a other to this container. */
+
+void Container::unite( const Container * other )
+{
+    sums = 0;
+    if ( type == Bitmap && other->type == Bitmap ) {
+        uint c = 0;
+        uint i = 0;
+        while ( i < Words ) {
+            bits[i] |= other->bits[i];
+            c += bitsSet( bits[i] );
+            i++;
         }
-    };
+        count = c;
+        return;
+    }
+
+    if ( other->type == Array && other->count < 64 ) {
+        uint i = 0;
+        while ( i < other->size )
+            insert( other->values[i++] );
+        return;
+    }
+
+    Word * w = type == Bitmap ? bits : scratch1;
+    toBitmap( w );
+    const Word * o = other->asBitmap( scratch2 );
+    uint i = 0;
+    while ( i < Words ) {
+        w[i] |= o[i];
+        i++;
+    }
+    fromBitmap( w );
+}
+
 
-    Map<Block> b;
+/* Removes all members of \a other from this container. */
+
+void Container::subtract( const Container * other )
+{
+    sums = 0;
+    if ( type == Array ) {
+        uint n = 0;
+        uint i = 0;
+        while ( i < size ) {
+            if ( !other->contains( values[i] ) )
+                values[n++] = values[i];
+            i++;
+        }
+        size = n;
+        count = n;
+        return;
+    }
+
+    Word * w = type == Bitmap ? bits : scratch1;
+    toBitmap( w );
+    const Word * o = other->asBitmap( scratch2 );
+    uint i = 0;
+    while ( i < Words ) {
+        w[i] &= ~o[i];
+        i++;
+    }
+    fromBitmap( w );
+}
+
+
+/* Returns a new container with the members common to this container
+   and \a other.
+*/
+
+Container * Container::intersection( const Container * other ) const
+{
+    Container * r = new Container( key );
+    const Container * a = this;
+    const Container * b = other;
+    if ( b->type == Array && ( a->type != Array || b->size < a->size ) ) {
+        a = other;
+        b = this;
+    }
+
+    if ( a->type == Array ) {
+        r->reserve( a->size );
+        uint i = 0;
+        while ( i < a->size ) {
+            if ( b->contains( a->values[i] ) )
+                r->values[r->size++] = a->values[i];
+            i++;
+        }
+        r->count = r->size;
+        return r;
+    }
+
+    const Word * x = a->asBitmap( scratch1 );
+    const Word * y = b->asBitmap( scratch2 );
+    uint i = 0;
+    while ( i < Words ) {
+        scratch1[i] = x[i] & y[i];
+        i++;
+    }
+    r->fromBitmap( scratch1 );
+    return r;
+}
+
+
+/* Returns true if this container contains all members of \a other. */
+
+bool Container::contains( const Container * other ) const
+{
+    if ( other->count > count )
+        return false;
+
+    if ( other->type == Array ) {
+        uint i = 0;
+        while ( i < other->size ) {
+            if ( !contains( other->values[i] ) )
+                return false;
+            i++;
+        }
+        return true;
+    }
+
+    const Word * x = asBitmap( scratch1 );
+    const Word * y = other->asBitmap( scratch2 );
+    uint i = 0;
+    while ( i < Words ) {
+        if ( y[i] & ~x[i] )
+            return false;
+        i++;
+    }
+    return true;
+}
+
+
+class SetData
+    : public Garbage
+{
+public:
+    SetData(): c( 0 ), cum( 0 ), n( 0 ), max( 0 ), counted( 0 ) {
+        setFirstNonPointer( &n );
+    }
+
+    // the containers, sorted by key
+    Container ** c;
+    // cum[i] is the number of members in c[0] to c[i-1]
+    uint * cum;
+    // no pointers after this line
+    uint n;
+    uint max;
+    // cum[0] to cum[counted] are correct
+    uint counted;
+
+    uint find( uint ) const;
+    Container * container( uint, uint & );
+    void insert( uint, Container * );
+    void take( uint );
+    void changed( uint i ) { if ( counted > i ) counted = i; }
 };
 
 
+/* Returns the position of the first container whose key is at least
+   \a key, or n if there is none.
+*/
+
+uint SetData::find( uint key ) const
+{
+    uint lo = 0;
+    uint hi = n;
+    while ( lo < hi ) {
+        uint m = ( lo + hi ) / 2;
+        if ( c[m]->key < key )
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo;
+}
+
+
+/* Returns the container for \a key, creating it if necessary, and
+   stores its position in \a i.
+*/
+
+Container * SetData::container( uint key, uint & i )
+{
+    i = find( key );
+    if ( i < n && c[i]->key == key )
+        return c[i];
+    Container * x = new Container( key );
+    insert( i, x );
+    return x;
+}
+
+
+/* Inserts \a x at position \a i. */
+
+void SetData::insert( uint i, Container * x )
+{
+    if ( n == max ) {
+        uint m = max * 2;
+        if ( m < 4 )
+            m = 4;
+        Container ** nc
+            = (Container**)Allocator::alloc( m * sizeof( Container * ) );
+        uint * ncum = (uint*)Allocator::alloc( ( m + 1 ) * sizeof( uint ), 0 );
+        if ( n ) {
+            memcpy( nc, c, n * sizeof( Container * ) );
+            memcpy( ncum, cum, ( n + 1 ) * sizeof( uint ) );
+        }
+        else {
+            ncum[0] = 0;
+        }
+        c = nc;
+        cum = ncum;
+        max = m;
+    }
+    memmove( c + i + 1, c + i, ( n - i ) * sizeof( Container * ) );
+    c[i] = x;
+    n++;
+    changed( i );
+}
+
+
+/* Removes the container at position \a i. */
+
+void SetData::take( uint i )
+{
+    memmove( c + i, c + i + 1, ( n - i - 1 ) * sizeof( Container * ) );
+    n--;
+    c[n] = 0;
+    changed( i );
+}
+
+
 /*! \class IntegerSet integerset.h
     This class contains a set of integers.
 
@@ -120,6 +914,15 @@ public:
     members to the set, find its members by value() or index() (sorted
     by size, with 1 first), look for the largest contained number, and
     produce an SQL "where" clause matching its contents.
+
+    The set is split into containers of 65536 numbers each, and each
+    container uses whichever representation is most compact: A sorted
+    array for sparse ones, a bitmap for dense ones, or a list of runs
+    when the members are mostly consecutive (as the UIDs in a mailbox
+    usually are). A cumulative count of the members in each container
+    lets value() and index() find the right container by binary
+    search, so that converting between MSNs and UIDs doesn't depend on
+    the size of the mailbox.
 */
 
 
@@ -149,10 +952,10 @@ IntegerSet& IntegerSet::operator=( const IntegerSet & other )
         return *this;
 
     d = new SetData;
-    Map<SetData::Block>::Iterator i( other.d->b );
-    while ( i ) {
-        d->b.insert( i->start, new SetData::Block( *i ) );
-        ++i;
+    uint i = 0;
+    while ( i < other.d->n ) {
+        d->insert( i, new Container( *other.d->c[i] ) );
+        i++;
     }
     return *this;
 }
@@ -177,25 +980,16 @@ void IntegerSet::add( uint n1, uint n2 )
         return;
     }
 
-    uint n = n1;
-    uint s = n - (n%BlockSize);
-    SetData::Block * b = d->b.find( s );
-    if ( !b ) {
-        b = new SetData::Block( s );
-        d->b.insert( s, b );
-    }
-    b->insert( n );
-    while ( n < n2 ) {
-        ++n;
-        if ( s != n - (n%BlockSize) ) {
-            s = n - (n%BlockSize);
-            b = d->b.find( s );
-            if ( !b ) {
-                b = new SetData::Block( s );
-                d->b.insert( s, b );
-            }
-        }
-        b->insert( n );
+    uint k = n1 >> 16;
+    uint last = n2 >> 16;
+    while ( k <= last ) {
+        uint lo = k == n1 >> 16 ? n1 & 0xffff : 0;
+        uint hi = k == last ? n2 & 0xffff : 0xffff;
+        uint i = 0;
+        Container * c = d->container( k, i );
+        c->add( lo, hi );
+        d->changed( i );
+        k++;
     }
 }
 
@@ -208,15 +1002,16 @@ void IntegerSet::add( const IntegerSet & set )
         *this = set;
         return;
     }
-    Map<SetData::Block>::Iterator i( set.d->b );
-    while( i ) {
-        SetData::Block * b = d->b.find( i->start );
-        if ( b )
-            b->merge( i );
+    uint h = 0;
+    while ( h < set.d->n ) {
+        Container * hers = set.d->c[h];
+        uint i = d->find( hers->key );
+        if ( i < d->n && d->c[i]->key == hers->key )
+            d->c[i]->unite( hers );
         else
-            d->b.insert( i->start, new SetData::Block( *i ) );
-
-        ++i;
+            d->insert( i, new Container( *hers ) );
+        d->changed( i );
+        h++;
     }
 }
 
@@ -227,7 +1022,9 @@ void IntegerSet::add( const IntegerSet & set )
 
 uint IntegerSet::smallest() const
 {
-    return value( 1 );
+    if ( !d->n )
+        return 0;
+    return ( d->c[0]->key << 16 ) + d->c[0]->smallest();
 }
 
 
@@ -237,17 +1034,10 @@ uint IntegerSet::smallest() const
 
 uint IntegerSet::largest() const
 {
-    SetData::Block * b = d->b.last();
-    if ( !b )
+    if ( !d->n )
         return 0;
-    uint i = ArraySize - 1;
-    while ( i && !b->contents[i] )
-        i--;
-    uint x = b->contents[i];
-    uint j = BitsPerUint-1;
-    while ( !(x & 1 << j) )
-        j--;
-    return b->start + i * BitsPerUint + j;
+    Container * c = d->c[d->n-1];
+    return ( c->key << 16 ) + c->largest();
 }
 
 
@@ -255,14 +1045,10 @@ uint IntegerSet::largest() const
 
 uint IntegerSet::count() const
 {
+    if ( !d->n )
+        return 0;
     recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        c += i->count;
-        ++i;
-    }
-    return c;
+    return d->cum[d->n];
 }
 
 
@@ -270,7 +1056,7 @@ uint IntegerSet::count() const
 
 bool IntegerSet::isEmpty() const
 {
-    return d->b.isEmpty();
+    return d->n == 0;
 }
 
 
@@ -283,33 +1069,24 @@ bool IntegerSet::isEmpty() const
 
 uint IntegerSet::value( uint index ) const
 {
-    if ( !index )
+    if ( !index || !d->n )
         return 0;
     recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i && c + i->count < index ) {
-        c += i->count;
-        ++i;
-    }
-    if ( !i )
+    if ( index > d->cum[d->n] )
         return 0;
 
-    uint bs = bitsSet( i->contents[0] );
-    uint n = 0;
-    while ( c + bs < index ) {
-        c += bs;
-        n++;
-        bs = bitsSet( i->contents[n] );
-    }
-    uint j = 0;
-    while ( c < index && j < BitsPerUint ) {
-        if ( i->contents[n] & ( 1 << j ) )
-            c++;
-        if ( c < index )
-            j++;
+    // find the last container with fewer than index members before it
+    uint lo = 0;
+    uint hi = d->n - 1;
+    while ( lo < hi ) {
+        uint m = ( lo + hi + 1 ) / 2;
+        if ( d->cum[m] < index )
+            lo = m;
+        else
+            hi = m - 1;
     }
-    return i->start + n*BitsPerUint + j;
+    Container * c = d->c[lo];
+    return ( c->key << 16 ) + c->select( index - d->cum[lo] - 1 );
 }
 
 
@@ -322,29 +1099,15 @@ uint IntegerSet::value( uint index ) const
 
 uint IntegerSet::index( uint value ) const
 {
-    recount();
-    uint i = 0;
-    Map<SetData::Block>::Iterator b( d->b );
-    while ( b && b->start + BlockSize - 1 < value ) {
-        i += b->count;
-        ++b;
-    }
-    if ( !b )
-        return 0;
-
-    if ( b->start > value )
+    uint i = d->find( value >> 16 );
+    if ( i >= d->n || d->c[i]->key != value >> 16 )
         return 0;
-
-    uint vi = (value-b->start)/BitsPerUint;
-    if ( !(b->contents[vi] & 1 << (value%BitsPerUint)) )
+    Container * c = d->c[i];
+    uint x = value & 0xffff;
+    if ( !c->contains( x ) )
         return 0;
-    uint n = 0;
-    while ( n < vi ) {
-        i += bitsSet( b->contents[n] );
-        n++;
-    }
-    i += bitsSet ( b->contents[vi] & ~( 0xfffffffe << (value%BitsPerUint) ) );
-    return i;
+    recount();
+    return d->cum[i] + c->rank( x );
 }
 
 
@@ -352,13 +1115,10 @@ uint IntegerSet::index( uint value ) const
 
 bool IntegerSet::contains( uint value ) const
 {
-    SetData::Block * b = d->b.find( value - (value%BlockSize) );
-    if ( !b )
+    uint i = d->find( value >> 16 );
+    if ( i >= d->n || d->c[i]->key != value >> 16 )
         return false;
-    uint n = value%BlockSize;
-    if ( b->contents[n/BitsPerUint] & ( 1 << n%BitsPerUint ) )
-        return true;
-    return false;
+    return d->c[i]->contains( value & 0xffff );
 }
 
 
@@ -367,26 +1127,15 @@ bool IntegerSet::contains( uint value ) const
 
 void IntegerSet::remove( uint value )
 {
-    SetData::Block * b = d->b.find( value - (value%BlockSize) );
-    if ( !b )
-        return;
-
-    uint i = value - b->start;
-    if ( i >= BlockSize )
-        return;
-
-    if ( ! ( (b->contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) ) )
+    uint i = d->find( value >> 16 );
+    if ( i >= d->n || d->c[i]->key != value >> 16 )
         return;
-
-    b->contents[i/BitsPerUint] &= ~(1 << ( i % BitsPerUint ) );
-    if ( b->count ) {
-        b->count--;
-        if ( !b->count )
-            d->b.remove( b->start );
-    }
-    else {
-        recount();
-    }
+    Container * c = d->c[i];
+    c->erase( value & 0xffff );
+    if ( c->count )
+        d->changed( i );
+    else
+        d->take( i );
 }
 
 
@@ -394,9 +1143,25 @@ void IntegerSet::remove( uint value )
 
 void IntegerSet::remove( uint v1, uint v2 )
 {
-    IntegerSet r;
-    r.add( v1, v2 );
-    remove( r );
+    if ( v2 < v1 ) {
+        remove( v2, v1 );
+        return;
+    }
+
+    uint i = d->find( v1 >> 16 );
+    while ( i < d->n && d->c[i]->key <= v2 >> 16 ) {
+        Container * c = d->c[i];
+        uint lo = c->key == v1 >> 16 ? v1 & 0xffff : 0;
+        uint hi = c->key == v2 >> 16 ? v2 & 0xffff : 0xffff;
+        c->remove( lo, hi );
+        if ( c->count ) {
+            d->changed( i );
+            i++;
+        }
+        else {
+            d->take( i );
+        }
+    }
 }
 
 
@@ -404,27 +1169,27 @@ void IntegerSet::remove( uint v1, uint v2 )
 
 void IntegerSet::remove( const IntegerSet & other )
 {
-    Map<SetData::Block>::Iterator mine( d->b );
-    Map<SetData::Block>::Iterator hers( other.d->b );
-    while ( mine && hers ) {
-        while ( mine && mine->start < hers->start )
-            ++mine;
-        while ( hers && hers->start < mine->start )
-            ++hers;
-        if ( mine && hers ) {
-            uint i = 0;
-            uint u = 0;
-            uint s = mine->start;
-            while ( i < ArraySize ) {
-                mine->contents[i] &= ~ hers->contents[i];
-                u |= mine->contents[i];
+    uint i = 0;
+    uint h = 0;
+    while ( i < d->n && h < other.d->n ) {
+        Container * mine = d->c[i];
+        Container * hers = other.d->c[h];
+        if ( mine->key < hers->key ) {
+            i++;
+        }
+        else if ( hers->key < mine->key ) {
+            h++;
+        }
+        else {
+            mine->subtract( hers );
+            if ( mine->count ) {
+                d->changed( i );
                 i++;
             }
-            mine->count = 0;
-            ++mine;
-            ++hers;
-            if ( !u )
-                d->b.remove( s );
+            else {
+                d->take( i );
+            }
+            h++;
         }
     }
 }
@@ -436,27 +1201,23 @@ void IntegerSet::remove( const IntegerSet & other )
 IntegerSet IntegerSet::intersection( const IntegerSet & other ) const
 {
     IntegerSet r;
-    Map<SetData::Block>::Iterator mine( d->b );
-    Map<SetData::Block>::Iterator hers( other.d->b );
-    while ( mine && hers ) {
-        while ( mine && mine->start < hers->start )
-            ++mine;
-        if ( mine )
-            while ( hers && hers->start < mine->start )
-                ++hers;
-        if ( mine && hers ) {
-            SetData::Block * b = new SetData::Block( mine->start );
-            uint u = 0;
-            uint i = 0;
-            while ( i < ArraySize ) {
-                b->contents[i] = mine->contents[i] & hers->contents[i];
-                u |= b->contents[i];
-                i++;
-            }
-            if ( u )
-                r.d->b.insert( b->start, b );
-            ++mine;
-            ++hers;
+    uint i = 0;
+    uint h = 0;
+    while ( i < d->n && h < other.d->n ) {
+        Container * mine = d->c[i];
+        Container * hers = other.d->c[h];
+        if ( mine->key < hers->key ) {
+            i++;
+        }
+        else if ( hers->key < mine->key ) {
+            h++;
+        }
+        else {
+            Container * c = mine->intersection( hers );
+            if ( c->count )
+                r.d->insert( r.d->n, c );
+            i++;
+            h++;
         }
     }
     return r;
@@ -500,36 +1261,26 @@ EString IntegerSet::set() const
     uint s = 0;
     uint e = 0;
 
-    Map<SetData::Block>::Iterator it( d->b );
-    while ( it ) {
-        uint v = it->start;
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !e ) {
-                            s = v + j;
-                            e = s;
-                        }
-                        else if ( e + 1 < v + j ) {
-                            addRange( r, s, e );
-                            s = v + j;
-                            e = s;
-                        }
-                        else {
-                            e = v + j;
-                        }
-                    }
-                    j++;
-                }
+    uint i = 0;
+    while ( i < d->n ) {
+        Container * c = d->c[i];
+        uint base = c->key << 16;
+        uint first = 0;
+        uint last = 0;
+        uint from = 0;
+        while ( from < 65536 && c->range( from, first, last ) ) {
+            if ( e && e + 1 == base + first ) {
+                e = base + last;
             }
-            n++;
-            v += BitsPerUint;
+            else {
+                if ( e )
+                    addRange( r, s, e );
+                s = base + first;
+                e = base + last;
+            }
+            from = last + 1;
         }
-        ++it;
+        i++;
     }
     if ( e )
         addRange( r, s, e );
@@ -546,44 +1297,40 @@ EString IntegerSet::csl() const
     EString r;
     r.reserve( 2222 );
 
-    Map<SetData::Block>::Iterator it( d->b );
-    while ( it ) {
-        uint n = 0;
-        while ( n < ArraySize ) {
-            uint j = 0;
-            uint b = it->contents[n];
-            if ( b ) {
-                while ( j < BitsPerUint ) {
-                    if ( b & ( 1 << j ) ) {
-                        if ( !r.isEmpty() )
-                            r.append( ',' );
-                        r.appendNumber( it->start + n * BitsPerUint + j );
-                    }
-                    j++;
-                }
+    uint i = 0;
+    while ( i < d->n ) {
+        Container * c = d->c[i];
+        uint base = c->key << 16;
+        uint first = 0;
+        uint last = 0;
+        uint from = 0;
+        while ( from < 65536 && c->range( from, first, last ) ) {
+            uint x = first;
+            while ( x <= last ) {
+                if ( !r.isEmpty() )
+                    r.append( ',' );
+                r.appendNumber( base + x );
+                x++;
             }
-            n++;
+            from = last + 1;
         }
-        ++it;
+        i++;
     }
     return r;
 }
 
 
-/*! This private helper ensures that all blocks have an accurate count
-    of set bits, and that no blocks are empty.
+/*! This private helper brings the cumulative count used by count(),
+    value() and index() up to date.
 */
 
 void IntegerSet::recount() const
 {
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        SetData::Block * b = i;
-        ++i;
-        if ( !b->count )
-            b->recount();
-        if ( !b->count )
-            d->b.remove( b->start );
+    if ( !d->cum )
+        return;
+    while ( d->counted < d->n ) {
+        d->cum[d->counted+1] = d->cum[d->counted] + d->c[d->counted]->count;
+        d->counted++;
     }
 }
 
@@ -594,24 +1341,17 @@ void IntegerSet::recount() const
 
 bool IntegerSet::contains( const IntegerSet & other ) const
 {
-    Map<SetData::Block>::Iterator m( d->b );
-    Map<SetData::Block>::Iterator h( other.d->b );
-    while ( h ) {
-        while ( m && m->start < h->start )
-            ++m;
-        if ( !m )
-            return false;
-        if ( h->start < m->start )
+    uint i = 0;
+    uint h = 0;
+    while ( h < other.d->n ) {
+        Container * hers = other.d->c[h];
+        while ( i < d->n && d->c[i]->key < hers->key )
+            i++;
+        if ( i >= d->n || d->c[i]->key != hers->key )
             return false;
-        if ( h->count && m->count && h->count > m->count )
+        if ( !d->c[i]->contains( hers ) )
             return false;
-        uint i = 0;
-        while ( i < ArraySize ) {
-            if ( ( m->contents[i] & h->contents[i] ) != h->contents[i] )
-                return false;
-            i++;
-        }
-        ++h;
+        h++;
     }
     return true;
 }
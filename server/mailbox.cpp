@@ -190,17 +190,58 @@ void MailboxReader::execute() {
 };
 
 
+// this helper updates the sessions on mailboxes whose uidnext or
+// nextmodseq the MailboxesWatcher has changed. it waits a little, so
+// that a busy mailbox gets one SessionInitialiser per 2-3 seconds
+// rather than one per delivery, as with a full MailboxReader.
+class SessionRefresher
+    : public EventHandler
+{
+public:
+    SessionRefresher(): EventHandler(), t( 0 ) {}
+
+    void add( Mailbox * mb ) {
+        if ( !pending.find( mb ) )
+            pending.append( mb );
+        if ( !t || !t->active() )
+            t = new Timer( this, 2 );
+    }
+
+    void execute() {
+        if ( EventLoop::global()->inShutdown() )
+            return;
+        List<Mailbox>::Iterator i( pending );
+        while ( i ) {
+            i->refreshSessions( 0 );
+            ++i;
+        }
+        pending.clear();
+    }
+
+    List<Mailbox> pending;
+    Timer * t;
+};
+
+
 class MailboxesWatcher
     : public EventHandler
 {
 public:
-    MailboxesWatcher(): EventHandler(), t( 0 ), m( 0 ) {
-        (void)new DatabaseSignal( "mailboxes_updated", this );
+    MailboxesWatcher()
+        : EventHandler(), t( 0 ), m( 0 ), s( 0 ),
+          r( new SessionRefresher ) {
+        s = new DatabaseSignal( "mailboxes_updated", this );
     }
     void execute() {
         if ( EventLoop::global()->inShutdown() )
             return;
 
+        // if the notification tells us what changed, and it's only
+        // uidnext/nextmodseq, we can apply that without rereading
+        // every mailbox.
+        if ( applyDelta( s->payload() ) )
+            return;
+
         if ( !t ) {
             // use a timer to run only one mailboxreader per 2-3
             // seconds.
@@ -221,8 +262,49 @@ public:
             m->q->execute();
         }
     }
+
+    // the mailbox update trigger sends "id uidnext nextmodseq" when
+    // that's all that changed (and the server is new enough to send
+    // payloads). returns true if p was such a payload and has
+    // been handled.
+    bool applyDelta( const EString & p ) {
+        if ( p.isEmpty() )
+            return false;
+        int64 n[3];
+        uint f = 0;
+        uint i = 0;
+        while ( f < 3 ) {
+            uint b = i;
+            n[f] = 0;
+            while ( p[i] >= '0' && p[i] <= '9' && i - b < 18 )
+                n[f] = n[f] * 10 + p[i++] - '0';
+            if ( i == b || ( f < 2 && p[i] != ' ' ) )
+                return false;
+            i++;
+            f++;
+        }
+        if ( i <= p.length() || n[1] > 0xffffffffLL )
+            return false;
+        Mailbox * mb = Mailbox::find( (uint)n[0] );
+        if ( !mb )
+            return false;
+        // notifications may be delivered out of order relative to
+        // our own updates, so never go backwards
+        if ( mb->uidnext() > n[1] || mb->nextModSeq() > n[2] ||
+             ( mb->uidnext() == n[1] && mb->nextModSeq() == n[2] ) )
+            return true;
+        // the new values are visible at once, but the sessions are
+        // updated a little later
+        mb->d->uidnext = (uint)n[1];
+        mb->d->nextModSeq = n[2];
+        r->add( mb );
+        return true;
+    }
+
     Timer * t;
     MailboxReader * m;
+    DatabaseSignal * s;
+    SessionRefresher * r;
 };
 
 
@@ -630,7 +712,16 @@ void Mailbox::setUidnextAndNextModSeq( uint n, int64 m, Transaction * t )
         return;
     d->uidnext = n;
     d->nextModSeq = m;
+    refreshSessions( t );
+}
+
 
+/*! Starts updating the sessions on this Mailbox and its views, using
+    subtransactions of \a t if \a t is non-null.
+*/
+
+void Mailbox::refreshSessions( Transaction * t )
+{
     if ( d->sessions )
         (void)new SessionInitialiser( this, t );
 
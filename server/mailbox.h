@@ -89,6 +89,10 @@ public:
 private:
     class MailboxData * d;
     friend class MailboxReader;
+    friend class MailboxesWatcher;
+    friend class SessionRefresher;
+
+    void refreshSessions( Transaction * );
 };
 
 
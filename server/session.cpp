@@ -848,6 +848,9 @@ void SessionInitialiser::findMailboxChanges()
         msgs.append( " and (mm.uid>=$3 or mm.modseq>=$4)" );
 
     d->messages = new Query( msgs, this );
+    // a big mailbox can have millions of rows here, but we only need
+    // to keep a few in memory at a time
+    d->messages->setRowLimit( 4096 );
     d->messages->bind( 1, d->mailbox->id() );
     d->messages->bind( 2, d->newUidnext );
     if ( !initialising ) {
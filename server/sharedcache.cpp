@@ -0,0 +1,244 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sharedcache.h"
+
+#include "graph.h"
+#include "log.h"
+
+// mmap
+#include <sys/mman.h>
+// memcmp, memcpy
+#include <string.h>
+// errno, EOWNERDEAD
+#include <errno.h>
+
+#include <pthread.h>
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+
+// each item (key and value together) uses one slot of this size
+static const uint slotSize = 2048;
+
+// each key hashes to a set of this many slots.
+static const uint ways = 8;
+
+// so each key and value together can be this big.
+static const uint maxItemSize = slotSize - 3 * sizeof( uint );
+
+
+struct CachedItem
+{
+    uint keyLength;
+    uint length;
+    uint used;
+    char data[maxItemSize];
+};
+
+
+struct SharedState
+{
+    pthread_mutex_t lock;
+    uint clock;
+    uint items;
+    // followed by items CachedItem objects
+};
+
+
+static SharedState * shared = 0;
+
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+
+
+static CachedItem * slots()
+{
+    return (CachedItem*)( shared + 1 );
+}
+
+
+static void lock()
+{
+    int r = pthread_mutex_lock( &shared->lock );
+    // someone died while holding the lock. at worst that leaves a
+    // half-written item, whose key doesn't match anything.
+    if ( r == EOWNERDEAD )
+        pthread_mutex_consistent( &shared->lock );
+}
+
+
+static void unlock()
+{
+    pthread_mutex_unlock( &shared->lock );
+}
+
+
+/*! Returns the first of the slots in which \a key may be stored. */
+
+static CachedItem * bucket( const EString & key )
+{
+    uint h = 2166136261u;
+    uint i = 0;
+    while ( i < key.length() )
+        h = ( h ^ (unsigned char)key[i++] ) * 16777619u;
+    return slots() + ( h % ( shared->items / ways ) ) * ways;
+}
+
+
+/*! Returns the slot containing \a key, or a null pointer if there is
+    none. Must be called with the lock held.
+*/
+
+static CachedItem * find( const EString & key )
+{
+    CachedItem * b = bucket( key );
+    uint i = 0;
+    while ( i < ways ) {
+        if ( b[i].keyLength == key.length() &&
+             !memcmp( b[i].data, key.data(), key.length() ) )
+            return b + i;
+        i++;
+    }
+    return 0;
+}
+
+
+/*! \class SharedCache sharedcache.h
+
+    The SharedCache class keeps small items of data in a shared
+    memory segment, so that all server processes can use what any of
+    them has computed. IMAP uses it for the parts of FETCH responses
+    that never change once a message has been delivered (ENVELOPE,
+    BODYSTRUCTURE and so on), so that a user whose clients connect to
+    different processes needn't have the same work done by the
+    database more than once.
+
+    The cache is mapped by setup() before the server processes are
+    forked, and is set-associative and of fixed size, much like the
+    TlsSessionCache. When a set is full, the least recently used item
+    in it is evicted. Items which don't fit in a slot aren't cached.
+
+    Since there's no way to tell another process that an item has
+    changed, items must be immutable, and their keys must contain
+    everything that could make the item differ.
+
+    The shared memory is protected by a process-shared mutex, and
+    nothing here touches the garbage-collected heap except for the
+    strings returned by find().
+*/
+
+
+/*! Maps \a size bytes of shared memory for the cache. Must be called
+    before the server forks, and only once.
+
+    If the memory cannot be mapped, logs the problem and leaves the
+    cache disabled.
+*/
+
+void SharedCache::setup( uint size )
+{
+    if ( shared )
+        return;
+
+    uint items = ( size / slotSize ) / ways * ways;
+    if ( !items )
+        return;
+    size = sizeof( SharedState ) + items * sizeof( CachedItem );
+    void * m = ::mmap( 0, size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+    if ( m == MAP_FAILED ) {
+        ::log( "Cannot map shared memory for the shared cache "
+               "(" + fn( size ) + " bytes), error " + fn( errno ),
+               Log::Error );
+        return;
+    }
+    // anonymous mappings are zeroed, so all slots are empty
+    shared = (SharedState*)m;
+    shared->items = items;
+
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init( &a );
+    pthread_mutexattr_setpshared( &a, PTHREAD_PROCESS_SHARED );
+    pthread_mutexattr_setrobust( &a, PTHREAD_MUTEX_ROBUST );
+    pthread_mutex_init( &shared->lock, &a );
+    pthread_mutexattr_destroy( &a );
+}
+
+
+/*! Returns true if setup() has been called and succeeded, and false
+    if find() will never find anything.
+*/
+
+bool SharedCache::enabled()
+{
+    return shared != 0;
+}
+
+
+/*! Returns the item stored with \a key, or an empty string if there
+    is none.
+*/
+
+EString SharedCache::find( const EString & key )
+{
+    EString r;
+    if ( !shared )
+        return r;
+
+    if ( !hits ) {
+        hits = new GraphableCounter( "shared-cache-hits" );
+        misses = new GraphableCounter( "shared-cache-misses" );
+    }
+
+    lock();
+    CachedItem * c = ::find( key );
+    if ( c ) {
+        c->used = ++shared->clock;
+        r.append( c->data + c->keyLength, c->length );
+    }
+    unlock();
+
+    if ( r.isEmpty() )
+        misses->tick();
+    else
+        hits->tick();
+    return r;
+}
+
+
+/*! Stores \a value with \a key, replacing any item already stored
+    with \a key. Does nothing if the two are too large for a slot.
+*/
+
+void SharedCache::insert( const EString & key, const EString & value )
+{
+    if ( !shared || key.isEmpty() ||
+         key.length() + value.length() > maxItemSize )
+        return;
+
+    lock();
+    CachedItem * c = ::find( key );
+    if ( !c ) {
+        // take an empty slot if there is one, else the one that's
+        // been unused the longest.
+        CachedItem * b = bucket( key );
+        c = b;
+        uint i = 1;
+        while ( i < ways && c->keyLength ) {
+            if ( !b[i].keyLength ||
+                 shared->clock - b[i].used > shared->clock - c->used )
+                c = b + i;
+            i++;
+        }
+    }
+    // the key goes last, so a half-written item doesn't match
+    c->keyLength = 0;
+    memcpy( c->data, key.data(), key.length() );
+    memcpy( c->data + key.length(), value.data(), value.length() );
+    c->length = value.length();
+    c->used = ++shared->clock;
+    c->keyLength = key.length();
+    unlock();
+}
@@ -0,0 +1,23 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SHAREDCACHE_H
+#define SHAREDCACHE_H
+
+#include "estring.h"
+
+
+class SharedCache
+{
+public:
+    static void setup( uint );
+    static bool enabled();
+
+    static EString find( const EString & );
+    static void insert( const EString &, const EString & );
+
+private:
+    SharedCache();
+};
+
+
+#endif
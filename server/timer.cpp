@@ -5,6 +5,7 @@
 #include "event.h"
 #include "eventloop.h"
 #include "connection.h"
+#include "timerwheel.h"
 #include "scope.h"
 
 // time
@@ -15,9 +16,12 @@ class TimerData
     : public Garbage
 {
 public:
-    TimerData(): owner( 0 ), timeout( 0 ), interval( 0 ), repeating( false ) {}
+    TimerData()
+        : owner( 0 ), entry( new WheelEntry ),
+          interval( 0 ), repeating( false )
+    {}
     EventHandler * owner;
-    uint timeout;
+    WheelEntry * entry;
     uint interval;
     bool repeating;
 };
@@ -30,9 +34,11 @@ public:
     intervals. The default is one callback; calling setRepeating()
     changes that.
 
-    The class provides second resolution, nothing better. Creating a
-    timer with delay/interval of 1 provides the first callback after
-    1-2 seconds and (if repeating() is true) at 1-second intervals
+    The delay and interval may be given in seconds or milliseconds,
+    and the EventLoop keeps to them with millisecond resolution, using
+    a monotonic clock (see TimerWheel). Creating a timer with
+    delay/interval of 1 second provides the first callback after
+    about a second and (if repeating() is true) at 1-second intervals
     thereafter.
 
     If the system is badly overloaded, callbacks may be skipped. There
@@ -41,18 +47,22 @@ public:
 
 
 /*!  Constructs an timer which will notify \a owner after \a delay
-     seconds, or slightly more.
+     seconds (or milliseconds, if \a unit is Milliseconds), or
+     slightly more.
 */
 
-Timer::Timer( class EventHandler * owner, uint delay )
+Timer::Timer( class EventHandler * owner, uint delay, Unit unit )
     : Garbage(), d( new TimerData )
 {
-    uint now = time( 0 );
-    if ( delay + now < now )
-        return; // would be after the end of the universe...
+    if ( unit == Seconds )
+        d->interval = delay * 1000;
+    else
+        d->interval = delay;
+    if ( unit == Seconds && d->interval / 1000 != delay )
+        d->interval = UINT_MAX; // as close to forever as we can
     d->owner = owner;
-    d->timeout = delay + now;
-    d->interval = delay;
+    d->entry->timer = this;
+    d->entry->at = TimerWheel::now() + d->interval;
     EventLoop::global()->addTimer( this );
 }
 
@@ -74,20 +84,25 @@ Timer::~Timer()
 
 bool Timer::active() const
 {
-    if ( d->timeout )
+    if ( d->entry->at )
         return true;
     return false;
 }
 
 
-/*! Returns the time (as an integer number of seconds increasing
-    towards the future) at which this Timer will call
-    EventHandler::execute(), or 0 if it is not active().
+/*! Returns the time (as an integer number of seconds since the epoch)
+    at which this Timer will call EventHandler::execute(), or 0 if it
+    is not active().
 */
 
 uint Timer::timeout() const
 {
-    return d->timeout;
+    if ( !d->entry->at )
+        return 0;
+    int64 ms = d->entry->at - TimerWheel::now();
+    if ( ms < 0 )
+        ms = 0;
+    return (uint)time( 0 ) + (uint)( ( ms + 999 ) / 1000 );
 }
 
 
@@ -106,15 +121,16 @@ class EventHandler * Timer::owner()
 void Timer::execute()
 {
     if ( d->repeating ) {
-        d->timeout += d->interval;
-        uint now = time( 0 );
+        d->entry->at += d->interval;
+        int64 now = TimerWheel::now();
         // if we can't make the required frequency, get as close as we can
-        if ( d->timeout <= now )
-            d->timeout = now + 1;
+        if ( d->entry->at <= now )
+            d->entry->at = now + 1;
+        EventLoop::global()->addTimer( this );
     }
     else {
-        d->timeout = 0;
         EventLoop::global()->removeTimer( this );
+        d->entry->at = 0;
     }
 
     notify();
@@ -190,3 +206,13 @@ bool Timer::repeating() const
 {
     return d->repeating;
 }
+
+
+/*! Returns the TimerWheel entry the EventLoop uses to schedule this
+    Timer.
+*/
+
+WheelEntry * Timer::wheelEntry() const
+{
+    return d->entry;
+}
@@ -11,7 +11,9 @@ class Timer
     : public Garbage
 {
 public:
-    Timer( class EventHandler *, uint );
+    enum Unit { Seconds, Milliseconds };
+
+    Timer( class EventHandler *, uint, Unit = Seconds );
     ~Timer();
 
     bool active() const;
@@ -27,6 +29,9 @@ public:
 
 private:
     class TimerData * d;
+
+    friend class EventLoop;
+    class WheelEntry * wheelEntry() const;
 };
 
 #endif
@@ -0,0 +1,316 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "timerwheel.h"
+
+// clock_gettime, CLOCK_MONOTONIC
+#include <time.h>
+
+
+static const uint bits0 = 8;
+static const uint bitsN = 6;
+static const uint levels = 5;
+static const uint size0 = 1 << bits0;
+static const uint sizeN = 1 << bitsN;
+static const uint due = size0 + ( levels - 1 ) * sizeN;
+static const int64 horizon =
+    ( (int64)1 << ( bits0 + ( levels - 1 ) * bitsN ) ) - 1;
+
+
+static uint shift( uint level )
+{
+    if ( !level )
+        return 0;
+    return bits0 + ( level - 1 ) * bitsN;
+}
+
+
+static uint slotOf( uint level, int64 t )
+{
+    if ( !level )
+        return (uint)( t & ( size0 - 1 ) );
+    return size0 + ( level - 1 ) * sizeN +
+        (uint)( ( t >> shift( level ) ) & ( sizeN - 1 ) );
+}
+
+
+static uint levelOf( uint slot )
+{
+    if ( slot < size0 )
+        return 0;
+    return 1 + ( slot - size0 ) / sizeN;
+}
+
+
+class TimerWheelData
+    : public Garbage
+{
+public:
+    TimerWheelData(): current( 0 ) {
+        uint i = 0;
+        while ( i <= due )
+            heads[i++] = 0;
+        i = 0;
+        while ( i < levels )
+            count[i++] = 0;
+        setFirstNonPointer( &current );
+    }
+
+    WheelEntry * heads[due+1];
+    // no pointers after this line
+    int64 current;
+    uint count[levels];
+};
+
+
+/*! \class WheelEntry timerwheel.h
+
+    The WheelEntry class is a TimerWheel's record of something that
+    should happen at a particular time: Either a Timer should fire, or
+    a Connection should receive a Timeout event.
+
+    at is the time (as returned by TimerWheel::now()) at which the
+    event should happen.
+*/
+
+
+/*! Constructs an entry that isn't scheduled and belongs to nothing. */
+
+WheelEntry::WheelEntry()
+    : timer( 0 ), connection( 0 ), prev( 0 ), next( 0 ),
+      at( 0 ), slot( -1 )
+{
+    setFirstNonPointer( &at );
+}
+
+
+/*! \class TimerWheel timerwheel.h
+
+    The TimerWheel class keeps track of WheelEntry objects that expire
+    at some point, using a hierarchical timing wheel with millisecond
+    resolution.
+
+    The lowest level has one slot for each of the next 256
+    milliseconds, and each higher level has 64 slots, each of which
+    covers an entire turn of the level below. An entry is stored in
+    the lowest level that reaches its expiry time, and is moved
+    ("cascaded") down a level each time the wheel below wraps
+    around. Entries more than 2^32 milliseconds (about seven weeks)
+    ahead are kept at the top level and filed again when they reach
+    the bottom.
+
+    Adding and removing an entry costs O(1), and take() looks only at
+    slots that are due and at the occasional cascade, so the cost of
+    advancing the wheel does not depend on how many entries wait for
+    later.
+
+    EventLoop uses this class for Timer and Connection timeouts.
+*/
+
+
+/*! Constructs an empty TimerWheel whose time starts now(). */
+
+TimerWheel::TimerWheel()
+    : d( new TimerWheelData )
+{
+    d->current = now();
+}
+
+
+/*! Returns the number of milliseconds since some arbitrary time in
+    the past. The clock is monotonic: It is not disturbed when someone
+    changes the system time.
+*/
+
+int64 TimerWheel::now()
+{
+    struct timespec ts;
+    if ( ::clock_gettime( CLOCK_MONOTONIC, &ts ) < 0 )
+        return (int64)::time( 0 ) * 1000;
+    return (int64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*! Schedules \a e to expire at \a at (as returned by now()). If \a e
+    was scheduled already, its old expiry time is forgotten.
+*/
+
+void TimerWheel::add( WheelEntry * e, int64 at )
+{
+    remove( e );
+    e->at = at;
+
+    int64 t = at;
+    if ( t < d->current ) {
+        link( e, due );
+        return;
+    }
+    int64 delta = t - d->current;
+    if ( delta > horizon ) {
+        delta = horizon;
+        t = d->current + horizon;
+    }
+    uint level = 0;
+    while ( level < levels - 1 &&
+            delta >= ( (int64)1 << shift( level + 1 ) ) )
+        level++;
+    link( e, slotOf( level, t ) );
+}
+
+
+/*! Unschedules \a e. Does nothing if \a e isn't scheduled. */
+
+void TimerWheel::remove( WheelEntry * e )
+{
+    if ( e->slot < 0 )
+        return;
+    if ( e->prev )
+        e->prev->next = e->next;
+    else
+        d->heads[e->slot] = e->next;
+    if ( e->next )
+        e->next->prev = e->prev;
+    if ( (uint)e->slot < due )
+        d->count[levelOf( e->slot )]--;
+    e->prev = 0;
+    e->next = 0;
+    e->slot = -1;
+}
+
+
+/*! Returns an entry whose time is at or before \a now, after
+    unscheduling it, or a null pointer if there is no such entry.
+
+    The caller is expected to call take() repeatedly until it returns
+    null, and may add or remove entries between the calls.
+*/
+
+WheelEntry * TimerWheel::take( int64 now )
+{
+    while ( true ) {
+        WheelEntry * e = d->heads[due];
+        if ( e ) {
+            remove( e );
+            if ( e->at <= now )
+                return e;
+            // it was beyond the horizon when it was added
+            add( e, e->at );
+            continue;
+        }
+
+        if ( d->current > now )
+            return 0;
+
+        uint l = 0;
+        while ( l < levels && !d->count[l] )
+            l++;
+        if ( l == levels ) {
+            // nothing is scheduled, so time can pass freely
+            d->current = now + 1;
+            return 0;
+        }
+
+        if ( !d->count[0] && ( d->current & ( size0 - 1 ) ) ) {
+            // nothing in the lowest level, so we can skip ahead to
+            // the next cascade (or to now, if that's sooner)
+            int64 next = ( d->current | ( size0 - 1 ) ) + 1;
+            if ( next > now + 1 )
+                next = now + 1;
+            d->current = next;
+            continue;
+        }
+
+        if ( !( d->current & ( size0 - 1 ) ) ) {
+            l = 1;
+            while ( l < levels ) {
+                cascade( l );
+                if ( ( d->current >> shift( l ) ) & ( sizeN - 1 ) )
+                    break;
+                l++;
+            }
+        }
+
+        WheelEntry * h = d->heads[slotOf( 0, d->current )];
+        while ( h ) {
+            WheelEntry * n = h->next;
+            remove( h );
+            link( h, due );
+            h = n;
+        }
+        d->current++;
+    }
+    return 0;
+}
+
+
+/*! Returns the earliest time at which take() may return something,
+    or \a limit if that's sooner. The return value may be earlier than
+    necessary, but is never later.
+*/
+
+int64 TimerWheel::nextDeadline( int64 limit ) const
+{
+    if ( d->heads[due] )
+        return d->current - 1;
+
+    int64 best = limit;
+    if ( d->count[0] ) {
+        uint i = 0;
+        while ( i < size0 && d->current + i < best ) {
+            if ( d->heads[slotOf( 0, d->current + i )] ) {
+                best = d->current + i;
+                break;
+            }
+            i++;
+        }
+    }
+
+    uint l = 1;
+    while ( l < levels ) {
+        if ( d->count[l] ) {
+            uint s = shift( l );
+            int64 g = (int64)1 << s;
+            int64 t = ( ( d->current + g - 1 ) >> s ) << s;
+            uint i = 0;
+            while ( i < sizeN && t < best ) {
+                if ( d->heads[slotOf( l, t )] ) {
+                    best = t;
+                    break;
+                }
+                t += g;
+                i++;
+            }
+        }
+        l++;
+    }
+    return best;
+}
+
+
+/*! Links \a e into \a slot. */
+
+void TimerWheel::link( WheelEntry * e, int slot )
+{
+    e->slot = slot;
+    e->prev = 0;
+    e->next = d->heads[slot];
+    if ( e->next )
+        e->next->prev = e;
+    d->heads[slot] = e;
+    if ( (uint)slot < due )
+        d->count[levelOf( slot )]++;
+}
+
+
+/*! Moves all the entries in the current slot of \a level down to
+    lower levels.
+*/
+
+void TimerWheel::cascade( uint level )
+{
+    WheelEntry * e = d->heads[slotOf( level, d->current )];
+    while ( e ) {
+        WheelEntry * n = e->next;
+        add( e, e->at );
+        e = n;
+    }
+}
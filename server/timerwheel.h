@@ -0,0 +1,51 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include "global.h"
+
+
+class Timer;
+class Connection;
+
+
+class WheelEntry
+    : public Garbage
+{
+public:
+    WheelEntry();
+
+    Timer * timer;
+    Connection * connection;
+    WheelEntry * prev;
+    WheelEntry * next;
+    // no pointers after this line
+    int64 at;
+    int slot;
+};
+
+
+class TimerWheel
+    : public Garbage
+{
+public:
+    TimerWheel();
+
+    void add( WheelEntry *, int64 );
+    void remove( WheelEntry * );
+
+    WheelEntry * take( int64 );
+    int64 nextDeadline( int64 ) const;
+
+    static int64 now();
+
+private:
+    class TimerWheelData * d;
+
+    void link( WheelEntry *, int );
+    void cascade( uint );
+};
+
+
+#endif
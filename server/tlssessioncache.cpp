@@ -0,0 +1,380 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tlssessioncache.h"
+
+#include "log.h"
+#include "estring.h"
+
+// mmap
+#include <sys/mman.h>
+// memcmp, memcpy, memset
+#include <string.h>
+// time
+#include <time.h>
+// errno, EOWNERDEAD
+#include <errno.h>
+
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+
+// a ticket key is used to encrypt new tickets for this long, and
+// accepted for as long again afterwards.
+static const int keyLifetime = 12 * 3600;
+
+// sessions whose encoded form is bigger than this aren't cached.
+static const uint maxSessionSize = 1024;
+
+// each session id hashes to a set of this many slots.
+static const uint ways = 4;
+
+
+struct TicketKey
+{
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+
+
+struct CachedSession
+{
+    uint idLength;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    int64 expires;
+    uint length;
+    unsigned char data[maxSessionSize];
+};
+
+
+struct SharedState
+{
+    pthread_mutex_t lock;
+    // the current ticket key and its predecessor
+    TicketKey keys[2];
+    int64 rotated;
+    uint sessions;
+    // followed by sessions CachedSession objects
+};
+
+
+static SharedState * shared = 0;
+
+
+static CachedSession * slots()
+{
+    return (CachedSession*)( shared + 1 );
+}
+
+
+static void lock()
+{
+    int r = pthread_mutex_lock( &shared->lock );
+    // someone died while holding the lock. the data it protects is
+    // at worst a half-written session, which fails to decode.
+    if ( r == EOWNERDEAD )
+        pthread_mutex_consistent( &shared->lock );
+}
+
+
+static void unlock()
+{
+    pthread_mutex_unlock( &shared->lock );
+}
+
+
+/*! Makes a new current ticket key if the old one has been used for
+    long enough. Must be called with the lock held.
+*/
+
+static void rotateKeys()
+{
+    int64 now = (int64)::time( 0 );
+    if ( shared->rotated && now < shared->rotated + keyLifetime )
+        return;
+
+    shared->keys[1] = shared->keys[0];
+    TicketKey k;
+    if ( RAND_bytes( (unsigned char *)&k, sizeof( k ) ) != 1 )
+        return;
+    shared->keys[0] = k;
+    if ( !shared->rotated )
+        shared->keys[1] = k;
+    shared->rotated = now;
+}
+
+
+/*! Returns the first of the slots in which \a id (of \a length bytes)
+    may be stored.
+*/
+
+static CachedSession * bucket( const unsigned char * id, uint length )
+{
+    uint h = 2166136261u;
+    uint i = 0;
+    while ( i < length )
+        h = ( h ^ id[i++] ) * 16777619u;
+    return slots() + ( h % ( shared->sessions / ways ) ) * ways;
+}
+
+
+/*! Returns the slot containing \a id (of \a length bytes), or a null
+    pointer if there is none. Must be called with the lock held.
+*/
+
+static CachedSession * find( const unsigned char * id, uint length )
+{
+    CachedSession * b = bucket( id, length );
+    uint i = 0;
+    while ( i < ways ) {
+        if ( b[i].idLength == length && !memcmp( b[i].id, id, length ) )
+            return b + i;
+        i++;
+    }
+    return 0;
+}
+
+
+static int newSession( SSL *, SSL_SESSION * s )
+{
+    unsigned int length = 0;
+    const unsigned char * id = SSL_SESSION_get_id( s, &length );
+    int size = i2d_SSL_SESSION( s, 0 );
+    if ( !length || length > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+         size <= 0 || (uint)size > maxSessionSize )
+        return 0;
+
+    int64 expires = SSL_SESSION_get_time( s ) + SSL_SESSION_get_timeout( s );
+
+    lock();
+    CachedSession * c = find( id, length );
+    if ( !c ) {
+        // take an empty slot if there is one, else the one that
+        // expires first.
+        CachedSession * b = bucket( id, length );
+        c = b;
+        uint i = 1;
+        while ( i < ways && c->idLength ) {
+            if ( !b[i].idLength || b[i].expires < c->expires )
+                c = b + i;
+            i++;
+        }
+    }
+    unsigned char * p = c->data;
+    c->length = i2d_SSL_SESSION( s, &p );
+    c->idLength = length;
+    memcpy( c->id, id, length );
+    c->expires = expires;
+    unlock();
+
+    // we didn't keep a reference to s
+    return 0;
+}
+
+
+static SSL_SESSION * getSession( SSL *, const unsigned char * id,
+                                 int length, int * copy )
+{
+    *copy = 0;
+    if ( length <= 0 || length > SSL_MAX_SSL_SESSION_ID_LENGTH )
+        return 0;
+
+    unsigned char data[maxSessionSize];
+    uint size = 0;
+    lock();
+    CachedSession * c = find( id, length );
+    if ( c && c->expires > (int64)::time( 0 ) ) {
+        size = c->length;
+        memcpy( data, c->data, size );
+    }
+    unlock();
+
+    if ( !size )
+        return 0;
+    const unsigned char * p = data;
+    return d2i_SSL_SESSION( 0, &p, size );
+}
+
+
+static void removeSession( SSL_CTX *, SSL_SESSION * s )
+{
+    unsigned int length = 0;
+    const unsigned char * id = SSL_SESSION_get_id( s, &length );
+    if ( !length || length > SSL_MAX_SSL_SESSION_ID_LENGTH )
+        return;
+
+    lock();
+    CachedSession * c = find( id, length );
+    if ( c )
+        c->idLength = 0;
+    unlock();
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int ticketKey( SSL *, unsigned char name[16], unsigned char * iv,
+                      EVP_CIPHER_CTX * cipher, EVP_MAC_CTX * mac, int enc )
+#else
+static int ticketKey( SSL *, unsigned char name[16], unsigned char * iv,
+                      EVP_CIPHER_CTX * cipher, HMAC_CTX * mac, int enc )
+#endif
+{
+    TicketKey k;
+    int r = 1;
+
+    lock();
+    rotateKeys();
+    if ( enc ) {
+        k = shared->keys[0];
+    }
+    else if ( !memcmp( name, shared->keys[0].name, 16 ) ) {
+        k = shared->keys[0];
+    }
+    else if ( !memcmp( name, shared->keys[1].name, 16 ) ) {
+        // good, but the client should get a ticket with the new key
+        k = shared->keys[1];
+        r = 2;
+    }
+    else {
+        r = 0;
+    }
+    unlock();
+
+    if ( !r )
+        return 0;
+
+    if ( enc ) {
+        if ( RAND_bytes( iv, EVP_CIPHER_iv_length( EVP_aes_256_cbc() ) ) != 1 )
+            return -1;
+        memcpy( name, k.name, 16 );
+        if ( !EVP_EncryptInit_ex( cipher, EVP_aes_256_cbc(), 0, k.aes, iv ) )
+            return -1;
+    }
+    else {
+        if ( !EVP_DecryptInit_ex( cipher, EVP_aes_256_cbc(), 0, k.aes, iv ) )
+            return -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY,
+                                                   k.hmac, sizeof( k.hmac ) );
+    params[1] = OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST,
+                                                  (char*)"SHA256", 0 );
+    params[2] = OSSL_PARAM_construct_end();
+    if ( !EVP_MAC_CTX_set_params( mac, params ) )
+        return -1;
+#else
+    if ( !HMAC_Init_ex( mac, k.hmac, sizeof( k.hmac ), EVP_sha256(), 0 ) )
+        return -1;
+#endif
+
+    memset( &k, 0, sizeof( k ) );
+    return r;
+}
+
+
+/*! \class TlsSessionCache tlssessioncache.h
+
+    The TlsSessionCache class lets TLS clients resume earlier sessions
+    instead of doing a full handshake, even if they reconnect to a
+    different server process.
+
+    Two mechanisms are supported. Clients that support session tickets
+    get their session state encrypted with a key shared by all server
+    processes, and the key is replaced every twelve hours (tickets
+    encrypted with the previous key are still accepted, and replaced).
+    Other clients can resume by session ID, using a cache kept in a
+    shared memory segment.
+
+    Both live in memory mapped by setup() before Server::fork() starts
+    the server processes. The cache is set-associative and has a fixed
+    size; when a set is full the session that expires first is
+    evicted.
+
+    The callbacks may be called by any TLS worker thread in any server
+    process, so all access to the shared memory is serialised by a
+    process-shared mutex. Nothing here touches the garbage-collected
+    heap.
+*/
+
+
+/*! Maps the shared memory needed to remember up to \a sessions TLS
+    sessions, and initialises the ticket keys. Must be called before
+    the server forks, and only once.
+
+    If the memory cannot be mapped, logs the problem and leaves
+    sessions unresumable.
+*/
+
+void TlsSessionCache::setup( uint sessions )
+{
+    if ( shared )
+        return;
+
+    sessions = ( sessions + ways - 1 ) / ways * ways;
+    uint size = sizeof( SharedState ) + sessions * sizeof( CachedSession );
+    void * m = ::mmap( 0, size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+    if ( m == MAP_FAILED ) {
+        ::log( "Cannot map shared memory for the TLS session cache "
+               "(" + fn( size ) + " bytes), error " + fn( errno ),
+               Log::Error );
+        return;
+    }
+    // anonymous mappings are zeroed, so all slots are empty
+    shared = (SharedState*)m;
+    shared->sessions = sessions;
+
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init( &a );
+    pthread_mutexattr_setpshared( &a, PTHREAD_PROCESS_SHARED );
+    pthread_mutexattr_setrobust( &a, PTHREAD_MUTEX_ROBUST );
+    pthread_mutex_init( &shared->lock, &a );
+    pthread_mutexattr_destroy( &a );
+
+    rotateKeys();
+}
+
+
+/*! Tells OpenSSL to use the shared session cache and ticket keys for
+    \a ctx. Does nothing unless setup() succeeded.
+*/
+
+void TlsSessionCache::install( SSL_CTX * ctx )
+{
+    if ( !shared )
+        return;
+
+    SSL_CTX_set_session_id_context( ctx, (const unsigned char *)"aox", 3 );
+    SSL_CTX_set_timeout( ctx, keyLifetime );
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx, ticketKey );
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb( ctx, ticketKey );
+#endif
+
+    if ( !shared->sessions ) {
+        SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_OFF );
+        return;
+    }
+    SSL_CTX_set_session_cache_mode( ctx,
+                                    SSL_SESS_CACHE_SERVER |
+                                    SSL_SESS_CACHE_NO_INTERNAL );
+    SSL_CTX_sess_set_new_cb( ctx, newSession );
+    SSL_CTX_sess_set_get_cb( ctx, getSession );
+    SSL_CTX_sess_set_remove_cb( ctx, removeSession );
+}
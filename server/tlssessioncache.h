@@ -0,0 +1,20 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TLSSESSIONCACHE_H
+#define TLSSESSIONCACHE_H
+
+#include "global.h"
+
+
+class TlsSessionCache
+{
+public:
+    static void setup( uint );
+    static void install( struct ssl_ctx_st * );
+
+private:
+    TlsSessionCache();
+};
+
+
+#endif
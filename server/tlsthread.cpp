@@ -3,9 +3,17 @@
 #include "tlsthread.h"
 
 #include "file.h"
+#include "graph.h"
+#include "timer.h"
 #include "estring.h"
+#include "event.h"
 #include "configuration.h"
+#include "tlssessioncache.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <pthread.h>
@@ -13,51 +21,65 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#if defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#endif
+
 
 static const int bs = 16384;
 
 
-class TlsThreadData
-    : public Garbage
+class TlsSession // NOT a Garbage class, it's used by the TlsWorker threads
 {
 public:
-    TlsThreadData()
-        : Garbage(),
-          ssl( 0 ),
-          ctrb( 0 ),
+    TlsSession( SSL * s )
+        : ssl( s ),
           ctrbo( 0 ), ctrbs( 0 ),
-          ctwb( 0 ),
           ctwbo( 0 ), ctwbs( 0 ),
           ctfd( -1 ),
-          encrb( 0 ),
           encrbo( 0 ), encrbs( 0 ),
-          encwb( 0 ),
           encwbo( 0 ), encwbs( 0 ),
           encfd( -1 ),
-          networkBio( 0 ), sslBio( 0 ), thread( 0 ),
-          broken( false )
-        {}
+          networkBio( 0 ), sslBio( 0 ),
+          ctgone( false ), encgone( false ), counted( false ),
+          ctEvents( 0 ), encEvents( 0 ),
+          dead( false ), prev( 0 ), next( 0 )
+    {}
+
+    ~TlsSession() {
+        if ( encfd >= 0 )
+            ::close( encfd );
+        if ( ctfd >= 0 )
+            ::close( ctfd );
+        ::SSL_free( ssl ); // also frees sslBio
+        ::BIO_free( networkBio );
+    }
+
+    bool step( bool, bool, bool, bool );
+    void flush();
+    bool errorIsSerious( int );
+    bool wants( int, uint * ) const;
 
     SSL * ssl;
 
     // clear-text read buffer, ie. data coming from aox
-    char * ctrb;
+    char ctrb[bs];
     // the offset at which cleartext data starts
     int ctrbo;
     // and the buffer size (if ...o=...s, the buffer contains no data)
     int ctrbs;
     // clear-text write buffer, ie. data going to aox
-    char * ctwb;
+    char ctwb[bs];
     int ctwbo;
     int ctwbs;
     // the cleartext fd, ie. the fd for talking to aox
     int ctfd;
     // encrypted read buffer, ie. data coming from the peer
-    char * encrb;
+    char encrb[bs];
     int encrbo;
     int encrbs;
     // encrypted write buffer, ie. data going to the peer
-    char * encwb;
+    char encwb[bs];
     int encwbo;
     int encwbs;
     int encfd;
@@ -67,14 +89,67 @@ public:
     // where openssl reads/writes ditto
     BIO * sslBio;
 
+    bool ctgone;
+    bool encgone;
+
+    // whether the handshake has been counted as a resumption or not
+    bool counted;
+
+    // the events we last asked the worker to wait for on each fd
+    uint ctEvents;
+    uint encEvents;
+
+    // set by TlsWorker::remove(); the session is freed later
+    bool dead;
+
+    // the worker's list of sessions
+    TlsSession * prev;
+    TlsSession * next;
+};
+
+
+class TlsWorker // NOT a Garbage class, it's used by other threads
+{
+public:
+    TlsWorker()
+        : incoming( 0 ), sessions( 0 ), all( 0 ), dead( 0 ), epoll( -1 )
+    {
+        wake[0] = -1;
+        wake[1] = -1;
+        pthread_mutex_init( &lock, 0 );
+    }
+
+    bool start();
+    void run();
+    void add( TlsSession * );
+    void remove( TlsSession * );
+    void bury();
+    void update( TlsSession * );
+    void dispatch( TlsSession *, bool, bool, bool, bool );
+
     pthread_t thread;
-    bool broken;
+    pthread_mutex_t lock;
+    // sessions handed over by the main thread, protected by lock
+    TlsSession * incoming;
+    // the number of sessions this worker serves, protected by lock
+    uint sessions;
+
+    // the rest is used only by the worker thread
+    TlsSession * all;
+    // sessions which have been removed, but not yet freed
+    TlsSession * dead;
+    int wake[2];
+    int epoll;
 };
 
 
-static void * trampoline( void * t )
+static TlsWorker * workers = 0;
+static uint numWorkers = 0;
+
+
+static void * trampoline( void * w )
 {
-    ((TlsThread*)t)->start();
+    ((TlsWorker*)w)->run();
     return 0;
 }
 
@@ -82,6 +157,32 @@ static void * trampoline( void * t )
 static SSL_CTX * ctx = 0;
 
 
+// handshakes finished by the workers, updated atomically
+static uint resumed = 0;
+static uint full = 0;
+
+
+class TlsStatistics
+    : public EventHandler
+{
+public:
+    TlsStatistics()
+        : hits( new GraphableCounter( "tls-session-hits" ) ),
+          misses( new GraphableCounter( "tls-session-misses" ) )
+    {}
+
+    void execute() {
+        // the workers can't touch GraphableCounters, so we copy
+        // their counts now and then.
+        hits->setValue( __sync_fetch_and_add( &resumed, 0 ) );
+        misses->setValue( __sync_fetch_and_add( &full, 0 ) );
+    }
+
+    GraphableCounter * hits;
+    GraphableCounter * misses;
+};
+
+
 /*! Perform any OpenSSL initialisation needed to enable us to create
     TlsThreads later.
 */
@@ -119,15 +220,75 @@ void TlsThread::setup()
 
     // we don't ask for a client cert
     SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
+
+    // this is called before Server::fork(), so all server processes
+    // share the session cache and ticket keys
+    TlsSessionCache::setup(
+        Configuration::scalar( Configuration::TlsSessionCache ) );
+    TlsSessionCache::install( ctx );
+}
+
+
+/*! Starts the pool of worker threads, unless that's been done
+    already. Returns true if at least one worker is running.
+
+    This is done when the first TLS connection is made rather than in
+    setup(), since threads don't survive Server::fork().
+*/
+
+static bool startWorkers()
+{
+    if ( numWorkers )
+        return true;
+
+    uint n = Configuration::scalar( Configuration::TlsThreads );
+    if ( !n ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        n = cpus > 0 ? (uint)cpus : 1;
+    }
+    Timer * t = new Timer( new TlsStatistics, 1 );
+    t->setRepeating( true );
+
+    workers = new TlsWorker[n];
+    uint i = 0;
+    while ( i < n && workers[i].start() )
+        i++;
+    numWorkers = i;
+    if ( i < n )
+        log( "Could start only " + fn( i ) + " of " + fn( n ) +
+             " TLS threads", Log::Error );
+    return numWorkers > 0;
 }
 
 
 /*! \class TlsThread tlsthread.h
-    Creates and manages a thread for TLS processing using openssl
+    Sets up TLS processing for a connection using openssl.
+
+    The TLS work is done by a fixed pool of worker threads (as many as
+    the tls-threads setting says, or one per CPU), each of which
+    serves many connections using nonblocking I/O. The main thread
+    talks cleartext to a worker via a socketpair, so Connection does
+    not need to know anything about OpenSSL.
+
+    The worker's state for each connection lives outside the
+    garbage-collected heap, so once setServerFD() and setClientFD()
+    have handed the connection to a worker, this object is not needed
+    any more.
 */
 
 
 
+class TlsThreadData
+    : public Garbage
+{
+public:
+    TlsThreadData(): session( 0 ), broken( false ) {}
+
+    TlsSession * session;
+    bool broken;
+};
+
+
 /*! Constructs an empty TlsThread */
 
 TlsThread::TlsThread()
@@ -136,227 +297,598 @@ TlsThread::TlsThread()
     if ( !ctx )
         setup();
 
-    d->ssl = ::SSL_new( ctx );
-    SSL_set_accept_state( d->ssl );
-
-    if ( !BIO_new_bio_pair( &d->sslBio, bs, &d->networkBio, bs ) ) {
-        // an error. hm?
+    if ( !startWorkers() ) {
+        d->broken = true;
+        return;
     }
-    ::SSL_set_bio( d->ssl, d->sslBio, d->sslBio );
 
-    d->ctrb = (char*)Allocator::alloc( bs, 0 );
-    d->ctwb = (char*)Allocator::alloc( bs, 0 );
-    d->encrb = (char*)Allocator::alloc( bs, 0 );
-    d->encwb = (char*)Allocator::alloc( bs, 0 );
+    SSL * ssl = ::SSL_new( ctx );
+    if ( !ssl ) {
+        d->broken = true;
+        return;
+    }
+    SSL_set_accept_state( ssl );
 
-    int r = pthread_create( &d->thread, 0, trampoline, (void*)this );
-    if ( r ) {
-        log( "pthread_create returned nonzero (" + fn( r ) + ")" );
+    d->session = new TlsSession( ssl );
+    if ( !BIO_new_bio_pair( &d->session->sslBio, bs,
+                            &d->session->networkBio, bs ) ) {
+        log( "Cannot create BIO pair for TLS" );
         d->broken = true;
-        ::SSL_free( d->ssl );
-        d->ssl = 0;
+        delete d->session;
+        d->session = 0;
+        return;
     }
+    ::SSL_set_bio( ssl, d->session->sslBio, d->session->sslBio );
 }
 
 
-/*! Destroys the object and frees any allocated resources. Except we
-    probably should do this in Connection::react() or
-    Connection::close() or something.
+/*! Destroys the object and frees any allocated resources. Once the
+    connection has been handed to a worker, the worker frees them
+    instead.
 */
 
 TlsThread::~TlsThread()
 {
-    ::SSL_free( d->ssl );
-    d->ssl = 0;
+    delete d->session;
+    d->session = 0;
 }
 
 
-/*! Starts negotiating and does everything after that. This is run in
-    the separate thread.
+/*! Makes \a fd nonblocking, since a worker serves many connections. */
 
+static void setNonblocking( int fd )
+{
+    int flags = fcntl( fd, F_GETFL, 0 );
+    if ( flags >= 0 )
+        fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+}
+
+
+/*! Hands the connection to the least busy worker once both file
+    descriptors are known.
 */
 
-void TlsThread::start()
+void TlsThread::handOver()
 {
-    bool crct = false;
-    bool crenc = false;
-    bool cwct = false;
-    bool cwenc = false;
-    bool ctgone = false;
-    bool encgone = false;
-    bool finish = false;
-    while ( !finish ) {
-        // are our read buffers empty, and select said we can read? if
-        // so, try to read
-        if ( crct ) {
-            d->ctrbs = ::read( d->ctfd, d->ctrb, bs );
-            if ( d->ctrbs <= 0 ) {
-                ctgone = true;
-                d->ctrbs = 0;
-            }
-        }
-        if ( crenc ) {
-            d->encrbs = ::read( d->encfd, d->encrb, bs );
-            if ( d->encrbs <= 0 ) {
-                encgone = true;
-                d->encrbs = 0;
-            }
-        }
-        if ( ctgone && encgone ) {
-            // if both file descriptors are gone, there's nothing left
-            // to do. but maybe we try anyway.
-            finish = true;
-        }
-        if ( ctgone && d->encwbs == 0 ) {
-            // if the cleartext one is gone and we have nothing to
-            // write to enc, finish
-            finish = true;
-        }
-        if ( encgone && d->ctwbs == 0 ) {
-            // if the encfd is gone and we have nothing to write to ct,
-            // finish
-            finish = true;
+    if ( !d->session || d->session->ctfd < 0 || d->session->encfd < 0 )
+        return;
+
+    TlsWorker * w = &workers[0];
+    uint i = 1;
+    while ( i < numWorkers ) {
+        // racy, but it's only a heuristic
+        if ( workers[i].sessions < w->sessions )
+            w = &workers[i];
+        i++;
+    }
+
+    TlsSession * s = d->session;
+    d->session = 0;
+    pthread_mutex_lock( &w->lock );
+    s->next = w->incoming;
+    w->incoming = s;
+    w->sessions++;
+    pthread_mutex_unlock( &w->lock );
+    char c = 0;
+    ::write( w->wake[1], &c, 1 );
+}
+
+
+/*! Records that \a fd should be used for cleartext communication with
+    the main aox thread. The TLS worker will close \a fd when it's done.
+*/
+
+void TlsThread::setServerFD( int fd )
+{
+    if ( !d->session )
+        return;
+    setNonblocking( fd );
+    d->session->ctfd = fd;
+    handOver();
+}
+
+
+/*! Records that \a fd should be used for encrypted communication with
+    the client. The TLS worker will close \a fd when it's done.
+*/
+
+void TlsThread::setClientFD( int fd )
+{
+    if ( !d->session )
+        return;
+    setNonblocking( fd );
+    d->session->encfd = fd;
+    handOver();
+}
+
+
+/*! Returns true if this TlsThread is broken somehow, and false if
+    it's in working order.
+*/
+
+bool TlsThread::broken() const
+{
+    return d->broken;
+}
+
+
+/*! Starts the worker thread. Returns true if all went well. */
+
+bool TlsWorker::start()
+{
+    if ( ::pipe( wake ) < 0 )
+        return false;
+    setNonblocking( wake[0] );
+    setNonblocking( wake[1] );
+    fcntl( wake[0], F_SETFD, FD_CLOEXEC );
+    fcntl( wake[1], F_SETFD, FD_CLOEXEC );
+
+#if defined(HAVE_EPOLL)
+    epoll = ::epoll_create1( EPOLL_CLOEXEC );
+    if ( epoll >= 0 ) {
+        struct epoll_event e;
+        e.events = EPOLLIN;
+        e.data.ptr = 0;
+        ::epoll_ctl( epoll, EPOLL_CTL_ADD, wake[0], &e );
+    }
+#endif
+
+    int r = pthread_create( &thread, 0, trampoline, (void*)this );
+    if ( r ) {
+        log( "pthread_create returned nonzero (" + fn( r ) + ")" );
+        return false;
+    }
+    return true;
+}
+
+
+/*! Serves the worker's sessions until the end of time. This is run in
+    the worker thread, and must not touch the garbage-collected heap.
+*/
+
+void TlsWorker::run()
+{
+    struct pollfd * fds = 0;
+    TlsSession ** owners = 0;
+    uint size = 0;
+
+    while ( true ) {
+        // nothing refers to the sessions removed last time round
+        bury();
+
+        // pick up new sessions
+        pthread_mutex_lock( &lock );
+        TlsSession * s = incoming;
+        incoming = 0;
+        pthread_mutex_unlock( &lock );
+        while ( s ) {
+            TlsSession * n = s->next;
+            add( s );
+            dispatch( s, false, false, false, false );
+            s = n;
         }
 
-        // is there something in our write buffers, and select() told
-        // us we can write it?
-        if ( cwct ) {
-            int r = ::write( d->ctfd,
-                             d->ctwb + d->ctwbo,
-                             d->ctwbs - d->ctwbo );
-            if ( r <= 0 ) {
-                // select said we could, but we couldn't. parachute time.
-                finish = true;
-            }
-            else {
-                d->ctwbo += r;
-                if ( d->ctwbo == d->ctwbs ) {
-                    d->ctwbs = 0;
-                    d->ctwbo = 0;
+#if defined(HAVE_EPOLL)
+        if ( epoll >= 0 ) {
+            struct epoll_event events[128];
+            int n = ::epoll_wait( epoll, events, 128, -1 );
+            int i = 0;
+            while ( i < n ) {
+                if ( !events[i].data.ptr ) {
+                    char b[64];
+                    while ( ::read( wake[0], b, sizeof( b ) ) > 0 )
+                        ;
+                }
+                else {
+                    // the low bit says which of the session's fds it is
+                    unsigned long p = (unsigned long)events[i].data.ptr;
+                    TlsSession * s = (TlsSession*)( p & ~1UL );
+                    uint e = events[i].events;
+                    bool r = ( e & ( EPOLLIN|EPOLLHUP|EPOLLERR ) ) != 0;
+                    bool w = ( e & ( EPOLLOUT|EPOLLERR ) ) != 0;
+                    // an earlier event in this batch may have
+                    // finished s off
+                    if ( s->dead )
+                        ;
+                    else if ( p & 1 )
+                        dispatch( s, false, r, false, w );
+                    else
+                        dispatch( s, r, false, w, false );
                 }
+                i++;
             }
+            continue;
         }
-        if ( cwenc ) {
-            int r = ::write( d->encfd,
-                             d->encwb + d->encwbo,
-                             d->encwbs - d->encwbo );
-            if ( r <= 0 ) {
-                finish = true;
+#endif
+
+        // no epoll, so we use poll() and look at everything
+        uint n = 1;
+        s = all;
+        while ( s ) {
+            n += 2;
+            s = s->next;
+        }
+        if ( n > size ) {
+            struct pollfd * nfds = (struct pollfd*)
+                                   ::malloc( n * 2 * sizeof( struct pollfd ) );
+            TlsSession ** nowners = (TlsSession**)
+                                    ::malloc( n * 2 * sizeof( TlsSession* ) );
+            if ( nfds && nowners ) {
+                ::free( fds );
+                ::free( owners );
+                fds = nfds;
+                owners = nowners;
+                size = n * 2;
             }
             else {
-                d->encwbo += r;
-                if ( d->encwbo == d->encwbs ) {
-                    d->encwbs = 0;
-                    d->encwbo = 0;
+                // we can't watch them all, so the newest sessions,
+                // which have the least to lose, are dropped.
+                ::free( nfds );
+                ::free( nowners );
+                while ( all && n > size ) {
+                    remove( all );
+                    n -= 2;
+                }
+                if ( n > size ) {
+                    ::poll( 0, 0, 100 );
+                    continue;
                 }
             }
         }
-
-        // we've served file descriptors. now for glorious openssl.
-        if ( d->encrbs > 0 && d->encrbo < d->encrbs ) {
-            int r = BIO_write( d->networkBio,
-                               d->encrb + d->encrbo,
-                               d->encrbs - d->encrbo );
-            if ( r > 0 )
-                d->encrbo += r;
-            if ( d->encrbo >= d->encrbs ) {
-                d->encrbo = 0;
-                d->encrbs = 0;
-            }
+        fds[0].fd = wake[0];
+        fds[0].events = POLLIN;
+        owners[0] = 0;
+        n = 1;
+        s = all;
+        while ( s ) {
+            fds[n].fd = s->ctfd;
+            fds[n].events = s->ctEvents;
+            owners[n++] = s;
+            fds[n].fd = s->encfd;
+            fds[n].events = s->encEvents;
+            owners[n++] = s;
+            s = s->next;
         }
-        if ( d->ctrbs > 0 && d->ctrbo < d->ctrbs ) {
-            int r = SSL_write( d->ssl,
-                               d->ctrb + d->ctrbo,
-                               d->ctrbs - d->ctrbo );
-            if ( r > 0 )
-                d->ctrbo += r;
-            else if ( r < 0 && !finish )
-                finish = sslErrorSeriousness( r );
-            if ( d->ctrbo >= d->ctrbs ) {
-                d->ctrbo = 0;
-                d->ctrbs = 0;
-            }
+        if ( ::poll( fds, n, -1 ) <= 0 )
+            continue;
+        if ( fds[0].revents ) {
+            char b[64];
+            while ( ::read( wake[0], b, sizeof( b ) ) > 0 )
+                ;
         }
-        if ( d->ctwbs == 0 ) {
-            d->ctwbs = SSL_read( d->ssl, d->ctwb, bs );
-            if ( d->ctwbs < 0 ) {
-                if ( !finish )
-                    finish = sslErrorSeriousness( d->ctwbs );
-                d->ctwbs = 0;
-            }
+        uint i = 1;
+        while ( i < n ) {
+            uint r = fds[i].revents;
+            uint w = fds[i+1].revents;
+            if ( ( r || w ) && !owners[i]->dead )
+                dispatch( owners[i],
+                          ( r & ( POLLIN|POLLHUP|POLLERR ) ) != 0,
+                          ( w & ( POLLIN|POLLHUP|POLLERR ) ) != 0,
+                          ( r & ( POLLOUT|POLLERR ) ) != 0,
+                          ( w & ( POLLOUT|POLLERR ) ) != 0 );
+            i += 2;
+        }
+    }
+}
+
+
+/*! Adds \a s to the sessions this worker serves. */
+
+void TlsWorker::add( TlsSession * s )
+{
+    s->prev = 0;
+    s->next = all;
+    if ( all )
+        all->prev = s;
+    all = s;
+}
+
+
+/*! Removes \a s from this worker. \a s isn't freed at once, since
+    the current batch of events may refer to it, but by the next call
+    to bury().
+*/
+
+void TlsWorker::remove( TlsSession * s )
+{
+#if defined(HAVE_EPOLL)
+    if ( epoll >= 0 ) {
+        struct epoll_event e;
+        if ( s->ctEvents )
+            ::epoll_ctl( epoll, EPOLL_CTL_DEL, s->ctfd, &e );
+        if ( s->encEvents )
+            ::epoll_ctl( epoll, EPOLL_CTL_DEL, s->encfd, &e );
+    }
+#endif
+    if ( s->prev )
+        s->prev->next = s->next;
+    else
+        all = s->next;
+    if ( s->next )
+        s->next->prev = s->prev;
+    s->dead = true;
+    s->prev = 0;
+    s->next = dead;
+    dead = s;
+
+    pthread_mutex_lock( &lock );
+    sessions--;
+    pthread_mutex_unlock( &lock );
+}
+
+
+/*! Frees the sessions remove() has removed. */
+
+void TlsWorker::bury()
+{
+    while ( dead ) {
+        TlsSession * s = dead;
+        dead = s->next;
+        delete s;
+    }
+}
+
+
+/*! Tells epoll (if used) about the events \a s now waits for. */
+
+void TlsWorker::update( TlsSession * s )
+{
+    uint ct = 0;
+    uint enc = 0;
+    s->wants( s->ctfd, &ct );
+    s->wants( s->encfd, &enc );
+
+#if defined(HAVE_EPOLL)
+    if ( epoll >= 0 ) {
+        struct epoll_event e;
+        if ( ct != s->ctEvents ) {
+            e.events = ct;
+            e.data.ptr = (void*)s;
+            int op = EPOLL_CTL_MOD;
+            if ( !s->ctEvents )
+                op = EPOLL_CTL_ADD;
+            else if ( !ct )
+                op = EPOLL_CTL_DEL;
+            ::epoll_ctl( epoll, op, s->ctfd, &e );
         }
-        if ( d->encwbs == 0 ) {
-            d->encwbs = BIO_read( d->networkBio, d->encwb, bs );
-            if ( d->encwbs < 0 )
-                d->encwbs = 0;
+        if ( enc != s->encEvents ) {
+            e.events = enc;
+            e.data.ptr = (void*)( (unsigned long)s | 1 );
+            int op = EPOLL_CTL_MOD;
+            if ( !s->encEvents )
+                op = EPOLL_CTL_ADD;
+            else if ( !enc )
+                op = EPOLL_CTL_DEL;
+            ::epoll_ctl( epoll, op, s->encfd, &e );
         }
+    }
+#endif
 
-        if ( !finish ) {
-            bool any = false;
-            fd_set r, w;
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-            if ( d->ctfd >= 0 ) {
-                if ( d->ctrbs == 0 ) {
-                    FD_SET( d->ctfd, &r );
-                    any = true;
-                }
-                if ( d->ctwbs ) {
-                    any = true;
-                    FD_SET( d->ctfd, &w );
-                }
-            }
-            if ( d->encfd >= 0 ) {
-                if ( d->encrbs == 0  ) {
-                    any = true;
-                    FD_SET( d->encfd, &r );
-                }
-                if ( d->encwbs ) {
-                    any = true;
-                    FD_SET( d->encfd, &w );
-                }
-            }
-            int maxfd = -1;
-            if ( maxfd < d->ctfd )
-                maxfd = d->ctfd;
-            if ( maxfd < d->encfd )
-                maxfd = d->encfd;
-            struct timeval tv;
-            if ( maxfd < 0 ) {
-                // if we don't have any fds yet, we wait for exactly 0.05s.
-                tv.tv_sec = 0;
-                tv.tv_usec = 50000; // 0.05s
-            }
-            else if ( any ) {
-                // if we think there's something to do, we wait for an hour.
-                tv.tv_sec = 3600;
-                tv.tv_usec = 0;
+    s->ctEvents = ct;
+    s->encEvents = enc;
+}
+
+
+/*! Lets \a s do whatever it can, given that \a crct, \a crenc, \a
+    cwct and \a cwenc say whether its cleartext and encrypted fds are
+    readable and writable, and then decides what to wait for next, or
+    frees \a s if it's done.
+*/
+
+void TlsWorker::dispatch( TlsSession * s, bool crct, bool crenc,
+                          bool cwct, bool cwenc )
+{
+    bool finish = s->step( crct, crenc, cwct, cwenc );
+
+    // openssl may be able to do more now without any I/O (e.g. if it
+    // decrypted only part of what we gave it), so we let it.
+    uint rounds = 0;
+    while ( !finish && rounds < 8 ) {
+        int before[8] = { s->ctrbo, s->ctrbs, s->ctwbo, s->ctwbs,
+                          s->encrbo, s->encrbs, s->encwbo, s->encwbs };
+        finish = s->step( false, false, s->ctwbs > 0, s->encwbs > 0 );
+        int after[8] = { s->ctrbo, s->ctrbs, s->ctwbo, s->ctwbs,
+                         s->encrbo, s->encrbs, s->encwbo, s->encwbs };
+        if ( !memcmp( before, after, sizeof( before ) ) )
+            break;
+        rounds++;
+    }
+
+    if ( !finish ) {
+        uint ct = 0;
+        uint enc = 0;
+        // if we aren't going to read and can't write, there's no
+        // point in prolonging the agony.
+        if ( !s->wants( s->ctfd, &ct ) && !s->wants( s->encfd, &enc ) )
+            finish = true;
+    }
+
+    if ( finish ) {
+        s->flush();
+        remove( s );
+    }
+    else {
+        update( s );
+    }
+}
+
+
+/*! Returns true if this session wants to read or write \a fd, and
+    stores the poll()/epoll() events it wants in \a events.
+*/
+
+bool TlsSession::wants( int fd, uint * events ) const
+{
+    // poll() and epoll() use the same values for these
+    *events = 0;
+    if ( fd == ctfd && !ctgone ) {
+        if ( ctrbs == 0 )
+            *events |= POLLIN;
+        if ( ctwbs )
+            *events |= POLLOUT;
+    }
+    else if ( fd == encfd && !encgone ) {
+        if ( encrbs == 0 )
+            *events |= POLLIN;
+        if ( encwbs )
+            *events |= POLLOUT;
+    }
+    return *events != 0;
+}
+
+
+/*! Returns true if the last read() or write() failed for a reason
+    other than there being nothing to do right now.
+*/
+
+static bool seriousFailure()
+{
+    return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+}
+
+
+/*! Reads, writes, encrypts and decrypts as much as possible. \a crct,
+    \a crenc, \a cwct and \a cwenc say whether the cleartext and
+    encrypted file descriptors may be read or written. Returns true if
+    the session is finished, and false if there may be more to do.
+*/
+
+bool TlsSession::step( bool crct, bool crenc, bool cwct, bool cwenc )
+{
+    bool finish = false;
+
+    // are our read buffers empty, and poll said we can read? if so,
+    // try to read
+    if ( crct && ctrbs == 0 ) {
+        int r = ::read( ctfd, ctrb, bs );
+        if ( r > 0 )
+            ctrbs = r;
+        else if ( r == 0 || seriousFailure() )
+            ctgone = true;
+    }
+    if ( crenc && encrbs == 0 ) {
+        int r = ::read( encfd, encrb, bs );
+        if ( r > 0 )
+            encrbs = r;
+        else if ( r == 0 || seriousFailure() )
+            encgone = true;
+    }
+    if ( ctgone && !encgone && SSL_is_init_finished( ssl ) &&
+         !( SSL_get_shutdown( ssl ) & SSL_SENT_SHUTDOWN ) ) {
+        // aox is done, so we tell the client. openssl forgets
+        // sessions that weren't shut down properly.
+        SSL_shutdown( ssl );
+    }
+    if ( ctgone && encgone ) {
+        // if both file descriptors are gone, there's nothing left
+        // to do. but maybe we try anyway.
+        finish = true;
+    }
+    if ( ctgone && encwbs == 0 ) {
+        // if the cleartext one is gone and we have nothing to
+        // write to enc, finish
+        finish = true;
+    }
+    if ( encgone && ctwbs == 0 ) {
+        // if the encfd is gone and we have nothing to write to ct,
+        // finish
+        finish = true;
+    }
+
+    // is there something in our write buffers, and poll() told us we
+    // can write it?
+    if ( cwct && ctwbs ) {
+        int r = ::write( ctfd, ctwb + ctwbo, ctwbs - ctwbo );
+        if ( r > 0 ) {
+            ctwbo += r;
+            if ( ctwbo == ctwbs ) {
+                ctwbs = 0;
+                ctwbo = 0;
             }
-            else {
-                // we aren't going to read, we can't write. no point
-                // in prolonging the agony.
-                finish = true;
-                tv.tv_sec = 0;
-                tv.tv_usec = 0;
+        }
+        else if ( r == 0 || seriousFailure() ) {
+            finish = true;
+        }
+    }
+    if ( cwenc && encwbs ) {
+        int r = ::write( encfd, encwb + encwbo, encwbs - encwbo );
+        if ( r > 0 ) {
+            encwbo += r;
+            if ( encwbo == encwbs ) {
+                encwbs = 0;
+                encwbo = 0;
             }
+        }
+        else if ( r == 0 || seriousFailure() ) {
+            finish = true;
+        }
+    }
 
-            int n = select( maxfd+1, &r, &w, 0, &tv );
-            if ( n < 0 )
-                finish = true;
-
-            crct = FD_ISSET( d->ctfd, &r );
-            cwct = FD_ISSET( d->ctfd, &w );
-            crenc = FD_ISSET( d->encfd, &r );
-            cwenc = FD_ISSET( d->encfd, &w );
+    // we've served file descriptors. now for glorious openssl.
+    if ( encrbs > 0 && encrbo < encrbs ) {
+        int r = BIO_write( networkBio, encrb + encrbo, encrbs - encrbo );
+        if ( r > 0 )
+            encrbo += r;
+        if ( encrbo >= encrbs ) {
+            encrbo = 0;
+            encrbs = 0;
+        }
+    }
+    if ( ctrbs > 0 && ctrbo < ctrbs ) {
+        int r = SSL_write( ssl, ctrb + ctrbo, ctrbs - ctrbo );
+        if ( r > 0 )
+            ctrbo += r;
+        else if ( r < 0 && !finish )
+            finish = errorIsSerious( r );
+        if ( ctrbo >= ctrbs ) {
+            ctrbo = 0;
+            ctrbs = 0;
+        }
+    }
+    if ( ctwbs == 0 ) {
+        ctwbs = SSL_read( ssl, ctwb, bs );
+        if ( ctwbs <= 0 ) {
+            if ( !finish )
+                finish = errorIsSerious( ctwbs );
+            ctwbs = 0;
         }
     }
+    if ( encwbs == 0 ) {
+        encwbs = BIO_read( networkBio, encwb, bs );
+        if ( encwbs < 0 )
+            encwbs = 0;
+    }
+
+    if ( !counted && SSL_is_init_finished( ssl ) ) {
+        counted = true;
+        if ( SSL_session_reused( ssl ) )
+            __sync_fetch_and_add( &resumed, 1 );
+        else
+            __sync_fetch_and_add( &full, 1 );
+    }
 
-    ::close( d->encfd );
-    ::close( d->ctfd );
-    SSL_free( d->ssl );
-    d->ssl = 0;
-    Allocator::removeEternal( this );
-    pthread_exit( 0 );
+    return finish;
+}
+
+
+/*! Makes a last attempt to send what's left for the client, typically
+    the close_notify alert, without waiting for anything.
+*/
+
+void TlsSession::flush()
+{
+    if ( encgone )
+        return;
+    if ( encwbs == 0 ) {
+        encwbs = BIO_read( networkBio, encwb, bs );
+        if ( encwbs < 0 )
+            encwbs = 0;
+    }
+    if ( encwbs > encwbo ) {
+        int r = ::write( encfd, encwb + encwbo, encwbs - encwbo );
+        if ( r > 0 )
+            encwbo += r;
+    }
 }
 
 
@@ -364,8 +896,9 @@ void TlsThread::start()
     and false otherwise.
 */
 
-bool TlsThread::sslErrorSeriousness( int r ) {
-    int e = SSL_get_error( d->ssl, r  );
+bool TlsSession::errorIsSerious( int r )
+{
+    int e = SSL_get_error( ssl, r  );
     switch( e ) {
     case SSL_ERROR_NONE:
     case SSL_ERROR_WANT_READ:
@@ -377,7 +910,9 @@ bool TlsThread::sslErrorSeriousness( int r ) {
         break;
 
     case SSL_ERROR_ZERO_RETURN:
-        // not an error, client closed cleanly
+        // not an error, client closed cleanly. we answer in kind,
+        // which also keeps the session resumable.
+        SSL_shutdown( ssl );
         return true;
         break;
 
@@ -389,33 +924,3 @@ bool TlsThread::sslErrorSeriousness( int r ) {
     }
     return true;
 }
-
-
-/*! Records that \a fd should be used for cleartext communication with
-    the main aox thread. The TLS thread will close \a fd when it's done.
-*/
-
-void TlsThread::setServerFD( int fd )
-{
-    d->ctfd = fd;
-}
-
-
-/*! Records that \a fd should be used for encrypted communication with
-    the client. The TLS thread will close \a fd when it's done.
-*/
-
-void TlsThread::setClientFD( int fd )
-{
-    d->encfd = fd;
-}
-
-
-/*! Returns true if this TlsThread is broken somehow, and false if
-    it's in working order.
-*/
-
-bool TlsThread::broken() const
-{
-    return d->broken;
-}
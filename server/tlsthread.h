@@ -18,14 +18,12 @@ public:
     void setServerFD( int );
     void setClientFD( int );
 
-    void start();
-
     bool broken() const;
 
-    bool sslErrorSeriousness( int );
-
 private:
     class TlsThreadData * d;
+
+    void handOver();
 };
 
 #endif
@@ -230,6 +230,7 @@ void Sieve::execute()
         if ( !d->injector ) {
             d->injector = new Injector( this );
             d->injector->setLog( new Log ); // XXX why here?
+            d->injector->allowBatching();
         }
 
         if ( !d->autoresponses ) {
@@ -85,6 +85,7 @@ void DeliveryAgent::execute()
 
     if ( !d->t ) {
         d->t = new Transaction( this );
+        d->t->setPriority( Query::Background );
         d->qm = new Query(
             "select id, sender, current_timestamp > expires_at as expired "
             "from deliveries where message=$1 for update",
@@ -58,6 +58,7 @@ SpoolManager::SpoolManager()
                            0 );
     q->bind( 1, Recipient::Unknown );
     q->bind( 2, Recipient::Delayed );
+    q->setPriority( Query::Background );
     q->execute();
 }
 
@@ -104,6 +105,7 @@ void SpoolManager::execute()
         d->q->bind( 2, Recipient::Delayed );
         if ( !have.isEmpty() )
             d->q->bind( 3, have );
+        d->q->setPriority( Query::Background );
         d->q->execute();
     }
 